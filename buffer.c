@@ -68,6 +68,9 @@
 #ifdef EVENT__HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
+#ifdef EVENT__HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
 
 
 #include <errno.h>
@@ -95,6 +98,7 @@
 #include "evthread-internal.h"
 #include "evbuffer-internal.h"
 #include "bufferevent-internal.h"
+#include "event-internal.h"
 
 /* some systems do not have MAP_FAILED */
 #ifndef MAP_FAILED
@@ -128,12 +132,28 @@
 #define CHAIN_SPACE_PTR(ch) ((ch)->buffer + (ch)->misalign + (ch)->off)
 // 计算evbuffer_chain的可用空间是多少
 #define CHAIN_SPACE_LEN(ch) ((ch)->flags & EVBUFFER_IMMUTABLE ? \
-    0 : (ch)->buffer_len - ((ch)->misalign + (ch)->off))
+    0 : (ch)->flags & EVBUFFER_RING ? (ch)->buffer_len - (ch)->off : \
+    (ch)->buffer_len - ((ch)->misalign + (ch)->off))
 
 // 表示该evbuffer_chain不能被修改
 #define CHAIN_PINNED(ch)  (((ch)->flags & EVBUFFER_MEM_PINNED_ANY) != 0)
 #define CHAIN_PINNED_R(ch)  (((ch)->flags & EVBUFFER_MEM_PINNED_R) != 0)
 
+/* Ring-buffer evbuffers need memfd_create() to double-map their storage. */
+#if defined(EVENT__HAVE_MMAP) && defined(MFD_CLOEXEC)
+#define USE_RING_IMPL
+#endif
+/* Spilling to disk needs unlinked temporary files. */
+#ifndef _WIN32
+#define USE_SPILL_IMPL
+#endif
+// 该evbuffer是否是环形缓冲区
+#define EVBUFFER_IS_RING(buf) (((buf)->flags & EVBUFFER_FLAG_RING) != 0)
+
+/* How much evbuffer_read() reads at most unless evbuffer_set_max_read()
+ * says otherwise. */
+#define EVBUFFER_MAX_READ_DEFAULT 4096
+
 /* evbuffer_ptr support */
 #define PTR_NOT_FOUND(ptr) do {			\
     (ptr)->pos = -1;					\
@@ -153,6 +173,717 @@ static int evbuffer_ptr_subtract(struct evbuffer *buf, struct evbuffer_ptr *pos,
                                  size_t howfar);
 static int evbuffer_file_segment_materialize(struct evbuffer_file_segment *seg);
 static inline void evbuffer_chain_incref(struct evbuffer_chain *chain);
+static void evbuffer_spsc_free_(struct evbuffer *buf);
+#ifdef USE_SPILL_IMPL
+static void evbuffer_spill_maybe_(struct evbuffer *buf);
+static size_t evbuffer_spill_on_disk_(struct evbuffer *buf);
+#endif
+static void evbuffer_spill_free_(struct evbuffer *buf);
+
+/* Per-thread cache of freed chain allocations.  Only the power-of-two
+ * sizes that evbuffer_chain_new() hands out are cached, one freelist per
+ * size class, so that a cached chain can be reused without any fixup. */
+#define EVBUFFER_CHAIN_CACHE_NCLASSES 7
+#define EVBUFFER_CHAIN_CACHE_MAX_ALLOC \
+    ((size_t)MIN_BUFFER_SIZE << (EVBUFFER_CHAIN_CACHE_NCLASSES - 1))
+
+#ifdef EVUTIL_THREAD_LOCAL_
+struct evbuffer_chain_cache {
+    /** Freed chains of each size class, linked through chain->next. */
+    struct evbuffer_chain *free_chains[EVBUFFER_CHAIN_CACHE_NCLASSES];
+    /** Total allocation size of everything on the freelists. */
+    size_t n_bytes;
+};
+static EVUTIL_THREAD_LOCAL_ struct evbuffer_chain_cache chain_cache_;
+#endif
+/** Largest n_bytes we let any thread's cache reach; 0 disables caching. */
+static size_t chain_cache_limit_ = 0;
+
+// 返回to_alloc对应的size class，不可缓存时返回-1
+static inline int
+evbuffer_chain_cache_class(size_t to_alloc)
+{
+    size_t sz = MIN_BUFFER_SIZE;
+    int idx = 0;
+
+    if (to_alloc > EVBUFFER_CHAIN_CACHE_MAX_ALLOC)
+        return -1;
+    while (sz < to_alloc) {
+        sz <<= 1;
+        ++idx;
+    }
+    return sz == to_alloc ? idx : -1;
+}
+
+/* Arena of fixed-size chain slots carved out of 2MB huge-page regions, for
+ * evbuffers with EVBUFFER_FLAG_ARENA.  Packing chains densely into huge
+ * pages keeps the TLB footprint of many small buffers down.  Regions are
+ * never returned to the system. */
+#if defined(EVENT__HAVE_MMAP) && defined(MAP_ANONYMOUS)
+#define USE_ARENA_IMPL
+#endif
+#define EVBUFFER_ARENA_REGION_SIZE ((size_t)2 << 20)
+#define EVBUFFER_ARENA_SLOT_SIZE ((size_t)4096)
+
+#ifndef EVENT__DISABLE_THREAD_SUPPORT
+static void *evbuffer_arena_lock_ = NULL;
+#endif
+#define EVBUFFER_ARENA_LOCK() EVLOCK_LOCK(evbuffer_arena_lock_, 0)
+#define EVBUFFER_ARENA_UNLOCK() EVLOCK_UNLOCK(evbuffer_arena_lock_, 0)
+
+/* All protected by evbuffer_arena_lock_.  Free slots are linked through
+ * their first word. */
+static void *arena_free_slots_ = NULL;
+static size_t arena_n_regions_ = 0;
+static size_t arena_n_hugetlb_regions_ = 0;
+static size_t arena_n_slots_used_ = 0;
+
+#ifdef USE_ARENA_IMPL
+/* Map one more region and put its slots on the freelist.  Requires the
+ * arena lock. */
+static int
+evbuffer_arena_grow_(void)
+{
+    const size_t region = EVBUFFER_ARENA_REGION_SIZE;
+    char *mem = MAP_FAILED;
+    size_t off;
+    int hugetlb = 0;
+
+#ifdef MAP_HUGETLB
+    mem = mmap(NULL, region, PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    hugetlb = mem != MAP_FAILED;
+#endif
+    if (mem == MAP_FAILED) {
+        /* No huge pages reserved: map twice what we need, trim it to a
+         * 2MB-aligned region, and ask for transparent huge pages. */
+        char *raw = mmap(NULL, 2 * region, PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        size_t head;
+        if (raw == MAP_FAILED)
+            return -1;
+        head = (region - ((ev_uintptr_t)raw & (region - 1))) & (region - 1);
+        mem = raw + head;
+        if (head)
+            munmap(raw, head);
+        munmap(mem + region, region - head);
+#ifdef MADV_HUGEPAGE
+        madvise(mem, region, MADV_HUGEPAGE);
+#endif
+    }
+
+    for (off = region; off > 0; off -= EVBUFFER_ARENA_SLOT_SIZE) {
+        void **slot = (void **)(mem + off - EVBUFFER_ARENA_SLOT_SIZE);
+        *slot = arena_free_slots_;
+        arena_free_slots_ = slot;
+    }
+    ++arena_n_regions_;
+    if (hugetlb)
+        ++arena_n_hugetlb_regions_;
+    return 0;
+}
+#endif
+
+/* Return a free arena slot, or NULL. */
+static void *
+evbuffer_arena_alloc_(void)
+{
+    void **slot = NULL;
+
+#ifdef USE_ARENA_IMPL
+    EVBUFFER_ARENA_LOCK();
+    if (arena_free_slots_ || evbuffer_arena_grow_() == 0) {
+        slot = arena_free_slots_;
+        arena_free_slots_ = *slot;
+        ++arena_n_slots_used_;
+    }
+    EVBUFFER_ARENA_UNLOCK();
+#endif
+    return slot;
+}
+
+static void
+evbuffer_arena_free_(void *mem)
+{
+    void **slot = mem;
+
+    EVBUFFER_ARENA_LOCK();
+    *slot = arena_free_slots_;
+    arena_free_slots_ = slot;
+    --arena_n_slots_used_;
+    EVBUFFER_ARENA_UNLOCK();
+}
+
+int
+evbuffer_arena_get_stats(struct evbuffer_arena_stats *stats)
+{
+#ifdef USE_ARENA_IMPL
+    EVBUFFER_ARENA_LOCK();
+    stats->region_size = EVBUFFER_ARENA_REGION_SIZE;
+    stats->slot_size = EVBUFFER_ARENA_SLOT_SIZE;
+    stats->n_regions = arena_n_regions_;
+    stats->n_hugetlb_regions = arena_n_hugetlb_regions_;
+    stats->n_slots = arena_n_regions_ *
+        (EVBUFFER_ARENA_REGION_SIZE / EVBUFFER_ARENA_SLOT_SIZE);
+    stats->n_slots_used = arena_n_slots_used_;
+    EVBUFFER_ARENA_UNLOCK();
+    return 0;
+#else
+    memset(stats, 0, sizeof(*stats));
+    return -1;
+#endif
+}
+
+/* Return the size of the block of memory that holds 'chain'. */
+static inline size_t
+evbuffer_chain_alloc_len(const struct evbuffer_chain *chain)
+{
+    /* These chains were allocated with only their EXTRA structure in
+     * mind, then had buffer and buffer_len pointed elsewhere. */
+    if (chain->flags & EVBUFFER_MULTICAST)
+        return EVBUFFER_MULTICAST_CHAIN_SIZE;
+    if (chain->flags & (EVBUFFER_REFERENCE|EVBUFFER_FILESEGMENT|
+                        EVBUFFER_RING))
+        return MIN_BUFFER_SIZE;
+    return chain->buffer_len + EVBUFFER_CHAIN_SIZE;
+}
+
+/* Take a chain of exactly to_alloc bytes from this thread's cache, or
+ * return NULL if there isn't one. */
+static inline struct evbuffer_chain *
+        evbuffer_chain_cache_get(size_t to_alloc)
+{
+#ifdef EVUTIL_THREAD_LOCAL_
+    struct evbuffer_chain *chain;
+    int idx = evbuffer_chain_cache_class(to_alloc);
+
+    if (idx < 0 || (chain = chain_cache_.free_chains[idx]) == NULL)
+        return NULL;
+    chain_cache_.free_chains[idx] = chain->next;
+    chain_cache_.n_bytes -= to_alloc;
+    return chain;
+#else
+    return NULL;
+#endif
+}
+
+/* Give the memory of a dead chain back to the cache, or to the allocator
+ * if the cache is full or the chain has an odd size. */
+static inline void
+evbuffer_chain_release(struct evbuffer_chain *chain)
+{
+#ifdef EVUTIL_THREAD_LOCAL_
+    size_t alloc_len;
+    int idx;
+#endif
+
+    if (chain->flags & EVBUFFER_ARENA_SLOT) {
+        evbuffer_arena_free_(chain);
+        return;
+    }
+#ifdef EVUTIL_THREAD_LOCAL_
+    alloc_len = evbuffer_chain_alloc_len(chain);
+    idx = evbuffer_chain_cache_class(alloc_len);
+
+    if (idx >= 0 && chain_cache_.n_bytes + alloc_len <= chain_cache_limit_) {
+        chain->next = chain_cache_.free_chains[idx];
+        chain_cache_.free_chains[idx] = chain;
+        chain_cache_.n_bytes += alloc_len;
+        return;
+    }
+#endif
+    mm_free(chain);
+}
+
+int
+evbuffer_chain_cache_set_limit(size_t max_bytes)
+{
+#ifdef EVUTIL_THREAD_LOCAL_
+    chain_cache_limit_ = max_bytes;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+size_t
+evbuffer_chain_cache_trim(size_t keep_bytes)
+{
+    size_t freed = 0;
+#ifdef EVUTIL_THREAD_LOCAL_
+    int idx;
+
+    /* Free the biggest chains first; they are the cheapest to lose. */
+    for (idx = EVBUFFER_CHAIN_CACHE_NCLASSES - 1;
+         idx >= 0 && chain_cache_.n_bytes > keep_bytes; --idx) {
+        const size_t alloc_len = (size_t)MIN_BUFFER_SIZE << idx;
+        struct evbuffer_chain *chain;
+        while (chain_cache_.n_bytes > keep_bytes &&
+               (chain = chain_cache_.free_chains[idx]) != NULL) {
+            chain_cache_.free_chains[idx] = chain->next;
+            chain_cache_.n_bytes -= alloc_len;
+            freed += alloc_len;
+            mm_free(chain);
+        }
+    }
+#endif
+    return freed;
+}
+
+/* Evbuffer memory accounting.
+ *
+ * An account sums the total_len of the evbuffers charged to it.  There is
+ * one global account, and each event_base may have one for the buffers of
+ * its bufferevents.  Buffers are charged from evbuffer_invoke_callbacks_(),
+ * which every operation that changes the length of a buffer already calls.
+ *
+ * Lock order: the global lock, then an account lock, then a base lock.  A
+ * buffer's own lock is always held first. */
+struct evbuffer_mem_account {
+    /* Protects the fields below.  For the global account, this is
+     * evbuffer_mem_global_lock_. */
+    void *lock;
+    /* One reference for the base, plus one per attached evbuffer. */
+    int refcnt;
+    /* The base we notify and resume bufferevents on, or NULL for the
+     * global account and for accounts whose base has been freed. */
+    struct event_base *base;
+    size_t bytes;
+    size_t soft_limit;
+    size_t hard_limit;
+    evbuffer_mem_cb cb;
+    void *cb_arg;
+    /* Our current EVBUFFER_MEM_* level, and the last one we passed to cb. */
+    int level;
+    int reported_level;
+    /* Runs cb and resumes suspended bufferevents from the event loop. */
+    struct event_callback deferred;
+    /* Bufferevents whose reading we have suspended with BEV_SUSPEND_MEM.
+     * Each one holds a reference. */
+    LIST_HEAD(, bufferevent_private) suspended;
+    /* Link in evbuffer_mem_accounts_. */
+    LIST_ENTRY(evbuffer_mem_account) next;
+};
+
+#ifndef EVENT__DISABLE_THREAD_SUPPORT
+static void *evbuffer_mem_global_lock_ = NULL;
+#endif
+#define EVBUFFER_MEM_GLOBAL_LOCK() EVLOCK_LOCK(evbuffer_mem_global_lock_, 0)
+#define EVBUFFER_MEM_GLOBAL_UNLOCK() EVLOCK_UNLOCK(evbuffer_mem_global_lock_, 0)
+
+/* Protected by evbuffer_mem_global_lock_. */
+static struct evbuffer_mem_account evbuffer_mem_global_;
+/* All per-base accounts.  Protected by evbuffer_mem_global_lock_. */
+static LIST_HEAD(evbuffer_mem_account_list, evbuffer_mem_account)
+    evbuffer_mem_accounts_ = LIST_HEAD_INITIALIZER(evbuffer_mem_accounts_);
+/* True once global accounting has been turned on.  New evbuffers are
+ * charged to the global account only if this is set. */
+static int evbuffer_mem_global_on_ = 0;
+
+#ifndef EVENT__DISABLE_THREAD_SUPPORT
+int
+evbuffer_global_setup_locks_(const int enable_locks)
+{
+    EVTHREAD_SETUP_GLOBAL_LOCK(evbuffer_mem_global_lock_, 0);
+    EVTHREAD_SETUP_GLOBAL_LOCK(evbuffer_arena_lock_, 0);
+    return 0;
+}
+#endif
+
+/* Return the level that acct should be at for its current usage.  We only
+ * leave a level once usage drops below the limit beneath it, so a buffer
+ * that hovers around a limit doesn't make the level flap. */
+static int
+evbuffer_mem_level_(const struct evbuffer_mem_account *acct)
+{
+    if (acct->hard_limit && acct->bytes >= acct->hard_limit)
+        return EVBUFFER_MEM_HARD;
+    if (acct->soft_limit && acct->bytes >= acct->soft_limit)
+        return acct->level == EVBUFFER_MEM_HARD ?
+            EVBUFFER_MEM_HARD : EVBUFFER_MEM_SOFT;
+    return EVBUFFER_MEM_NORMAL;
+}
+
+/* Have the event loop of acct's base report its level and resume what it
+ * has suspended, if that is allowed now.  Requires acct->lock. */
+static void
+evbuffer_mem_schedule_(struct evbuffer_mem_account *acct)
+{
+    if (acct->base)
+        event_deferred_cb_schedule_(acct->base, &acct->deferred);
+}
+
+/* Schedule every base account that has suspended bufferevents.  Called
+ * when the global account leaves the hard level.  Requires the global
+ * lock. */
+static void
+evbuffer_mem_schedule_all_(void)
+{
+    struct evbuffer_mem_account *acct;
+
+    LIST_FOREACH(acct, &evbuffer_mem_accounts_, next) {
+        EVLOCK_LOCK(acct->lock, 0);
+        if (!LIST_EMPTY(&acct->suspended))
+            evbuffer_mem_schedule_(acct);
+        EVLOCK_UNLOCK(acct->lock, 0);
+    }
+}
+
+/* Resume and release every bufferevent that acct has suspended. */
+static void
+evbuffer_mem_resume_(struct evbuffer_mem_account *acct)
+{
+    struct bufferevent_private *bev_p;
+
+    for (;;) {
+        EVLOCK_LOCK(acct->lock, 0);
+        bev_p = LIST_FIRST(&acct->suspended);
+        if (bev_p) {
+            LIST_REMOVE(bev_p, mem_suspended_next);
+            bev_p->mem_suspended = 0;
+        }
+        EVLOCK_UNLOCK(acct->lock, 0);
+        if (!bev_p)
+            break;
+        bufferevent_unsuspend_read_(&bev_p->bev, BEV_SUSPEND_MEM);
+        bufferevent_decref_(&bev_p->bev);
+    }
+}
+
+static void
+evbuffer_mem_deferred_cb_(struct event_callback *cb, void *arg)
+{
+    struct evbuffer_mem_account *acct = arg;
+    evbuffer_mem_cb user_cb = NULL;
+    void *user_arg = NULL;
+    size_t bytes = 0;
+    int level = EVBUFFER_MEM_NORMAL, global_hard, resume;
+
+    EVBUFFER_MEM_GLOBAL_LOCK();
+    global_hard = evbuffer_mem_global_.level == EVBUFFER_MEM_HARD;
+    EVBUFFER_MEM_GLOBAL_UNLOCK();
+
+    EVLOCK_LOCK(acct->lock, 0);
+    if (acct->level != acct->reported_level) {
+        acct->reported_level = level = acct->level;
+        user_cb = acct->cb;
+        user_arg = acct->cb_arg;
+        bytes = acct->bytes;
+    }
+    resume = acct->level != EVBUFFER_MEM_HARD && !global_hard;
+    EVLOCK_UNLOCK(acct->lock, 0);
+
+    if (user_cb)
+        user_cb(acct->base, bytes, level, user_arg);
+    if (resume)
+        evbuffer_mem_resume_(acct);
+}
+
+static void
+evbuffer_mem_account_decref_(struct evbuffer_mem_account *acct)
+{
+    int refcnt;
+
+    EVLOCK_LOCK(acct->lock, 0);
+    refcnt = --acct->refcnt;
+    EVLOCK_UNLOCK(acct->lock, 0);
+    if (refcnt == 0) {
+        EVTHREAD_FREE_LOCK(acct->lock, 0);
+        mm_free(acct);
+    }
+}
+
+/* Return the memory account of base, creating it if it doesn't exist and
+ * create is set. */
+static struct evbuffer_mem_account *
+evbuffer_mem_base_account_(struct event_base *base, int create)
+{
+    struct evbuffer_mem_account *acct;
+    int priority = event_base_get_npriorities(base) / 2;
+    int created = 0;
+
+    EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+    acct = base->evbuffer_mem;
+    if (!acct && create &&
+        (acct = mm_calloc(1, sizeof(struct evbuffer_mem_account)))) {
+        EVTHREAD_ALLOC_LOCK(acct->lock, 0);
+        acct->refcnt = 1;
+        acct->base = base;
+        LIST_INIT(&acct->suspended);
+        event_deferred_cb_init_(&acct->deferred, priority,
+                                evbuffer_mem_deferred_cb_, acct);
+        base->evbuffer_mem = acct;
+        created = 1;
+    }
+    EVBASE_RELEASE_LOCK(base, th_base_lock);
+
+    /* The global lock comes before the base lock, so we can only publish
+     * the account once we have let go of the base. */
+    if (created) {
+        EVBUFFER_MEM_GLOBAL_LOCK();
+        LIST_INSERT_HEAD(&evbuffer_mem_accounts_, acct, next);
+        EVBUFFER_MEM_GLOBAL_UNLOCK();
+    }
+    return acct;
+}
+
+/* How much of buffer counts against the memory accounts: everything but
+ * what has been spilled to disk.  Requires lock. */
+static size_t
+evbuffer_mem_len_(struct evbuffer *buffer)
+{
+#ifdef USE_SPILL_IMPL
+    if (buffer->spill)
+        return buffer->total_len - evbuffer_spill_on_disk_(buffer);
+#endif
+    return buffer->total_len;
+}
+
+/* Bring the accounts of buffer up to date with its length, and stop its
+ * bufferevent from reading if it grew while memory is at the hard limit. */
+static void
+evbuffer_mem_charge_(struct evbuffer *buffer, size_t len)
+{
+    struct evbuffer_mem_account *acct = buffer->mem_account;
+    size_t old_len = buffer->mem_accounted;
+    int hard = 0, suspend = 0, level;
+
+    ASSERT_EVBUFFER_LOCKED(buffer);
+
+    if (len == old_len)
+        return;
+    buffer->mem_accounted = len;
+
+    if (buffer->mem_global) {
+        struct evbuffer_mem_account *g = &evbuffer_mem_global_;
+        evbuffer_mem_cb cb = NULL;
+        void *cb_arg = NULL;
+        size_t bytes = 0;
+
+        EVBUFFER_MEM_GLOBAL_LOCK();
+        g->bytes = g->bytes + len - old_len;
+        level = evbuffer_mem_level_(g);
+        if (level != g->level) {
+            if (g->level == EVBUFFER_MEM_HARD)
+                evbuffer_mem_schedule_all_();
+            g->level = level;
+            cb = g->cb;
+            cb_arg = g->cb_arg;
+            bytes = g->bytes;
+        }
+        hard = g->level == EVBUFFER_MEM_HARD;
+        EVBUFFER_MEM_GLOBAL_UNLOCK();
+
+        if (cb)
+            cb(NULL, bytes, level, cb_arg);
+    }
+
+    if (acct) {
+        EVLOCK_LOCK(acct->lock, 0);
+        acct->bytes = acct->bytes + len - old_len;
+        level = evbuffer_mem_level_(acct);
+        if (level != acct->level) {
+            acct->level = level;
+            evbuffer_mem_schedule_(acct);
+        }
+        if (acct->level == EVBUFFER_MEM_HARD)
+            hard = 1;
+        // 只在输入缓冲区增长时才挂起读
+        if (hard && len > old_len && acct->base && buffer->parent &&
+            buffer == buffer->parent->input &&
+            !BEV_UPCAST(buffer->parent)->mem_suspended) {
+            LIST_INSERT_HEAD(&acct->suspended, BEV_UPCAST(buffer->parent),
+                             mem_suspended_next);
+            BEV_UPCAST(buffer->parent)->mem_suspended = 1;
+            suspend = 1;
+        }
+        EVLOCK_UNLOCK(acct->lock, 0);
+
+        if (suspend) {
+            bufferevent_incref_(buffer->parent);
+            bufferevent_suspend_read_(buffer->parent, BEV_SUSPEND_MEM);
+        }
+    }
+}
+
+void
+evbuffer_mem_attach_(struct evbuffer *buf, struct event_base *base)
+{
+    struct evbuffer_mem_account *acct;
+
+    if (!base)
+        return;
+    acct = evbuffer_mem_base_account_(base, evbuffer_mem_global_on_);
+    if (!acct)
+        return;
+
+    EVBUFFER_LOCK(buf);
+    if (!buf->mem_account) {
+        EVLOCK_LOCK(acct->lock, 0);
+        ++acct->refcnt;
+        acct->bytes += buf->mem_accounted;
+        EVLOCK_UNLOCK(acct->lock, 0);
+        buf->mem_account = acct;
+        evbuffer_mem_charge_(buf, evbuffer_mem_len_(buf));
+    }
+    EVBUFFER_UNLOCK(buf);
+}
+
+/* Uncharge buf from its accounts before it is freed. */
+static void
+evbuffer_mem_detach_(struct evbuffer *buf)
+{
+    evbuffer_mem_charge_(buf, 0);
+    if (buf->mem_account) {
+        evbuffer_mem_account_decref_(buf->mem_account);
+        buf->mem_account = NULL;
+    }
+    buf->mem_global = 0;
+}
+
+void
+evbuffer_mem_bufferevent_free_(struct bufferevent *bev)
+{
+    struct bufferevent_private *bev_p = BEV_UPCAST(bev);
+    struct evbuffer_mem_account *acct = bev->input->mem_account;
+    int held = 0;
+
+    if (!acct)
+        return;
+    EVLOCK_LOCK(acct->lock, 0);
+    if (bev_p->mem_suspended) {
+        LIST_REMOVE(bev_p, mem_suspended_next);
+        bev_p->mem_suspended = 0;
+        held = 1;
+    }
+    EVLOCK_UNLOCK(acct->lock, 0);
+    if (held) {
+        bufferevent_unsuspend_read_(bev, BEV_SUSPEND_MEM);
+        bufferevent_decref_(bev);
+    }
+}
+
+void
+evbuffer_mem_base_free_(struct event_base *base)
+{
+    struct evbuffer_mem_account *acct = base->evbuffer_mem;
+
+    if (!acct)
+        return;
+    base->evbuffer_mem = NULL;
+
+    EVBUFFER_MEM_GLOBAL_LOCK();
+    LIST_REMOVE(acct, next);
+    EVBUFFER_MEM_GLOBAL_UNLOCK();
+
+    EVLOCK_LOCK(acct->lock, 0);
+    acct->base = NULL;
+    EVLOCK_UNLOCK(acct->lock, 0);
+    event_deferred_cb_cancel_(base, &acct->deferred);
+
+    evbuffer_mem_resume_(acct);
+    evbuffer_mem_account_decref_(acct);
+}
+
+int
+event_base_set_evbuffer_mem_limits(struct event_base *base,
+    size_t soft_limit, size_t hard_limit, evbuffer_mem_cb cb, void *arg)
+{
+    struct evbuffer_mem_account *acct;
+    int level;
+
+    if (hard_limit && soft_limit > hard_limit)
+        return -1;
+    if (!(acct = evbuffer_mem_base_account_(base, 1)))
+        return -1;
+
+    EVLOCK_LOCK(acct->lock, 0);
+    acct->soft_limit = soft_limit;
+    acct->hard_limit = hard_limit;
+    acct->cb = cb;
+    acct->cb_arg = arg;
+    level = evbuffer_mem_level_(acct);
+    if (level != acct->level) {
+        acct->level = level;
+        evbuffer_mem_schedule_(acct);
+    }
+    EVLOCK_UNLOCK(acct->lock, 0);
+    return 0;
+}
+
+size_t
+event_base_get_evbuffer_mem(struct event_base *base)
+{
+    struct evbuffer_mem_account *acct;
+    size_t bytes = 0;
+
+    if ((acct = evbuffer_mem_base_account_(base, 0))) {
+        EVLOCK_LOCK(acct->lock, 0);
+        bytes = acct->bytes;
+        EVLOCK_UNLOCK(acct->lock, 0);
+    }
+    return bytes;
+}
+
+int
+evbuffer_set_global_mem_limits(size_t soft_limit, size_t hard_limit,
+    evbuffer_mem_cb cb, void *arg)
+{
+    struct evbuffer_mem_account *g = &evbuffer_mem_global_;
+    evbuffer_mem_cb changed_cb = NULL;
+    size_t bytes = 0;
+    int level;
+
+    if (hard_limit && soft_limit > hard_limit)
+        return -1;
+
+    EVBUFFER_MEM_GLOBAL_LOCK();
+    evbuffer_mem_global_on_ = 1;
+    g->soft_limit = soft_limit;
+    g->hard_limit = hard_limit;
+    g->cb = cb;
+    g->cb_arg = arg;
+    level = evbuffer_mem_level_(g);
+    if (level != g->level) {
+        if (g->level == EVBUFFER_MEM_HARD)
+            evbuffer_mem_schedule_all_();
+        g->level = level;
+        changed_cb = cb;
+        bytes = g->bytes;
+    }
+    EVBUFFER_MEM_GLOBAL_UNLOCK();
+
+    if (changed_cb)
+        changed_cb(NULL, bytes, level, arg);
+    return 0;
+}
+
+size_t
+evbuffer_get_global_mem(void)
+{
+    size_t bytes;
+
+    EVBUFFER_MEM_GLOBAL_LOCK();
+    bytes = evbuffer_mem_global_.bytes;
+    EVBUFFER_MEM_GLOBAL_UNLOCK();
+    return bytes;
+}
+
+void
+evbuffer_free_globals_(void)
+{
+    evbuffer_chain_cache_trim(0);
+#ifndef EVENT__DISABLE_THREAD_SUPPORT
+    if (evbuffer_mem_global_lock_ != NULL) {
+        EVTHREAD_FREE_LOCK(evbuffer_mem_global_lock_, 0);
+        evbuffer_mem_global_lock_ = NULL;
+    }
+    if (evbuffer_arena_lock_ != NULL) {
+        EVTHREAD_FREE_LOCK(evbuffer_arena_lock_, 0);
+        evbuffer_arena_lock_ = NULL;
+    }
+#endif
+}
 
 // 用来创建一个evbuffer_chain, size是buffer的大小
 static struct evbuffer_chain *
@@ -185,7 +916,9 @@ static struct evbuffer_chain *
     /* we get everything in one chunk */
     // 从分配的内存大小可以知道，evbuffer_chain结构体和buffer是一起分配的
     // 也就是说他们是存放在同一块内存中
-    if ((chain = mm_malloc(to_alloc)) == NULL)
+    // 优先复用本线程缓存中同样大小的chain
+    chain = evbuffer_chain_cache_get(to_alloc);
+    if (chain == NULL && (chain = mm_malloc(to_alloc)) == NULL)
         return (NULL);
 
     // 只需初始化最前面的结构体部分即可
@@ -206,6 +939,26 @@ static struct evbuffer_chain *
     return (chain);
 }
 
+/* Allocate a chain to hold at least size bytes of data for buf, from the
+ * arena if buf wants that and the data fits in a slot. */
+static struct evbuffer_chain *
+evbuffer_chain_new_membuf(struct evbuffer *buf, size_t size)
+{
+    struct evbuffer_chain *chain;
+
+    if ((buf->flags & EVBUFFER_FLAG_ARENA) &&
+        size <= EVBUFFER_ARENA_SLOT_SIZE - EVBUFFER_CHAIN_SIZE &&
+        (chain = evbuffer_arena_alloc_()) != NULL) {
+        memset(chain, 0, EVBUFFER_CHAIN_SIZE);
+        chain->buffer_len = EVBUFFER_ARENA_SLOT_SIZE - EVBUFFER_CHAIN_SIZE;
+        chain->buffer = EVBUFFER_CHAIN_EXTRA(unsigned char, chain);
+        chain->flags = EVBUFFER_ARENA_SLOT;
+        chain->refcnt = 1;
+        return chain;
+    }
+    return evbuffer_chain_new(size);
+}
+
 // 释放该evbuffer_chain
 static inline void
 evbuffer_chain_free(struct evbuffer_chain *chain)
@@ -266,8 +1019,12 @@ evbuffer_chain_free(struct evbuffer_chain *chain)
         evbuffer_chain_free(info->parent);
         evbuffer_decref_and_unlock_(info->source);
     }
+#ifdef USE_RING_IMPL
+    if (chain->flags & EVBUFFER_RING)
+        munmap(chain->buffer, chain->buffer_len * 2);
+#endif
 
-    mm_free(chain);
+    evbuffer_chain_release(chain);
 }
 
 // 释放从这个节点开始的余下链表节点
@@ -362,7 +1119,7 @@ static inline struct evbuffer_chain *
         evbuffer_chain_insert_new(struct evbuffer *buf, size_t datlen)
 {
     struct evbuffer_chain *chain;
-    if ((chain = evbuffer_chain_new(datlen)) == NULL)
+    if ((chain = evbuffer_chain_new_membuf(buf, datlen)) == NULL)
         return NULL;
     evbuffer_chain_insert(buf, chain);
     return chain;
@@ -390,6 +1147,194 @@ evbuffer_chain_incref(struct evbuffer_chain *chain)
     ++chain->refcnt;
 }
 
+/* Chain offset index, used when EVBUFFER_FLAG_CHAIN_INDEX is set.
+ *
+ * Positions in the index are absolute: they count every byte that has ever
+ * been drained from the front of the buffer, so draining only needs to
+ * advance 'front' and appending only needs new entries at the end.  Each
+ * entry records the absolute position of chain->buffer[0], which stays
+ * fixed while the chain's misalign and off change under drains and
+ * appends.  Operations that move data around inside the buffer in any
+ * other way drop the whole index, and it gets rebuilt on the next lookup.
+ */
+struct evbuffer_chain_index_entry {
+    struct evbuffer_chain *chain;
+    /** Absolute position of chain->buffer[0]. */
+    ev_uint64_t base;
+    /** Absolute position of the chain's first and last+1 bytes of data
+     * when we indexed it.  The chain is certainly still in the buffer
+     * if 'end' is past index->front. */
+    ev_uint64_t start, end;
+};
+
+struct evbuffer_chain_index {
+    /** Absolute position of the first byte in the buffer. */
+    ev_uint64_t front;
+    struct evbuffer_chain_index_entry *entries;
+    int n_entries;
+    int n_alloc;
+};
+
+/* Forget every entry in the index of buf, if it has one. */
+static inline void
+evbuffer_chain_index_invalidate(struct evbuffer *buf)
+{
+    if (buf->chain_index)
+        buf->chain_index->n_entries = 0;
+}
+
+/* Note that len bytes were drained from the front of buf. */
+static inline void
+evbuffer_chain_index_drained(struct evbuffer *buf, size_t len)
+{
+    if (buf->chain_index)
+        buf->chain_index->front += len;
+}
+
+static void
+evbuffer_chain_index_free(struct evbuffer *buf)
+{
+    if (buf->chain_index) {
+        mm_free(buf->chain_index->entries);
+        mm_free(buf->chain_index);
+        buf->chain_index = NULL;
+    }
+}
+
+/* Return the index of the last entry in idx that starts at or before abs,
+ * or -1 if there is none. */
+static int
+evbuffer_chain_index_bsearch(const struct evbuffer_chain_index *idx,
+                             ev_uint64_t abs)
+{
+    int lo = 0, hi = idx->n_entries - 1, mid, found = -1;
+
+    while (lo <= hi) {
+        mid = lo + (hi - lo) / 2;
+        if (idx->entries[mid].start <= abs) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+/* Append entries for the chains with data that are not yet in the index.
+ * Returns the number of entries added, or -1 on allocation failure. */
+static int
+evbuffer_chain_index_extend(struct evbuffer *buf)
+{
+    struct evbuffer_chain_index *idx = buf->chain_index;
+    struct evbuffer_chain *chain, *stop = *buf->last_with_datap;
+    ev_uint64_t pos;
+    int n_added = 0;
+
+    if (stop == NULL || stop->off == 0)
+        return 0;
+
+    if (idx->n_entries) {
+        const struct evbuffer_chain_index_entry *last =
+                &idx->entries[idx->n_entries - 1];
+        if (last->chain == stop)
+            return 0;
+        chain = last->chain->next;
+        pos = last->base + last->chain->misalign + last->chain->off;
+    } else {
+        chain = buf->first;
+        pos = idx->front;
+    }
+
+    for (; chain; chain = chain->next) {
+        struct evbuffer_chain_index_entry *e;
+        if (chain->off) {
+            if (idx->n_entries == idx->n_alloc) {
+                /* Throw away the entries for drained chains before we
+                 * think about growing the array. */
+                int first_live = evbuffer_chain_index_bsearch(idx,
+                                                              idx->front);
+                if (first_live > 0) {
+                    idx->n_entries -= first_live;
+                    memmove(idx->entries, idx->entries + first_live,
+                            idx->n_entries * sizeof(*e));
+                }
+            }
+            if (idx->n_entries == idx->n_alloc) {
+                int n_alloc = idx->n_alloc ? idx->n_alloc * 2 : 64;
+                void *tmp = mm_realloc(idx->entries,
+                                       n_alloc * sizeof(*e));
+                if (tmp == NULL)
+                    return -1;
+                idx->entries = tmp;
+                idx->n_alloc = n_alloc;
+            }
+            e = &idx->entries[idx->n_entries++];
+            e->chain = chain;
+            e->base = pos - chain->misalign;
+            e->start = pos;
+            e->end = pos + chain->off;
+            pos += chain->off;
+            ++n_added;
+        }
+        if (chain == stop)
+            break;
+    }
+    return n_added;
+}
+
+/* Use the chain index of buf to find the chain holding byte 'position'.
+ * On success, sets *chainp and *pos_in_chainp and returns 0.  Returns -1
+ * if we couldn't allocate the index; the caller should walk the chains
+ * instead.  Requires that position < buf->total_len. */
+static int
+evbuffer_chain_index_lookup(struct evbuffer *buf, size_t position,
+                            struct evbuffer_chain **chainp, size_t *pos_in_chainp)
+{
+    struct evbuffer_chain_index *idx = buf->chain_index;
+    ev_uint64_t abs;
+    int i;
+
+    ASSERT_EVBUFFER_LOCKED(buf);
+    EVUTIL_ASSERT(position < buf->total_len);
+
+    if (idx == NULL) {
+        if ((idx = mm_calloc(1, sizeof(*idx))) == NULL)
+            return -1;
+        buf->chain_index = idx;
+    }
+    /* If the newest entry has been drained, we can't tell whether its
+     * chain still exists, so start over. */
+    if (idx->n_entries && idx->entries[idx->n_entries - 1].end <= idx->front)
+        idx->n_entries = 0;
+
+    abs = idx->front + position;
+    for (;;) {
+        i = evbuffer_chain_index_bsearch(idx, abs);
+        if (i < 0 && idx->n_entries) {
+            /* Something was put in front of the oldest entry without
+             * invalidating the index.  Be safe and rebuild. */
+            idx->n_entries = 0;
+        } else if (i >= 0) {
+            const struct evbuffer_chain_index_entry *e = &idx->entries[i];
+            ev_uint64_t start = e->base + e->chain->misalign;
+            if (abs < start + e->chain->off) {
+                EVUTIL_ASSERT(abs >= start);
+                *chainp = e->chain;
+                *pos_in_chainp = (size_t)(abs - start);
+                return 0;
+            }
+            /* Past the end of the newest entry: index some more. */
+            EVUTIL_ASSERT(i == idx->n_entries - 1);
+        }
+        if ((i = evbuffer_chain_index_extend(buf)) < 0)
+            return -1;
+        /* Since position < total_len, there must have been a chain
+         * left to index. */
+        EVUTIL_ASSERT(i > 0);
+    }
+}
+
 // 用来创建一个evbuffer
 struct evbuffer *
         evbuffer_new(void)
@@ -405,6 +1350,8 @@ struct evbuffer *
     // 此时first为NULL。所以当链表没有节点时*last_with_datap为NULL
     // 当只有一个节点时*last_with_datap就是first
     buffer->last_with_datap = &buffer->first;
+    buffer->mem_global = evbuffer_mem_global_on_;
+    buffer->max_read = EVBUFFER_MAX_READ_DEFAULT;
 
     return (buffer);
 }
@@ -412,7 +1359,15 @@ struct evbuffer *
 int
 evbuffer_set_flags(struct evbuffer *buf, ev_uint64_t flags)
 {
+    if (flags & EVBUFFER_FLAG_RING)
+        return -1;
     EVBUFFER_LOCK(buf);
+    if ((flags & EVBUFFER_FLAG_RUNNING_CRC32C) &&
+        !(buf->flags & EVBUFFER_FLAG_RUNNING_CRC32C)) {
+        /* Start over, covering only data added from now on. */
+        buf->running_crc = ~(ev_uint32_t)0;
+        buf->running_crc_len = buf->total_len;
+    }
     buf->flags |= (ev_uint32_t)flags;
     EVBUFFER_UNLOCK(buf);
     return 0;
@@ -421,8 +1376,12 @@ evbuffer_set_flags(struct evbuffer *buf, ev_uint64_t flags)
 int
 evbuffer_clear_flags(struct evbuffer *buf, ev_uint64_t flags)
 {
+    if (flags & EVBUFFER_FLAG_RING)
+        return -1;
     EVBUFFER_LOCK(buf);
     buf->flags &= ~(ev_uint32_t)flags;
+    if (flags & EVBUFFER_FLAG_CHAIN_INDEX)
+        evbuffer_chain_index_free(buf);
     EVBUFFER_UNLOCK(buf);
     return 0;
 }
@@ -435,25 +1394,106 @@ evbuffer_incref_(struct evbuffer *buf)
     EVBUFFER_UNLOCK(buf);
 }
 
-void
-evbuffer_incref_and_lock_(struct evbuffer *buf)
+void
+evbuffer_incref_and_lock_(struct evbuffer *buf)
+{
+    EVBUFFER_LOCK(buf);
+    ++buf->refcnt;
+}
+
+// 可以让 evbuffer 回调不在 evbuffer 被修改时立即运行,而是延迟到某 event_base 的事件循环中执行
+int
+evbuffer_defer_callbacks(struct evbuffer *buffer, struct event_base *base)
+{
+    EVBUFFER_LOCK(buffer);
+    buffer->cb_queue = base;
+    buffer->deferred_cbs = 1;
+    event_deferred_cb_init_(&buffer->deferred,
+                            event_base_get_npriorities(base) / 2,
+                            evbuffer_deferred_callback, buffer);
+    EVBUFFER_UNLOCK(buffer);
+    return 0;
+}
+
+/* A drain of at least this many bytes from a buffer with a release base
+ * unlinks its chains and leaves freeing them to the event loop. */
+#define EVBUFFER_RELEASE_DEFER_MIN (1024*1024)
+/* The most drained chains that we free in one go from the event loop. */
+#define EVBUFFER_RELEASE_BATCH 64
+
+static void
+evbuffer_release_callback_(struct event_callback *cb, void *arg)
+{
+    struct bufferevent *parent = NULL;
+    struct evbuffer *buffer = arg;
+    struct evbuffer_chain *chain, *next;
+    int n;
+
+    EVBUFFER_LOCK(buffer);
+    parent = buffer->parent;
+    for (chain = buffer->release_first, n = 0;
+         chain && n < EVBUFFER_RELEASE_BATCH; chain = next, ++n) {
+        next = chain->next;
+        evbuffer_chain_free(chain);
+    }
+    buffer->release_first = chain;
+    if (chain == NULL) {
+        buffer->release_last = NULL;
+    } else if (event_callback_activate_later_(buffer->release_base,
+                                              &buffer->release_cb)) {
+        /* The rest waits for the next loop iteration. */
+        ++buffer->refcnt;
+        if (parent)
+            bufferevent_incref_(parent);
+    }
+    evbuffer_decref_and_unlock_(buffer);
+    if (parent)
+        bufferevent_decref_(parent);
+}
+
+/* Hand the drained chains first..last over to the release callback.
+ * Requires lock. */
+static void
+evbuffer_release_chains_(struct evbuffer *buffer,
+                         struct evbuffer_chain *first, struct evbuffer_chain *last)
 {
-    EVBUFFER_LOCK(buf);
-    ++buf->refcnt;
+    last->next = NULL;
+    if (buffer->release_first)
+        buffer->release_last->next = first;
+    else
+        buffer->release_first = first;
+    buffer->release_last = last;
+    /* Keep the buffer, and the bufferevent whose lock it may share, alive
+     * until the callback is done with them. */
+    if (event_deferred_cb_schedule_(buffer->release_base, &buffer->release_cb)) {
+        ++buffer->refcnt;
+        if (buffer->parent)
+            bufferevent_incref_(buffer->parent);
+    }
 }
 
-// 可以让 evbuffer 回调不在 evbuffer 被修改时立即运行,而是延迟到某 event_base 的事件循环中执行
 int
-evbuffer_defer_callbacks(struct evbuffer *buffer, struct event_base *base)
+evbuffer_defer_release(struct evbuffer *buffer, struct event_base *base)
 {
+    int result = 0;
+
+    if (base == NULL)
+        return -1;
+
     EVBUFFER_LOCK(buffer);
-    buffer->cb_queue = base;
-    buffer->deferred_cbs = 1;
-    event_deferred_cb_init_(&buffer->deferred,
-                            event_base_get_npriorities(base) / 2,
-                            evbuffer_deferred_callback, buffer);
+    if (buffer->release_base) {
+        if (buffer->release_base != base)
+            result = -1;
+        goto done;
+    }
+    buffer->release_base = base;
+    /* Lowest priority: freeing memory can wait for real work. */
+    event_deferred_cb_init_(&buffer->release_cb,
+                            event_base_get_npriorities(base) - 1,
+                            evbuffer_release_callback_, buffer);
+done:
     EVBUFFER_UNLOCK(buffer);
-    return 0;
+    return result;
 }
 
 // 使得evbuffer支持锁
@@ -494,6 +1534,267 @@ evbuffer_set_parent_(struct evbuffer *buf, struct bufferevent *bev)
     EVBUFFER_UNLOCK(buf);
 }
 
+/* CRC32C (Castagnoli) and FNV-1a over evbuffer contents. */
+
+static const ev_uint32_t evbuffer_crc32c_table_[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4,
+    0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+    0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+    0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+    0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b,
+    0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54,
+    0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+    0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+    0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+    0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5,
+    0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45,
+    0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+    0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+    0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+    0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48,
+    0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687,
+    0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+    0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+    0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+    0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8,
+    0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096,
+    0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+    0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+    0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+    0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9,
+    0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36,
+    0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+    0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+    0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+    0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043,
+    0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3,
+    0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+    0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+    0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+    0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652,
+    0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d,
+    0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+    0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+    0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+    0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2,
+    0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530,
+    0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+    0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+    0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+    0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f,
+    0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90,
+    0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+    0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+    0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+    0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321,
+    0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81,
+    0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+    0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+    0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
+};
+
+static ev_uint32_t
+evbuffer_crc32c_sw_(ev_uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len--)
+        crc = evbuffer_crc32c_table_[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define EVBUFFER_CRC32C_SSE42
+/* -1 until we have asked the CPU whether it has SSE4.2. */
+static int evbuffer_crc32c_have_sse42_ = -1;
+
+__attribute__((target("sse4.2")))
+static ev_uint32_t
+evbuffer_crc32c_sse42_(ev_uint32_t crc, const unsigned char *p, size_t len)
+{
+    ev_uint64_t crc64;
+
+    while (len && ((ev_uintptr_t)p & 7)) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+        --len;
+    }
+    crc64 = crc;
+    while (len >= 8) {
+        ev_uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (ev_uint32_t)crc64;
+    while (len--)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+#endif
+
+/* Continue a CRC32C, in its inverted internal form, over len bytes. */
+static ev_uint32_t
+evbuffer_crc32c_update_(ev_uint32_t crc, const unsigned char *p, size_t len)
+{
+#ifdef EVBUFFER_CRC32C_SSE42
+    if (evbuffer_crc32c_have_sse42_ < 0)
+        evbuffer_crc32c_have_sse42_ = __builtin_cpu_supports("sse4.2") != 0;
+    if (evbuffer_crc32c_have_sse42_)
+        return evbuffer_crc32c_sse42_(crc, p, len);
+#endif
+    return evbuffer_crc32c_sw_(crc, p, len);
+}
+
+/* Walk len bytes of buf starting at pos (or at the front if pos is NULL),
+ * handing each contiguous piece to fn.  Requires the lock.  Returns -1 if
+ * the range runs past the end of the buffer, or if it reaches a chain whose
+ * data is only in a file that we'll sendfile() from; fn may have seen part
+ * of the range by then. */
+static int
+evbuffer_foreach_range_(struct evbuffer *buf, const struct evbuffer_ptr *pos,
+    ev_ssize_t len, void (*fn)(const unsigned char *, size_t, void *),
+    void *arg)
+{
+    struct evbuffer_chain *chain = buf->first;
+    size_t pos_in_chain = 0, start = 0;
+
+    ASSERT_EVBUFFER_LOCKED(buf);
+    if (pos) {
+        if (pos->pos < 0 || (size_t)pos->pos > buf->total_len)
+            return -1;
+        chain = pos->internal_.chain;
+        pos_in_chain = pos->internal_.pos_in_chain;
+        start = pos->pos;
+    }
+    if (len < 0)
+        len = buf->total_len - start;
+    else if ((size_t)len > buf->total_len - start)
+        return -1;
+
+    while (len) {
+        size_t n = chain->off - pos_in_chain;
+        if (chain->flags & EVBUFFER_SENDFILE)
+            return -1;
+        if (n > (size_t)len)
+            n = len;
+        fn(chain->buffer + chain->misalign + pos_in_chain, n, arg);
+        len -= n;
+        pos_in_chain = 0;
+        chain = chain->next;
+    }
+    return 0;
+}
+
+static void
+evbuffer_crc32c_range_cb_(const unsigned char *p, size_t len, void *arg)
+{
+    ev_uint32_t *crc = arg;
+    *crc = evbuffer_crc32c_update_(*crc, p, len);
+}
+
+#define EVBUFFER_FNV64_OFFSET ((((ev_uint64_t)0xcbf29ce4) << 32) | 0x84222325)
+#define EVBUFFER_FNV64_PRIME ((((ev_uint64_t)0x100) << 32) | 0x000001b3)
+
+static void
+evbuffer_hash64_range_cb_(const unsigned char *p, size_t len, void *arg)
+{
+    ev_uint64_t h = *(ev_uint64_t *)arg;
+    while (len--) {
+        h ^= *p++;
+        h *= EVBUFFER_FNV64_PRIME;
+    }
+    *(ev_uint64_t *)arg = h;
+}
+
+int
+evbuffer_crc32c(struct evbuffer *buf, const struct evbuffer_ptr *start,
+    ev_ssize_t len, ev_uint32_t *crc)
+{
+    ev_uint32_t c = ~*crc;
+    int result;
+
+    EVBUFFER_LOCK(buf);
+    result = evbuffer_foreach_range_(buf, start, len,
+                                     evbuffer_crc32c_range_cb_, &c);
+    EVBUFFER_UNLOCK(buf);
+    if (result == 0)
+        *crc = ~c;
+    return result;
+}
+
+int
+evbuffer_hash64(struct evbuffer *buf, const struct evbuffer_ptr *start,
+    ev_ssize_t len, ev_uint64_t *hash)
+{
+    ev_uint64_t h = EVBUFFER_FNV64_OFFSET;
+    int result;
+
+    EVBUFFER_LOCK(buf);
+    result = evbuffer_foreach_range_(buf, start, len,
+                                     evbuffer_hash64_range_cb_, &h);
+    EVBUFFER_UNLOCK(buf);
+    if (result == 0)
+        *hash = h;
+    return result;
+}
+
+/* Fold whatever was appended to buf since the last call into its running
+ * CRC.  Called from evbuffer_invoke_callbacks_(); operations that add data
+ * at the front move running_crc_len past it so that we skip it here.  If
+ * the new data includes a sendfile() chain we can't see it, so we stop
+ * keeping the CRC at all rather than report a wrong one. */
+static void
+evbuffer_running_crc_update_(struct evbuffer *buf)
+{
+    struct evbuffer_chain *last = *buf->last_with_datap;
+    ev_uint32_t crc;
+    size_t n;
+
+    if (buf->total_len <= buf->running_crc_len) {
+        buf->running_crc_len = buf->total_len;
+        return;
+    }
+    n = buf->total_len - buf->running_crc_len;
+    buf->running_crc_len = buf->total_len;
+
+    // 新数据一般都在最后一个chain里
+    if (last && last->off >= n && !(last->flags & EVBUFFER_SENDFILE)) {
+        buf->running_crc = evbuffer_crc32c_update_(buf->running_crc,
+            last->buffer + last->misalign + last->off - n, n);
+    } else {
+        struct evbuffer_ptr pos;
+        crc = buf->running_crc;
+        if (evbuffer_ptr_set(buf, &pos, buf->total_len - n,
+                EVBUFFER_PTR_SET) < 0 ||
+            evbuffer_foreach_range_(buf, &pos, n,
+                                    evbuffer_crc32c_range_cb_, &crc) < 0) {
+            buf->flags &= ~EVBUFFER_FLAG_RUNNING_CRC32C;
+            return;
+        }
+        buf->running_crc = crc;
+    }
+}
+
+ev_uint32_t
+evbuffer_get_running_crc32c(struct evbuffer *buf)
+{
+    ev_uint32_t crc;
+
+    EVBUFFER_LOCK(buf);
+    crc = ~buf->running_crc;
+    EVBUFFER_UNLOCK(buf);
+    return crc;
+}
+
 // 直接遍历回调队列，然后依次调用回调函数
 static void
 evbuffer_run_callbacks(struct evbuffer *buffer, int running_deferred)
@@ -568,6 +1869,16 @@ evbuffer_run_callbacks(struct evbuffer *buffer, int running_deferred)
 void
 evbuffer_invoke_callbacks_(struct evbuffer *buffer)
 {
+    /* The running CRC has to see new data before a spill can move it. */
+    if (buffer->flags & EVBUFFER_FLAG_RUNNING_CRC32C)
+        evbuffer_running_crc_update_(buffer);
+#ifdef USE_SPILL_IMPL
+    if (buffer->spill)
+        evbuffer_spill_maybe_(buffer);
+#endif
+    if (buffer->mem_account || buffer->mem_global)
+        evbuffer_mem_charge_(buffer, evbuffer_mem_len_(buffer));
+
     if (LIST_EMPTY(&buffer->callbacks)) {
         buffer->n_add_for_cb = buffer->n_del_for_cb = 0;
         return;
@@ -636,6 +1947,16 @@ evbuffer_decref_and_unlock_(struct evbuffer *buffer)
     evbuffer_remove_all_callbacks(buffer);
     if (buffer->deferred_cbs)
         event_deferred_cb_cancel_(buffer->cb_queue, &buffer->deferred);
+    /* The release callback holds a reference while it is pending, so
+     * this is only ever non-empty if its base went away first. */
+    evbuffer_free_all_chains(buffer->release_first);
+    evbuffer_chain_index_free(buffer);
+    if (buffer->mem_account || buffer->mem_global)
+        evbuffer_mem_detach_(buffer);
+    if (buffer->spsc)
+        evbuffer_spsc_free_(buffer);
+    if (buffer->spill)
+        evbuffer_spill_free_(buffer);
 
     EVBUFFER_UNLOCK(buffer);
     if (buffer->own_lock)
@@ -898,7 +2219,7 @@ PRESERVE_PINNED(struct evbuffer *src, struct evbuffer_chain **first,
         struct evbuffer_chain *tmp;
 
         EVUTIL_ASSERT(pinned == src->last_with_datap);
-        tmp = evbuffer_chain_new(chain->off);
+        tmp = evbuffer_chain_new_membuf(src, chain->off);
         if (!tmp)
             return -1;
         memcpy(tmp->buffer, chain->buffer + chain->misalign,
@@ -966,12 +2287,44 @@ APPEND_CHAIN(struct evbuffer *dst, struct evbuffer *src)
     dst->total_len += src->total_len;
 }
 
+/* Make a chain that refers to the data in 'chain', which belongs to 'src',
+ * without copying it.  These chains have no buffer of their own, so we
+ * allocate only the chain and its evbuffer_multicast_parent, not a whole
+ * MIN_BUFFER_SIZE block.  Requires lock on src. */
+static struct evbuffer_chain *
+evbuffer_chain_new_multicast(struct evbuffer *src, struct evbuffer_chain *chain)
+{
+    struct evbuffer_chain *tmp;
+    struct evbuffer_multicast_parent *extra;
+
+    ASSERT_EVBUFFER_LOCKED(src);
+
+    if ((tmp = mm_calloc(1, EVBUFFER_MULTICAST_CHAIN_SIZE)) == NULL)
+        return NULL;
+    tmp->refcnt = 1;
+    extra = EVBUFFER_CHAIN_EXTRA(struct evbuffer_multicast_parent, tmp);
+    /* reference evbuffer containing source chain so it
+     * doesn't get released while the chain is still
+     * being referenced to */
+    evbuffer_incref_(src);
+    extra->source = src;
+    /* reference source chain which now becomes immutable */
+    evbuffer_chain_incref(chain);
+    extra->parent = chain;
+    chain->flags |= EVBUFFER_IMMUTABLE;
+    tmp->buffer_len = chain->buffer_len;
+    tmp->misalign = chain->misalign;
+    tmp->off = chain->off;
+    tmp->flags |= EVBUFFER_MULTICAST|EVBUFFER_IMMUTABLE;
+    tmp->buffer = chain->buffer;
+    return tmp;
+}
+
 static inline void
 APPEND_CHAIN_MULTICAST(struct evbuffer *dst, struct evbuffer *src)
 {
     struct evbuffer_chain *tmp;
     struct evbuffer_chain *chain = src->first;
-    struct evbuffer_multicast_parent *extra;
 
     ASSERT_EVBUFFER_LOCKED(dst);
     ASSERT_EVBUFFER_LOCKED(src);
@@ -982,94 +2335,338 @@ APPEND_CHAIN_MULTICAST(struct evbuffer *dst, struct evbuffer *src)
             continue;
         }
 
-        tmp = evbuffer_chain_new(sizeof(struct evbuffer_multicast_parent));
+        tmp = evbuffer_chain_new_multicast(src, chain);
         if (!tmp) {
             event_warn("%s: out of memory", __func__);
             return;
         }
-        extra = EVBUFFER_CHAIN_EXTRA(struct evbuffer_multicast_parent, tmp);
-        /* reference evbuffer containing source chain so it
-         * doesn't get released while the chain is still
-         * being referenced to */
-        evbuffer_incref_(src);
-        extra->source = src;
-        /* reference source chain which now becomes immutable */
-        evbuffer_chain_incref(chain);
-        extra->parent = chain;
-        chain->flags |= EVBUFFER_IMMUTABLE;
-        tmp->buffer_len = chain->buffer_len;
-        tmp->misalign = chain->misalign;
-        tmp->off = chain->off;
-        tmp->flags |= EVBUFFER_MULTICAST|EVBUFFER_IMMUTABLE;
-        tmp->buffer = chain->buffer;
-        evbuffer_chain_insert(dst, tmp);
+        evbuffer_chain_insert(dst, tmp);
+    }
+}
+
+static void
+PREPEND_CHAIN(struct evbuffer *dst, struct evbuffer *src)
+{
+    ASSERT_EVBUFFER_LOCKED(dst);
+    ASSERT_EVBUFFER_LOCKED(src);
+    src->last->next = dst->first;
+    dst->first = src->first;
+    dst->total_len += src->total_len;
+    if (*dst->last_with_datap == NULL) {
+        if (src->last_with_datap == &(src)->first)
+            dst->last_with_datap = &dst->first;
+        else
+            dst->last_with_datap = src->last_with_datap;
+    } else if (dst->last_with_datap == &dst->first) {
+        dst->last_with_datap = &src->last->next;
+    }
+}
+
+/* Helper: move the first datlen bytes of src to the end of dst by copying
+ * them, for when one of the buffers is a ring and chains can't be handed
+ * over.  Copies nothing and returns -1 if dst has no room for all of it.
+ * Requires both locks. */
+static int
+evbuffer_copy_between_(struct evbuffer *dst, struct evbuffer *src,
+                       size_t datlen)
+{
+    struct evbuffer_chain *chain, *space;
+    unsigned char *p;
+    size_t n, left;
+
+    ASSERT_EVBUFFER_LOCKED(dst);
+    ASSERT_EVBUFFER_LOCKED(src);
+    EVUTIL_ASSERT(datlen <= src->total_len);
+
+    if (datlen == 0)
+        return 0;
+    if ((space = evbuffer_expand_singlechain(dst, datlen)) == NULL)
+        return -1;
+
+    p = CHAIN_SPACE_PTR(space);
+    for (chain = src->first, left = datlen; left; chain = chain->next) {
+        n = chain->off < left ? chain->off : left;
+        memcpy(p, chain->buffer + chain->misalign, n);
+        p += n;
+        left -= n;
+    }
+    space->off += datlen;
+    dst->total_len += datlen;
+    dst->n_add_for_cb += datlen;
+    advance_last_with_data(dst);
+    evbuffer_invoke_callbacks_(dst);
+
+    evbuffer_drain(src, datlen);
+    return 0;
+}
+
+// 将 inbuf 中的所有数据移动到 outbuf 末尾,成功时返回0,失败时返回-1
+int
+evbuffer_add_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
+{
+    struct evbuffer_chain *pinned, *last;
+    size_t in_total_len, out_total_len;
+    int result = 0;
+
+    EVBUFFER_LOCK2(inbuf, outbuf);
+    in_total_len = inbuf->total_len;
+    out_total_len = outbuf->total_len;
+
+    if (in_total_len == 0 || outbuf == inbuf)
+        goto done;
+
+    if (outbuf->freeze_end || inbuf->freeze_start) {
+        result = -1;
+        goto done;
+    }
+
+    if (EVBUFFER_IS_RING(outbuf) || EVBUFFER_IS_RING(inbuf)) {
+        result = evbuffer_copy_between_(outbuf, inbuf, in_total_len);
+        goto done;
+    }
+
+    if (PRESERVE_PINNED(inbuf, &pinned, &last) < 0) {
+        result = -1;
+        goto done;
+    }
+
+    // 把inbuf中的数据加入到outbuf中
+    if (out_total_len == 0) {
+        /* There might be an empty chain at the start of outbuf; free
+         * it. */
+        evbuffer_free_all_chains(outbuf->first);
+        COPY_CHAIN(outbuf, inbuf);
+    } else {
+        APPEND_CHAIN(outbuf, inbuf);
+    }
+
+    RESTORE_PINNED(inbuf, pinned, last);
+    evbuffer_chain_index_invalidate(inbuf);
+
+    inbuf->n_del_for_cb += in_total_len;
+    outbuf->n_add_for_cb += in_total_len;
+
+    evbuffer_invoke_callbacks_(inbuf);
+    evbuffer_invoke_callbacks_(outbuf);
+
+done:
+    EVBUFFER_UNLOCK2(inbuf, outbuf);
+    return result;
+}
+
+/* State for an evbuffer in single-producer/single-consumer mode.  The
+ * producer pushes chains onto 'inbox' newest first, without taking the
+ * buffer's lock; the consumer takes the whole list at once from the event
+ * loop, puts it back in order, and appends it to the buffer. */
+struct evbuffer_spsc {
+    struct evbuffer_chain *inbox;
+    /** The base that delivers our data, or NULL once it has been freed */
+    struct event_base *base;
+    struct event_callback deliver;
+    /** Link in base's list of SPSC buffers, so that freeing the base can
+     * detach us. */
+    LIST_ENTRY(evbuffer_spsc) next;
+};
+
+#ifdef EVUTIL_HAVE_ATOMICS_
+/* Producer side: publish the chains from 'newest' to 'oldest', which are
+ * linked newest first, and wake the consumer if it has nothing pending. */
+static void
+evbuffer_spsc_push_(struct evbuffer_spsc *spsc, struct evbuffer_chain *newest,
+                    struct evbuffer_chain *oldest)
+{
+    struct evbuffer_chain *old = EVUTIL_ATOMIC_LOAD_PTR_(&spsc->inbox);
+
+    do {
+        oldest->next = old;
+    } while (!EVUTIL_ATOMIC_CAS_PTR_(&spsc->inbox, &old, newest));
+
+    /* The consumer empties the inbox every time it runs, so only the push
+     * that finds it empty has to wake it up. */
+    if (old == NULL)
+        event_callback_activate_(spsc->base, &spsc->deliver);
+}
+
+/* Consumer side: move everything in the inbox to the end of buf.
+ * Requires lock. */
+static void
+evbuffer_spsc_collect_(struct evbuffer *buf)
+{
+    struct evbuffer_chain *chain, *next, *ordered = NULL;
+    size_t old_len = buf->total_len;
+
+    ASSERT_EVBUFFER_LOCKED(buf);
+
+    chain = EVUTIL_ATOMIC_XCHG_PTR_(&buf->spsc->inbox,
+                                    (struct evbuffer_chain *)NULL);
+    if (chain == NULL)
+        return;
+    for (; chain; chain = next) {
+        next = chain->next;
+        chain->next = ordered;
+        ordered = chain;
+    }
+    for (chain = ordered; chain; chain = next) {
+        next = chain->next;
+        chain->next = NULL;
+        evbuffer_chain_insert(buf, chain);
+    }
+
+    buf->n_add_for_cb += buf->total_len - old_len;
+    evbuffer_invoke_callbacks_(buf);
+}
+
+static void
+evbuffer_spsc_deliver_(struct event_callback *cb, void *arg)
+{
+    struct evbuffer *buf = arg;
+
+    EVBUFFER_LOCK(buf);
+    evbuffer_spsc_collect_(buf);
+    EVBUFFER_UNLOCK(buf);
+}
+#endif
+
+/* Free an evbuffer's SPSC state and anything still in its inbox.  Requires
+ * lock; the producer must be done with the buffer. */
+static void
+evbuffer_spsc_free_(struct evbuffer *buf)
+{
+    struct evbuffer_spsc *spsc = buf->spsc;
+    struct event_base *base = spsc->base;
+
+    if (base) {
+        EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+        LIST_REMOVE(spsc, next);
+        EVBASE_RELEASE_LOCK(base, th_base_lock);
+        event_deferred_cb_cancel_(base, &spsc->deliver);
+    }
+    evbuffer_free_all_chains(spsc->inbox);
+    mm_free(spsc);
+    buf->spsc = NULL;
+}
+
+void
+evbuffer_spsc_base_free_(struct event_base *base)
+{
+    struct evbuffer_spsc *spsc;
+
+    for (;;) {
+        EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+        spsc = LIST_FIRST(&base->evbuffer_spscs);
+        if (spsc) {
+            LIST_REMOVE(spsc, next);
+            spsc->base = NULL;
+        }
+        EVBASE_RELEASE_LOCK(base, th_base_lock);
+        if (!spsc)
+            break;
+        event_deferred_cb_cancel_(base, &spsc->deliver);
     }
 }
 
-static void
-PREPEND_CHAIN(struct evbuffer *dst, struct evbuffer *src)
+int
+evbuffer_enable_spsc(struct evbuffer *buf, struct event_base *base)
 {
-    ASSERT_EVBUFFER_LOCKED(dst);
-    ASSERT_EVBUFFER_LOCKED(src);
-    src->last->next = dst->first;
-    dst->first = src->first;
-    dst->total_len += src->total_len;
-    if (*dst->last_with_datap == NULL) {
-        if (src->last_with_datap == &(src)->first)
-            dst->last_with_datap = &dst->first;
-        else
-            dst->last_with_datap = src->last_with_datap;
-    } else if (dst->last_with_datap == &dst->first) {
-        dst->last_with_datap = &src->last->next;
-    }
+#ifdef EVUTIL_HAVE_ATOMICS_
+    struct evbuffer_spsc *spsc;
+    int priority = event_base_get_npriorities(base) / 2;
+    int result = -1;
+
+    EVBUFFER_LOCK(buf);
+    if (buf->spsc || EVBUFFER_IS_RING(buf))
+        goto done;
+    if ((spsc = mm_calloc(1, sizeof(struct evbuffer_spsc))) == NULL)
+        goto done;
+    spsc->base = base;
+    event_deferred_cb_init_(&spsc->deliver, priority,
+                            evbuffer_spsc_deliver_, buf);
+    EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+    LIST_INSERT_HEAD(&base->evbuffer_spscs, spsc, next);
+    EVBASE_RELEASE_LOCK(base, th_base_lock);
+    buf->spsc = spsc;
+    result = 0;
+done:
+    EVBUFFER_UNLOCK(buf);
+    return result;
+#else
+    (void)buf;
+    (void)base;
+    return -1;
+#endif
 }
 
-// 将 inbuf 中的所有数据移动到 outbuf 末尾,成功时返回0,失败时返回-1
 int
-evbuffer_add_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
+evbuffer_spsc_add(struct evbuffer *buf, const void *data, size_t datlen)
 {
-    struct evbuffer_chain *pinned, *last;
-    size_t in_total_len, out_total_len;
-    int result = 0;
+#ifdef EVUTIL_HAVE_ATOMICS_
+    struct evbuffer_spsc *spsc = buf->spsc;
+    struct evbuffer_chain *chain;
 
-    EVBUFFER_LOCK2(inbuf, outbuf);
-    in_total_len = inbuf->total_len;
-    out_total_len = outbuf->total_len;
+    if (spsc == NULL)
+        return -1;
+    if (datlen == 0)
+        return 0;
+    if ((chain = evbuffer_chain_new(datlen)) == NULL)
+        return -1;
+    memcpy(chain->buffer, data, datlen);
+    chain->off = datlen;
+    evbuffer_spsc_push_(spsc, chain, chain);
+    return 0;
+#else
+    (void)buf;
+    (void)data;
+    (void)datlen;
+    return -1;
+#endif
+}
 
-    if (in_total_len == 0 || outbuf == inbuf)
-        goto done;
+int
+evbuffer_spsc_add_buffer(struct evbuffer *buf, struct evbuffer *src)
+{
+#ifdef EVUTIL_HAVE_ATOMICS_
+    struct evbuffer_spsc *spsc = buf->spsc;
+    struct evbuffer_chain *pinned, *last, *chain, *next;
+    struct evbuffer_chain *newest = NULL, *oldest = NULL;
+    size_t src_len;
+    int result = 0;
 
-    if (outbuf->freeze_end || inbuf->freeze_start) {
-        result = -1;
-        goto done;
-    }
+    if (spsc == NULL || src == buf)
+        return -1;
 
-    if (PRESERVE_PINNED(inbuf, &pinned, &last) < 0) {
+    EVBUFFER_LOCK(src);
+    src_len = src->total_len;
+    if (src_len == 0)
+        goto done;
+    if (src->freeze_start || EVBUFFER_IS_RING(src) ||
+            PRESERVE_PINNED(src, &pinned, &last) < 0) {
         result = -1;
         goto done;
     }
 
-    // 把inbuf中的数据加入到outbuf中
-    if (out_total_len == 0) {
-        /* There might be an empty chain at the start of outbuf; free
-         * it. */
-        evbuffer_free_all_chains(outbuf->first);
-        COPY_CHAIN(outbuf, inbuf);
-    } else {
-        APPEND_CHAIN(outbuf, inbuf);
+    /* Relink src's chains newest first, the way the inbox holds them. */
+    for (chain = src->first; chain; chain = next) {
+        next = chain->next;
+        chain->next = newest;
+        newest = chain;
+        if (oldest == NULL)
+            oldest = chain;
     }
 
-    RESTORE_PINNED(inbuf, pinned, last);
-
-    inbuf->n_del_for_cb += in_total_len;
-    outbuf->n_add_for_cb += in_total_len;
-
-    evbuffer_invoke_callbacks_(inbuf);
-    evbuffer_invoke_callbacks_(outbuf);
+    RESTORE_PINNED(src, pinned, last);
+    evbuffer_chain_index_invalidate(src);
+    src->n_del_for_cb += src_len;
+    evbuffer_invoke_callbacks_(src);
 
+    evbuffer_spsc_push_(spsc, newest, oldest);
 done:
-    EVBUFFER_UNLOCK2(inbuf, outbuf);
+    EVBUFFER_UNLOCK(src);
     return result;
+#else
+    (void)buf;
+    (void)src;
+    return -1;
+#endif
 }
 
 int
@@ -1087,7 +2684,10 @@ evbuffer_add_buffer_reference(struct evbuffer *outbuf, struct evbuffer *inbuf)
     if (in_total_len == 0)
         goto done;
 
-    if (outbuf->freeze_end || outbuf == inbuf) {
+    if (outbuf->freeze_end || outbuf == inbuf ||
+            EVBUFFER_IS_RING(outbuf) || EVBUFFER_IS_RING(inbuf)) {
+        /* A ring reuses its memory, so nothing may refer to it, and
+         * it can't take on chains of its own. */
         result = -1;
         goto done;
     }
@@ -1115,6 +2715,82 @@ done:
     return result;
 }
 
+int
+evbuffer_add_buffer_broadcast(struct evbuffer **outbufs, int n_outbufs,
+                              struct evbuffer *inbuf)
+{
+    struct evbuffer_chain *chain, *tmp, *wrappers = NULL;
+    size_t in_total_len;
+    int i, n_added = 0;
+
+    if (n_outbufs < 0)
+        return -1;
+
+    EVBUFFER_LOCK(inbuf);
+    in_total_len = inbuf->total_len;
+    if (in_total_len == 0) {
+        EVBUFFER_UNLOCK(inbuf);
+        return n_outbufs;
+    }
+    if (EVBUFFER_IS_RING(inbuf))
+        goto err;
+    for (chain = inbuf->first; chain; chain = chain->next) {
+        if ((chain->flags & (EVBUFFER_FILESEGMENT|EVBUFFER_SENDFILE|EVBUFFER_MULTICAST)) != 0) {
+            /* chain type can not be referenced */
+            goto err;
+        }
+    }
+
+    /* Put all the data in one chain, so that every destination needs
+     * exactly one chain of its own, however the payload was built. */
+    if (inbuf->first->off < in_total_len &&
+            evbuffer_pullup(inbuf, -1) == NULL)
+        goto err;
+    chain = inbuf->first;
+    EVUTIL_ASSERT(chain->off == in_total_len);
+
+    /* Make every referencing chain now, so that we never need to hold
+     * inbuf's lock and a destination's lock at once: freeing a
+     * referencing chain locks its source while its own buffer is
+     * locked. */
+    for (i = 0; i < n_outbufs; ++i) {
+        if ((tmp = evbuffer_chain_new_multicast(inbuf, chain)) == NULL)
+            break;
+        tmp->next = wrappers;
+        wrappers = tmp;
+    }
+    EVBUFFER_UNLOCK(inbuf);
+
+    for (i = 0; i < n_outbufs && wrappers; ++i) {
+        struct evbuffer *outbuf = outbufs[i];
+        if (outbuf == inbuf)
+            continue;
+        EVBUFFER_LOCK(outbuf);
+        if (outbuf->freeze_end || EVBUFFER_IS_RING(outbuf)) {
+            EVBUFFER_UNLOCK(outbuf);
+            continue;
+        }
+        tmp = wrappers;
+        wrappers = tmp->next;
+        tmp->next = NULL;
+        evbuffer_chain_insert(outbuf, tmp);
+        outbuf->n_add_for_cb += in_total_len;
+        evbuffer_invoke_callbacks_(outbuf);
+        EVBUFFER_UNLOCK(outbuf);
+        ++n_added;
+    }
+
+    /* Drop the ones we couldn't use. */
+    for (; wrappers; wrappers = tmp) {
+        tmp = wrappers->next;
+        evbuffer_chain_free(wrappers);
+    }
+    return n_added;
+err:
+    EVBUFFER_UNLOCK(inbuf);
+    return -1;
+}
+
 // 添加 inbuf 数据到 outbuf 头部
 int
 evbuffer_prepend_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
@@ -1136,6 +2812,17 @@ evbuffer_prepend_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
         goto done;
     }
 
+    if (EVBUFFER_IS_RING(outbuf) || EVBUFFER_IS_RING(inbuf)) {
+        /* Chains can't move into or out of a ring; copy instead.
+         * Pulling up a ring is free. */
+        unsigned char *data = evbuffer_pullup(inbuf, -1);
+        if (data == NULL || evbuffer_prepend(outbuf, data, in_total_len) < 0)
+            result = -1;
+        else
+            evbuffer_drain(inbuf, in_total_len);
+        goto done;
+    }
+
     if (PRESERVE_PINNED(inbuf, &pinned, &last) < 0) {
         result = -1;
         goto done;
@@ -1151,9 +2838,12 @@ evbuffer_prepend_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
     }
 
     RESTORE_PINNED(inbuf, pinned, last);
+    evbuffer_chain_index_invalidate(inbuf);
+    evbuffer_chain_index_invalidate(outbuf);
 
     inbuf->n_del_for_cb += in_total_len;
     outbuf->n_add_for_cb += in_total_len;
+    outbuf->running_crc_len = outbuf->total_len;
 
     evbuffer_invoke_callbacks_(inbuf);
     evbuffer_invoke_callbacks_(outbuf);
@@ -1167,6 +2857,7 @@ int
 evbuffer_drain(struct evbuffer *buf, size_t len)
 {
     struct evbuffer_chain *chain, *next;
+    struct evbuffer_chain *dead_first = NULL, *dead_last = NULL;
     size_t remaining, old_len;
     int result = 0;
 
@@ -1182,12 +2873,29 @@ evbuffer_drain(struct evbuffer *buf, size_t len)
         goto done;
     }
 
-    // 要删除的数据量大于等于已有的数据量,并且这个evbuffer是可以删除的
-    if (len >= old_len && !HAS_PINNED_R(buf)) {
+    if (EVBUFFER_IS_RING(buf)) {
+        /* The ring chain stays put; just move the front of the data. */
+        chain = buf->first;
+        if (len > old_len)
+            len = old_len;
+        buf->total_len -= len;
+        chain->misalign += len;
+        chain->off -= len;
+        if ((size_t)chain->misalign >= chain->buffer_len) {
+            /* Same bytes, seen through the first mapping. */
+            chain->misalign -= chain->buffer_len;
+            evbuffer_chain_index_invalidate(buf);
+        }
+    } else if (len >= old_len && !HAS_PINNED_R(buf)) {
+        // 要删除的数据量大于等于已有的数据量,并且这个evbuffer是可以删除的
         len = old_len;
-        for (chain = buf->first; chain != NULL; chain = next) {
-            next = chain->next;
-            evbuffer_chain_free(chain);
+        if (buf->release_base && len >= EVBUFFER_RELEASE_DEFER_MIN) {
+            evbuffer_release_chains_(buf, buf->first, buf->last);
+        } else {
+            for (chain = buf->first; chain != NULL; chain = next) {
+                next = chain->next;
+                evbuffer_chain_free(chain);
+            }
         }
 
         // 相当于初试化evbuffer的链表
@@ -1196,6 +2904,8 @@ evbuffer_drain(struct evbuffer *buf, size_t len)
         if (len >= old_len)
             len = old_len;
 
+        if (buf->release_base && len >= EVBUFFER_RELEASE_DEFER_MIN)
+            dead_first = buf->first;
         buf->total_len -= len;
         remaining = len;
         for (chain = buf->first;
@@ -1219,9 +2929,13 @@ evbuffer_drain(struct evbuffer *buf, size_t len)
                 chain->off = 0;
                 // 后面的evbuffer_chain也是固定的
                 break;
-            } else
+            } else if (dead_first)
+                dead_last = chain;
+            else
                 evbuffer_chain_free(chain);
         }
+        if (dead_last)
+            evbuffer_release_chains_(buf, dead_first, dead_last);
 
         buf->first = chain;
         EVUTIL_ASSERT(chain && remaining <= chain->off);
@@ -1229,6 +2943,7 @@ evbuffer_drain(struct evbuffer *buf, size_t len)
         chain->off -= remaining;
     }
 
+    evbuffer_chain_index_drained(buf, len);
     buf->n_del_for_cb += len;
     /* Tell someone about changes in this buffer */
     // 因为删除数据，所以也要调用回调函数
@@ -1361,6 +3076,20 @@ evbuffer_remove_buffer(struct evbuffer *src, struct evbuffer *dst,
         goto done;
     }
 
+    if (EVBUFFER_IS_RING(dst) || EVBUFFER_IS_RING(src)) {
+        /* Copy as much as dst has room for. */
+        if (datlen > src->total_len)
+            datlen = src->total_len;
+        if (EVBUFFER_IS_RING(dst) &&
+                datlen > (size_t)CHAIN_SPACE_LEN(dst->first))
+            datlen = (size_t)CHAIN_SPACE_LEN(dst->first);
+        if (evbuffer_copy_between_(dst, src, datlen) < 0)
+            result = -1;
+        else
+            result = (int)datlen;
+        goto done;
+    }
+
     /* short-cut if there is no more data buffered */
     if (datlen >= src->total_len) {
         datlen = src->total_len;
@@ -1414,6 +3143,7 @@ evbuffer_remove_buffer(struct evbuffer *src, struct evbuffer *dst,
      */
     src->total_len -= nread;
     src->n_del_for_cb += nread;
+    evbuffer_chain_index_invalidate(src);
 
     if (nread) {
         evbuffer_invoke_callbacks_(dst);
@@ -1491,7 +3221,7 @@ evbuffer_pullup(struct evbuffer *buf, ev_ssize_t size)
         size -= old_off;
         chain = chain->next;
     } else {
-        if ((tmp = evbuffer_chain_new(size)) == NULL) {
+        if ((tmp = evbuffer_chain_new_membuf(buf, size)) == NULL) {
             event_warn("%s: out of memory", __func__);
             goto done;
         }
@@ -1538,6 +3268,7 @@ evbuffer_pullup(struct evbuffer *buf, ev_ssize_t size)
     }
 
     result = (tmp->buffer + tmp->misalign);
+    evbuffer_chain_index_invalidate(buf);
 
 done:
     EVBUFFER_UNLOCK(buf);
@@ -1859,6 +3590,18 @@ evbuffer_add(struct evbuffer *buf, const void *data_in, size_t datlen)
         goto done;
     }
 
+    if (EVBUFFER_IS_RING(buf)) {
+        /* A ring never grows: either all of the data fits or none. */
+        chain = buf->first;
+        if (datlen > (size_t)CHAIN_SPACE_LEN(chain))
+            goto done;
+        memcpy(CHAIN_SPACE_PTR(chain), data, datlen);
+        chain->off += datlen;
+        buf->total_len += datlen;
+        buf->n_add_for_cb += datlen;
+        goto out;
+    }
+
     // 找到最后一个evbuffer_chain
     if (*buf->last_with_datap == NULL) {
         chain = buf->last;
@@ -1870,7 +3613,7 @@ evbuffer_add(struct evbuffer *buf, const void *data_in, size_t datlen)
      * big enough to hold all the data. */
     // 第一次插入数据时，buf->last为NULL
     if (chain == NULL) {
-        chain = evbuffer_chain_new(datlen);
+        chain = evbuffer_chain_new_membuf(buf, datlen);
         if (!chain)
             goto done;
         evbuffer_chain_insert(buf, chain);
@@ -1903,6 +3646,7 @@ evbuffer_add(struct evbuffer *buf, const void *data_in, size_t datlen)
             /* we can fit the data into the misalignment */
             // 通过使用chain->misalign这个错位空间而插入数据
             evbuffer_chain_align(chain);
+            evbuffer_chain_index_invalidate(buf);
 
             memcpy(chain->buffer + chain->off, data, datlen);
             chain->off += datlen;
@@ -1930,7 +3674,7 @@ evbuffer_add(struct evbuffer *buf, const void *data_in, size_t datlen)
     if (datlen > to_alloc)
         to_alloc = datlen;
     // 此时需要new一个chain才能保存本次要插入的数据
-    tmp = evbuffer_chain_new(to_alloc);
+    tmp = evbuffer_chain_new_membuf(buf, to_alloc);
     if (tmp == NULL)
         goto done;
 
@@ -1982,9 +3726,24 @@ evbuffer_prepend(struct evbuffer *buf, const void *data, size_t datlen)
 
     chain = buf->first;
 
+    if (EVBUFFER_IS_RING(buf)) {
+        /* The free space in a ring is just as contiguous in front of
+         * the data as behind it. */
+        if (datlen > (size_t)CHAIN_SPACE_LEN(chain))
+            goto done;
+        if ((size_t)chain->misalign < datlen)
+            chain->misalign += chain->buffer_len;
+        chain->misalign -= datlen;
+        memcpy(chain->buffer + chain->misalign, data, datlen);
+        chain->off += datlen;
+        buf->total_len += datlen;
+        buf->n_add_for_cb += datlen;
+        goto out;
+    }
+
     // 该链表暂时还没有节点，则新建插入chain
     if (chain == NULL) {
-        chain = evbuffer_chain_new(datlen);
+        chain = evbuffer_chain_new_membuf(buf, datlen);
         if (!chain)
             goto done;
         evbuffer_chain_insert(buf, chain);
@@ -2028,7 +3787,7 @@ evbuffer_prepend(struct evbuffer *buf, const void *data, size_t datlen)
 
     /* we need to add another chain */
     // 新建一个新的chain来存放剩余的data
-    if ((tmp = evbuffer_chain_new(datlen)) == NULL)
+    if ((tmp = evbuffer_chain_new_membuf(buf, datlen)) == NULL)
         goto done;
     buf->first = tmp;
     if (buf->last_with_datap == &buf->first)
@@ -2046,6 +3805,9 @@ evbuffer_prepend(struct evbuffer *buf, const void *data, size_t datlen)
     buf->n_add_for_cb += datlen;
 
 out:
+    evbuffer_chain_index_invalidate(buf);
+    /* The running CRC covers appended data only. */
+    buf->running_crc_len = buf->total_len;
     // 调用回调函数
     evbuffer_invoke_callbacks_(buf);
     result = 0;
@@ -2078,6 +3840,125 @@ evbuffer_chain_should_realign(struct evbuffer_chain *chain,
             (chain->off <= MAX_TO_REALIGN_IN_EXPAND);
 }
 
+/* Chains holding no more than this many bytes are candidates for being
+ * merged with their neighbours by evbuffer_compact_(). */
+#define COMPACT_SMALL_CHAIN_SIZE 512
+/* Never build a merged chain holding more than this many bytes. */
+#define COMPACT_MAX_CHAIN_SIZE 16384
+
+/** Helper: return true iff chain's data may be copied elsewhere and the
+ * chain freed. */
+static inline int
+evbuffer_chain_is_compactable(const struct evbuffer_chain *chain)
+{
+    return chain->off <= COMPACT_SMALL_CHAIN_SIZE &&
+            !CHAIN_PINNED(chain) &&
+            !(chain->flags & (EVBUFFER_SENDFILE|EVBUFFER_DANGLING));
+}
+
+/* Coalesce runs of adjacent small chains among those holding the first
+ * 'howmuch' bytes of buf (all of buf if howmuch is negative) into bigger
+ * chains.  Return the number of chains removed, or -1 if we ran out of
+ * memory.  Never touches the empty chains after last_with_data, since
+ * they may hold reserved space.  Requires lock. */
+static int
+evbuffer_compact_(struct evbuffer *buf, ev_ssize_t howmuch)
+{
+    struct evbuffer_chain **chp = &buf->first;
+    struct evbuffer_chain *chain, *end, *last_in_run, *tmp;
+    struct evbuffer_chain *victim, *next;
+    size_t run_len, so_far = 0;
+    int n_run, removed = 0;
+    int was_last_with_data, before_last_with_data, was_last;
+
+    ASSERT_EVBUFFER_LOCKED(buf);
+
+    if (howmuch < 0 || (size_t)howmuch > buf->total_len)
+        howmuch = buf->total_len;
+
+    while ((chain = *chp) != NULL && so_far < (size_t)howmuch) {
+        // 找出从chain开始的一串可以合并的小chain: [chain, end)
+        run_len = 0;
+        n_run = 0;
+        last_in_run = NULL;
+        for (end = chain; end && evbuffer_chain_is_compactable(end) &&
+             run_len + end->off <= COMPACT_MAX_CHAIN_SIZE; end = end->next) {
+            run_len += end->off;
+            ++n_run;
+            last_in_run = end;
+            if (end == *buf->last_with_datap ||
+                    so_far + run_len >= (size_t)howmuch) {
+                end = end->next;
+                break;
+            }
+        }
+
+        if (n_run < 2) {
+            if (chain == *buf->last_with_datap)
+                break;
+            so_far += chain->off;
+            chp = &chain->next;
+            continue;
+        }
+
+        was_last_with_data = (last_in_run == *buf->last_with_datap);
+        before_last_with_data =
+                (buf->last_with_datap == &last_in_run->next);
+        was_last = (last_in_run == buf->last);
+
+        if (!(chain->flags & EVBUFFER_IMMUTABLE) &&
+                chain->buffer_len >= run_len) {
+            /* The first chain can hold the whole run. */
+            if (chain->buffer_len - (size_t)chain->misalign < run_len)
+                evbuffer_chain_align(chain);
+            tmp = chain;
+            victim = chain->next;
+        } else {
+            if ((tmp = evbuffer_chain_new_membuf(buf, run_len)) == NULL)
+                return -1;
+            victim = chain;
+        }
+
+        for (; victim != end; victim = next) {
+            next = victim->next;
+            memcpy(CHAIN_SPACE_PTR(tmp),
+                   victim->buffer + victim->misalign, victim->off);
+            tmp->off += victim->off;
+            evbuffer_chain_free(victim);
+        }
+        EVUTIL_ASSERT(tmp->off == run_len);
+
+        tmp->next = end;
+        *chp = tmp;
+        if (was_last_with_data)
+            buf->last_with_datap = chp;
+        else if (before_last_with_data)
+            buf->last_with_datap = &tmp->next;
+        if (was_last)
+            buf->last = tmp;
+
+        evbuffer_chain_index_invalidate(buf);
+        removed += n_run - 1;
+        so_far += run_len;
+        if (was_last_with_data)
+            break;
+        chp = &tmp->next;
+    }
+
+    return removed;
+}
+
+int
+evbuffer_compact(struct evbuffer *buf)
+{
+    int result;
+
+    EVBUFFER_LOCK(buf);
+    result = evbuffer_compact_(buf, -1);
+    EVBUFFER_UNLOCK(buf);
+    return result;
+}
+
 /* Expands the available space in the event buffer to at least datlen, all in
  * a single chunk.  Return that chunk. */
 // 扩大链表的buffer空间，使得下次add一个长度为datlen的数据时，无需动态申请内存
@@ -2088,6 +3969,11 @@ static struct evbuffer_chain *
     struct evbuffer_chain *result = NULL;
     ASSERT_EVBUFFER_LOCKED(buf);
 
+    if (EVBUFFER_IS_RING(buf)) {
+        chain = buf->first;
+        return (size_t)CHAIN_SPACE_LEN(chain) >= datlen ? chain : NULL;
+    }
+
     chainp = buf->last_with_datap;
 
     /* XXX If *chainp is no longer writeable, but has enough space in its
@@ -2136,6 +4022,7 @@ static struct evbuffer_chain *
     // 那么也不用扩大buffer空间
     if (evbuffer_chain_should_realign(chain, datlen)) {
         evbuffer_chain_align(chain);
+        evbuffer_chain_index_invalidate(buf);
         result = chain;
         goto ok;
     }
@@ -2175,7 +4062,7 @@ static struct evbuffer_chain *
         // 由于本chain的数据量比较小，所以把这个chain的数据迁移到另外一个
         // chain上是值得的
         size_t length = chain->off + datlen;
-        struct evbuffer_chain *tmp = evbuffer_chain_new(length);
+        struct evbuffer_chain *tmp = evbuffer_chain_new_membuf(buf, length);
         if (tmp == NULL)
             goto err;
 
@@ -2194,6 +4081,7 @@ static struct evbuffer_chain *
         // 设置新chain的next并释放旧的chain
         tmp->next = chain->next;
         evbuffer_chain_free(chain);
+        evbuffer_chain_index_invalidate(buf);
         goto ok;
     }
 
@@ -2208,6 +4096,38 @@ err:
     return result;
 }
 
+/* Room in the chains that evbuffer_expand_fast_() spreads large amounts
+ * of space over: the largest allocation the chain cache recycles. */
+#define EVBUFFER_RECYCLED_CHAIN_SPACE \
+    (EVBUFFER_CHAIN_CACHE_MAX_ALLOC - EVBUFFER_CHAIN_SIZE)
+
+/* Append empty chains with room for datlen bytes in all to buf, using no
+ * more than n of them.  Rather than make one large allocation, spread
+ * large amounts over chains that the chain cache can recycle, with
+ * whatever is left in the last one.  Requires lock. */
+static int
+evbuffer_append_space_chains_(struct evbuffer *buf, size_t datlen, int n)
+{
+    struct evbuffer_chain *tmp;
+
+    while (datlen) {
+        size_t size = datlen;
+        if (n > 1 && size > EVBUFFER_RECYCLED_CHAIN_SPACE)
+            size = EVBUFFER_RECYCLED_CHAIN_SPACE;
+        if ((tmp = evbuffer_chain_new_membuf(buf, size)) == NULL)
+            return (-1);
+        if (buf->last == NULL) {
+            buf->first = buf->last = tmp;
+        } else {
+            buf->last->next = tmp;
+            buf->last = tmp;
+        }
+        datlen -= size;
+        --n;
+    }
+    return (0);
+}
+
 /* Make sure that datlen bytes are available for writing in the last n
  * chains.  Never copies or moves data. */
 // 用最多不超过n个节点就提供datlen大小的空闲空间。链表过长是不好的
@@ -2222,16 +4142,14 @@ evbuffer_expand_fast_(struct evbuffer *buf, size_t datlen, int n)
     // n必须大于等于2
     EVUTIL_ASSERT(n >= 2);
 
+    if (EVBUFFER_IS_RING(buf))
+        return (size_t)CHAIN_SPACE_LEN(buf->first) >= datlen ? 0 : -1;
+
     //如果最后一个chain为NULL或是不可更改的，则新建插入
     if (chain == NULL || (chain->flags & EVBUFFER_IMMUTABLE)) {
         /* There is no last chunk, or we can't touch the last chunk.
-         * Just add a new chunk. */
-        chain = evbuffer_chain_new(datlen);
-        if (chain == NULL)
-            return (-1);
-
-        evbuffer_chain_insert(buf, chain);
-        return (0);
+         * Just add new chunks. */
+        return evbuffer_append_space_chains_(buf, datlen, n);
     }
 
     // 要使用的chain个数
@@ -2278,17 +4196,11 @@ evbuffer_expand_fast_(struct evbuffer *buf, size_t datlen, int n)
          * chains; we can add another. */
         EVUTIL_ASSERT(chain == NULL);
 
-        // 申请一个足够大的evbuffer_chain，把空间补足
-        tmp = evbuffer_chain_new(datlen - avail);
-        if (tmp == NULL)
-            return (-1);
-
-        buf->last->next = tmp;
-        buf->last = tmp;
+        // 申请足够的evbuffer_chain，把空间补足
         /* (we would only set last_with_data if we added the first
          * chain. But if the buffer had no chains, we would have
          * just allocated a new chain earlier) */
-        return (0);
+        return evbuffer_append_space_chains_(buf, datlen - avail, n - used);
     } else {
         // used == n。把后面的n个节点都用了还是不够datlen空间
         // 这个n个节点中，至少有n-1个节点的off等于0
@@ -2321,7 +4233,7 @@ evbuffer_expand_fast_(struct evbuffer *buf, size_t datlen, int n)
         }
         EVUTIL_ASSERT(datlen >= avail);
         // 然后new一个足够大的evbuffer_chain即可。这能降低链表的长度
-        tmp = evbuffer_chain_new(datlen - avail);
+        tmp = evbuffer_chain_new_membuf(buf, datlen - avail);
         // new失败
         if (tmp == NULL) {
             // 这种情况下，该链表就根本没有节点了
@@ -2396,8 +4308,15 @@ evbuffer_expand(struct evbuffer *buf, size_t datlen)
 #endif
 #endif
 #define NUM_READ_IOVEC 4
-
-#define EVBUFFER_MAX_READ	4096
+#ifdef USE_IOVEC_IMPL
+/* The most iovecs we use for one large read, spread over recycled chains;
+ * like NUM_WRITE_IOVEC, never more than IOV_MAX. */
+#ifdef _WIN32
+#define NUM_READ_IOVEC_MAX NUM_READ_IOVEC
+#else
+#define NUM_READ_IOVEC_MAX NUM_WRITE_IOVEC
+#endif
+#endif
 
 /** Helper function to figure out which space to use for reading data into
     an evbuffer.  Internal use only.
@@ -2464,23 +4383,37 @@ evbuffer_read_setup_vecs_(struct evbuffer *buf, ev_ssize_t howmuch,
     return i;
 }
 
+#ifdef USE_IOVEC_IMPL
+/* Free the empty chains at the end of buf.  Requires lock. */
+static void
+evbuffer_trim_empty_chains_(struct evbuffer *buf)
+{
+    struct evbuffer_chain **chp = evbuffer_free_trailing_empty_chains(buf);
+
+    if (chp == &buf->first)
+        buf->last = NULL;
+    else
+        buf->last = EVUTIL_UPCAST(chp, struct evbuffer_chain, next);
+}
+#endif
+
 // 通过ioctl获取这个socket的读缓冲区中有多少字节
 static int
 get_n_bytes_readable_on_socket(evutil_socket_t fd)
 {
 #if defined(FIONREAD) && defined(_WIN32)
-    unsigned long lng = EVBUFFER_MAX_READ;
+    unsigned long lng = EVBUFFER_MAX_READ_DEFAULT;
     if (ioctlsocket(fd, FIONREAD, &lng) < 0)
         return -1;
     /* Can overflow, but mostly harmlessly. XXXX */
     return (int)lng;
 #elif defined(FIONREAD)
-    int n = EVBUFFER_MAX_READ;
+    int n = EVBUFFER_MAX_READ_DEFAULT;
     if (ioctl(fd, FIONREAD, &n) < 0)
         return -1;
     return n;
 #else
-    return EVBUFFER_MAX_READ;
+    return EVBUFFER_MAX_READ_DEFAULT;
 #endif
 }
 
@@ -2497,7 +4430,7 @@ evbuffer_read(struct evbuffer *buf, evutil_socket_t fd, int howmuch)
 
     //所在的系统支持iovec或者是Windows操作系统
 #ifdef USE_IOVEC_IMPL
-    int nvecs, i, remaining;
+    int nvecs, i, remaining, n_iovec;
 #else
     struct evbuffer_chain *chain;
     unsigned char *p;
@@ -2514,27 +4447,51 @@ evbuffer_read(struct evbuffer *buf, evutil_socket_t fd, int howmuch)
     // 获取这个socket的读缓冲区中有多少字节,
     // 进而确定本次要读多少字节到evbuffer中
     n = get_n_bytes_readable_on_socket(fd);
-    if (n <= 0 || n > EVBUFFER_MAX_READ)
-        n = EVBUFFER_MAX_READ;
+    if (n <= 0 || n > (int)buf->max_read)
+        n = (int)buf->max_read;
     if (howmuch < 0 || howmuch > n)
         howmuch = n;
 
+    if (EVBUFFER_IS_RING(buf)) {
+        /* Read straight into the ring, but never more than fits. */
+        size_t space = (size_t)CHAIN_SPACE_LEN(buf->first);
+        if (space == 0) {
+            /* Not an error on the socket: try again once there's room. */
+#ifdef _WIN32
+            EVUTIL_SET_SOCKET_ERROR(WSAEWOULDBLOCK);
+#else
+            errno = EAGAIN;
+#endif
+            result = -1;
+            goto done;
+        }
+        if ((size_t)howmuch > space)
+            howmuch = (int)space;
+    }
+
     // 所在的系统支持iovec或者是Windows操作系统
 #ifdef USE_IOVEC_IMPL
     /* Since we can use iovecs, we're willing to use the last
-     * NUM_READ_IOVEC chains. */
+     * NUM_READ_IOVEC chains, or for a large read, enough recycled chains
+     * to hold it all, up to NUM_READ_IOVEC_MAX. */
+    n_iovec = NUM_READ_IOVEC;
+    if (!EVBUFFER_IS_RING(buf) &&
+            (size_t)howmuch > NUM_READ_IOVEC * EVBUFFER_RECYCLED_CHAIN_SPACE) {
+        size_t want = howmuch / EVBUFFER_RECYCLED_CHAIN_SPACE + 2;
+        n_iovec = want < NUM_READ_IOVEC_MAX ? (int)want : NUM_READ_IOVEC_MAX;
+    }
     // 在真正read之前会先把evbuffer扩容，使得其有howmuch字节的空闲空间
     // ,免得在read的时候缓冲区不够
-    if (evbuffer_expand_fast_(buf, howmuch, NUM_READ_IOVEC) == -1) {
+    if (evbuffer_expand_fast_(buf, howmuch, n_iovec) == -1) {
         result = -1;
         goto done;
     } else {
         // 把链表的各个evbuffer_chain的空闲空间的地址赋值给iovec数组
         // 可以使用readv把数据读取到相应的chain中
-        IOV_TYPE vecs[NUM_READ_IOVEC];
+        IOV_TYPE vecs[NUM_READ_IOVEC_MAX];
 #ifdef EVBUFFER_IOVEC_IS_NATIVE_
         nvecs = evbuffer_read_setup_vecs_(buf, howmuch, vecs,
-                                          NUM_READ_IOVEC, &chainp, 1);
+                                          n_iovec, &chainp, 1);
 #else
         /* We aren't using the native struct iovec.  Therefore,
            we are on win32. */
@@ -2594,12 +4551,12 @@ evbuffer_read(struct evbuffer *buf, evutil_socket_t fd, int howmuch)
     // 错误
     if (n == -1) {
         result = -1;
-        goto done;
+        goto trim;
     }
     // 断开了连接
     if (n == 0) {
         result = 0;
-        goto done;
+        goto trim;
     }
 
 #ifdef USE_IOVEC_IMPL
@@ -2642,15 +4599,71 @@ evbuffer_read(struct evbuffer *buf, evutil_socket_t fd, int howmuch)
     // 因为evbuffer添加了数据，就需要调用回调函数
     evbuffer_invoke_callbacks_(buf);
     result = n;
+trim:
+#ifdef USE_IOVEC_IMPL
+    /* Hand back the recycled chains that a large read didn't reach, rather
+     * than keep megabytes of empty space around until the next one. */
+    if (n_iovec > NUM_READ_IOVEC)
+        evbuffer_trim_empty_chains_(buf);
+#endif
 done:
     EVBUFFER_UNLOCK(buf);
     return result;
 }
 
-#ifdef USE_IOVEC_IMPL
+int
+evbuffer_set_max_read(struct evbuffer *buf, size_t max)
+{
+    if (max > INT_MAX)
+        return -1;
+
+    EVBUFFER_LOCK(buf);
+    buf->max_read = max ? max : EVBUFFER_MAX_READ_DEFAULT;
+    EVBUFFER_UNLOCK(buf);
+    return 0;
+}
+
+size_t
+evbuffer_get_max_read(struct evbuffer *buf)
+{
+    size_t result;
+
+    EVBUFFER_LOCK(buf);
+    result = buf->max_read;
+    EVBUFFER_UNLOCK(buf);
+    return result;
+}
+
+#ifdef USE_IOVEC_IMPL
+/* Return true iff the first 'howmuch' bytes of buffer are spread over more
+ * chains than one writev can take, and most of those chains are small
+ * enough that merging them first is cheaper than more system calls. */
+static int
+evbuffer_should_compact_for_write(struct evbuffer *buffer, ev_ssize_t howmuch)
+{
+    struct evbuffer_chain *chain = buffer->first;
+    size_t so_far = 0;
+    int i, n_small = 0;
+
+    ASSERT_EVBUFFER_LOCKED(buffer);
+    for (i = 0; chain && i < NUM_WRITE_IOVEC; ++i, chain = chain->next) {
+        if (chain->flags & EVBUFFER_SENDFILE)
+            return 0;
+        so_far += chain->off;
+        if (so_far >= (size_t)howmuch)
+            return 0;
+        if (evbuffer_chain_is_compactable(chain))
+            ++n_small;
+    }
+    return chain != NULL && n_small >= NUM_WRITE_IOVEC / 2;
+}
+
+/* If 'more' is set and the first 'howmuch' bytes don't all fit in one
+ * writev, the caller is about to write again: tell the kernel so, where we
+ * can, so that it doesn't push out a short segment in between. */
 static inline int
 evbuffer_write_iovec(struct evbuffer *buffer, evutil_socket_t fd,
-                     ev_ssize_t howmuch)
+                     ev_ssize_t howmuch, int more)
 {
     IOV_TYPE iov[NUM_WRITE_IOVEC];
     struct evbuffer_chain *chain = buffer->first;
@@ -2677,6 +4690,7 @@ evbuffer_write_iovec(struct evbuffer *buffer, evutil_socket_t fd,
         } else {
             /* XXXcould be problematic when windows supports mmap*/
             iov[i++].IOV_LEN_FIELD = (IOV_LEN_TYPE)howmuch;
+            howmuch = 0;
             break;
         }
         chain = chain->next;
@@ -2685,6 +4699,7 @@ evbuffer_write_iovec(struct evbuffer *buffer, evutil_socket_t fd,
         return 0;
 
 #ifdef _WIN32
+    (void)more;
     {
         DWORD bytesSent;
         if (WSASend(fd, iov, i, &bytesSent, 0, NULL, NULL))
@@ -2692,7 +4707,18 @@ evbuffer_write_iovec(struct evbuffer *buffer, evutil_socket_t fd,
         else
             n = bytesSent;
     }
+#elif defined(MSG_MORE)
+    if (more && howmuch) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = i;
+        n = sendmsg(fd, &msg, MSG_MORE);
+    } else {
+        n = writev(fd, iov, i);
+    }
 #else
+    (void)more;
     n = writev(fd, iov, i);
 #endif
     return (n);
@@ -2759,13 +4785,13 @@ evbuffer_write_sendfile(struct evbuffer *buffer, evutil_socket_t dest_fd,
 // 试图将 buffer 前面至多 howmuch 字节写入到套接字 fd 中,并删除以写入的数据
 // 如果howmuch小于0，那么就把buffer里的所有数据都写入fd
 // 成功时函数返回写入的字节数,失败时返回-1
-int
-evbuffer_write_atmost(struct evbuffer *buffer, evutil_socket_t fd,
-                      ev_ssize_t howmuch)
+static int
+evbuffer_write_atmost_impl(struct evbuffer *buffer, evutil_socket_t fd,
+                           ev_ssize_t howmuch, int more)
 {
     int n = -1;
 
-    EVBUFFER_LOCK(buffer);
+    ASSERT_EVBUFFER_LOCKED(buffer);
 
     // 冻结了链表头，无法往fd写数据。因为写之后，还要把数据从evbuffer中删除
     if (buffer->freeze_start) {
@@ -2786,9 +4812,18 @@ evbuffer_write_atmost(struct evbuffer *buffer, evutil_socket_t fd,
         else {
 #endif
 #ifdef USE_IOVEC_IMPL
+            // 小chain太多，一次writev写不完时，先把它们合并成大chain。
+            // 只合并一次writev最多能写出的数据量
+            if (evbuffer_should_compact_for_write(buffer, howmuch)) {
+                ev_ssize_t to_compact = howmuch;
+                if ((size_t)to_compact >
+                        (size_t)NUM_WRITE_IOVEC * COMPACT_MAX_CHAIN_SIZE)
+                    to_compact = NUM_WRITE_IOVEC * COMPACT_MAX_CHAIN_SIZE;
+                evbuffer_compact_(buffer, to_compact);
+            }
             // 所在的系统支持writev这类函数
             // 函数内部会设置数组元素的成员指针，以及长度成员
-            n = evbuffer_write_iovec(buffer, fd, howmuch);
+            n = evbuffer_write_iovec(buffer, fd, howmuch, more);
 #elif defined(_WIN32)
             /* XXX(nickm) Don't disable this code until we know if
          * the WSARecv code above works. */
@@ -2813,10 +4848,46 @@ evbuffer_write_atmost(struct evbuffer *buffer, evutil_socket_t fd,
         evbuffer_drain(buffer, n);
 
 done:
+    return (n);
+}
+
+int
+evbuffer_write_atmost(struct evbuffer *buffer, evutil_socket_t fd,
+                      ev_ssize_t howmuch)
+{
+    int n;
+
+    EVBUFFER_LOCK(buffer);
+    n = evbuffer_write_atmost_impl(buffer, fd, howmuch, 0);
     EVBUFFER_UNLOCK(buffer);
     return (n);
 }
 
+int
+evbuffer_write_batch_(struct evbuffer *buffer, evutil_socket_t fd,
+                      ev_ssize_t howmuch)
+{
+    int n, total = 0;
+
+    EVBUFFER_LOCK(buffer);
+    if (howmuch < 0 || (size_t)howmuch > buffer->total_len)
+        howmuch = buffer->total_len;
+    while (howmuch > 0) {
+        n = evbuffer_write_atmost_impl(buffer, fd, howmuch, 1);
+        if (n <= 0) {
+            /* Report the failure only if nothing went out; otherwise
+             * the next write will run into it again. */
+            if (!total)
+                total = n;
+            break;
+        }
+        total += n;
+        howmuch -= n;
+    }
+    EVBUFFER_UNLOCK(buffer);
+    return (total);
+}
+
 // 把buffer所有数据写入到socket fd中，并清空 buffer 的内容
 int
 evbuffer_write(struct evbuffer *buffer, evutil_socket_t fd)
@@ -2909,6 +4980,20 @@ evbuffer_ptr_set(struct evbuffer *buf, struct evbuffer_ptr *pos,
         break;
     }
 
+    /* With a chain index we can jump straight to the right chain instead
+     * of walking there. */
+    if ((buf->flags & EVBUFFER_FLAG_CHAIN_INDEX) &&
+            (size_t)pos->pos < buf->total_len) {
+        size_t pos_in_chain;
+        if (evbuffer_chain_index_lookup(buf, (size_t)pos->pos,
+                                        &chain, &pos_in_chain) == 0) {
+            pos->internal_.chain = chain;
+            pos->internal_.pos_in_chain = pos_in_chain;
+            EVBUFFER_UNLOCK(buf);
+            return 0;
+        }
+    }
+
     EVUTIL_ASSERT(EV_SIZE_MAX - left >= position);
     // 这个偏移量跨了evbuffer_chain。可能不止跨一个chain
     while (chain && position + left >= chain->off) {
@@ -3133,6 +5218,185 @@ evbuffer_peek(struct evbuffer *buffer, ev_ssize_t len,
     return idx;
 }
 
+int
+evbuffer_iter_init(struct evbuffer_iter *it, struct evbuffer *buf,
+    size_t offset)
+{
+    it->buffer = buf;
+    return evbuffer_ptr_set(buf, &it->ptr, offset, EVBUFFER_PTR_SET);
+}
+
+size_t
+evbuffer_iter_remaining(const struct evbuffer_iter *it)
+{
+    size_t result;
+
+    EVBUFFER_LOCK(it->buffer);
+    result = it->buffer->total_len - it->ptr.pos;
+    EVBUFFER_UNLOCK(it->buffer);
+    return result;
+}
+
+// 数据都在当前chain里时直接返回chain中的指针，跨chain时才复制到scratch
+const unsigned char *
+evbuffer_iter_peek(struct evbuffer_iter *it, size_t len, void *scratch)
+{
+    struct evbuffer *buf = it->buffer;
+    struct evbuffer_chain *chain;
+    size_t pos_in_chain;
+    const unsigned char *result = NULL;
+
+    EVBUFFER_LOCK(buf);
+    if (len == 0 || buf->total_len - it->ptr.pos < len)
+        goto done;
+    chain = it->ptr.internal_.chain;
+    pos_in_chain = it->ptr.internal_.pos_in_chain;
+    if (chain->off - pos_in_chain >= len)
+        result = chain->buffer + chain->misalign + pos_in_chain;
+    else if (scratch &&
+             evbuffer_copyout_from(buf, &it->ptr, scratch, len) ==
+             (ev_ssize_t)len)
+        result = scratch;
+done:
+    EVBUFFER_UNLOCK(buf);
+    return result;
+}
+
+int
+evbuffer_iter_advance(struct evbuffer_iter *it, size_t len)
+{
+    int result = -1;
+
+    /* Unlike evbuffer_ptr_set(), leave the iterator usable on failure. */
+    EVBUFFER_LOCK(it->buffer);
+    if (it->buffer->total_len - it->ptr.pos >= len)
+        result = evbuffer_ptr_set(it->buffer, &it->ptr, len,
+                                  EVBUFFER_PTR_ADD);
+    EVBUFFER_UNLOCK(it->buffer);
+    return result;
+}
+
+int
+evbuffer_iter_read(struct evbuffer_iter *it, void *data_out, size_t len)
+{
+    const unsigned char *p;
+
+    if (len == 0)
+        return 0;
+    if ((p = evbuffer_iter_peek(it, len, data_out)) == NULL)
+        return -1;
+    if (p != data_out)
+        memcpy(data_out, p, len);
+    return evbuffer_iter_advance(it, len);
+}
+
+/* Read an n-byte little-endian integer at it into *out, and advance. */
+static int
+evbuffer_iter_read_le_(struct evbuffer_iter *it, ev_uint64_t *out, int n)
+{
+    unsigned char scratch[8];
+    const unsigned char *p;
+    ev_uint64_t v = 0;
+    int i;
+
+    if ((p = evbuffer_iter_peek(it, n, scratch)) == NULL)
+        return -1;
+    for (i = n - 1; i >= 0; --i)
+        v = (v << 8) | p[i];
+    if (evbuffer_iter_advance(it, n) < 0)
+        return -1;
+    *out = v;
+    return 0;
+}
+
+int
+evbuffer_iter_read_le16(struct evbuffer_iter *it, ev_uint16_t *out)
+{
+    ev_uint64_t v;
+
+    if (evbuffer_iter_read_le_(it, &v, 2) < 0)
+        return -1;
+    *out = (ev_uint16_t)v;
+    return 0;
+}
+
+int
+evbuffer_iter_read_le32(struct evbuffer_iter *it, ev_uint32_t *out)
+{
+    ev_uint64_t v;
+
+    if (evbuffer_iter_read_le_(it, &v, 4) < 0)
+        return -1;
+    *out = (ev_uint32_t)v;
+    return 0;
+}
+
+int
+evbuffer_iter_read_le64(struct evbuffer_iter *it, ev_uint64_t *out)
+{
+    return evbuffer_iter_read_le_(it, out, 8);
+}
+
+/* The longest LEB128 encoding of a 64-bit number. */
+#define EVBUFFER_VARINT_MAX 10
+
+int
+evbuffer_iter_read_varint(struct evbuffer_iter *it, ev_uint64_t *out)
+{
+    unsigned char scratch[EVBUFFER_VARINT_MAX];
+    const unsigned char *p;
+    size_t avail = evbuffer_iter_remaining(it);
+    ev_uint64_t v = 0;
+    int i;
+
+    if (avail > EVBUFFER_VARINT_MAX)
+        avail = EVBUFFER_VARINT_MAX;
+    if ((p = evbuffer_iter_peek(it, avail, scratch)) == NULL)
+        return -1;
+    for (i = 0; i < (int)avail; ++i) {
+        /* The tenth byte may only hold the top bit of the number. */
+        if (i == EVBUFFER_VARINT_MAX - 1 && p[i] > 1)
+            return -1;
+        v |= (ev_uint64_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            if (evbuffer_iter_advance(it, i + 1) < 0)
+                return -1;
+            *out = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int
+evbuffer_iter_match(const struct evbuffer_iter *it, const void *prefix,
+    size_t len)
+{
+    struct evbuffer *buf = it->buffer;
+    struct evbuffer_chain *chain;
+    const unsigned char *p = prefix;
+    size_t pos_in_chain = it->ptr.internal_.pos_in_chain;
+    int result = 0;
+
+    EVBUFFER_LOCK(buf);
+    if (buf->total_len - it->ptr.pos < len)
+        goto done;
+    for (chain = it->ptr.internal_.chain; len; chain = chain->next) {
+        size_t n = chain->off - pos_in_chain;
+        if (n > len)
+            n = len;
+        if (memcmp(chain->buffer + chain->misalign + pos_in_chain, p, n))
+            goto done;
+        p += n;
+        len -= n;
+        pos_in_chain = 0;
+    }
+    result = 1;
+done:
+    EVBUFFER_UNLOCK(buf);
+    return result;
+}
+
 // 添加格式化的数据到 buf 末尾
 int
 evbuffer_add_vprintf(struct evbuffer *buf, const char *fmt, va_list ap)
@@ -3188,28 +5452,342 @@ evbuffer_add_vprintf(struct evbuffer *buf, const char *fmt, va_list ap)
             result = sz;
             goto done;
         }
-        if ((chain = evbuffer_expand_singlechain(buf, sz + 1)) == NULL)
-            goto done;
+        if ((chain = evbuffer_expand_singlechain(buf, sz + 1)) == NULL)
+            goto done;
+    }
+    /* NOTREACHED */
+
+done:
+    EVBUFFER_UNLOCK(buf);
+    return result;
+}
+
+// 按照fmt格式把数据添加到evbuffer中
+int
+evbuffer_add_printf(struct evbuffer *buf, const char *fmt, ...)
+{
+    int res = -1;
+    va_list ap;
+
+    va_start(ap, fmt);
+    res = evbuffer_add_vprintf(buf, fmt, ap);
+    va_end(ap);
+
+    return (res);
+}
+
+/* Pairs of decimal digits, so that we can emit two digits per division. */
+static const char evbuffer_digit_pairs_[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+
+/* The most bytes that evbuffer_fmt_u64_() and evbuffer_fmt_hex_() write:
+ * 20 decimal digits, or 16 hex digits, plus a sign. */
+#define EVBUFFER_FMT_INT_MAX 21
+
+/* Write the decimal digits of v to out, and return how many there were. */
+static size_t
+evbuffer_fmt_u64_(char *out, ev_uint64_t v)
+{
+    char tmp[EVBUFFER_FMT_INT_MAX];
+    char *p = tmp + sizeof(tmp);
+    size_t n;
+
+    while (v >= 100) {
+        const char *d = evbuffer_digit_pairs_ + (v % 100) * 2;
+        v /= 100;
+        *--p = d[1];
+        *--p = d[0];
+    }
+    if (v >= 10) {
+        const char *d = evbuffer_digit_pairs_ + v * 2;
+        *--p = d[1];
+        *--p = d[0];
+    } else {
+        *--p = (char)('0' + v);
+    }
+    n = tmp + sizeof(tmp) - p;
+    memcpy(out, p, n);
+    return n;
+}
+
+static size_t
+evbuffer_fmt_i64_(char *out, ev_int64_t v)
+{
+    if (v < 0) {
+        *out = '-';
+        /* Negate as unsigned, so that EV_INT64_MIN works. */
+        return 1 + evbuffer_fmt_u64_(out + 1, (ev_uint64_t)0 - (ev_uint64_t)v);
+    }
+    return evbuffer_fmt_u64_(out, (ev_uint64_t)v);
+}
+
+static size_t
+evbuffer_fmt_hex_(char *out, ev_uint64_t v, int upper)
+{
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char tmp[16];
+    char *p = tmp + sizeof(tmp);
+    size_t n;
+
+    do {
+        *--p = digits[v & 0xf];
+        v >>= 4;
+    } while (v);
+    n = tmp + sizeof(tmp) - p;
+    memcpy(out, p, n);
+    return n;
+}
+
+/* Reserve space for at most maxlen bytes at the end of buf, and return a
+ * pointer to it, or NULL.  Requires the lock; the caller finishes with
+ * evbuffer_fmt_commit_(). */
+static char *
+evbuffer_fmt_reserve_(struct evbuffer *buf, size_t maxlen,
+    struct evbuffer_chain **chainp)
+{
+    struct evbuffer_chain *chain;
+
+    ASSERT_EVBUFFER_LOCKED(buf);
+    if (buf->freeze_end)
+        return NULL;
+    if ((chain = evbuffer_expand_singlechain(buf, maxlen)) == NULL)
+        return NULL;
+    *chainp = chain;
+    return (char *)CHAIN_SPACE_PTR(chain);
+}
+
+static void
+evbuffer_fmt_commit_(struct evbuffer *buf, struct evbuffer_chain *chain,
+    size_t len)
+{
+    chain->off += len;
+    buf->total_len += len;
+    buf->n_add_for_cb += len;
+    advance_last_with_data(buf);
+    evbuffer_invoke_callbacks_(buf);
+}
+
+// 不经过printf，直接把数字写进chain的空闲空间
+int
+evbuffer_add_u64(struct evbuffer *buf, ev_uint64_t value)
+{
+    struct evbuffer_chain *chain;
+    char *out;
+    int result = -1;
+
+    EVBUFFER_LOCK(buf);
+    if ((out = evbuffer_fmt_reserve_(buf, EVBUFFER_FMT_INT_MAX, &chain))) {
+        result = (int)evbuffer_fmt_u64_(out, value);
+        evbuffer_fmt_commit_(buf, chain, result);
+    }
+    EVBUFFER_UNLOCK(buf);
+    return result;
+}
+
+int
+evbuffer_add_i64(struct evbuffer *buf, ev_int64_t value)
+{
+    struct evbuffer_chain *chain;
+    char *out;
+    int result = -1;
+
+    EVBUFFER_LOCK(buf);
+    if ((out = evbuffer_fmt_reserve_(buf, EVBUFFER_FMT_INT_MAX, &chain))) {
+        result = (int)evbuffer_fmt_i64_(out, value);
+        evbuffer_fmt_commit_(buf, chain, result);
+    }
+    EVBUFFER_UNLOCK(buf);
+    return result;
+}
+
+int
+evbuffer_add_hex(struct evbuffer *buf, ev_uint64_t value)
+{
+    struct evbuffer_chain *chain;
+    char *out;
+    int result = -1;
+
+    EVBUFFER_LOCK(buf);
+    if ((out = evbuffer_fmt_reserve_(buf, EVBUFFER_FMT_INT_MAX, &chain))) {
+        result = (int)evbuffer_fmt_hex_(out, value, 0);
+        evbuffer_fmt_commit_(buf, chain, result);
+    }
+    EVBUFFER_UNLOCK(buf);
+    return result;
+}
+
+/* Length modifiers understood by evbuffer_add_fmt(). */
+#define FMT_LEN_INT 0
+#define FMT_LEN_LONG 1
+#define FMT_LEN_LLONG 2
+#define FMT_LEN_SIZE 3
+
+/* Parse the conversion after a '%' at p.  Return a pointer past it, or
+ * NULL if it uses anything evbuffer_add_fmt() leaves to vsnprintf. */
+static const char *
+evbuffer_fmt_parse_(const char *p, int *lenp, char *convp)
+{
+    int len = FMT_LEN_INT;
+
+    if (*p == 'l') {
+        ++p;
+        len = FMT_LEN_LONG;
+        if (*p == 'l') {
+            ++p;
+            len = FMT_LEN_LLONG;
+        }
+    } else if (*p == 'z') {
+        ++p;
+        len = FMT_LEN_SIZE;
+    }
+    switch (*p) {
+    case 'd': case 'i': case 'u': case 'x': case 'X':
+        break;
+    case 's': case 'c': case '%':
+        if (len != FMT_LEN_INT)
+            return NULL;
+        break;
+    default:
+        return NULL;
+    }
+    *lenp = len;
+    *convp = *p;
+    return p + 1;
+}
+
+static ev_int64_t
+evbuffer_fmt_signed_arg_(va_list *ap, int len)
+{
+    switch (len) {
+    case FMT_LEN_LONG: return va_arg(*ap, long);
+    case FMT_LEN_LLONG: return va_arg(*ap, long long);
+    case FMT_LEN_SIZE: return va_arg(*ap, ev_ssize_t);
+    default: return va_arg(*ap, int);
+    }
+}
+
+static ev_uint64_t
+evbuffer_fmt_unsigned_arg_(va_list *ap, int len)
+{
+    switch (len) {
+    case FMT_LEN_LONG: return va_arg(*ap, unsigned long);
+    case FMT_LEN_LLONG: return va_arg(*ap, unsigned long long);
+    case FMT_LEN_SIZE: return va_arg(*ap, size_t);
+    default: return va_arg(*ap, unsigned);
+    }
+}
+
+/* Return the most bytes that fmt can expand to with the arguments in ap,
+ * or -1 if fmt needs the full vsnprintf. */
+static ev_ssize_t
+evbuffer_fmt_measure_(const char *fmt, va_list *ap)
+{
+    size_t total = 0;
+    const char *p = fmt, *s;
+    char conv;
+    int len;
+
+    while (*p) {
+        if (*p != '%') {
+            ++p;
+            ++total;
+            continue;
+        }
+        if (!(p = evbuffer_fmt_parse_(p + 1, &len, &conv)))
+            return -1;
+        switch (conv) {
+        case '%':
+            total += 1;
+            break;
+        case 'c':
+            (void)va_arg(*ap, int);
+            total += 1;
+            break;
+        case 's':
+            if (!(s = va_arg(*ap, const char *)))
+                return -1;
+            total += strlen(s);
+            break;
+        case 'd': case 'i':
+            (void)evbuffer_fmt_signed_arg_(ap, len);
+            total += EVBUFFER_FMT_INT_MAX;
+            break;
+        default:
+            (void)evbuffer_fmt_unsigned_arg_(ap, len);
+            total += EVBUFFER_FMT_INT_MAX;
+            break;
+        }
+        if (total >= EVBUFFER_CHAIN_MAX || total > INT_MAX)
+            return -1;
     }
-    /* NOTREACHED */
-
-done:
-    EVBUFFER_UNLOCK(buf);
-    return result;
+    return (ev_ssize_t)total;
 }
 
-// 按照fmt格式把数据添加到evbuffer中
+// 只支持%s %c %d %i %u %x %X(以及l/ll/z修饰)的快速格式化，其他格式交给vprintf
 int
-evbuffer_add_printf(struct evbuffer *buf, const char *fmt, ...)
+evbuffer_add_fmt(struct evbuffer *buf, const char *fmt, ...)
 {
-    int res = -1;
-    va_list ap;
+    struct evbuffer_chain *chain;
+    const char *p, *s;
+    char *out, *start;
+    ev_ssize_t maxlen;
+    va_list ap, aq;
+    size_t slen;
+    char conv;
+    int len, result = -1;
 
     va_start(ap, fmt);
-    res = evbuffer_add_vprintf(buf, fmt, ap);
-    va_end(ap);
+    va_copy(aq, ap);
+    maxlen = evbuffer_fmt_measure_(fmt, &aq);
+    va_end(aq);
+    if (maxlen < 0) {
+        result = evbuffer_add_vprintf(buf, fmt, ap);
+        va_end(ap);
+        return result;
+    }
 
-    return (res);
+    EVBUFFER_LOCK(buf);
+    if (!(start = out = evbuffer_fmt_reserve_(buf, (size_t)maxlen, &chain)))
+        goto done;
+    for (p = fmt; *p; ) {
+        if (*p != '%') {
+            *out++ = *p++;
+            continue;
+        }
+        p = evbuffer_fmt_parse_(p + 1, &len, &conv);
+        switch (conv) {
+        case '%':
+            *out++ = '%';
+            break;
+        case 'c':
+            *out++ = (char)va_arg(ap, int);
+            break;
+        case 's':
+            s = va_arg(ap, const char *);
+            slen = strlen(s);
+            memcpy(out, s, slen);
+            out += slen;
+            break;
+        case 'd': case 'i':
+            out += evbuffer_fmt_i64_(out, evbuffer_fmt_signed_arg_(&ap, len));
+            break;
+        case 'u':
+            out += evbuffer_fmt_u64_(out, evbuffer_fmt_unsigned_arg_(&ap, len));
+            break;
+        default:
+            out += evbuffer_fmt_hex_(out, evbuffer_fmt_unsigned_arg_(&ap, len),
+                                     conv == 'X');
+            break;
+        }
+    }
+    result = (int)(out - start);
+    evbuffer_fmt_commit_(buf, chain, result);
+done:
+    EVBUFFER_UNLOCK(buf);
+    va_end(ap);
+    return result;
 }
 
 // 通过引用向 evbuffer 末尾添加一段数据。不会进行复制:evbuffer 只会存储一个到
@@ -3237,7 +5815,7 @@ evbuffer_add_reference(struct evbuffer *outbuf,
     info->extra = extra;
 
     EVBUFFER_LOCK(outbuf);
-    if (outbuf->freeze_end) {
+    if (outbuf->freeze_end || EVBUFFER_IS_RING(outbuf)) {
         /* don't call chain_free; we do not want to actually invoke
          * the cleanup function */
         mm_free(chain);
@@ -3332,6 +5910,98 @@ get_page_size(void)
 }
 #endif
 
+#ifdef USE_RING_IMPL
+/* Allocate a ring chain whose storage is a memfd of 'capacity' bytes,
+ * rounded up to whole pages, mapped twice in a row. */
+static struct evbuffer_chain *
+evbuffer_ring_chain_new(size_t capacity)
+{
+    struct evbuffer_chain *chain;
+    size_t page = (size_t)get_page_size();
+    unsigned char *mem;
+    int fd;
+
+    if (capacity == 0 || capacity > EVBUFFER_CHAIN_MAX / 4)
+        return NULL;
+    capacity = (capacity + page - 1) / page * page;
+
+    if ((fd = memfd_create("evbuffer-ring", MFD_CLOEXEC)) < 0)
+        return NULL;
+    if (ftruncate(fd, capacity) < 0) {
+        close(fd);
+        return NULL;
+    }
+    /* Reserve room for both copies, then map the file over each half. */
+    mem = mmap(NULL, capacity * 2, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS,
+               -1, 0);
+    if (mem == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    if (mmap(mem, capacity, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED,
+             fd, 0) == MAP_FAILED ||
+            mmap(mem + capacity, capacity, PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(mem, capacity * 2);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    if ((chain = evbuffer_chain_new(0)) == NULL) {
+        munmap(mem, capacity * 2);
+        return NULL;
+    }
+    chain->flags |= EVBUFFER_RING;
+    chain->buffer = mem;
+    chain->buffer_len = capacity;
+    return chain;
+}
+#endif
+
+int
+evbuffer_ring_full_(struct evbuffer *buf)
+{
+    int full;
+
+    EVBUFFER_LOCK(buf);
+    full = EVBUFFER_IS_RING(buf) && CHAIN_SPACE_LEN(buf->first) == 0;
+    EVBUFFER_UNLOCK(buf);
+    return full;
+}
+
+int
+evbuffer_set_ring(struct evbuffer *buf, size_t capacity)
+{
+#ifdef USE_RING_IMPL
+    struct evbuffer_chain *chain;
+    int result = -1;
+
+    EVBUFFER_LOCK(buf);
+    /* Being frozen doesn't matter: no data moves.  A bufferevent's input
+     * buffer is frozen at the end whenever it isn't reading. */
+    if (buf->total_len || EVBUFFER_IS_RING(buf) || buf->spsc)
+        goto done;
+    if ((chain = evbuffer_ring_chain_new(capacity)) == NULL)
+        goto done;
+
+    /* Throw away any empty chains we had before. */
+    evbuffer_free_all_chains(buf->first);
+    ZERO_CHAIN(buf);
+    evbuffer_chain_insert(buf, chain);
+    evbuffer_chain_index_invalidate(buf);
+    buf->flags |= EVBUFFER_FLAG_RING;
+    result = 0;
+done:
+    EVBUFFER_UNLOCK(buf);
+    return result;
+#else
+    (void)buf;
+    (void)capacity;
+    return -1;
+#endif
+}
+
 /* DOCDOC */
 /* Requires lock */
 static int
@@ -3488,43 +6158,36 @@ evbuffer_file_segment_free(struct evbuffer_file_segment *seg)
     mm_free(seg);
 }
 
-int
-evbuffer_add_file_segment(struct evbuffer *buf,
-                          struct evbuffer_file_segment *seg, ev_off_t offset, ev_off_t length)
+/* Make a chain that refers to length bytes of seg from offset on, taking a
+ * reference to seg.  The data is materialized unless buf drains to a file
+ * descriptor and seg can be sent with sendfile().  Requires lock on buf. */
+static struct evbuffer_chain *
+evbuffer_chain_new_file_segment(struct evbuffer *buf,
+                                struct evbuffer_file_segment *seg, ev_off_t offset, ev_off_t length)
 {
     struct evbuffer_chain *chain;
     struct evbuffer_chain_file_segment *extra;
     int can_use_sendfile = 0;
 
-    EVBUFFER_LOCK(buf);
+    ASSERT_EVBUFFER_LOCKED(buf);
+
     EVLOCK_LOCK(seg->lock, 0);
-    if (buf->flags & EVBUFFER_FLAG_DRAINS_TO_FD) {
+    /* A running CRC has to see the data, so don't hide it in a sendfile()
+     * chain in that case. */
+    if ((buf->flags & EVBUFFER_FLAG_DRAINS_TO_FD) &&
+        !(buf->flags & EVBUFFER_FLAG_RUNNING_CRC32C)) {
         can_use_sendfile = 1;
     } else {
         if (!seg->contents) {
             if (evbuffer_file_segment_materialize(seg)<0) {
                 EVLOCK_UNLOCK(seg->lock, 0);
-                EVBUFFER_UNLOCK(buf);
-                return -1;
+                return NULL;
             }
         }
     }
     ++seg->refcnt;
     EVLOCK_UNLOCK(seg->lock, 0);
 
-    if (buf->freeze_end)
-        goto err;
-
-    if (length < 0) {
-        if (offset > seg->length)
-            goto err;
-        length = seg->length - offset;
-    }
-
-    /* Can we actually add this? */
-    if (offset+length > seg->length)
-        goto err;
-
     chain = evbuffer_chain_new(sizeof(struct evbuffer_chain_file_segment));
     if (!chain)
         goto err;
@@ -3574,6 +6237,37 @@ evbuffer_add_file_segment(struct evbuffer *buf,
     }
 
     extra->segment = seg;
+    return chain;
+err:
+    evbuffer_file_segment_free(seg); /* Lowers the refcount */
+    return NULL;
+}
+
+int
+evbuffer_add_file_segment(struct evbuffer *buf,
+                          struct evbuffer_file_segment *seg, ev_off_t offset, ev_off_t length)
+{
+    struct evbuffer_chain *chain;
+
+    EVBUFFER_LOCK(buf);
+
+    if (buf->freeze_end || EVBUFFER_IS_RING(buf))
+        goto err;
+
+    if (length < 0) {
+        if (offset > seg->length)
+            goto err;
+        length = seg->length - offset;
+    }
+
+    /* Can we actually add this? */
+    if (offset+length > seg->length)
+        goto err;
+
+    chain = evbuffer_chain_new_file_segment(buf, seg, offset, length);
+    if (!chain)
+        goto err;
+
     buf->n_add_for_cb += length;
     evbuffer_chain_insert(buf, chain);
 
@@ -3584,7 +6278,6 @@ evbuffer_add_file_segment(struct evbuffer *buf,
     return 0;
 err:
     EVBUFFER_UNLOCK(buf);
-    evbuffer_file_segment_free(seg); /* Lowers the refcount */
     return -1;
 }
 
@@ -3605,6 +6298,407 @@ evbuffer_add_file(struct evbuffer *buf, int fd, ev_off_t offset, ev_off_t length
     return r;
 }
 
+/* Spilling to disk.  An evbuffer with a spill threshold keeps its first
+ * 'threshold' bytes in memory; plain memory chains past that point are
+ * written to an unlinked temporary file and replaced with file-segment
+ * chains over it, which go out with sendfile() if the buffer drains to a
+ * file descriptor and are mmap()ed otherwise. */
+/* Don't bother spilling until at least this much has been added since we
+ * last did, so that each spill writes a decent amount and we don't walk
+ * the chains on every add. */
+#define EVBUFFER_SPILL_BATCH 65536
+
+/* An unlinked temporary file that an evbuffer spills into.  The buffer
+ * holds one reference, and each file segment carved out of it another. */
+struct evbuffer_spill_file {
+    int fd;
+    int refcnt;
+#ifndef EVENT__DISABLE_THREAD_SUPPORT
+    void *lock;
+#endif
+    /** Where the next spill goes.  Only touched under the lock of the
+     * buffer that owns this file. */
+    ev_off_t len;
+};
+
+struct evbuffer_spill {
+    size_t threshold;
+    /** Directory for the spill file, or NULL for the default */
+    char *dir;
+    /** The spill file, once we've needed one */
+    struct evbuffer_spill_file *file;
+    /** The buffer's length when we last spilled, or less if it has shrunk
+     * since: we spill again once it has grown a batch past this. */
+    size_t mark;
+    /** How much of the buffer is in our spill file, as of when its length
+     * was seen_len. */
+    size_t on_disk;
+    size_t seen_len;
+    /** True iff creating or writing the spill file failed; we don't
+     * keep trying after that. */
+    unsigned failed : 1;
+};
+
+/* A chain we may write out and replace: plain memory that we own and
+ * that nobody else is looking at. */
+#define CHAIN_SPILLABLE(ch)                                             \
+    ((ch)->off && !((ch)->flags & (EVBUFFER_FILESEGMENT|EVBUFFER_REFERENCE| \
+        EVBUFFER_IMMUTABLE|EVBUFFER_MEM_PINNED_ANY|EVBUFFER_DANGLING|   \
+        EVBUFFER_MULTICAST|EVBUFFER_RING)))
+
+/* A chain that evbuffer_spill_run_() carved out of file. */
+#define CHAIN_SPILLED(ch, f)                                            \
+    (((ch)->flags & EVBUFFER_FILESEGMENT) &&                            \
+     (EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_file_segment,         \
+         ch))->segment->cleanup_cb_arg == (void *)(f))
+
+static void
+evbuffer_spill_file_decref_(struct evbuffer_spill_file *file)
+{
+    int refcnt;
+
+    EVLOCK_LOCK(file->lock, 0);
+    refcnt = --file->refcnt;
+    EVLOCK_UNLOCK(file->lock, 0);
+    if (refcnt > 0)
+        return;
+    close(file->fd);
+    EVTHREAD_FREE_LOCK(file->lock, 0);
+    mm_free(file);
+}
+
+#ifdef USE_SPILL_IMPL
+static int
+evbuffer_spill_file_open_(struct evbuffer_spill *spill)
+{
+    struct evbuffer_spill_file *file;
+    const char *dir = spill->dir;
+    int fd = -1;
+
+    if (!dir && !(dir = evutil_getenv_("TMPDIR")))
+        dir = "/tmp";
+#if defined(O_TMPFILE) && defined(O_CLOEXEC)
+    fd = open(dir, O_TMPFILE|O_RDWR|O_CLOEXEC, 0600);
+#endif
+    if (fd < 0) {
+        char path[1024];
+        if (evutil_snprintf(path, sizeof(path), "%s/evbuffer-spill-XXXXXX",
+                            dir) >= (int)sizeof(path))
+            return -1;
+        if ((fd = mkstemp(path)) < 0)
+            return -1;
+        unlink(path);
+        evutil_make_socket_closeonexec(fd);
+    }
+
+    if ((file = mm_calloc(1, sizeof(struct evbuffer_spill_file))) == NULL) {
+        close(fd);
+        return -1;
+    }
+    file->fd = fd;
+    file->refcnt = 1;
+    EVTHREAD_ALLOC_LOCK(file->lock, 0);
+    spill->file = file;
+    return 0;
+}
+
+/* Called when a spilled segment is freed: give its disk space back if we
+ * can, and let go of the file. */
+static void
+evbuffer_spill_segment_cleanup_(struct evbuffer_file_segment const *seg,
+                                int flags, void *arg)
+{
+    struct evbuffer_spill_file *file = arg;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    fallocate(file->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+              seg->file_offset, seg->length);
+#endif
+    evbuffer_spill_file_decref_(file);
+}
+
+/* Write the data in the chains from 'chain' up to 'end' to fd at offset. */
+static int
+evbuffer_spill_write_(int fd, ev_off_t offset, struct evbuffer_chain *chain,
+                      struct evbuffer_chain *end)
+{
+    if (lseek(fd, offset, SEEK_SET) < 0)
+        return -1;
+    for (; chain != end; chain = chain->next) {
+        const unsigned char *p = chain->buffer + chain->misalign;
+        size_t left = chain->off;
+        while (left) {
+            ev_ssize_t n = write(fd, p, left);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            p += n;
+            left -= n;
+        }
+    }
+    return 0;
+}
+
+/* Write out the run of spillable chains starting at *chp and replace them
+ * with a single file-segment chain.  Requires lock. */
+static int
+evbuffer_spill_run_(struct evbuffer *buf, struct evbuffer_chain **chp)
+{
+    struct evbuffer_spill *spill = buf->spill;
+    struct evbuffer_spill_file *file;
+    struct evbuffer_file_segment *seg;
+    struct evbuffer_chain *first = *chp, *end, *last = NULL;
+    struct evbuffer_chain *chain, *next, *seg_chain;
+    int last_with_data_in_run = 0;
+    size_t len = 0;
+
+    if (!spill->file && evbuffer_spill_file_open_(spill) < 0)
+        goto failed;
+    file = spill->file;
+
+    for (end = first; end && CHAIN_SPILLABLE(end); end = end->next) {
+        if (len + end->off > EVBUFFER_CHAIN_MAX)
+            break;
+        len += end->off;
+        if (end == *buf->last_with_datap)
+            last_with_data_in_run = 1;
+        last = end;
+    }
+    EVUTIL_ASSERT(last != NULL);
+
+    if (evbuffer_spill_write_(file->fd, file->len, first, end) < 0)
+        goto failed;
+    seg = evbuffer_file_segment_new(file->fd, file->len, len, 0);
+    if (!seg)
+        goto failed;
+
+    EVLOCK_LOCK(file->lock, 0);
+    ++file->refcnt;
+    EVLOCK_UNLOCK(file->lock, 0);
+    evbuffer_file_segment_add_cleanup_cb(seg,
+        evbuffer_spill_segment_cleanup_, file);
+
+    seg_chain = evbuffer_chain_new_file_segment(buf, seg, 0, len);
+    evbuffer_file_segment_free(seg);
+    if (!seg_chain)
+        goto failed;
+    /* Only claim the file space once nothing can fail; otherwise the next
+     * spill reuses it. */
+    file->len += len;
+
+    /* Swap the run for seg_chain. */
+    if (last_with_data_in_run)
+        buf->last_with_datap = chp;
+    else if (buf->last_with_datap == &last->next)
+        buf->last_with_datap = &seg_chain->next;
+    if (buf->last == last)
+        buf->last = seg_chain;
+    seg_chain->next = end;
+    *chp = seg_chain;
+    for (chain = first; chain != end; chain = next) {
+        next = chain->next;
+        evbuffer_chain_free(chain);
+    }
+    spill->on_disk += len;
+    return 0;
+
+failed:
+    event_warn("%s: can't spill to disk; keeping data in memory",
+               __func__);
+    spill->failed = 1;
+    return -1;
+}
+
+/* Move the data that lies past buf's spill threshold to disk.  Requires
+ * lock. */
+static void
+evbuffer_spill_(struct evbuffer *buf)
+{
+    struct evbuffer_spill *spill = buf->spill;
+    struct evbuffer_chain **chp = &buf->first, *chain;
+    size_t pos = 0;
+
+    ASSERT_EVBUFFER_LOCKED(buf);
+
+    evbuffer_spill_on_disk_(buf);
+    spill->mark = buf->total_len;
+
+    /* Skip over what we keep in memory. */
+    while ((chain = *chp) != NULL && pos + chain->off <= spill->threshold) {
+        pos += chain->off;
+        chp = &chain->next;
+    }
+
+    /* If a large chain straddles the threshold, copy the part we keep
+     * into a chain of its own so that the rest can go. */
+    if (chain && pos < spill->threshold && CHAIN_SPILLABLE(chain) &&
+            pos + chain->off - spill->threshold >= EVBUFFER_SPILL_BATCH) {
+        size_t keep = spill->threshold - pos;
+        struct evbuffer_chain *tmp = evbuffer_chain_new_membuf(buf, keep);
+        if (tmp) {
+            memcpy(tmp->buffer, chain->buffer + chain->misalign, keep);
+            tmp->off = keep;
+            chain->misalign += keep;
+            chain->off -= keep;
+            tmp->next = chain;
+            *chp = tmp;
+            if (buf->last_with_datap == chp)
+                buf->last_with_datap = &tmp->next;
+            chp = &tmp->next;
+        }
+    } else if (chain && pos < spill->threshold) {
+        chp = &chain->next;
+    }
+
+    while (*chp && !spill->failed) {
+        if (CHAIN_SPILLABLE(*chp) && evbuffer_spill_run_(buf, chp) < 0)
+            break;
+        chp = &(*chp)->next;
+    }
+    evbuffer_chain_index_invalidate(buf);
+}
+
+/* Return how much of buf is in its spill file.  Appends don't change that
+ * and spills keep it up to date, so we only have to count again when
+ * something has left the buffer.  Requires lock. */
+static size_t
+evbuffer_spill_on_disk_(struct evbuffer *buf)
+{
+    struct evbuffer_spill *spill = buf->spill;
+    struct evbuffer_chain *chain;
+
+    if (spill->on_disk && buf->total_len < spill->seen_len) {
+        spill->on_disk = 0;
+        for (chain = buf->first; chain; chain = chain->next) {
+            if (CHAIN_SPILLED(chain, spill->file))
+                spill->on_disk += chain->off;
+        }
+    }
+    spill->seen_len = buf->total_len;
+    return spill->on_disk;
+}
+
+/* Return true iff enough has piled up past buf's threshold since we last
+ * spilled.  Requires lock. */
+static int
+evbuffer_spill_due_(struct evbuffer *buf)
+{
+    struct evbuffer_spill *spill = buf->spill;
+
+    if (buf->total_len < spill->mark)
+        spill->mark = buf->total_len;
+    return !spill->failed && buf->total_len > spill->threshold &&
+        buf->total_len - spill->mark >= EVBUFFER_SPILL_BATCH;
+}
+
+static void
+evbuffer_spill_callback_(struct event_callback *cb, void *arg)
+{
+    struct bufferevent *parent = NULL;
+    struct evbuffer *buf = arg;
+
+    EVBUFFER_LOCK(buf);
+    parent = buf->parent;
+    buf->spill_pending = 0;
+    if (buf->spill && evbuffer_spill_due_(buf)) {
+        evbuffer_spill_(buf);
+        if (buf->mem_account || buf->mem_global)
+            evbuffer_mem_charge_(buf, evbuffer_mem_len_(buf));
+    }
+    evbuffer_decref_and_unlock_(buf);
+    if (parent)
+        bufferevent_decref_(parent);
+}
+
+/* Hook for evbuffer_invoke_callbacks_(): spill if enough has piled up past
+ * the threshold since last time.  Spilling writes to disk, so a buffer
+ * that has an event loop leaves it to the loop instead of holding up
+ * whoever added the data.  Requires lock. */
+static void
+evbuffer_spill_maybe_(struct evbuffer *buf)
+{
+    struct event_base *base = buf->cb_queue;
+
+    evbuffer_spill_on_disk_(buf);
+    if (buf->spill_pending || !evbuffer_spill_due_(buf))
+        return;
+    if (!base && buf->parent)
+        base = buf->parent->ev_base;
+    if (!base) {
+        evbuffer_spill_(buf);
+        return;
+    }
+    /* Lowest priority, like the release callback: whatever gets written
+     * out before we run is that much less to spill. */
+    event_deferred_cb_init_(&buf->spill_cb,
+                            event_base_get_npriorities(base) - 1,
+                            evbuffer_spill_callback_, buf);
+    if (event_deferred_cb_schedule_(base, &buf->spill_cb)) {
+        buf->spill_pending = 1;
+        ++buf->refcnt;
+        if (buf->parent)
+            bufferevent_incref_(buf->parent);
+    }
+}
+#endif
+
+/* Requires lock. */
+static void
+evbuffer_spill_free_(struct evbuffer *buf)
+{
+    struct evbuffer_spill *spill = buf->spill;
+
+    if (spill->file)
+        evbuffer_spill_file_decref_(spill->file);
+    if (spill->dir)
+        mm_free(spill->dir);
+    mm_free(spill);
+    buf->spill = NULL;
+}
+
+int
+evbuffer_set_spill(struct evbuffer *buf, size_t threshold, const char *dir)
+{
+#ifdef USE_SPILL_IMPL
+    struct evbuffer_spill *spill;
+    int result = -1;
+
+    EVBUFFER_LOCK(buf);
+    if (buf->spill)
+        evbuffer_spill_free_(buf);
+    if (threshold == 0) {
+        result = 0;
+        goto done;
+    }
+    if (EVBUFFER_IS_RING(buf))
+        goto done;
+
+    if ((spill = mm_calloc(1, sizeof(struct evbuffer_spill))) == NULL)
+        goto done;
+    if (dir && (spill->dir = mm_strdup(dir)) == NULL) {
+        mm_free(spill);
+        goto done;
+    }
+    spill->threshold = threshold;
+    buf->spill = spill;
+    if (buf->total_len > threshold)
+        evbuffer_spill_(buf);
+    result = 0;
+done:
+    if (buf->mem_account || buf->mem_global)
+        evbuffer_mem_charge_(buf, evbuffer_mem_len_(buf));
+    EVBUFFER_UNLOCK(buf);
+    return result;
+#else
+    (void)buf;
+    (void)threshold;
+    (void)dir;
+    return -1;
+#endif
+}
+
 // 设置evbuffer_cb类型的回调函数(已不推荐使用)
 // 设置这个前要先删除之前添加的所有回调函数
 void
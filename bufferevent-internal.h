@@ -73,9 +73,30 @@ extern "C" {
 /* On a base bufferevent, for reading: used when a filter has choked this
  * (underlying) bufferevent because it has stopped reading from it. */
 #define BEV_SUSPEND_FILT_READ 0x10
+/* On any bufferevent, for reading: used when the evbuffer memory in use on
+ * our base or in the whole process has reached its hard limit. */
+#define BEV_SUSPEND_MEM 0x20
 
 typedef ev_uint16_t bufferevent_suspend_flags;
 
+/** One event_base's cache of tokens from a sharded rate-limit group.  The
+ * counters are only changed with atomic operations, so that bufferevents
+ * on different bases never contend; the rest is protected by the group
+ * lock. */
+struct bufferevent_rate_limit_shard {
+	LIST_ENTRY(bufferevent_rate_limit_shard) next;
+	/** The base whose bufferevents use this cache. */
+	struct event_base *base;
+	/** Tokens taken from the group and not spent yet.  Can go negative
+	 * when a bufferevent overdraws. */
+	ev_ssize_t read_tokens;
+	ev_ssize_t write_tokens;
+	/** Bytes read or written from this base; added into the group's
+	 * totals when they are asked for. */
+	ev_uint64_t total_read;
+	ev_uint64_t total_written;
+};
+
 // 速率限制组
 struct bufferevent_rate_limit_group {
 	/** List of all members in the group */
@@ -90,14 +111,6 @@ struct bufferevent_rate_limit_group {
 	/** True iff we don't want to write from any member of the group.until
 	 * the token bucket refills.  */
 	unsigned write_suspended : 1;
-	/** True iff we were unable to suspend one of the bufferevents in the
-	 * group for reading the last time we tried, and we should try
-	 * again. */
-	unsigned pending_unsuspend_read : 1;
-	/** True iff we were unable to suspend one of the bufferevents in the
-	 * group for writing the last time we tried, and we should try
-	 * again. */
-	unsigned pending_unsuspend_write : 1;
 
 	/*@{*/
 	/** Total number of bytes read or written in this group since last
@@ -118,13 +131,31 @@ struct bufferevent_rate_limit_group {
 	 * to refill. */
 	struct event master_refill_event;
 
-	/** Seed for weak random number generator. Protected by 'lock' */
-	struct evutil_weakrand_state weakrand_seed;
-
 	/** Lock to protect the members of this group.  This lock should nest
 	 * within every bufferevent lock: if you are holding this lock, do
-	 * not assume you can lock another bufferevent. */
+	 * not assume you can lock another bufferevent.  A group's lock may
+	 * be held while taking its parent's, never the other way around. */
 	void *lock;
+
+	/** The group whose limits apply on top of this one's, or NULL. */
+	struct bufferevent_rate_limit_group *parent;
+	/** The number of groups whose parent this group is. */
+	int n_children;
+	/** The number of bufferevents in this group and in every group
+	 * below it.  Our bucket is shared among all of them. */
+	int n_total_members;
+	/** Bufferevents in this group or below it that stopped reading or
+	 * writing because our bucket ran dry, in the order they noticed.
+	 * When we refill, we wake them from the front, only as many as the
+	 * bucket can feed; the rest keep their place for the next tick. */
+	TAILQ_HEAD(rlim_group_queue, bufferevent_private) read_queue;
+	struct rlim_group_queue write_queue;
+
+	/** If nonzero, the number of bytes each event_base takes from our
+	 * buckets at a time, to spend without taking our lock. */
+	ev_ssize_t shard_batch;
+	/** One cache per event_base that has had a member in this group. */
+	LIST_HEAD(rlim_group_shard_list, bufferevent_rate_limit_shard) shards;
 };
 
 /** Fields for rate-limiting a single bufferevent. */
@@ -148,6 +179,17 @@ struct bufferevent_rate_limit {
 	/* Timeout event used when one this bufferevent's buckets are
 	 * empty. */
 	struct event refill_bucket_event;
+
+	/** The group (ours or one above it) that we are waiting on to read
+	 * or to write, if any, and our entries in its queues.  The entries
+	 * are protected by that group's lock. */
+	struct bufferevent_rate_limit_group *read_waiting_on;
+	struct bufferevent_rate_limit_group *write_waiting_on;
+	TAILQ_ENTRY(bufferevent_private) next_read_waiter;
+	TAILQ_ENTRY(bufferevent_private) next_write_waiter;
+
+	/** If our group is sharded, our event_base's cache of its tokens. */
+	struct bufferevent_rate_limit_shard *shard;
 };
 
 /** Parts of the bufferevent structure that are shared among all bufferevent
@@ -206,6 +248,10 @@ struct bufferevent_private {
     // 条件满足时,延迟回调不会立即调用,而是在 event_loop()调用中被排队,然后在通常的事件回调之后执行
 	struct event_callback deferred;
 
+	/** For BEV_OPT_COALESCE_WRITES: runs the pending write at the end of
+	 * the current loop iteration. */
+	struct event_callback write_flush;
+
 	/** The options this bufferevent was constructed with */
 	enum bufferevent_options options;
 
@@ -242,6 +288,18 @@ struct bufferevent_private {
 	} conn_address;
 
 	struct evdns_getaddrinfo_request *dns_request;
+
+	/** The connection attempts racing each other for
+	 * bufferevent_socket_connect_hostname, when the name resolved to more
+	 * than one address. */
+	struct bufferevent_connect_race *connect_race;
+
+	/** Link in the list of bufferevents suspended by our base's evbuffer
+	 * memory account.  Protected by the account's lock. */
+	LIST_ENTRY(bufferevent_private) mem_suspended_next;
+	/** True iff we are on that list, and the account holds a reference to
+	 * us.  Protected by the account's lock. */
+	unsigned mem_suspended : 1;
 };
 
 /** Possible operations for a control callback. */
@@ -356,6 +414,10 @@ void bufferevent_unsuspend_write_(struct bufferevent *bufev, bufferevent_suspend
 #define bufferevent_wm_unsuspend_read(b) \
 	bufferevent_unsuspend_read_((b), BEV_SUSPEND_WM)
 
+/** For internal use: stop reading on bufev because its input buffer is a
+ * full ring buffer, until draining the input makes room again. */
+void bufferevent_ring_suspend_read_(struct bufferevent *bufev);
+
 /*
   Disable a bufferevent.  Equivalent to bufferevent_disable(), but
   first resets 'connecting' flag to force EV_WRITE down for sure.
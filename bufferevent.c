@@ -118,7 +118,8 @@ bufferevent_unsuspend_write_(struct bufferevent *bufev, bufferevent_suspend_flag
 
 
 /* Callback to implement watermarks on the input buffer.  Only enabled
- * if the watermark is set. */
+ * if the watermark is set, or if the input is a ring buffer that has
+ * filled up. */
 static void
 bufferevent_inbuf_wm_cb(struct evbuffer *buf,
     const struct evbuffer_cb_info *cbinfo,
@@ -130,7 +131,8 @@ bufferevent_inbuf_wm_cb(struct evbuffer *buf,
 	size = evbuffer_get_length(buf);
 
     // 如果达到了高水位标志，则挂起读事件，否则恢复读事件
-	if (size >= bufev->wm_read.high)
+	if ((bufev->wm_read.high && size >= bufev->wm_read.high) ||
+	    evbuffer_ring_full_(buf))
 		bufferevent_wm_suspend_read(bufev);
 	else
 		bufferevent_wm_unsuspend_read(bufev);
@@ -373,6 +375,18 @@ bufferevent_init_common_(struct bufferevent_private *bufev_private,
 	evbuffer_set_parent_(bufev->input, bufev);
 	evbuffer_set_parent_(bufev->output, bufev);
 
+	evbuffer_mem_attach_(bufev->input, base);
+	evbuffer_mem_attach_(bufev->output, base);
+	if (base) {
+		evbuffer_defer_release(bufev->input, base);
+		evbuffer_defer_release(bufev->output, base);
+	}
+
+	if (base && (base->flags & EVENT_BASE_FLAG_EVBUFFER_ARENA)) {
+		evbuffer_set_flags(bufev->input, EVBUFFER_FLAG_ARENA);
+		evbuffer_set_flags(bufev->output, EVBUFFER_FLAG_ARENA);
+	}
+
 	return 0;
 }
 
@@ -657,6 +671,30 @@ bufferevent_setwatermark(struct bufferevent *bufev, short events,
 	BEV_UNLOCK(bufev);
 }
 
+/* A full ring is a high-water mark that the input buffer sets for itself:
+ * suspend reading the same way, and have the watermark callback resume it
+ * once there's room. */
+void
+bufferevent_ring_suspend_read_(struct bufferevent *bufev)
+{
+	struct bufferevent_private *bufev_private =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+
+	BEV_LOCK(bufev);
+	if (bufev_private->read_watermarks_cb == NULL) {
+		bufev_private->read_watermarks_cb =
+		    evbuffer_add_cb(bufev->input, bufferevent_inbuf_wm_cb,
+			bufev);
+	}
+	if (bufev_private->read_watermarks_cb) {
+		evbuffer_cb_set_flags(bufev->input,
+		    bufev_private->read_watermarks_cb,
+		    EVBUFFER_CB_ENABLED|EVBUFFER_CB_NODEFER);
+		bufferevent_wm_suspend_read(bufev);
+	}
+	BEV_UNLOCK(bufev);
+}
+
 int
 bufferevent_getwatermark(struct bufferevent *bufev, short events,
     size_t *lowmark, size_t *highmark)
@@ -841,6 +879,7 @@ bufferevent_free(struct bufferevent *bufev)
 	BEV_LOCK(bufev);
 	bufferevent_setcb(bufev, NULL, NULL, NULL, NULL);
 	bufferevent_cancel_all_(bufev);
+	evbuffer_mem_bufferevent_free_(bufev);
 	bufferevent_decref_and_unlock_(bufev);
 }
 
@@ -62,10 +62,21 @@
 #include "mm-internal.h"
 #include "bufferevent-internal.h"
 #include "log-internal.h"
+#include "util-internal.h"
+#include "ht-internal.h"
+
+#include <time.h>
 
 #include <openssl/bio.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 #include "openssl-compat.h"
 
 /*
@@ -310,6 +321,28 @@ struct bufferevent_openssl {
 #define NUM_ERRORS 3
 	ev_uint32_t errors[NUM_ERRORS];
 
+	/* If set, SSL_do_handshake runs on another thread: we pass it to
+	   offload_cb, and handshake_done tells us when it has returned. */
+	bufferevent_ssl_offload_cb offload_cb;
+	void *offload_arg;
+	struct event handshake_done;
+	/* What the offloaded SSL_do_handshake returned, and the errors it
+	   left on its own thread's OpenSSL error queue. */
+	int offload_ret;
+	int offload_err;
+	ev_uint32_t offload_errors[NUM_ERRORS];
+
+	/* Dynamic record sizing: until we have sent record_warmup bytes, our
+	   records carry at most record_small bytes each, so that the first
+	   ones fit in a packet or two and can be decrypted as soon as they
+	   arrive.  After record_idle with nothing sent, we warm up again.
+	   If record_small is 0, every record is full-size. */
+	size_t record_small;
+	size_t record_warmup;
+	struct timeval record_idle;
+	size_t record_sent;
+	struct timeval record_last;
+
 	/* When we next get available space, we should say "read" instead of
 	   "write". This can happen if there's a renegotiation during a read
 	   operation. */
@@ -318,8 +351,15 @@ struct bufferevent_openssl {
 	unsigned write_blocked_on_read : 1;
 	/* Treat TCP close before SSL close on SSL >= v3 as clean EOF. */
 	unsigned allow_dirty_shutdown : 1;
+	/* The kernel encrypts what we send (kTLS), so we write plaintext to
+	   the socket ourselves instead of going through SSL_write. */
+	unsigned ktls_send : 1;
 	/* XXX */
 	unsigned n_errors : 2;
+	unsigned n_offload_errors : 2;
+	/* An offloaded SSL_do_handshake owns the SSL until handshake_done
+	   runs; we must not touch it meanwhile. */
+	unsigned handshake_offloaded : 1;
 
 	/* Are we currently connecting, accepting, or doing IO? */
 	unsigned state : 2;
@@ -644,15 +684,55 @@ do_read(struct bufferevent_openssl *bev_ssl, int n_to_read) {
 	return result;
 }
 
+/* Like do_write, for when the kernel does our encryption: hand the data
+   straight to the socket, so that file segments can go out with sendfile. */
+static int
+do_write_ktls(struct bufferevent_openssl *bev_ssl, int atmost)
+{
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+	evutil_socket_t fd = event_get_fd(&bev->ev_write);
+	int n;
+
+	n = evbuffer_write_atmost(bev->output, fd, atmost);
+	if (n > 0) {
+		bufferevent_decrement_write_buckets_(&bev_ssl->bev, n);
+		bufferevent_trigger_nolock_(bev, EV_WRITE,
+		    BEV_OPT_DEFER_CALLBACKS);
+		return OP_MADE_PROGRESS;
+	}
+	if (n == 0 || EVUTIL_ERR_RW_RETRIABLE(evutil_socket_geterror(fd)))
+		return OP_BLOCKED;
+	conn_closed(bev_ssl, BEV_EVENT_WRITING, SSL_ERROR_SYSCALL, n);
+	return OP_ERR;
+}
+
+/* Return how many bytes the next record we write should carry. */
+static size_t
+record_size(struct bufferevent_openssl *bev_ssl)
+{
+	struct timeval now, idle;
+
+	if (!bev_ssl->record_small)
+		return SSL3_RT_MAX_PLAIN_LENGTH;
+	if (bev_ssl->record_sent && evutil_timerisset(&bev_ssl->record_idle)) {
+		event_base_gettimeofday_cached(bev_ssl->bev.bev.ev_base, &now);
+		evutil_timersub(&now, &bev_ssl->record_last, &idle);
+		if (evutil_timercmp(&idle, &bev_ssl->record_idle, >=))
+			bev_ssl->record_sent = 0;
+	}
+	if (bev_ssl->record_sent < bev_ssl->record_warmup)
+		return bev_ssl->record_small;
+	return SSL3_RT_MAX_PLAIN_LENGTH;
+}
+
 /* Return a bitmask of OP_MADE_PROGRESS (if we wrote anything); OP_BLOCKED (if
    we're now blocked); and OP_ERR (if an error occurred). */
 static int
 do_write(struct bufferevent_openssl *bev_ssl, int atmost)
 {
-	int i, r, n, n_written = 0;
+	int r, n_written = 0;
 	struct bufferevent *bev = &bev_ssl->bev.bev;
 	struct evbuffer *output = bev->output;
-	struct evbuffer_iovec space[8];
 	int result = 0;
 
 	if (bev_ssl->last_write > 0)
@@ -660,25 +740,46 @@ do_write(struct bufferevent_openssl *bev_ssl, int atmost)
 	else
 		atmost = bufferevent_get_write_max_(&bev_ssl->bev);
 
-	n = evbuffer_peek(output, atmost, NULL, space, 8);
-	if (n < 0)
-		return OP_ERR | result;
+	/* A blocked SSL_write has to be retried with the same data, so only
+	 * bypass OpenSSL when nothing is pending there. */
+	if (bev_ssl->ktls_send && bev_ssl->last_write <= 0) {
+		if (bev_ssl->bev.write_suspended)
+			return 0;
+		return do_write_ktls(bev_ssl, atmost);
+	}
+
+	while (n_written < atmost) {
+		size_t len;
+		unsigned char *data;
 
-	if (n > 8)
-		n = 8;
-	for (i=0; i < n; ++i) {
 		if (bev_ssl->bev.write_suspended)
 			break;
 
+		/* A blocked SSL_write must be retried with the same length. */
+		if (bev_ssl->last_write > 0) {
+			len = bev_ssl->last_write;
+		} else {
+			len = record_size(bev_ssl);
+			if (len > (size_t)(atmost - n_written))
+				len = atmost - n_written;
+			if (len > evbuffer_get_length(output))
+				len = evbuffer_get_length(output);
+		}
 		/* SSL_write will (reasonably) return 0 if we tell it to
 		   send 0 data.  Skip this case so we don't interpret the
 		   result as an error */
-		if (space[i].iov_len == 0)
-			continue;
+		if (len == 0)
+			break;
+
+		/* Each SSL_write makes (at least) one record, so gather small
+		 * chains together rather than sending a record apiece.  This
+		 * only copies anything when the first chain is short. */
+		data = evbuffer_pullup(output, len);
+		if (!data)
+			return OP_ERR | result;
 
 		ERR_clear_error();
-		r = SSL_write(bev_ssl->ssl, space[i].iov_base,
-		    space[i].iov_len);
+		r = SSL_write(bev_ssl->ssl, data, len);
 		if (r > 0) {
 			result |= OP_MADE_PROGRESS;
 			if (bev_ssl->write_blocked_on_read)
@@ -686,6 +787,11 @@ do_write(struct bufferevent_openssl *bev_ssl, int atmost)
 					return OP_ERR | result;
 			n_written += r;
 			bev_ssl->last_write = -1;
+			bev_ssl->record_sent += r;
+			if (bev_ssl->record_small)
+				event_base_gettimeofday_cached(bev->ev_base,
+				    &bev_ssl->record_last);
+			evbuffer_drain(output, r);
 			decrement_buckets(bev_ssl);
 		} else {
 			int err = SSL_get_error(bev_ssl->ssl, r);
@@ -696,7 +802,7 @@ do_write(struct bufferevent_openssl *bev_ssl, int atmost)
 				if (bev_ssl->write_blocked_on_read)
 					if (clear_wbor(bev_ssl) < 0)
 						return OP_ERR | result;
-				bev_ssl->last_write = space[i].iov_len;
+				bev_ssl->last_write = len;
 				break;
 			case SSL_ERROR_WANT_READ:
 				/* This read operation requires a write, and the
@@ -704,7 +810,7 @@ do_write(struct bufferevent_openssl *bev_ssl, int atmost)
 				if (!bev_ssl->write_blocked_on_read)
 					if (set_wbor(bev_ssl) < 0)
 						return OP_ERR | result;
-				bev_ssl->last_write = space[i].iov_len;
+				bev_ssl->last_write = len;
 				break;
 			default:
 				conn_closed(bev_ssl, BEV_EVENT_WRITING, err, r);
@@ -716,7 +822,6 @@ do_write(struct bufferevent_openssl *bev_ssl, int atmost)
 		}
 	}
 	if (n_written) {
-		evbuffer_drain(output, n_written);
 		if (bev_ssl->underlying)
 			BEV_RESET_GENERIC_WRITE_TIMEOUT(bev);
 
@@ -727,7 +832,7 @@ do_write(struct bufferevent_openssl *bev_ssl, int atmost)
 
 #define WRITE_FRAME 15000
 
-#define READ_DEFAULT 4096
+#define READ_DEFAULT SSL3_RT_MAX_PLAIN_LENGTH
 
 /* Try to figure out how many bytes to read; return 0 if we shouldn't be
  * reading. */
@@ -1011,28 +1116,33 @@ set_open_callbacks(struct bufferevent_openssl *bev_ssl, evutil_socket_t fd)
 	}
 }
 
-static int
-do_handshake(struct bufferevent_openssl *bev_ssl)
+/* Check whether OpenSSL has handed our sending keys to the kernel. */
+static void
+check_ktls(struct bufferevent_openssl *bev_ssl)
 {
-	int r;
-
-	switch (bev_ssl->state) {
-	default:
-	case BUFFEREVENT_SSL_OPEN:
-		EVUTIL_ASSERT(0);
-		return -1;
-	case BUFFEREVENT_SSL_CONNECTING:
-	case BUFFEREVENT_SSL_ACCEPTING:
-		ERR_clear_error();
-		r = SSL_do_handshake(bev_ssl->ssl);
-		break;
+#ifdef BIO_get_ktls_send
+	BIO *wbio = SSL_get_wbio(bev_ssl->ssl);
+	if (!bev_ssl->underlying && wbio && BIO_get_ktls_send(wbio)) {
+		bev_ssl->ktls_send = 1;
+		/* File segments added from now on may use sendfile. */
+		evbuffer_set_flags(bev_ssl->bev.bev.output,
+		    EVBUFFER_FLAG_DRAINS_TO_FD);
 	}
+#endif
+}
+
+/* Act on what SSL_do_handshake returned: r, and err from SSL_get_error()
+ * when r is not 1. */
+static int
+handshake_result(struct bufferevent_openssl *bev_ssl, int r, int err)
+{
 	decrement_buckets(bev_ssl);
 
 	if (r==1) {
 		int fd = event_get_fd(&bev_ssl->bev.bev.ev_read);
 		/* We're done! */
 		bev_ssl->state = BUFFEREVENT_SSL_OPEN;
+		check_ktls(bev_ssl);
 		set_open_callbacks(bev_ssl, fd); /* XXXX handle failure */
 		/* Call do_read and do_write as needed */
 		bufferevent_enable(&bev_ssl->bev.bev, bev_ssl->bev.bev.enabled);
@@ -1040,7 +1150,6 @@ do_handshake(struct bufferevent_openssl *bev_ssl)
 		    BEV_EVENT_CONNECTED, 0);
 		return 1;
 	} else {
-		int err = SSL_get_error(bev_ssl->ssl, r);
 		print_err(err);
 		switch (err) {
 		case SSL_ERROR_WANT_WRITE:
@@ -1056,6 +1165,84 @@ do_handshake(struct bufferevent_openssl *bev_ssl)
 	}
 }
 
+/* Runs on whatever thread offload_cb picked.  The loop leaves the SSL
+ * alone while handshake_offloaded is set, so we don't need the lock. */
+static void
+be_openssl_handshake_job(void *arg)
+{
+	struct bufferevent_openssl *bev_ssl = arg;
+	unsigned long err;
+	int r;
+
+	ERR_clear_error();
+	r = SSL_do_handshake(bev_ssl->ssl);
+	bev_ssl->offload_ret = r;
+	bev_ssl->offload_err = r == 1 ? SSL_ERROR_NONE :
+	    SSL_get_error(bev_ssl->ssl, r);
+	/* The error queue is per-thread, so carry it back with us. */
+	bev_ssl->n_offload_errors = 0;
+	while ((err = ERR_get_error())) {
+		if (bev_ssl->n_offload_errors < NUM_ERRORS)
+			bev_ssl->offload_errors[bev_ssl->n_offload_errors++] =
+			    (ev_uint32_t) err;
+	}
+	event_active(&bev_ssl->handshake_done, EV_TIMEOUT, 1);
+}
+
+/* Back on the loop thread once an offloaded handshake step is over. */
+static void
+be_openssl_handshake_done(evutil_socket_t fd, short what, void *arg)
+{
+	struct bufferevent_openssl *bev_ssl = arg;
+	int err, i;
+
+	BEV_LOCK(&bev_ssl->bev.bev);
+	bev_ssl->handshake_offloaded = 0;
+	err = bev_ssl->offload_err;
+	for (i = 0; i < bev_ssl->n_offload_errors; ++i)
+		put_error(bev_ssl, bev_ssl->offload_errors[i]);
+	/* conn_closed can't see the other thread's error queue; if there was
+	 * anything on it, this was not a plain TCP close. */
+	if (err == SSL_ERROR_SYSCALL && bev_ssl->n_offload_errors)
+		err = SSL_ERROR_SSL;
+	handshake_result(bev_ssl, bev_ssl->offload_ret, err);
+	/* Drop the reference do_handshake took for the job. */
+	bufferevent_decref_and_unlock_(&bev_ssl->bev.bev);
+}
+
+static int
+do_handshake(struct bufferevent_openssl *bev_ssl)
+{
+	int r;
+
+	switch (bev_ssl->state) {
+	default:
+	case BUFFEREVENT_SSL_OPEN:
+		EVUTIL_ASSERT(0);
+		return -1;
+	case BUFFEREVENT_SSL_CONNECTING:
+	case BUFFEREVENT_SSL_ACCEPTING:
+		if (bev_ssl->offload_cb) {
+			/* Nothing happens on the socket until the job is
+			 * done; handshake_done starts it up again. */
+			stop_reading(bev_ssl);
+			stop_writing(bev_ssl);
+			if (bev_ssl->handshake_offloaded)
+				return 0;
+			bev_ssl->handshake_offloaded = 1;
+			bufferevent_incref_(&bev_ssl->bev.bev);
+			bev_ssl->offload_cb(be_openssl_handshake_job, bev_ssl,
+			    bev_ssl->offload_arg);
+			return 0;
+		}
+		ERR_clear_error();
+		r = SSL_do_handshake(bev_ssl->ssl);
+		break;
+	}
+	return handshake_result(bev_ssl, r,
+	    r == 1 ? SSL_ERROR_NONE : SSL_get_error(bev_ssl->ssl, r));
+}
+
 static void
 be_openssl_handshakecb(struct bufferevent *bev_base, void *ctx)
 {
@@ -1116,17 +1303,23 @@ set_handshake_callbacks(struct bufferevent_openssl *bev_ssl, evutil_socket_t fd)
 int
 bufferevent_ssl_renegotiate(struct bufferevent *bev)
 {
-	struct bufferevent_openssl *bev_ssl = upcast(bev);
-	if (!bev_ssl)
-		return -1;
+	int r = -1;
+	struct bufferevent_openssl *bev_ssl;
+	BEV_LOCK(bev);
+	bev_ssl = upcast(bev);
+	/* The kernel has our keys; it can't take new ones.  And a handshake
+	 * job on another thread owns the SSL until it reports back. */
+	if (!bev_ssl || bev_ssl->ktls_send || bev_ssl->handshake_offloaded)
+		goto done;
 	if (SSL_renegotiate(bev_ssl->ssl) < 0)
-		return -1;
+		goto done;
 	bev_ssl->state = BUFFEREVENT_SSL_CONNECTING;
 	if (set_handshake_callbacks(bev_ssl, be_openssl_auto_fd(bev_ssl, -1)) < 0)
-		return -1;
-	if (!bev_ssl->underlying)
-		return do_handshake(bev_ssl);
-	return 0;
+		goto done;
+	r = bev_ssl->underlying ? 0 : do_handshake(bev_ssl);
+done:
+	BEV_UNLOCK(bev);
+	return r;
 }
 
 static void
@@ -1295,6 +1488,10 @@ be_openssl_ctrl(struct bufferevent *bev,
 	struct bufferevent_openssl *bev_ssl = upcast(bev);
 	switch (op) {
 	case BEV_CTRL_SET_FD:
+		/* SSL_set_bio() would free the BIO an offloaded
+		 * SSL_do_handshake() is using. */
+		if (bev_ssl->handshake_offloaded)
+			return -1;
 		if (!bev_ssl->underlying) {
 			BIO *bio;
 			bio = BIO_new_socket(data->fd, 0);
@@ -1383,6 +1580,8 @@ bufferevent_openssl_new_impl(struct event_base *base,
 	fd = be_openssl_auto_fd(bev_ssl, fd);
 	if (be_openssl_set_fd(bev_ssl, state, fd))
 		goto err;
+	if (state == BUFFEREVENT_SSL_OPEN)
+		check_ktls(bev_ssl);
 
 	if (underlying) {
 		bufferevent_setwatermark(underlying, EV_READ, 0, 0);
@@ -1417,6 +1616,11 @@ bufferevent_openssl_filter_new(struct event_base *base,
 		return NULL;
 
 	SSL_set_bio(ssl, bio, bio);
+	/* Let OpenSSL take as much ciphertext as the underlying input holds
+	 * in one BIO read, rather than a header and a body per record.
+	 * Whatever it reads ahead stays in its buffer; consider_reading()
+	 * keeps calling SSL_read() until that runs dry. */
+	SSL_set_read_ahead(ssl, 1);
 
 	return bufferevent_openssl_new_impl(
 		base, underlying, -1, ssl, state, options);
@@ -1490,6 +1694,93 @@ bufferevent_openssl_set_allow_dirty_shutdown(struct bufferevent *bev,
 	BEV_UNLOCK(bev);
 }
 
+// 在握手前开启内核TLS(kTLS)，握手完成后由内核加密发送的数据
+int
+bufferevent_openssl_set_ktls(struct bufferevent *bev, int enable)
+{
+	int r = -1;
+	struct bufferevent_openssl *bev_ssl;
+	BEV_LOCK(bev);
+	bev_ssl = upcast(bev);
+#ifdef SSL_OP_ENABLE_KTLS
+	/* OpenSSL sets kTLS up when it installs the keys, so it is too late
+	 * once we are open. */
+	if (bev_ssl && !bev_ssl->underlying &&
+	    bev_ssl->state != BUFFEREVENT_SSL_OPEN &&
+	    !bev_ssl->handshake_offloaded) {
+		if (enable)
+			SSL_set_options(bev_ssl->ssl, SSL_OP_ENABLE_KTLS);
+		else
+			SSL_clear_options(bev_ssl->ssl, SSL_OP_ENABLE_KTLS);
+		r = 0;
+	}
+#else
+	(void)bev_ssl;
+#endif
+	BEV_UNLOCK(bev);
+	return r;
+}
+
+int
+bufferevent_openssl_get_ktls_send(struct bufferevent *bev)
+{
+	int ktls_send = -1;
+	struct bufferevent_openssl *bev_ssl;
+	BEV_LOCK(bev);
+	bev_ssl = upcast(bev);
+	if (bev_ssl)
+		ktls_send = bev_ssl->ktls_send;
+	BEV_UNLOCK(bev);
+	return ktls_send;
+}
+
+int
+bufferevent_openssl_set_record_sizing(struct bufferevent *bev,
+    size_t small_size, size_t warmup, const struct timeval *idle)
+{
+	int r = -1;
+	struct bufferevent_openssl *bev_ssl;
+	BEV_LOCK(bev);
+	bev_ssl = upcast(bev);
+	if (!bev_ssl || small_size > SSL3_RT_MAX_PLAIN_LENGTH)
+		goto done;
+	bev_ssl->record_small = small_size;
+	bev_ssl->record_warmup = warmup;
+	if (idle)
+		bev_ssl->record_idle = *idle;
+	else
+		evutil_timerclear(&bev_ssl->record_idle);
+	r = 0;
+done:
+	BEV_UNLOCK(bev);
+	return r;
+}
+
+int
+bufferevent_openssl_set_handshake_offload(struct bufferevent *bev,
+    bufferevent_ssl_offload_cb cb, void *arg)
+{
+	int r = -1;
+	struct bufferevent_openssl *bev_ssl;
+	BEV_LOCK(bev);
+	bev_ssl = upcast(bev);
+	/* The job reports back with event_active() from its own thread, and
+	 * a filter's BIO would touch the underlying bufferevent from there:
+	 * so we need locking, and a socket. */
+	if (!bev_ssl || bev_ssl->underlying || bev_ssl->handshake_offloaded ||
+	    !EVTHREAD_LOCKING_ENABLED())
+		goto done;
+	if (cb && !event_initialized(&bev_ssl->handshake_done))
+		event_assign(&bev_ssl->handshake_done, bev->ev_base, -1, 0,
+		    be_openssl_handshake_done, bev_ssl);
+	bev_ssl->offload_cb = cb;
+	bev_ssl->offload_arg = arg;
+	r = 0;
+done:
+	BEV_UNLOCK(bev);
+	return r;
+}
+
 // 返回给定 bufferevent 的第一个未决的 OpenSSL 错误
 unsigned long
 bufferevent_get_openssl_error(struct bufferevent *bev)
@@ -1504,3 +1795,459 @@ bufferevent_get_openssl_error(struct bufferevent *bev)
 	BEV_UNLOCK(bev);
 	return err;
 }
+
+/*
+ * A server-side session cache that several SSL_CTXs (typically one per
+ * event_base) can share.  Sessions are spread over shards by the hash of
+ * their ids, and each shard has its own lock, table and LRU list, so that
+ * threads handshaking at the same time rarely wait for one another.  The
+ * cache also holds the keys for session tickets, so that a ticket issued
+ * by one SSL_CTX can be used with all the others.
+ */
+
+struct bev_ssl_cached_session {
+	HT_ENTRY(bev_ssl_cached_session) node;
+	/* Most recently used first. */
+	TAILQ_ENTRY(bev_ssl_cached_session) lru;
+	unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	unsigned id_len;
+	unsigned hash;
+	SSL_SESSION *session;
+};
+
+static inline unsigned
+hash_cached_session(const struct bev_ssl_cached_session *e)
+{
+	return e->hash;
+}
+
+static inline int
+eq_cached_session(const struct bev_ssl_cached_session *a,
+    const struct bev_ssl_cached_session *b)
+{
+	return a->id_len == b->id_len && !memcmp(a->id, b->id, a->id_len);
+}
+
+HT_HEAD(bev_ssl_session_map, bev_ssl_cached_session);
+HT_PROTOTYPE(bev_ssl_session_map, bev_ssl_cached_session, node,
+    hash_cached_session, eq_cached_session)
+HT_GENERATE(bev_ssl_session_map, bev_ssl_cached_session, node,
+    hash_cached_session, eq_cached_session, 0.5,
+    mm_malloc, mm_realloc, mm_free)
+
+struct bev_ssl_session_shard {
+	void *lock;
+	struct bev_ssl_session_map map;
+	TAILQ_HEAD(bev_ssl_session_lru, bev_ssl_cached_session) lru;
+	size_t n_sessions;
+	ev_uint64_t hits;
+	ev_uint64_t misses;
+	ev_uint64_t stored;
+	ev_uint64_t evicted;
+};
+
+#define TICKET_KEY_NAME_LEN 16
+#define TICKET_KEY_LEN 32
+
+struct bev_ssl_ticket_key {
+	unsigned char name[TICKET_KEY_NAME_LEN];
+	unsigned char aes_key[TICKET_KEY_LEN];
+	unsigned char hmac_key[TICKET_KEY_LEN];
+};
+
+/* The key we encrypt new tickets with, and the one before it, which we
+ * still accept. */
+#define N_TICKET_KEYS 2
+
+struct bufferevent_ssl_session_cache {
+	struct bev_ssl_session_shard *shards;
+	unsigned n_shards;
+	size_t max_per_shard;
+
+	/* Protects everything below. */
+	void *key_lock;
+	struct bev_ssl_ticket_key keys[N_TICKET_KEYS];
+	int n_keys;
+	ev_uint64_t tickets_issued;
+	ev_uint64_t tickets_resumed;
+	ev_uint64_t tickets_renewed;
+	ev_uint64_t tickets_unknown;
+};
+
+/* Where we keep the cache an SSL_CTX is attached to.  Set up once, by the
+ * first call to bufferevent_ssl_session_cache_attach() in any thread. */
+static int session_cache_ex_index = -1;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+typedef unsigned char session_id_t;
+#else
+typedef const unsigned char session_id_t;
+#endif
+
+static struct bufferevent_ssl_session_cache *
+session_cache_for(SSL *ssl)
+{
+	return SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl),
+	    session_cache_ex_index);
+}
+
+static unsigned
+hash_session_id(const unsigned char *id, unsigned len)
+{
+	unsigned h = 0;
+	while (len--)
+		h = (1000003*h) ^ *id++;
+	return h;
+}
+
+/* Set up 'find' to look for id, and return the shard that would hold it. */
+static struct bev_ssl_session_shard *
+session_cache_find_shard(struct bufferevent_ssl_session_cache *cache,
+    struct bev_ssl_cached_session *find, const unsigned char *id,
+    unsigned len)
+{
+	if (len > sizeof(find->id))
+		len = sizeof(find->id);
+	memcpy(find->id, id, len);
+	find->id_len = len;
+	find->hash = hash_session_id(id, len);
+	return &cache->shards[find->hash % cache->n_shards];
+}
+
+/* Take ent out of shard and drop our reference to its session.  Requires
+ * the shard's lock. */
+static void
+session_cache_remove_entry(struct bev_ssl_session_shard *shard,
+    struct bev_ssl_cached_session *ent)
+{
+	HT_REMOVE(bev_ssl_session_map, &shard->map, ent);
+	TAILQ_REMOVE(&shard->lru, ent, lru);
+	--shard->n_sessions;
+	SSL_SESSION_free(ent->session);
+	mm_free(ent);
+}
+
+static int
+session_cache_new_cb(SSL *ssl, SSL_SESSION *session)
+{
+	struct bufferevent_ssl_session_cache *cache = session_cache_for(ssl);
+	struct bev_ssl_session_shard *shard;
+	struct bev_ssl_cached_session *ent, *old;
+	const unsigned char *id;
+	unsigned len;
+
+	if (!cache || !(ent = mm_calloc(1, sizeof(*ent))))
+		return 0;
+	id = SSL_SESSION_get_id(session, &len);
+	shard = session_cache_find_shard(cache, ent, id, len);
+	/* We keep the reference OpenSSL hands us; see the return value. */
+	ent->session = session;
+
+	EVLOCK_LOCK(shard->lock, 0);
+	if ((old = HT_FIND(bev_ssl_session_map, &shard->map, ent)))
+		session_cache_remove_entry(shard, old);
+	while (shard->n_sessions >= cache->max_per_shard &&
+	    !TAILQ_EMPTY(&shard->lru)) {
+		session_cache_remove_entry(shard,
+		    TAILQ_LAST(&shard->lru, bev_ssl_session_lru));
+		++shard->evicted;
+	}
+	HT_INSERT(bev_ssl_session_map, &shard->map, ent);
+	TAILQ_INSERT_HEAD(&shard->lru, ent, lru);
+	++shard->n_sessions;
+	++shard->stored;
+	EVLOCK_UNLOCK(shard->lock, 0);
+	return 1;
+}
+
+static int
+session_is_usable(SSL_SESSION *session)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	/* Connections that end without a proper shutdown spoil their
+	 * sessions. */
+	if (!SSL_SESSION_is_resumable(session))
+		return 0;
+#endif
+	return (long)time(NULL) < SSL_SESSION_get_time(session) +
+	    SSL_SESSION_get_timeout(session);
+}
+
+static SSL_SESSION *
+session_cache_get_cb(SSL *ssl, session_id_t *id, int len, int *copy)
+{
+	struct bufferevent_ssl_session_cache *cache = session_cache_for(ssl);
+	struct bev_ssl_session_shard *shard;
+	struct bev_ssl_cached_session find, *ent;
+	SSL_SESSION *session = NULL;
+
+	/* We take the reference ourselves, while we hold the lock. */
+	*copy = 0;
+	if (!cache || len <= 0)
+		return NULL;
+	shard = session_cache_find_shard(cache, &find, id, len);
+
+	EVLOCK_LOCK(shard->lock, 0);
+	ent = HT_FIND(bev_ssl_session_map, &shard->map, &find);
+	/* OpenSSL never tells us about sessions it gives up on, since they
+	 * aren't in its own cache; weed them out here. */
+	if (ent && !session_is_usable(ent->session)) {
+		session_cache_remove_entry(shard, ent);
+		ent = NULL;
+	}
+	if (ent) {
+		TAILQ_REMOVE(&shard->lru, ent, lru);
+		TAILQ_INSERT_HEAD(&shard->lru, ent, lru);
+		session = ent->session;
+		SSL_SESSION_up_ref(session);
+		++shard->hits;
+	} else {
+		++shard->misses;
+	}
+	EVLOCK_UNLOCK(shard->lock, 0);
+	return session;
+}
+
+/* Copy out the key to use for a ticket: the newest one if name is NULL,
+ * else the one called name.  Return its index, or -1 if we have no such
+ * key. */
+static int
+session_cache_get_ticket_key(struct bufferevent_ssl_session_cache *cache,
+    const unsigned char *name, struct bev_ssl_ticket_key *key)
+{
+	int i, found = -1;
+
+	EVLOCK_LOCK(cache->key_lock, 0);
+	for (i = 0; i < cache->n_keys; ++i) {
+		if (!name ||
+		    !memcmp(cache->keys[i].name, name, TICKET_KEY_NAME_LEN)) {
+			memcpy(key, &cache->keys[i], sizeof(*key));
+			found = i;
+			break;
+		}
+	}
+	if (name == NULL)
+		++cache->tickets_issued;
+	else if (found < 0)
+		++cache->tickets_unknown;
+	else if (found == 0)
+		++cache->tickets_resumed;
+	else
+		++cache->tickets_renewed;
+	EVLOCK_UNLOCK(cache->key_lock, 0);
+	return found;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX ticket_mac_ctx_t;
+
+static int
+ticket_mac_init(ticket_mac_ctx_t *mac, struct bev_ssl_ticket_key *key)
+{
+	OSSL_PARAM params[3];
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+	    key->hmac_key, TICKET_KEY_LEN);
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+	    (char *)"SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	return EVP_MAC_CTX_set_params(mac, params);
+}
+#else
+typedef HMAC_CTX ticket_mac_ctx_t;
+
+static int
+ticket_mac_init(ticket_mac_ctx_t *mac, struct bev_ssl_ticket_key *key)
+{
+	return HMAC_Init_ex(mac, key->hmac_key, TICKET_KEY_LEN,
+	    EVP_sha256(), NULL);
+}
+#endif
+
+static int
+session_cache_ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+    EVP_CIPHER_CTX *cipher, ticket_mac_ctx_t *mac, int enc)
+{
+	struct bufferevent_ssl_session_cache *cache = session_cache_for(ssl);
+	struct bev_ssl_ticket_key key;
+	int idx, r = -1;
+
+	if (!cache)
+		return -1;
+	if (enc) {
+		if (session_cache_get_ticket_key(cache, NULL, &key) < 0)
+			return -1;
+		memcpy(name, key.name, TICKET_KEY_NAME_LEN);
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+			goto done;
+		if (!EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL,
+			key.aes_key, iv) || !ticket_mac_init(mac, &key))
+			goto done;
+		r = 1;
+	} else {
+		idx = session_cache_get_ticket_key(cache, name, &key);
+		if (idx < 0)
+			return 0; /* Do a full handshake. */
+		if (!EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL,
+			key.aes_key, iv) || !ticket_mac_init(mac, &key))
+			goto done;
+		/* An old key works, but the client should get a new ticket. */
+		r = idx == 0 ? 1 : 2;
+	}
+done:
+	OPENSSL_cleanse(&key, sizeof(key));
+	return r;
+}
+
+struct bufferevent_ssl_session_cache *
+bufferevent_ssl_session_cache_new(unsigned n_shards, size_t max_sessions)
+{
+	struct bufferevent_ssl_session_cache *cache;
+	unsigned i;
+
+	if (!n_shards || max_sessions < n_shards)
+		return NULL;
+	if (!(cache = mm_calloc(1, sizeof(*cache))))
+		return NULL;
+	if (!(cache->shards = mm_calloc(n_shards, sizeof(*cache->shards)))) {
+		mm_free(cache);
+		return NULL;
+	}
+	cache->n_shards = n_shards;
+	cache->max_per_shard = max_sessions / n_shards;
+	for (i = 0; i < n_shards; ++i) {
+		struct bev_ssl_session_shard *shard = &cache->shards[i];
+		HT_INIT(bev_ssl_session_map, &shard->map);
+		TAILQ_INIT(&shard->lru);
+		EVTHREAD_ALLOC_LOCK(shard->lock, 0);
+	}
+	EVTHREAD_ALLOC_LOCK(cache->key_lock, 0);
+	if (bufferevent_ssl_session_cache_rotate_ticket_key(cache) < 0) {
+		bufferevent_ssl_session_cache_free(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+void
+bufferevent_ssl_session_cache_free(struct bufferevent_ssl_session_cache *cache)
+{
+	struct bev_ssl_session_shard *shard;
+	unsigned i;
+
+	for (i = 0; i < cache->n_shards; ++i) {
+		shard = &cache->shards[i];
+		while (!TAILQ_EMPTY(&shard->lru))
+			session_cache_remove_entry(shard,
+			    TAILQ_FIRST(&shard->lru));
+		HT_CLEAR(bev_ssl_session_map, &shard->map);
+		EVTHREAD_FREE_LOCK(shard->lock, 0);
+	}
+	EVTHREAD_FREE_LOCK(cache->key_lock, 0);
+	OPENSSL_cleanse(cache->keys, sizeof(cache->keys));
+	mm_free(cache->shards);
+	mm_free(cache);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static CRYPTO_ONCE session_cache_ex_index_once = CRYPTO_ONCE_STATIC_INIT;
+
+static void
+session_cache_ex_index_init(void)
+{
+	session_cache_ex_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL,
+	    NULL);
+}
+#endif
+
+/* Return the ex_data index for session caches, allocating it on first use.
+ * Different threads may be attaching caches to different SSL_CTXs at once,
+ * so they must all agree on a single index. */
+static int
+session_cache_get_ex_index(void)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	if (!CRYPTO_THREAD_run_once(&session_cache_ex_index_once,
+		session_cache_ex_index_init))
+		return -1;
+#else
+	CRYPTO_w_lock(CRYPTO_LOCK_SSL_CTX);
+	if (session_cache_ex_index < 0)
+		session_cache_ex_index = SSL_CTX_get_ex_new_index(0, NULL,
+		    NULL, NULL, NULL);
+	CRYPTO_w_unlock(CRYPTO_LOCK_SSL_CTX);
+#endif
+	return session_cache_ex_index;
+}
+
+int
+bufferevent_ssl_session_cache_attach(
+    struct bufferevent_ssl_session_cache *cache, SSL_CTX *ctx)
+{
+	int idx = session_cache_get_ex_index();
+
+	if (idx < 0)
+		return -1;
+	if (!SSL_CTX_set_ex_data(ctx, idx, cache))
+		return -1;
+
+	SSL_CTX_set_session_cache_mode(ctx,
+	    SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+	SSL_CTX_sess_set_new_cb(ctx, session_cache_new_cb);
+	SSL_CTX_sess_set_get_cb(ctx, session_cache_get_cb);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, session_cache_ticket_cb);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(ctx, session_cache_ticket_cb);
+#endif
+	return 0;
+}
+
+int
+bufferevent_ssl_session_cache_rotate_ticket_key(
+    struct bufferevent_ssl_session_cache *cache)
+{
+	struct bev_ssl_ticket_key key;
+	int r = -1;
+
+	if (RAND_bytes((unsigned char *)&key, sizeof(key)) <= 0)
+		goto done;
+	EVLOCK_LOCK(cache->key_lock, 0);
+	memmove(&cache->keys[1], &cache->keys[0],
+	    sizeof(key) * (N_TICKET_KEYS - 1));
+	memcpy(&cache->keys[0], &key, sizeof(key));
+	if (cache->n_keys < N_TICKET_KEYS)
+		++cache->n_keys;
+	EVLOCK_UNLOCK(cache->key_lock, 0);
+	r = 0;
+done:
+	OPENSSL_cleanse(&key, sizeof(key));
+	return r;
+}
+
+void
+bufferevent_ssl_session_cache_get_stats(
+    struct bufferevent_ssl_session_cache *cache,
+    struct bufferevent_ssl_session_cache_stats *stats)
+{
+	struct bev_ssl_session_shard *shard;
+	unsigned i;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < cache->n_shards; ++i) {
+		shard = &cache->shards[i];
+		EVLOCK_LOCK(shard->lock, 0);
+		stats->n_sessions += shard->n_sessions;
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		stats->stored += shard->stored;
+		stats->evicted += shard->evicted;
+		EVLOCK_UNLOCK(shard->lock, 0);
+	}
+	EVLOCK_LOCK(cache->key_lock, 0);
+	stats->tickets_issued = cache->tickets_issued;
+	stats->tickets_resumed = cache->tickets_resumed;
+	stats->tickets_renewed = cache->tickets_renewed;
+	stats->tickets_unknown = cache->tickets_unknown;
+	EVLOCK_UNLOCK(cache->key_lock, 0);
+}
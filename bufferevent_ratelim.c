@@ -192,6 +192,20 @@ static int bev_group_suspend_reading_(struct bufferevent_rate_limit_group *g);
 static int bev_group_suspend_writing_(struct bufferevent_rate_limit_group *g);
 static void bev_group_unsuspend_reading_(struct bufferevent_rate_limit_group *g);
 static void bev_group_unsuspend_writing_(struct bufferevent_rate_limit_group *g);
+static void bev_group_wait_(struct bufferevent_private *bev,
+    struct bufferevent_rate_limit_group *g, int is_write);
+static ev_ssize_t bev_group_shard_refill_(struct bufferevent_private *bev,
+    int is_write);
+
+#ifdef EVUTIL_HAVE_ATOMICS_
+#define SHARD_ADD_(p, v) EVUTIL_ATOMIC_ADD_((p), (v))
+#define SHARD_LOAD_(p) EVUTIL_ATOMIC_LOAD_(p)
+#else
+/* bufferevent_rate_limit_group_set_shard_batch() refuses to shard a group
+ * without atomics, so these are never used on a shared cache. */
+#define SHARD_ADD_(p, v) (*(p) += (v))
+#define SHARD_LOAD_(p) (*(p))
+#endif
 
 /** Helper: figure out the maximum amount we should write if is_write, or
     the maximum amount we should read if is_read.  Return that maximum, or
@@ -228,31 +242,51 @@ bufferevent_get_rlim_max_(struct bufferevent_private *bev, int is_write)
 		bufferevent_update_buckets(bev);
 		max_so_far = LIM(bev->rate_limiting->limit);
 	}
-	if (bev->rate_limiting->group) {
-		struct bufferevent_rate_limit_group *g =
-		    bev->rate_limiting->group;
+	if (bev->rate_limiting->shard) {
+		/* We get whatever our base has cached; sharded groups are
+		 * never nested. */
+		struct bufferevent_rate_limit_shard *s =
+		    bev->rate_limiting->shard;
+		ev_ssize_t cached = SHARD_LOAD_(is_write ?
+		    &s->write_tokens : &s->read_tokens);
+		if (cached <= 0)
+			cached = bev_group_shard_refill_(bev, is_write);
+		CLAMPTO(cached);
+	} else if (bev->rate_limiting->group) {
+		struct bufferevent_rate_limit_group *g, *parent;
 		ev_ssize_t share;
-		LOCK_GROUP(g);
-		if (GROUP_SUSPENDED(g)) {
-			/* We can get here if we failed to lock this
-			 * particular bufferevent while suspending the whole
-			 * group. */
-			if (is_write)
-				bufferevent_suspend_write_(&bev->bev,
-				    BEV_SUSPEND_BW_GROUP);
-			else
-				bufferevent_suspend_read_(&bev->bev,
-				    BEV_SUSPEND_BW_GROUP);
-			share = 0;
-		} else {
-			/* XXXX probably we should divide among the active
-			 * members, not the total members. */
-			share = LIM(g->rate_limit) / g->n_members;
-			if (share < g->min_share)
-				share = g->min_share;
+		int suspended;
+		/* We get no more than our share at every level between our
+		 * group and the top. */
+		for (g = bev->rate_limiting->group; g; g = parent) {
+			LOCK_GROUP(g);
+			parent = g->parent;
+			suspended = GROUP_SUSPENDED(g);
+			if (suspended) {
+				/* A group that runs dry doesn't visit its
+				 * members; each of us finds out here, and
+				 * takes a place in its queue. */
+				if (is_write)
+					bufferevent_suspend_write_(&bev->bev,
+					    BEV_SUSPEND_BW_GROUP);
+				else
+					bufferevent_suspend_read_(&bev->bev,
+					    BEV_SUSPEND_BW_GROUP);
+				share = 0;
+			} else {
+				/* XXXX probably we should divide among the
+				 * active members, not the total members. */
+				share = LIM(g->rate_limit) / g->n_total_members;
+				if (share < g->min_share)
+					share = g->min_share;
+			}
+			UNLOCK_GROUP(g);
+			CLAMPTO(share);
+			if (suspended) {
+				bev_group_wait_(bev, g, is_write);
+				break;
+			}
 		}
-		UNLOCK_GROUP(g);
-		CLAMPTO(share);
 	}
 
 	if (max_so_far < 0)
@@ -295,16 +329,36 @@ bufferevent_decrement_read_buckets_(struct bufferevent_private *bev, ev_ssize_t
 		}
 	}
 
-	if (bev->rate_limiting->group) {
-		LOCK_GROUP(bev->rate_limiting->group);
-		bev->rate_limiting->group->rate_limit.read_limit -= bytes;
-		bev->rate_limiting->group->total_read += bytes;
-		if (bev->rate_limiting->group->rate_limit.read_limit <= 0) {
-			bev_group_suspend_reading_(bev->rate_limiting->group);
-		} else if (bev->rate_limiting->group->read_suspended) {
-			bev_group_unsuspend_reading_(bev->rate_limiting->group);
+	if (bev->rate_limiting->shard) {
+		struct bufferevent_rate_limit_shard *s =
+		    bev->rate_limiting->shard;
+		SHARD_ADD_(&s->total_read, bytes);
+		if (SHARD_ADD_(&s->read_tokens, -bytes) <= 0)
+			bev_group_shard_refill_(bev, 0);
+	} else if (bev->rate_limiting->group) {
+		struct bufferevent_rate_limit_group *g, *parent;
+		int exhausted;
+		/* Draw the bytes from every group between ours and the top. */
+		for (g = bev->rate_limiting->group; g; g = parent) {
+			LOCK_GROUP(g);
+			parent = g->parent;
+			g->rate_limit.read_limit -= bytes;
+			g->total_read += bytes;
+			exhausted = g->rate_limit.read_limit <= 0;
+			if (exhausted) {
+				bev_group_suspend_reading_(g);
+			} else if (g->read_suspended) {
+				bev_group_unsuspend_reading_(g);
+			}
+			UNLOCK_GROUP(g);
+			if (exhausted) {
+				/* Nobody else is told; stop ourselves and
+				 * get in line. */
+				bufferevent_suspend_read_(&bev->bev,
+				    BEV_SUSPEND_BW_GROUP);
+				bev_group_wait_(bev, g, 0);
+			}
 		}
-		UNLOCK_GROUP(bev->rate_limiting->group);
 	}
 
 	return r;
@@ -333,61 +387,173 @@ bufferevent_decrement_write_buckets_(struct bufferevent_private *bev, ev_ssize_t
 		}
 	}
 
-	if (bev->rate_limiting->group) {
-		LOCK_GROUP(bev->rate_limiting->group);
-		bev->rate_limiting->group->rate_limit.write_limit -= bytes;
-		bev->rate_limiting->group->total_written += bytes;
-		if (bev->rate_limiting->group->rate_limit.write_limit <= 0) {
-			bev_group_suspend_writing_(bev->rate_limiting->group);
-		} else if (bev->rate_limiting->group->write_suspended) {
-			bev_group_unsuspend_writing_(bev->rate_limiting->group);
+	if (bev->rate_limiting->shard) {
+		struct bufferevent_rate_limit_shard *s =
+		    bev->rate_limiting->shard;
+		SHARD_ADD_(&s->total_written, bytes);
+		if (SHARD_ADD_(&s->write_tokens, -bytes) <= 0)
+			bev_group_shard_refill_(bev, 1);
+	} else if (bev->rate_limiting->group) {
+		struct bufferevent_rate_limit_group *g, *parent;
+		int exhausted;
+		/* Draw the bytes from every group between ours and the top. */
+		for (g = bev->rate_limiting->group; g; g = parent) {
+			LOCK_GROUP(g);
+			parent = g->parent;
+			g->rate_limit.write_limit -= bytes;
+			g->total_written += bytes;
+			exhausted = g->rate_limit.write_limit <= 0;
+			if (exhausted) {
+				bev_group_suspend_writing_(g);
+			} else if (g->write_suspended) {
+				bev_group_unsuspend_writing_(g);
+			}
+			UNLOCK_GROUP(g);
+			if (exhausted) {
+				/* Nobody else is told; stop ourselves and
+				 * get in line. */
+				bufferevent_suspend_write_(&bev->bev,
+				    BEV_SUSPEND_BW_GROUP);
+				bev_group_wait_(bev, g, 1);
+			}
 		}
-		UNLOCK_GROUP(bev->rate_limiting->group);
 	}
 
 	return r;
 }
 
-/** Stop reading on every bufferevent in <b>g</b> */
+/** Stop reading on every bufferevent in <b>g</b> and below it.
+
+    We don't visit the members here: with tens of thousands of them, that
+    would cost a walk of the whole group every tick.  Instead, each one
+    finds out the next time it looks at its limit and sees that the group
+    is suspended, and then suspends itself and joins our read queue.
+*/
 static int
 bev_group_suspend_reading_(struct bufferevent_rate_limit_group *g)
 {
 	/* Needs group lock */
-	struct bufferevent_private *bev;
 	g->read_suspended = 1;
-	g->pending_unsuspend_read = 0;
-
-	/* Note that in this loop we call EVLOCK_TRY_LOCK_ instead of BEV_LOCK,
-	   to prevent a deadlock.  (Ordinarily, the group lock nests inside
-	   the bufferevent locks.  If we are unable to lock any individual
-	   bufferevent, it will find out later when it looks at its limit
-	   and sees that its group is suspended.)
-	*/
-	LIST_FOREACH(bev, &g->members, rate_limiting->next_in_group) {
-		if (EVLOCK_TRY_LOCK_(bev->lock)) {
-			bufferevent_suspend_read_(&bev->bev,
-			    BEV_SUSPEND_BW_GROUP);
-			EVLOCK_UNLOCK(bev->lock, 0);
-		}
-	}
 	return 0;
 }
 
-/** Stop writing on every bufferevent in <b>g</b> */
+/** Stop writing on every bufferevent in <b>g</b> and below it. */
 static int
 bev_group_suspend_writing_(struct bufferevent_rate_limit_group *g)
 {
 	/* Needs group lock */
-	struct bufferevent_private *bev;
 	g->write_suspended = 1;
-	g->pending_unsuspend_write = 0;
-	LIST_FOREACH(bev, &g->members, rate_limiting->next_in_group) {
-		if (EVLOCK_TRY_LOCK_(bev->lock)) {
-			bufferevent_suspend_write_(&bev->bev,
+	return 0;
+}
+
+/** Stop waiting for whichever group we are waiting on to read if
+    !is_write, or to write if is_write.  Needs lock on bev. */
+static void
+bev_group_unwait_(struct bufferevent_private *bev, int is_write)
+{
+	struct bufferevent_rate_limit *rl = bev->rate_limiting;
+	struct bufferevent_rate_limit_group *g =
+	    is_write ? rl->write_waiting_on : rl->read_waiting_on;
+
+	if (!g)
+		return;
+	LOCK_GROUP(g);
+	if (is_write) {
+		TAILQ_REMOVE(&g->write_queue, bev,
+		    rate_limiting->next_write_waiter);
+		rl->write_waiting_on = NULL;
+	} else {
+		TAILQ_REMOVE(&g->read_queue, bev,
+		    rate_limiting->next_read_waiter);
+		rl->read_waiting_on = NULL;
+	}
+	UNLOCK_GROUP(g);
+}
+
+/** Note that bev, which is in g or below it, has suspended itself for
+    reading (or writing, if is_write) because g ran dry, so that g wakes it
+    up in turn when it refills.  Needs lock on bev, but not on any group. */
+static void
+bev_group_wait_(struct bufferevent_private *bev,
+    struct bufferevent_rate_limit_group *g, int is_write)
+{
+	struct bufferevent_rate_limit *rl = bev->rate_limiting;
+	int suspended;
+
+	if ((is_write ? rl->write_waiting_on : rl->read_waiting_on) == g)
+		return;
+	bev_group_unwait_(bev, is_write);
+
+	LOCK_GROUP(g);
+	suspended = GROUP_SUSPENDED(g);
+	if (suspended) {
+		if (is_write) {
+			TAILQ_INSERT_TAIL(&g->write_queue, bev,
+			    rate_limiting->next_write_waiter);
+			rl->write_waiting_on = g;
+		} else {
+			TAILQ_INSERT_TAIL(&g->read_queue, bev,
+			    rate_limiting->next_read_waiter);
+			rl->read_waiting_on = g;
+		}
+	}
+	UNLOCK_GROUP(g);
+
+	/* g refilled while we weren't holding its lock; nobody is going to
+	 * wake us, so don't sleep. */
+	if (!suspended) {
+		if (is_write)
+			bufferevent_unsuspend_write_(&bev->bev,
 			    BEV_SUSPEND_BW_GROUP);
-			EVLOCK_UNLOCK(bev->lock, 0);
+		else
+			bufferevent_unsuspend_read_(&bev->bev,
+			    BEV_SUSPEND_BW_GROUP);
+	}
+}
+
+/** Helper for a bufferevent in a sharded group: top up its event_base's
+    cache for reading (or writing, if is_write) with a batch from the
+    group's bucket, and return how many tokens the cache then holds.  If
+    the group is dry too, suspend bev until it refills and return 0.
+    Needs lock on bev, but not on the group. */
+static ev_ssize_t
+bev_group_shard_refill_(struct bufferevent_private *bev, int is_write)
+{
+	struct bufferevent_rate_limit_group *g = bev->rate_limiting->group;
+	struct bufferevent_rate_limit_shard *s = bev->rate_limiting->shard;
+	ev_ssize_t *cached = is_write ? &s->write_tokens : &s->read_tokens;
+	ev_ssize_t *limit = is_write ?
+	    &g->rate_limit.write_limit : &g->rate_limit.read_limit;
+	ev_ssize_t have, take;
+
+	LOCK_GROUP(g);
+	/* Another bufferevent on our base may have beaten us to it. */
+	have = SHARD_LOAD_(cached);
+	if (have <= 0 && !GROUP_SUSPENDED(g)) {
+		/* Pay off whatever we overdrew, and take a batch. */
+		take = g->shard_batch - have;
+		if (take > *limit)
+			take = *limit;
+		if (take > 0) {
+			*limit -= take;
+			have = SHARD_ADD_(cached, take);
+		}
+		if (*limit <= 0) {
+			if (is_write)
+				bev_group_suspend_writing_(g);
+			else
+				bev_group_suspend_reading_(g);
 		}
 	}
+	UNLOCK_GROUP(g);
+
+	if (have > 0)
+		return have;
+	if (is_write)
+		bufferevent_suspend_write_(&bev->bev, BEV_SUSPEND_BW_GROUP);
+	else
+		bufferevent_suspend_read_(&bev->bev, BEV_SUSPEND_BW_GROUP);
+	bev_group_wait_(bev, g, is_write);
 	return 0;
 }
 
@@ -441,88 +607,69 @@ bev_refill_callback_(evutil_socket_t fd, short what, void *arg)
 	BEV_UNLOCK(&bev->bev);
 }
 
-/** Helper: grab a random element from a bufferevent group.
- *
- * Requires that we hold the lock on the group.
- */
-static struct bufferevent_private *
-bev_group_random_element_(struct bufferevent_rate_limit_group *group)
+/** Helper: return how much of <b>limit</b> we expect each bufferevent we
+    wake from one of g's queues to use up, so that we know when to stop
+    waking them.  Needs group lock. */
+static ev_ssize_t
+bev_group_wake_share_(struct bufferevent_rate_limit_group *g,
+    ev_ssize_t limit)
 {
-	int which;
-	struct bufferevent_private *bev;
-
-	/* requires group lock */
-
-	if (!group->n_members)
-		return NULL;
-
-	EVUTIL_ASSERT(! LIST_EMPTY(&group->members));
-
-	which = evutil_weakrand_range_(&group->weakrand_seed, group->n_members);
-
-	bev = LIST_FIRST(&group->members);
-	while (which--)
-		bev = LIST_NEXT(bev, rate_limiting->next_in_group);
-
-	return bev;
+	ev_ssize_t share = limit;
+	if (g->n_total_members)
+		share = limit / g->n_total_members;
+	if (share < g->min_share)
+		share = g->min_share;
+	if (share < 1)
+		share = 1;
+	return share;
 }
 
-/** Iterate over the elements of a rate-limiting group 'g' with a random
-    starting point, assigning each to the variable 'bev', and executing the
-    block 'block'.
-
-    We do this in a half-baked effort to get fairness among group members.
-    XXX Round-robin or some kind of priority queue would be even more fair.
- */
-#define FOREACH_RANDOM_ORDER(block)			\
-	do {						\
-		first = bev_group_random_element_(g);	\
-		for (bev = first; bev != LIST_END(&g->members); \
-		    bev = LIST_NEXT(bev, rate_limiting->next_in_group)) { \
-			block ;					 \
-		}						 \
-		for (bev = LIST_FIRST(&g->members); bev && bev != first; \
-		    bev = LIST_NEXT(bev, rate_limiting->next_in_group)) { \
-			block ;						\
-		}							\
-	} while (0)
-
 static void
 bev_group_unsuspend_reading_(struct bufferevent_rate_limit_group *g)
 {
-	int again = 0;
-	struct bufferevent_private *bev, *first;
+	struct bufferevent_private *bev, *next;
+	ev_ssize_t budget = g->rate_limit.read_limit;
+	ev_ssize_t share = bev_group_wake_share_(g, budget);
 
 	g->read_suspended = 0;
-	FOREACH_RANDOM_ORDER({
+	/* Wake whoever has waited longest, until the bucket has nothing left
+	 * for the next one in line; the rest keep their place for the next
+	 * tick.  As when suspending, we only TRY to lock each bufferevent to
+	 * avoid a deadlock, and one we can't lock stays at the front. */
+	for (bev = TAILQ_FIRST(&g->read_queue); bev && budget > 0; bev = next) {
+		next = TAILQ_NEXT(bev, rate_limiting->next_read_waiter);
 		if (EVLOCK_TRY_LOCK_(bev->lock)) {
+			TAILQ_REMOVE(&g->read_queue, bev,
+			    rate_limiting->next_read_waiter);
+			bev->rate_limiting->read_waiting_on = NULL;
 			bufferevent_unsuspend_read_(&bev->bev,
 			    BEV_SUSPEND_BW_GROUP);
 			EVLOCK_UNLOCK(bev->lock, 0);
-		} else {
-			again = 1;
+			budget -= share;
 		}
-	});
-	g->pending_unsuspend_read = again;
+	}
 }
 
 static void
 bev_group_unsuspend_writing_(struct bufferevent_rate_limit_group *g)
 {
-	int again = 0;
-	struct bufferevent_private *bev, *first;
-	g->write_suspended = 0;
+	struct bufferevent_private *bev, *next;
+	ev_ssize_t budget = g->rate_limit.write_limit;
+	ev_ssize_t share = bev_group_wake_share_(g, budget);
 
-	FOREACH_RANDOM_ORDER({
+	g->write_suspended = 0;
+	for (bev = TAILQ_FIRST(&g->write_queue); bev && budget > 0; bev = next) {
+		next = TAILQ_NEXT(bev, rate_limiting->next_write_waiter);
 		if (EVLOCK_TRY_LOCK_(bev->lock)) {
+			TAILQ_REMOVE(&g->write_queue, bev,
+			    rate_limiting->next_write_waiter);
+			bev->rate_limiting->write_waiting_on = NULL;
 			bufferevent_unsuspend_write_(&bev->bev,
 			    BEV_SUSPEND_BW_GROUP);
 			EVLOCK_UNLOCK(bev->lock, 0);
-		} else {
-			again = 1;
+			budget -= share;
 		}
-	});
-	g->pending_unsuspend_write = again;
+	}
 }
 
 /** Callback invoked every tick to add more elements to the group bucket
@@ -542,20 +689,17 @@ bev_group_refill_callback_(evutil_socket_t fd, short what, void *arg)
 	tick = ev_token_bucket_get_tick_(&now, &g->rate_limit_cfg);
 	ev_token_bucket_update_(&g->rate_limit, &g->rate_limit_cfg, tick);
 
-	if (g->pending_unsuspend_read ||
-	    (g->read_suspended && (g->rate_limit.read_limit >= g->min_share))) {
+	/* Even if we never ran dry, there may be bufferevents left in line
+	 * from an earlier tick that we didn't have enough to wake. */
+	if ((g->read_suspended || !TAILQ_EMPTY(&g->read_queue)) &&
+	    g->rate_limit.read_limit >= g->min_share) {
 		bev_group_unsuspend_reading_(g);
 	}
-	if (g->pending_unsuspend_write ||
-	    (g->write_suspended && (g->rate_limit.write_limit >= g->min_share))){
+	if ((g->write_suspended || !TAILQ_EMPTY(&g->write_queue)) &&
+	    g->rate_limit.write_limit >= g->min_share) {
 		bev_group_unsuspend_writing_(g);
 	}
 
-	/* XXXX Rather than waiting to the next tick to unsuspend stuff
-	 * with pending_unsuspend_write/read, we should do it on the
-	 * next iteration of the mainloop.
-	 */
-
 	UNLOCK_GROUP(g);
 }
 
@@ -657,6 +801,9 @@ bufferevent_rate_limit_group_new(struct event_base *base,
 		return NULL;
 	memcpy(&g->rate_limit_cfg, cfg, sizeof(g->rate_limit_cfg));
 	LIST_INIT(&g->members);
+	TAILQ_INIT(&g->read_queue);
+	TAILQ_INIT(&g->write_queue);
+	LIST_INIT(&g->shards);
 
 	ev_token_bucket_init_(&g->rate_limit, cfg, tick, 0);
 
@@ -669,9 +816,6 @@ bufferevent_rate_limit_group_new(struct event_base *base,
 
 	bufferevent_rate_limit_group_set_min_share(g, 64);
 
-	evutil_weakrand_seed_(&g->weakrand_seed,
-	    (ev_uint32_t) ((now.tv_sec + now.tv_usec) + (ev_intptr_t)g));
-
 	return g;
 }
 
@@ -729,13 +873,126 @@ bufferevent_rate_limit_group_set_min_share(
 	return 0;
 }
 
+/** Add delta to the member count of g and of every group above it. */
+static void
+bev_group_count_members_(struct bufferevent_rate_limit_group *g, int delta)
+{
+	struct bufferevent_rate_limit_group *parent;
+	for (; g; g = parent) {
+		LOCK_GROUP(g);
+		g->n_total_members += delta;
+		parent = g->parent;
+		UNLOCK_GROUP(g);
+	}
+}
+
+// 设置速率限制组的父组，组内的流量同时受父组限制
+int
+bufferevent_rate_limit_group_set_parent(
+	struct bufferevent_rate_limit_group *g,
+	struct bufferevent_rate_limit_group *parent)
+{
+	struct bufferevent_rate_limit_group *a, *next;
+	int r = -1;
+
+	LOCK_GROUP(g);
+	/* Nobody below us may be waiting on our old parents. */
+	if (g->n_total_members)
+		goto done;
+	/* Cached tokens only ever come from one bucket. */
+	if (g->shard_batch || (parent && parent->shard_batch))
+		goto done;
+	for (a = parent; a; a = next) {
+		if (a == g)
+			goto done;
+		LOCK_GROUP(a);
+		next = a->parent;
+		UNLOCK_GROUP(a);
+	}
+	if (g->parent) {
+		LOCK_GROUP(g->parent);
+		--g->parent->n_children;
+		UNLOCK_GROUP(g->parent);
+	}
+	if (parent) {
+		LOCK_GROUP(parent);
+		++parent->n_children;
+		UNLOCK_GROUP(parent);
+	}
+	g->parent = parent;
+	r = 0;
+done:
+	UNLOCK_GROUP(g);
+	return r;
+}
+
+/** Throw away g's per-base caches and their totals.  Needs group lock. */
+static void
+bev_group_free_shards_(struct bufferevent_rate_limit_group *g)
+{
+	struct bufferevent_rate_limit_shard *s;
+	while ((s = LIST_FIRST(&g->shards))) {
+		g->total_read += s->total_read;
+		g->total_written += s->total_written;
+		LIST_REMOVE(s, next);
+		mm_free(s);
+	}
+}
+
+/** Return g's cache for the bufferevents on base, creating it if needed.
+    Return NULL on allocation failure.  Needs group lock. */
+static struct bufferevent_rate_limit_shard *
+bev_group_get_shard_(struct bufferevent_rate_limit_group *g,
+    struct event_base *base)
+{
+	struct bufferevent_rate_limit_shard *s;
+	LIST_FOREACH(s, &g->shards, next) {
+		if (s->base == base)
+			return s;
+	}
+	s = mm_calloc(1, sizeof(struct bufferevent_rate_limit_shard));
+	if (!s)
+		return NULL;
+	s->base = base;
+	LIST_INSERT_HEAD(&g->shards, s, next);
+	return s;
+}
+
+// 让每个event_base缓存一批组的令牌，减少多线程对组锁的争用
+int
+bufferevent_rate_limit_group_set_shard_batch(
+	struct bufferevent_rate_limit_group *g, size_t batch)
+{
+	int r = -1;
+#ifndef EVUTIL_HAVE_ATOMICS_
+	if (batch)
+		return -1;
+#endif
+	if (batch > EV_SSIZE_MAX)
+		return -1;
+
+	LOCK_GROUP(g);
+	if (g->n_members || g->parent || g->n_children)
+		goto done;
+	/* Nobody is using the old caches; the tokens in them go to waste. */
+	bev_group_free_shards_(g);
+	g->shard_batch = batch;
+	r = 0;
+done:
+	UNLOCK_GROUP(g);
+	return r;
+}
+
 // 释放速率限制组,移除所有成员
 void
 bufferevent_rate_limit_group_free(struct bufferevent_rate_limit_group *g)
 {
+	bufferevent_rate_limit_group_set_parent(g, NULL);
 	LOCK_GROUP(g);
 	EVUTIL_ASSERT(0 == g->n_members);
+	EVUTIL_ASSERT(0 == g->n_children);
 	event_del(&g->master_refill_event);
+	bev_group_free_shards_(g);
 	UNLOCK_GROUP(g);
 	EVTHREAD_FREE_LOCK(g->lock, EVTHREAD_LOCKTYPE_RECURSIVE);
 	mm_free(g);
@@ -747,6 +1004,7 @@ bufferevent_add_to_rate_limit_group(struct bufferevent *bev,
     struct bufferevent_rate_limit_group *g)
 {
 	int wsuspend, rsuspend;
+	struct bufferevent_rate_limit_shard *shard = NULL;
 	struct bufferevent_private *bevp =
 	    EVUTIL_UPCAST(bev, struct bufferevent_private, bev);
 	BEV_LOCK(bev);
@@ -767,11 +1025,26 @@ bufferevent_add_to_rate_limit_group(struct bufferevent *bev,
 		BEV_UNLOCK(bev);
 		return 0;
 	}
+
+	LOCK_GROUP(g);
+	if (g->shard_batch) {
+		/* Caches are only freed with the group, so we can look ours
+		 * up before we commit to anything. */
+		shard = bev_group_get_shard_(g, bev->ev_base);
+		if (!shard) {
+			UNLOCK_GROUP(g);
+			BEV_UNLOCK(bev);
+			return -1;
+		}
+	}
+	UNLOCK_GROUP(g);
+
 	if (bevp->rate_limiting->group)
 		bufferevent_remove_from_rate_limit_group(bev);
 
 	LOCK_GROUP(g);
 	bevp->rate_limiting->group = g;
+	bevp->rate_limiting->shard = shard;
 	++g->n_members;
 	LIST_INSERT_HEAD(&g->members, bevp, rate_limiting->next_in_group);
 
@@ -779,11 +1052,16 @@ bufferevent_add_to_rate_limit_group(struct bufferevent *bev,
 	wsuspend = g->write_suspended;
 
 	UNLOCK_GROUP(g);
+	bev_group_count_members_(g, 1);
 
-	if (rsuspend)
+	if (rsuspend) {
 		bufferevent_suspend_read_(bev, BEV_SUSPEND_BW_GROUP);
-	if (wsuspend)
+		bev_group_wait_(bevp, g, 0);
+	}
+	if (wsuspend) {
 		bufferevent_suspend_write_(bev, BEV_SUSPEND_BW_GROUP);
+		bev_group_wait_(bevp, g, 1);
+	}
 
 	BEV_UNLOCK(bev);
 	return 0;
@@ -806,11 +1084,15 @@ bufferevent_remove_from_rate_limit_group_internal_(struct bufferevent *bev,
 	if (bevp->rate_limiting && bevp->rate_limiting->group) {
 		struct bufferevent_rate_limit_group *g =
 		    bevp->rate_limiting->group;
+		bev_group_unwait_(bevp, 0);
+		bev_group_unwait_(bevp, 1);
 		LOCK_GROUP(g);
 		bevp->rate_limiting->group = NULL;
+		bevp->rate_limiting->shard = NULL;
 		--g->n_members;
 		LIST_REMOVE(bevp, rate_limiting->next_in_group);
 		UNLOCK_GROUP(g);
+		bev_group_count_members_(g, -1);
 	}
 	if (unsuspend) {
 		bufferevent_unsuspend_read_(bev, BEV_SUSPEND_BW_GROUP);
@@ -875,6 +1157,11 @@ bufferevent_set_max_single_read(struct bufferevent *bev, size_t size)
 		bevp->max_single_read = MAX_SINGLE_READ_DEFAULT;
 	else
 		bevp->max_single_read = size;
+	/* Let a single read from the socket take all of that, too. */
+	if (size == 0 || size > EV_SSIZE_MAX)
+		evbuffer_set_max_read(bev->input, 0);
+	else
+		evbuffer_set_max_read(bev->input, size > INT_MAX ? INT_MAX : size);
 	BEV_UNLOCK(bev);
 	return 0;
 }
@@ -1080,17 +1367,37 @@ void
 bufferevent_rate_limit_group_get_totals(struct bufferevent_rate_limit_group *grp,
     ev_uint64_t *total_read_out, ev_uint64_t *total_written_out)
 {
+	struct bufferevent_rate_limit_shard *s;
+	ev_uint64_t total_read, total_written;
 	EVUTIL_ASSERT(grp != NULL);
+	LOCK_GROUP(grp);
+	total_read = grp->total_read;
+	total_written = grp->total_written;
+	LIST_FOREACH(s, &grp->shards, next) {
+		total_read += SHARD_LOAD_(&s->total_read);
+		total_written += SHARD_LOAD_(&s->total_written);
+	}
+	UNLOCK_GROUP(grp);
 	if (total_read_out)
-		*total_read_out = grp->total_read;
+		*total_read_out = total_read;
 	if (total_written_out)
-		*total_written_out = grp->total_written;
+		*total_written_out = total_written;
 }
 
 void
 bufferevent_rate_limit_group_reset_totals(struct bufferevent_rate_limit_group *grp)
 {
+	struct bufferevent_rate_limit_shard *s;
+	LOCK_GROUP(grp);
 	grp->total_read = grp->total_written = 0;
+	LIST_FOREACH(s, &grp->shards, next) {
+		/* Bytes counted while we do this are lost; they're only
+		 * statistics. */
+		SHARD_ADD_(&s->total_read, -SHARD_LOAD_(&s->total_read));
+		SHARD_ADD_(&s->total_written,
+		    -SHARD_LOAD_(&s->total_written));
+	}
+	UNLOCK_GROUP(grp);
 }
 
 int
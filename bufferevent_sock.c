@@ -64,12 +64,14 @@
 #include "event2/util.h"
 #include "event2/bufferevent.h"
 #include "event2/buffer.h"
+#include "event2/buffer_compat.h"
 #include "event2/bufferevent_struct.h"
 #include "event2/bufferevent_compat.h"
 #include "event2/event.h"
 #include "log-internal.h"
 #include "mm-internal.h"
 #include "bufferevent-internal.h"
+#include "evbuffer-internal.h"
 #include "util-internal.h"
 #ifdef _WIN32
 #include "iocp-internal.h"
@@ -78,6 +80,7 @@
 /* prototypes */
 static int be_socket_enable(struct bufferevent *, short);
 static int be_socket_disable(struct bufferevent *, short);
+static void be_socket_unlink(struct bufferevent *);
 static void be_socket_destruct(struct bufferevent *);
 static int be_socket_flush(struct bufferevent *, short, enum bufferevent_flush_mode);
 static int be_socket_ctrl(struct bufferevent *, enum bufferevent_ctrl_op, union bufferevent_ctrl_data *);
@@ -90,7 +93,7 @@ const struct bufferevent_ops bufferevent_ops_socket = {
 	evutil_offsetof(struct bufferevent_private, bev),
 	be_socket_enable,
 	be_socket_disable,
-	NULL, /* unlink */
+	be_socket_unlink,
 	be_socket_destruct,
 	bufferevent_generic_adj_existing_timeouts_,
 	be_socket_flush,
@@ -139,6 +142,13 @@ bufferevent_socket_outbuf_cb(struct evbuffer *buf,
         !bufev_p->write_suspended) { // 这个bufferevent的写并没有被挂起
 		/* Somebody added data to the buffer, and we would like to
 		 * write, and we were not writing.  So, start writing. */
+		if (bufev_p->options & BEV_OPT_COALESCE_WRITES) {
+			/* ... once this loop iteration is done adding. */
+			if (event_deferred_cb_schedule_(bufev->ev_base,
+				&bufev_p->write_flush))
+				bufferevent_incref_(bufev);
+			return;
+		}
         // 把这个写event添加到event_base中，使得base返回后，能发送数据
 		if (bufferevent_add_event_(&bufev->ev_write, &bufev->timeout_write) == -1) {
 		    /* Should we log this? */
@@ -187,6 +197,11 @@ bufferevent_readcb(evutil_socket_t fd, short event, void *arg)
     // 因为用户可以限速，所以这里要检测最大的可读大小。
     // 如果没有限速的话，那么将返回16384字节，即16K
     // 默认情况下是没有限速的。
+	/* A ring buffer can't grow, so stop reading while it's full. */
+	if (evbuffer_ring_full_(input)) {
+		bufferevent_ring_suspend_read_(bufev);
+		goto done;
+	}
 	readmax = bufferevent_get_read_max_(bufev_p);
 	if (howmuch < 0 || howmuch > readmax) /* The use of -1 for "unlimited"
 					       * uglifies this code. XXXX */
@@ -327,7 +342,10 @@ bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 		evbuffer_unfreeze(bufev->output, 1);
         // 将output这个evbuffer的数据写到sockfd 的缓冲区中，
         // 会把已经写到socket fd缓冲区的数据，从evbuffer中删除
-		res = evbuffer_write_atmost(bufev->output, fd, atmost);
+		if (bufev_p->options & BEV_OPT_COALESCE_WRITES)
+			res = evbuffer_write_batch_(bufev->output, fd, atmost);
+		else
+			res = evbuffer_write_atmost(bufev->output, fd, atmost);
 		evbuffer_freeze(bufev->output, 1);
 		if (res == -1) {
 			int err = evutil_socket_geterror(fd);
@@ -381,6 +399,33 @@ bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 	bufferevent_decref_and_unlock_(bufev);
 }
 
+/* For BEV_OPT_COALESCE_WRITES: write out everything that was added to the
+ * output during this loop iteration, and wait for the socket to become
+ * writable only if it doesn't all fit. */
+static void
+bufferevent_socket_flush_cb(struct event_callback *cb, void *arg)
+{
+	struct bufferevent_private *bufev_p = arg;
+	struct bufferevent *bufev = &bufev_p->bev;
+	evutil_socket_t fd;
+
+	BEV_LOCK(bufev);
+	fd = event_get_fd(&bufev->ev_write);
+	if (fd < 0 || !(bufev->enabled & EV_WRITE) ||
+	    bufev_p->write_suspended ||
+	    event_pending(&bufev->ev_write, EV_WRITE, NULL) ||
+	    !evbuffer_get_length(bufev->output))
+		goto done;
+
+	bufferevent_writecb(fd, EV_WRITE, bufev);
+	if (evbuffer_get_length(bufev->output) &&
+	    (bufev->enabled & EV_WRITE) && !bufev_p->write_suspended &&
+	    !event_pending(&bufev->ev_write, EV_WRITE, NULL))
+		bufferevent_add_event_(&bufev->ev_write, &bufev->timeout_write);
+done:
+	bufferevent_decref_and_unlock_(bufev);
+}
+
 // 创建用于socket的bufferevent
 // fd: 是一个可选的表示套接字的文件描述符。如果想以后设置文件描述符,可以设置fd为-1.
 // options: 表示 bufferevent 选项(如 BEV_OPT_CLOSE_ON_FREE 等) 的位掩码.
@@ -418,6 +463,10 @@ bufferevent_socket_new(struct event_base *base, evutil_socket_t fd,
     // 设置output evbuffer的回调函数，使得外界给写缓冲区添加数据时，
     // 能自动触发把数据写到sockfd中，这个回调对于写事件的监听是很重要的
 	evbuffer_add_cb(bufev->output, bufferevent_socket_outbuf_cb, bufev);
+	if (options & BEV_OPT_COALESCE_WRITES)
+		event_deferred_cb_init_(&bufev_p->write_flush,
+		    event_base_get_npriorities(base) / 2,
+		    bufferevent_socket_flush_cb, bufev_p);
 
     // 冻结读缓冲区的尾部，未解冻之前不能往读缓冲区追加数据
     // 也就是说不能从socket fd中读取数据
@@ -524,6 +573,313 @@ done:
 	return result;
 }
 
+/* How long to wait for one connection attempt before starting the next
+ * one alongside it, as recommended by RFC 8305. */
+#define CONNECT_ATTEMPT_DELAY_MSEC 250
+
+struct bufferevent_connect_race;
+
+/* One of the connection attempts in a race. */
+struct bufferevent_connect_attempt {
+	struct bufferevent_connect_race *race;
+	const struct evutil_addrinfo *ai;
+	/* The socket we are connecting, or -1 if this attempt has not begun
+	 * or is over. */
+	evutil_socket_t fd;
+	struct event ev;
+};
+
+/* When bufferevent_socket_connect_hostname() resolves more than one
+ * address, we don't wait for each connect() to fail before trying the next:
+ * we start an attempt every CONNECT_ATTEMPT_DELAY_MSEC (or as soon as the
+ * last one fails), alternating address families, and keep whichever socket
+ * connects first. */
+struct bufferevent_connect_race {
+	struct bufferevent *bev;
+	/* The whole result from the resolver; we own it. */
+	struct evutil_addrinfo *ai;
+	/* Fires when it is time to start the next attempt. */
+	struct event timer;
+	/* One entry per address, in the order we try them. */
+	struct bufferevent_connect_attempt *attempts;
+	int n_attempts;
+	/* The next attempt to start. */
+	int next;
+	/* How many attempts are waiting on connect(). */
+	int n_pending;
+	/* The socket error from the last attempt that failed, and whether it
+	 * failed by timing out. */
+	int last_error;
+	unsigned timed_out : 1;
+};
+
+static void bufferevent_connect_race_start_next(
+	struct bufferevent_connect_race *race);
+
+/* Close every attempt still in progress and free the race.  The caller
+ * must already have unlinked it from the bufferevent. */
+static void
+bufferevent_connect_race_free(struct bufferevent_connect_race *race)
+{
+	int i;
+
+	event_del(&race->timer);
+	for (i = 0; i < race->n_attempts; ++i) {
+		struct bufferevent_connect_attempt *a = &race->attempts[i];
+		if (a->fd >= 0) {
+			event_del(&a->ev);
+			evutil_closesocket(a->fd);
+		}
+	}
+	evutil_freeaddrinfo(race->ai);
+	mm_free(race->attempts);
+	mm_free(race);
+}
+
+/* Give up on the race, if there is one, and drop the reference it held on
+ * the bufferevent. */
+static void
+bufferevent_connect_race_cancel(struct bufferevent_private *bev_p)
+{
+	struct bufferevent_connect_race *race = bev_p->connect_race;
+
+	if (race) {
+		bev_p->connect_race = NULL;
+		bufferevent_connect_race_free(race);
+		bufferevent_decref_(&bev_p->bev);
+	}
+}
+
+/* Attempt 'a' has connected: make its socket the bufferevent's, and let
+ * bufferevent_writecb() report the connection as it would for
+ * bufferevent_socket_connect(). */
+static void
+bufferevent_connect_race_won(struct bufferevent_connect_attempt *a)
+{
+	struct bufferevent_connect_race *race = a->race;
+	struct bufferevent *bev = race->bev;
+	struct bufferevent_private *bev_p =
+	    EVUTIL_UPCAST(bev, struct bufferevent_private, bev);
+	evutil_socket_t fd = a->fd;
+
+	event_del(&a->ev);
+	a->fd = -1;
+	bev_p->connect_race = NULL;
+	bufferevent_socket_set_conn_address(bev_p, a->ai->ai_addr,
+	    (int)a->ai->ai_addrlen);
+	bufferevent_connect_race_free(race);
+
+	bufferevent_setfd(bev, fd);
+	bufferevent_unsuspend_write_(bev, BEV_SUSPEND_LOOKUP);
+	bufferevent_unsuspend_read_(bev, BEV_SUSPEND_LOOKUP);
+	bev_p->connecting = 1;
+	if (be_socket_enable(bev, EV_WRITE) < 0) {
+		bev_p->connecting = 0;
+		bufferevent_run_eventcb_(bev, BEV_EVENT_ERROR, 0);
+	}
+	bufferevent_decref_(bev);
+}
+
+/* Every attempt has failed: tell the user, with the socket error set to
+ * the last failure's. */
+static void
+bufferevent_connect_race_lost(struct bufferevent_connect_race *race)
+{
+	struct bufferevent *bev = race->bev;
+	struct bufferevent_private *bev_p =
+	    EVUTIL_UPCAST(bev, struct bufferevent_private, bev);
+	int err = race->last_error;
+	short what = BEV_EVENT_ERROR;
+
+	if (race->timed_out)
+		what = BEV_EVENT_WRITING|BEV_EVENT_TIMEOUT;
+	bev_p->connect_race = NULL;
+	bufferevent_connect_race_free(race);
+
+	bufferevent_unsuspend_write_(bev, BEV_SUSPEND_LOOKUP);
+	bufferevent_unsuspend_read_(bev, BEV_SUSPEND_LOOKUP);
+	EVUTIL_SET_SOCKET_ERROR(err);
+	bufferevent_run_eventcb_(bev, what, 0);
+	bufferevent_decref_(bev);
+}
+
+/* Attempt 'a' is over without a connection: start the next one right away
+ * rather than waiting out the delay, or give up if none are left. */
+static void
+bufferevent_connect_attempt_failed(struct bufferevent_connect_attempt *a,
+    int err, int timed_out)
+{
+	struct bufferevent_connect_race *race = a->race;
+
+	if (a->fd >= 0) {
+		event_del(&a->ev);
+		evutil_closesocket(a->fd);
+		a->fd = -1;
+		--race->n_pending;
+	}
+	race->last_error = err;
+	race->timed_out = timed_out;
+	event_del(&race->timer);
+	bufferevent_connect_race_start_next(race);
+}
+
+static void
+bufferevent_connect_attempt_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bufferevent_connect_attempt *a = arg;
+	struct bufferevent *bev = a->race->bev;
+	int c;
+
+	bufferevent_incref_and_lock_(bev);
+	if (what & EV_TIMEOUT) {
+#ifdef _WIN32
+		bufferevent_connect_attempt_failed(a, WSAETIMEDOUT, 1);
+#else
+		bufferevent_connect_attempt_failed(a, ETIMEDOUT, 1);
+#endif
+		goto done;
+	}
+	c = evutil_socket_finished_connecting_(fd);
+	if (c == 0)
+		goto done;
+	if (c < 0)
+		bufferevent_connect_attempt_failed(a,
+		    evutil_socket_geterror(fd), 0);
+	else
+		bufferevent_connect_race_won(a);
+done:
+	bufferevent_decref_and_unlock_(bev);
+}
+
+static void
+bufferevent_connect_race_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bufferevent_connect_race *race = arg;
+	struct bufferevent *bev = race->bev;
+
+	bufferevent_incref_and_lock_(bev);
+	bufferevent_connect_race_start_next(race);
+	bufferevent_decref_and_unlock_(bev);
+}
+
+/* Start the next attempt that gets as far as connect(), and arrange for
+ * the one after it.  May end the race, and free it, if nothing is left. */
+static void
+bufferevent_connect_race_start_next(struct bufferevent_connect_race *race)
+{
+	struct bufferevent *bev = race->bev;
+	struct timeval delay = { 0, CONNECT_ATTEMPT_DELAY_MSEC * 1000 };
+
+	while (race->next < race->n_attempts) {
+		struct bufferevent_connect_attempt *a =
+		    &race->attempts[race->next++];
+		evutil_socket_t fd;
+		int r;
+
+		fd = evutil_socket_(a->ai->ai_family,
+		    SOCK_STREAM|EVUTIL_SOCK_NONBLOCK, 0);
+		if (fd < 0) {
+			race->last_error = EVUTIL_SOCKET_ERROR();
+			race->timed_out = 0;
+			continue;
+		}
+		r = evutil_socket_connect_(&fd, a->ai->ai_addr,
+		    (int)a->ai->ai_addrlen);
+		if (r < 0 || r == 2) {
+			race->last_error = evutil_socket_geterror(fd);
+			race->timed_out = 0;
+			evutil_closesocket(fd);
+			continue;
+		}
+
+		a->fd = fd;
+		event_assign(&a->ev, bev->ev_base, fd, EV_WRITE|EV_PERSIST,
+		    bufferevent_connect_attempt_cb, a);
+		if (event_add(&a->ev, evutil_timerisset(&bev->timeout_write) ?
+			&bev->timeout_write : NULL) < 0) {
+			race->last_error = EVUTIL_SOCKET_ERROR();
+			race->timed_out = 0;
+			evutil_closesocket(fd);
+			a->fd = -1;
+			continue;
+		}
+		++race->n_pending;
+		/* connect() can succeed at once; let the callback see it. */
+		if (r == 1)
+			event_active(&a->ev, EV_WRITE, 1);
+		if (race->next < race->n_attempts)
+			event_add(&race->timer, &delay);
+		return;
+	}
+
+	if (!race->n_pending)
+		bufferevent_connect_race_lost(race);
+}
+
+/* Begin racing connections to the addresses in 'ai', which we now own.
+ * Following RFC 8305, we alternate between address families, starting
+ * with the family of the resolver's first answer. */
+static int
+bufferevent_connect_race_begin(struct bufferevent *bev,
+    struct evutil_addrinfo *ai)
+{
+	struct bufferevent_private *bev_p =
+	    EVUTIL_UPCAST(bev, struct bufferevent_private, bev);
+	struct bufferevent_connect_race *race;
+	struct evutil_addrinfo *cur, *first[2], *pos[2];
+	int n = 0, i, fam;
+
+	for (cur = ai; cur; cur = cur->ai_next)
+		++n;
+	race = mm_calloc(1, sizeof(*race));
+	if (!race)
+		return -1;
+	race->attempts = mm_calloc(n, sizeof(*race->attempts));
+	if (!race->attempts) {
+		mm_free(race);
+		return -1;
+	}
+	race->bev = bev;
+	race->ai = ai;
+	race->n_attempts = n;
+	evtimer_assign(&race->timer, bev->ev_base,
+	    bufferevent_connect_race_timer_cb, race);
+
+	/* first[0] walks the addresses in the first answer's family, and
+	 * first[1] walks all the others. */
+	first[0] = first[1] = NULL;
+	for (cur = ai; cur; cur = cur->ai_next) {
+		fam = cur->ai_family != ai->ai_family;
+		if (!first[fam])
+			first[fam] = cur;
+	}
+	pos[0] = first[0];
+	pos[1] = first[1];
+	fam = 0;
+	for (i = 0; i < n; ++i) {
+		if (!pos[fam])
+			fam = !fam;
+		race->attempts[i].race = race;
+		race->attempts[i].ai = pos[fam];
+		race->attempts[i].fd = -1;
+		/* Step to the next address in the same family. */
+		for (cur = pos[fam]->ai_next; cur; cur = cur->ai_next) {
+			if ((cur->ai_family != ai->ai_family) == fam)
+				break;
+		}
+		pos[fam] = cur;
+		fam = !fam;
+	}
+
+	/* The race keeps the bufferevent alive until it is won, lost or
+	 * cancelled, since its events point at it. */
+	bufferevent_incref_(bev);
+	bufferevent_connect_race_cancel(bev_p);
+	bev_p->connect_race = race;
+	bufferevent_connect_race_start_next(race);
+	return 0;
+}
+
 static void
 bufferevent_connect_getaddrinfo_cb(int result, struct evutil_addrinfo *ai,
     void *arg)
@@ -534,11 +890,20 @@ bufferevent_connect_getaddrinfo_cb(int result, struct evutil_addrinfo *ai,
 	int r;
 	BEV_LOCK(bev);
 
+	bev_p->dns_request = NULL;
+
+	/* With more than one address, and no socket of the user's own to
+	 * connect, race them.  We stay suspended until the race is over. */
+	if (result == 0 && ai->ai_next && bufferevent_getfd(bev) < 0 &&
+	    !BEV_IS_ASYNC(bev) &&
+	    bufferevent_connect_race_begin(bev, ai) == 0) {
+		bufferevent_decref_and_unlock_(bev);
+		return;
+	}
+
 	bufferevent_unsuspend_write_(bev, BEV_SUSPEND_LOOKUP);
 	bufferevent_unsuspend_read_(bev, BEV_SUSPEND_LOOKUP);
 
-	bev_p->dns_request = NULL;
-
 	if (result == EVUTIL_EAI_CANCEL) {
 		bev_p->dns_error = result;
 		bufferevent_decref_and_unlock_(bev);
@@ -553,7 +918,6 @@ bufferevent_connect_getaddrinfo_cb(int result, struct evutil_addrinfo *ai,
 		return;
 	}
 
-	/* XXX use the other addrinfos? */
 	/* XXX use this return value */
 	bufferevent_socket_set_conn_address(bev_p, ai->ai_addr, (int)ai->ai_addrlen);
 	r = bufferevent_socket_connect(bev, ai->ai_addr, (int)ai->ai_addrlen);
@@ -590,6 +954,8 @@ bufferevent_socket_connect_hostname(struct bufferevent *bev,
 
 	BEV_LOCK(bev);
 	bev_p->dns_error = 0;
+	/* A new lookup replaces any race that an earlier one started. */
+	bufferevent_connect_race_cancel(bev_p);
 
 	bufferevent_suspend_write_(bev, BEV_SUSPEND_LOOKUP);
 	bufferevent_suspend_read_(bev, BEV_SUSPEND_LOOKUP);
@@ -689,6 +1055,21 @@ be_socket_destruct(struct bufferevent *bufev)
 	evutil_getaddrinfo_cancel_async_(bufev_p->dns_request);
 }
 
+static void
+be_socket_unlink(struct bufferevent *bufev)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+	struct bufferevent_connect_race *race = bufev_p->connect_race;
+
+	/* A race holds a reference, so it should be over by now; but don't
+	 * leave its events armed on a bufferevent that is going away. */
+	if (race) {
+		bufev_p->connect_race = NULL;
+		bufferevent_connect_race_free(race);
+	}
+}
+
 static int
 be_socket_flush(struct bufferevent *bev, short iotype,
     enum bufferevent_flush_mode mode)
@@ -721,6 +1102,7 @@ be_socket_setfd(struct bufferevent *bufev, evutil_socket_t fd)
 		bufferevent_enable(bufev, bufev->enabled);
 
 	evutil_getaddrinfo_cancel_async_(bufev_p->dns_request);
+	bufferevent_connect_race_cancel(bufev_p);
 
 	BEV_UNLOCK(bufev);
 }
@@ -784,8 +1166,11 @@ be_socket_ctrl(struct bufferevent *bev, enum bufferevent_ctrl_op op,
 	case BEV_CTRL_GET_FD:
 		data->fd = event_get_fd(&bev->ev_read);
 		return 0;
-	case BEV_CTRL_GET_UNDERLYING:
 	case BEV_CTRL_CANCEL_ALL:
+		bufferevent_connect_race_cancel(
+			EVUTIL_UPCAST(bev, struct bufferevent_private, bev));
+		return 0;
+	case BEV_CTRL_GET_UNDERLYING:
 	default:
 		return -1;
 	}
@@ -83,6 +83,7 @@ struct evbuffer_cb_entry {
 
 struct bufferevent;
 struct evbuffer_chain;
+struct evbuffer_chain_index;
 // Libevent将网络 IO 的缓冲数据都存放到evbuffer中,
 // 它不提供调度 IO 或者当 IO 就绪时触发 IO 的 功能:这是 bufferevent 的工作
 // 实现了为向后面添加数据和从前面移除数据而优化的字节队列。
@@ -178,6 +179,46 @@ struct evbuffer {
 	 * NULL if the evbuffer stands alone. */
     // 这个 evbuffer 所属的父 bufferevent 对象。如果 evbuffer 独立，则为 NULL
 	struct bufferevent *parent;
+
+	/** Offset index over our chains, if EVBUFFER_FLAG_CHAIN_INDEX is
+	 * set and we have needed it yet. */
+	struct evbuffer_chain_index *chain_index;
+
+	/** The per-base memory account this buffer is charged to, if any. */
+	struct evbuffer_mem_account *mem_account;
+	/** True iff this buffer is charged to the global memory account. */
+	unsigned mem_global : 1;
+	/** The number of bytes we have charged to our memory accounts. */
+	size_t mem_accounted;
+
+	/** If EVBUFFER_FLAG_RUNNING_CRC32C is set: the CRC32C of everything
+	 * appended so far (not yet inverted), and the length of the buffer
+	 * when we last brought it up to date. */
+	ev_uint32_t running_crc;
+	size_t running_crc_len;
+
+	/** Handoff state if evbuffer_enable_spsc() has been called on this
+	 * buffer. */
+	struct evbuffer_spsc *spsc;
+
+	/** Spill-to-disk state if evbuffer_set_spill() has been called on
+	 * this buffer. */
+	struct evbuffer_spill *spill;
+	/** Runs the spill from the event loop, if the buffer has one. */
+	struct event_callback spill_cb;
+	/** True iff spill_cb is scheduled. */
+	unsigned spill_pending : 1;
+
+	/** The most evbuffer_read() reads in one call. */
+	size_t max_read;
+
+	/** If evbuffer_defer_release() has been called: the base whose loop
+	 * frees the chains that a big drain unlinked, a batch at a time. */
+	struct event_base *release_base;
+	/** Drained chains that are still waiting to be freed. */
+	struct evbuffer_chain *release_first, *release_last;
+	/** Frees the next batch of release_first. */
+	struct event_callback release_cb;
 };
 
 #if EVENT__SIZEOF_OFF_T < EVENT__SIZEOF_SIZE_T
@@ -231,6 +272,11 @@ struct evbuffer_chain {
 #define EVBUFFER_DANGLING	0x0040
 	/** a chain that is a referenced copy of another chain */
 #define EVBUFFER_MULTICAST	0x0080
+	/** a chain whose buffer is mapped twice in a row, for a ring
+	 * buffer; its data may run past buffer_len into the second copy */
+#define EVBUFFER_RING	0x0100
+	/** a chain whose memory is a slot in the huge-page arena */
+#define EVBUFFER_ARENA_SLOT	0x0200
 
 	/** number of references to this chain */
 	int refcnt;
@@ -307,6 +353,9 @@ struct evbuffer_multicast_parent {
 };
 
 #define EVBUFFER_CHAIN_SIZE sizeof(struct evbuffer_chain)
+/** Size of the allocation for an EVBUFFER_MULTICAST chain. */
+#define EVBUFFER_MULTICAST_CHAIN_SIZE \
+	(EVBUFFER_CHAIN_SIZE + sizeof(struct evbuffer_multicast_parent))
 /** Return a pointer to extra data allocated along with an evbuffer. */
 // 返回chain + sizeof(evbuffer_chain) 的内存地址
 #define EVBUFFER_CHAIN_EXTRA(t, c) (t *)((struct evbuffer_chain *)(c) + 1)
@@ -377,6 +426,35 @@ int evbuffer_get_callbacks_(struct evbuffer *buffer,
     struct event_callback **cbs,
     int max_cbs);
 
+/** Release global evbuffer state (currently, the calling thread's chain
+ * cache).  Called from libevent_global_shutdown. */
+void evbuffer_free_globals_(void);
+
+/** Like evbuffer_write_atmost(), but keep writing until howmuch bytes (or
+ * the whole buffer, if howmuch is negative) are gone or fd would block.
+ * Every write that is known to be followed by another carries MSG_MORE,
+ * where we have it.  Return the number of bytes written, or the result of
+ * the first write if nothing was written. */
+int evbuffer_write_batch_(struct evbuffer *buffer, evutil_socket_t fd,
+    ev_ssize_t howmuch);
+
+/** Return true iff buf is a ring buffer with no room left. */
+int evbuffer_ring_full_(struct evbuffer *buf);
+
+/** Charge buf to the memory account of base, if base has one or global
+ * memory accounting is on. */
+void evbuffer_mem_attach_(struct evbuffer *buf, struct event_base *base);
+/** If the memory account of bev's base has suspended its reading, take it
+ * off the list and drop the reference the account holds on it, so that it
+ * can be freed.  Called from bufferevent_free. */
+void evbuffer_mem_bufferevent_free_(struct bufferevent *bev);
+/** Release the memory account of base, resuming any bufferevents that it
+ * has suspended.  Called from event_base_free. */
+void evbuffer_mem_base_free_(struct event_base *base);
+/** Detach the SPSC evbuffers that base delivers to, so that freeing them
+ * later doesn't touch base.  Called from event_base_free. */
+void evbuffer_spsc_base_free_(struct event_base *base);
+
 #ifdef __cplusplus
 }
 #endif
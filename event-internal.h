@@ -255,6 +255,9 @@ struct event_once {
 
 // libevent中基于Reactor模式的事件处理框架对应event_base，在event在完成创建后，
 // 需要向event_base注册事件，监控事件的当前状态，当事件状态为激活状(EV_ACTIVE)时，调用回调函数执行
+struct evbuffer_mem_account;
+struct evbuffer_spsc;
+
 struct event_base {
 	/** Function pointers and other data to describe this event_base's
 	 * backend. */
@@ -457,6 +460,13 @@ struct event_base {
     // 尚未触发的event_once列表
 	LIST_HEAD(once_event_list, event_once) once_events;
 
+	/** Memory accounting for the evbuffers of this base's bufferevents,
+	 * or NULL if it has never been turned on. */
+	struct evbuffer_mem_account *evbuffer_mem;
+
+	/** Evbuffers in single-producer/single-consumer mode that this base
+	 * delivers data to.  Protected by th_base_lock. */
+	LIST_HEAD(evbuffer_spsc_list, evbuffer_spsc) evbuffer_spscs;
 };
 
 // 表示要屏蔽的后台方法
@@ -562,6 +572,8 @@ int event_callback_finalize_many_(struct event_base *base, int n_cbs, struct eve
 
 void event_active_later_(struct event *ev, int res);
 void event_active_later_nolock_(struct event *ev, int res);
+int event_callback_activate_later_(struct event_base *base,
+    struct event_callback *evcb);
 int event_callback_activate_later_nolock_(struct event_base *base,
     struct event_callback *evcb);
 int event_callback_cancel_nolock_(struct event_base *base,
@@ -64,10 +64,13 @@
 #include "evthread-internal.h"
 #include "event2/thread.h"
 #include "event2/util.h"
+#include "event2/buffer.h"
+#include "event2/buffer_compat.h"
 #include "log-internal.h"
 #include "evmap-internal.h"
 #include "iocp-internal.h"
 #include "changelist-internal.h"
+#include "evbuffer-internal.h"
 #define HT_NO_CACHE_HASH_VALUES
 #include "ht-internal.h"
 #include "util-internal.h"
@@ -893,6 +896,11 @@ event_base_free_(struct event_base *base, int run_finalizers)
         event_debug_unassign(&base->th_notify);
     }
 
+    /* Resume anything our evbuffer memory account has suspended while the
+     * base can still finalize it. */
+    evbuffer_mem_base_free_(base);
+    evbuffer_spsc_base_free_(base);
+
     /* Delete all non-internal events. */
     evmap_delete_all_(base);
 
@@ -3382,6 +3390,17 @@ event_callback_activate_nolock_(struct event_base *base,
     return r;
 }
 
+int
+event_callback_activate_later_(struct event_base *base,
+                               struct event_callback *evcb)
+{
+    int r;
+    EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+    r = event_callback_activate_later_nolock_(base, evcb);
+    EVBASE_RELEASE_LOCK(base, th_base_lock);
+    return r;
+}
+
 int
 event_callback_activate_later_nolock_(struct event_base *base,
                                       struct event_callback *evcb)
@@ -4302,12 +4321,19 @@ event_free_evutil_globals(void)
     evutil_free_globals_();
 }
 
+static void
+event_free_evbuffer_globals(void)
+{
+    evbuffer_free_globals_();
+}
+
 static void
 event_free_globals(void)
 {
     event_free_debug_globals();
     event_free_evsig_globals();
     event_free_evutil_globals();
+    event_free_evbuffer_globals();
 }
 
 void
@@ -4326,6 +4352,8 @@ event_global_setup_locks_(const int enable_locks)
 #endif
     if (evsig_global_setup_locks_(enable_locks) < 0)
         return -1;
+    if (evbuffer_global_setup_locks_(enable_locks) < 0)
+        return -1;
     if (evutil_global_setup_locks_(enable_locks) < 0)
         return -1;
     if (evutil_secure_rng_global_setup_locks_(enable_locks) < 0)
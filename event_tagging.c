@@ -201,7 +201,9 @@ decode_tag_internal(ev_uint32_t *ptag, struct evbuffer *evbuf, int dodrain)
 {
 	ev_uint32_t number = 0;
 	size_t len = evbuffer_get_length(evbuf);
-	ev_uint8_t *data;
+	struct evbuffer_iter it;
+	ev_uint8_t scratch[sizeof(number) + 1];
+	const ev_uint8_t *data;
 	size_t count = 0;
 	int  shift = 0, done = 0;
 
@@ -209,8 +211,9 @@ decode_tag_internal(ev_uint32_t *ptag, struct evbuffer *evbuf, int dodrain)
 	 * the encoding of a number is at most one byte more than its
 	 * storage size.  however, it may also be much smaller.
 	 */
-	data = evbuffer_pullup(
-		evbuf, len < sizeof(number) + 1 ? len : sizeof(number) + 1);
+	evbuffer_iter_init(&it, evbuf, 0);
+	data = evbuffer_iter_peek(
+		&it, len < sizeof(number) + 1 ? len : sizeof(number) + 1, scratch);
 	if (!data)
 		return (-1);
 
@@ -317,15 +320,18 @@ evtag_marshal_timeval(struct evbuffer *evbuf, ev_uint32_t tag, struct timeval *t
 
 #define DECODE_INT_INTERNAL(number, maxnibbles, pnumber, evbuf, offset) \
 do {									\
-	ev_uint8_t *data;						\
+	struct evbuffer_iter it;					\
+	ev_uint8_t scratch[9];						\
+	const ev_uint8_t *data;						\
 	ev_ssize_t len = evbuffer_get_length(evbuf) - offset;		\
 	int nibbles = 0;						\
 									\
 	if (len <= 0)							\
 		return (-1);						\
 									\
-	/* XXX(niels): faster? */					\
-	data = evbuffer_pullup(evbuf, offset + 1) + offset;		\
+	/* Read the number in place unless it spans two chains. */	\
+	evbuffer_iter_init(&it, evbuf, offset);				\
+	data = evbuffer_iter_peek(&it, 1, scratch);			\
 	if (!data)							\
 		return (-1);						\
 									\
@@ -334,7 +340,7 @@ do {									\
 		return (-1);						\
 	len = (nibbles >> 1) + 1;					\
 									\
-	data = evbuffer_pullup(evbuf, offset + len) + offset;		\
+	data = evbuffer_iter_peek(&it, len, scratch);			\
 	if (!data)							\
 		return (-1);						\
 									\
@@ -451,7 +451,7 @@ evhttp_make_header_request(struct evhttp_connection *evcon,
 		method = "NULL";
 	}
 
-	evbuffer_add_printf(bufferevent_get_output(evcon->bufev),
+	evbuffer_add_fmt(bufferevent_get_output(evcon->bufev),
 	    "%s %s HTTP/%d.%d\r\n",
 	    method, req->uri, req->major, req->minor);
 
@@ -536,7 +536,7 @@ evhttp_make_header_response(struct evhttp_connection *evcon,
     struct evhttp_request *req)
 {
 	int is_keepalive = evhttp_is_connection_keepalive(req->input_headers);
-	evbuffer_add_printf(bufferevent_get_output(evcon->bufev),
+	evbuffer_add_fmt(bufferevent_get_output(evcon->bufev),
 	    "HTTP/%d.%d %d %s\r\n",
 	    req->major, req->minor, req->response_code,
 	    req->response_code_line);
@@ -626,7 +626,7 @@ evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
 	}
 
 	TAILQ_FOREACH(header, req->output_headers, next) {
-		evbuffer_add_printf(output, "%s: %s\r\n",
+		evbuffer_add_fmt(output, "%s: %s\r\n",
 		    header->key, header->value);
 	}
 	evbuffer_add(output, "\r\n", 2);
@@ -2929,7 +2929,7 @@ evhttp_send_reply_chunk_with_cb(struct evhttp_request *req, struct evbuffer *dat
 	if (!evhttp_response_needs_body(req))
 		return;
 	if (req->chunked) {
-		evbuffer_add_printf(output, "%x\r\n",
+		evbuffer_add_fmt(output, "%x\r\n",
 				    (unsigned)evbuffer_get_length(databuf));
 	}
 	evbuffer_add_buffer(output, databuf);
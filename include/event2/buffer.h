@@ -213,6 +213,47 @@ void evbuffer_unlock(struct evbuffer *buf);
  * output buffer.
  */
 #define EVBUFFER_FLAG_DRAINS_TO_FD 1
+/**
+ * If this flag is set, the evbuffer keeps an index of the offsets of its
+ * chains, so that evbuffer_ptr_set() and the functions that use it can find
+ * a position in O(log n) of the number of chains rather than walking
+ * the whole list.
+ *
+ * This is worth turning on for very large buffers that you search or peek
+ * into at arbitrary offsets.  The index is built lazily and costs a little
+ * memory and a little work on each drain; operations that rearrange the
+ * chains throw it away to be rebuilt on the next lookup.
+ */
+#define EVBUFFER_FLAG_CHAIN_INDEX 2
+/**
+ * This flag is set on evbuffers that evbuffer_set_ring() has turned into
+ * fixed-capacity ring buffers.  It can't be set or cleared with
+ * evbuffer_set_flags() or evbuffer_clear_flags().
+ */
+#define EVBUFFER_FLAG_RING 4
+/**
+ * If this flag is set, the evbuffer keeps a running CRC32C of all the data
+ * appended to it from the time the flag was set, whether or not that data
+ * has since been drained.  Data added with evbuffer_prepend() or
+ * evbuffer_prepend_buffer() is not included.  Read it with
+ * evbuffer_get_running_crc32c().
+ *
+ * File segments added to such a buffer are always read into memory, even
+ * if the buffer drains to a fd.  If sendfile() data from some other buffer
+ * is moved in with evbuffer_add_buffer(), the CRC can't cover it: the flag
+ * is cleared, and evbuffer_get_running_crc32c() keeps returning the CRC of
+ * the data that came before.
+ */
+#define EVBUFFER_FLAG_RUNNING_CRC32C 8
+/**
+ * If this flag is set, small chains for the evbuffer are carved out of a
+ * process-wide arena of 2MB huge-page regions instead of coming from
+ * malloc.  Chains too large for an arena slot, and allocations made when
+ * the arena can't be grown, still use malloc.
+ *
+ * @see evbuffer_arena_get_stats(), EVENT_BASE_FLAG_EVBUFFER_ARENA
+ */
+#define EVBUFFER_FLAG_ARENA 16
 
 /** Change the flags that are set for an evbuffer by adding more.
  *
@@ -233,6 +274,34 @@ int evbuffer_set_flags(struct evbuffer *buf, ev_uint64_t flags);
 EVENT2_EXPORT_SYMBOL
 int evbuffer_clear_flags(struct evbuffer *buf, ev_uint64_t flags);
 
+/**
+  Turn an empty evbuffer into a fixed-capacity ring buffer.
+
+  The buffer's storage becomes a single region of 'capacity' bytes (rounded
+  up to a whole number of pages) that is mapped twice, back to back, so
+  that the data in the buffer is always contiguous no matter where it
+  wraps.  evbuffer_pullup() never copies, evbuffer_read() reads straight
+  into the ring, and no memory is allocated as data comes and goes.
+
+  The buffer never grows: evbuffer_add() and friends fail if the data
+  doesn't fit, evbuffer_read() fails with EAGAIN if the ring is full, and
+  evbuffer_remove_buffer() into a ring moves only as much as fits.  Data
+  moved into or out of a ring with evbuffer_add_buffer() and its relatives
+  is copied.  References, file segments and evbuffer_add_buffer_reference()
+  are not supported.  A socket bufferevent whose input buffer is a ring
+  stops reading while the ring is full, as if it had reached a read
+  high-water mark, and starts again once the ring has been drained.
+
+  Ring buffers need memfd_create() and mmap(); on other platforms this
+  function always fails.
+
+  @param buf the evbuffer to convert; it must be empty
+  @param capacity the number of bytes the ring should hold
+  @return 0 on success, -1 on failure.
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_set_ring(struct evbuffer *buf, size_t capacity);
+
 /**
   Returns the total number of bytes stored in the evbuffer
 
@@ -484,6 +553,86 @@ EVENT2_EXPORT_SYMBOL
 int evbuffer_add_buffer_reference(struct evbuffer *outbuf,
                                   struct evbuffer *inbuf);
 
+/**
+  Copy the data in one evbuffer into many evbuffers, without copying it.
+
+  This is evbuffer_add_buffer_reference() for fanning one payload out to
+  many destinations, as a publish/subscribe server does.  The data in inbuf
+  is gathered into a single shared, refcounted chain (copying it once if it
+  was split across several), and each output buffer gets one small chain
+  that refers to it.  inbuf is not changed, so it can be broadcast again
+  later at the same cost; once you have drained or freed it, the payload's
+  memory is released when the last output buffer lets go of it.
+
+  Output buffers that are frozen at the end, or that are ring buffers, are
+  skipped.  As with evbuffer_add_buffer_reference(), inbuf must not contain
+  file segments or references to other buffers.
+
+  @param outbufs the output buffers
+  @param n_outbufs the number of output buffers
+  @param inbuf the input buffer
+  @return the number of output buffers the data was added to, or -1 if
+    an error occurred
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_add_buffer_broadcast(struct evbuffer **outbufs, int n_outbufs,
+                                  struct evbuffer *inbuf);
+
+struct event_base;
+/**
+  Let one other thread add data to an evbuffer without taking its lock.
+
+  After this call, a single producer thread may call evbuffer_spsc_add()
+  and evbuffer_spsc_add_buffer() on buf while the thread running base (the
+  consumer) uses buf as usual, for example as the output buffer of a
+  bufferevent.  The producer hands over whole chains with atomic pointer
+  updates alone.  The data shows up in buf, and buf's callbacks run, from
+  base's event loop; however much the producer adds in the meantime, the
+  consumer is woken up only once until it has taken that data.
+
+  base must have locking enabled so that it can be woken from another
+  thread.  Call this before the producer starts, and stop the producer
+  before freeing buf or base.  buf and base may be freed in either order:
+  if base goes first, whatever the producer added that base hasn't
+  delivered yet is freed along with buf.  Don't free one of them in one
+  thread while freeing the other in another.
+
+  @param buf the evbuffer to hand data to
+  @param base the event_base whose loop delivers the data into buf
+  @return 0 on success, or -1 if buf is a ring buffer, already has a
+    producer, or this platform lacks the atomic operations needed
+  @see evbuffer_spsc_add(), evbuffer_spsc_add_buffer()
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_enable_spsc(struct evbuffer *buf, struct event_base *base);
+
+/**
+  From the producer thread, append a copy of some data to an evbuffer that
+  has had evbuffer_enable_spsc() called on it.
+
+  @param buf the evbuffer to add to
+  @param data the data to copy
+  @param datlen the length of the data
+  @return 0 on success, or -1 on failure
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_spsc_add(struct evbuffer *buf, const void *data, size_t datlen);
+
+/**
+  From the producer thread, move all the data from src to the end of an
+  evbuffer that has had evbuffer_enable_spsc() called on it, without
+  copying it.
+
+  src belongs to the producer; it is locked while its chains are taken, but
+  buf is not.
+
+  @param buf the evbuffer to add to
+  @param src the buffer to move data from
+  @return 0 on success, or -1 on failure
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_spsc_add_buffer(struct evbuffer *buf, struct evbuffer *src);
+
 /**
    A cleanup function for a piece of memory added to an evbuffer by
    reference.
@@ -660,6 +809,39 @@ EVENT2_EXPORT_SYMBOL
 int evbuffer_add_file_segment(struct evbuffer *buf,
                               struct evbuffer_file_segment *seg, ev_off_t offset, ev_off_t length);
 
+/**
+   Keep only the first part of an evbuffer in memory, and spill the rest to
+   disk.
+
+   Once an evbuffer has more than threshold bytes, data added past that
+   point is written, in batches, to an unlinked temporary file, and its
+   memory is freed.  The spilled data stays in the buffer as file segments:
+   if the buffer has EVBUFFER_FLAG_DRAINS_TO_FD set, as a bufferevent's
+   output buffer does, it is sent with sendfile() where available;
+   otherwise it is mapped back in when read.  Data added by reference, file
+   segments, and chains that are pinned or shared with other buffers stay
+   where they are.
+
+   If the buffer belongs to a bufferevent, or evbuffer_defer_callbacks()
+   has been called on it, the writing to disk is done from the event loop,
+   so adding data never waits on the disk; otherwise it is done as data is
+   added.  Spilled data doesn't count against the evbuffer memory limits.
+
+   Disk space is given back as the spilled data is drained, where the
+   filesystem supports it, and in any case once the buffer and everything
+   that took data from it are freed.
+
+   @param buf the evbuffer to configure
+   @param threshold how many bytes to keep in memory, or 0 to stop spilling
+   @param dir the directory to create the temporary file in, or NULL to use
+     $TMPDIR or /tmp
+   @return 0 on success, or -1 if buf is a ring buffer, or this platform
+     can't spill to disk
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_set_spill(struct evbuffer *buf, size_t threshold,
+                       const char *dir);
+
 /**
   Append a formatted string to the end of an evbuffer.
 
@@ -694,6 +876,62 @@ __attribute__((format(printf, 2, 0)))
 #endif
 ;
 
+/**
+  Append a formatted string to the end of an evbuffer, without going
+  through printf(3) for the common conversions.
+
+  The format is checked by the compiler as for evbuffer_add_printf().  The
+  conversions %s, %c, %d, %i, %u, %x, %X and %%, optionally with an l, ll
+  or z length modifier, are formatted directly into the buffer.  A format
+  that uses anything else (flags, widths, precisions, floating point...)
+  is handed to evbuffer_add_vprintf() instead, so the result is always the
+  same as evbuffer_add_printf() would give.
+
+  @param buf the evbuffer that will be appended to
+  @param fmt a format string
+  @param ... arguments for the format string
+  @return The number of bytes added if successful, or -1 if an error occurred.
+
+  @see evbuffer_add_printf()
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_add_fmt(struct evbuffer *buf, const char *fmt, ...)
+#ifdef __GNUC__
+__attribute__((format(printf, 2, 3)))
+#endif
+;
+
+/**
+  Append the decimal representation of an unsigned integer to an evbuffer.
+
+  @param buf the evbuffer that will be appended to
+  @param value the number to append
+  @return The number of bytes added if successful, or -1 if an error occurred.
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_add_u64(struct evbuffer *buf, ev_uint64_t value);
+
+/**
+  Append the decimal representation of a signed integer to an evbuffer.
+
+  @param buf the evbuffer that will be appended to
+  @param value the number to append
+  @return The number of bytes added if successful, or -1 if an error occurred.
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_add_i64(struct evbuffer *buf, ev_int64_t value);
+
+/**
+  Append the lowercase hexadecimal representation of an integer to an
+  evbuffer, with no "0x" prefix.
+
+  @param buf the evbuffer that will be appended to
+  @param value the number to append
+  @return The number of bytes added if successful, or -1 if an error occurred.
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_add_hex(struct evbuffer *buf, ev_uint64_t value);
+
 
 /**
   Remove a specified number of bytes data from the beginning of an evbuffer.
@@ -747,6 +985,31 @@ int evbuffer_write_atmost(struct evbuffer *buffer, evutil_socket_t fd,
 EVENT2_EXPORT_SYMBOL
 int evbuffer_read(struct evbuffer *buffer, evutil_socket_t fd, int howmuch);
 
+/**
+  Set the most data that evbuffer_read() reads from a file descriptor in
+  one call.
+
+  The default is 4096 bytes.  Raising it lets a single readv() drain a
+  large socket receive queue at once: reads bigger than a few chains are
+  spread over as many recycled chains as it takes, up to IOV_MAX of them,
+  and any of that space the read doesn't fill is given back afterwards.
+
+  @param buf the evbuffer to configure
+  @param max the largest read to make, or 0 to restore the default
+  @return 0 on success, or -1 if max is larger than INT_MAX
+  @see evbuffer_get_max_read(), bufferevent_set_max_single_read()
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_set_max_read(struct evbuffer *buf, size_t max);
+
+/**
+  Return the most data that evbuffer_read() reads in one call.
+
+  @see evbuffer_set_max_read()
+ */
+EVENT2_EXPORT_SYMBOL
+size_t evbuffer_get_max_read(struct evbuffer *buf);
+
 /**
    Search for a string within an evbuffer.
 
@@ -870,6 +1133,194 @@ int evbuffer_peek(struct evbuffer *buffer, ev_ssize_t len,
                   struct evbuffer_ptr *start_at,
                   struct evbuffer_iovec *vec_out, int n_vec);
 
+/**
+    An iterator for parsing the contents of an evbuffer in place.
+
+    Protocol decoders can use an iterator to read fields out of an evbuffer
+    without calling evbuffer_pullup() first: fields that lie inside one
+    chain are read where they are, and only fields that span two or more
+    chains are copied.  Like an evbuffer_ptr, an iterator is invalidated by
+    any call that removes data from the buffer or re-packs it.
+
+    @see evbuffer_iter_init()
+ */
+struct evbuffer_iter {
+    /* Do not alter or rely on the values of fields: they are for internal
+     * use */
+    struct evbuffer *buffer;
+    struct evbuffer_ptr ptr;
+};
+
+/**
+   Set up an iterator at a given offset into an evbuffer.
+
+   @param it the iterator to initialize
+   @param buf the evbuffer to iterate over
+   @param offset the offset of the first byte to read
+   @return 0 on success, or -1 if offset is past the end of the buffer.
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_iter_init(struct evbuffer_iter *it, struct evbuffer *buf,
+    size_t offset);
+
+/**
+   Return the number of bytes between an iterator and the end of its buffer.
+ */
+EVENT2_EXPORT_SYMBOL
+size_t evbuffer_iter_remaining(const struct evbuffer_iter *it);
+
+/**
+   Return a pointer to the next len bytes of an evbuffer, without advancing
+   the iterator.
+
+   If the bytes are all in one chain, the result points into the buffer and
+   stays valid until the buffer is next modified.  Otherwise they are copied
+   into scratch, which must have room for len bytes, and scratch is
+   returned.
+
+   @param it the iterator
+   @param len the number of bytes to look at
+   @param scratch space to copy the bytes to if they span chains, or NULL
+     to fail in that case
+   @return a pointer to len contiguous bytes, or NULL if fewer than len
+     bytes remain, if len is 0, or if the bytes span chains and scratch is
+     NULL.
+ */
+EVENT2_EXPORT_SYMBOL
+const unsigned char *evbuffer_iter_peek(struct evbuffer_iter *it,
+    size_t len, void *scratch);
+
+/**
+   Move an iterator forward.
+
+   @return 0 on success, or -1 if fewer than len bytes remain, in which
+     case the iterator does not move.
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_iter_advance(struct evbuffer_iter *it, size_t len);
+
+/**
+   Copy the next len bytes of an evbuffer into data_out, and move the
+   iterator past them.
+
+   @return 0 on success, or -1 if fewer than len bytes remain.
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_iter_read(struct evbuffer_iter *it, void *data_out, size_t len);
+
+/**
+   Read a little-endian integer of 2, 4 or 8 bytes and move the iterator
+   past it.
+
+   @return 0 on success, or -1 if not enough bytes remain, in which case
+     the iterator does not move.
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_iter_read_le16(struct evbuffer_iter *it, ev_uint16_t *out);
+/** @see evbuffer_iter_read_le16() */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_iter_read_le32(struct evbuffer_iter *it, ev_uint32_t *out);
+/** @see evbuffer_iter_read_le16() */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_iter_read_le64(struct evbuffer_iter *it, ev_uint64_t *out);
+
+/**
+   Read an unsigned LEB128 varint (seven bits per byte, least significant
+   group first, high bit set on all but the last byte) and move the
+   iterator past it.
+
+   @return 0 on success, or -1 if the varint is incomplete or does not fit
+     in 64 bits, in which case the iterator does not move.
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_iter_read_varint(struct evbuffer_iter *it, ev_uint64_t *out);
+
+/**
+   Check whether the bytes at an iterator start with a given prefix,
+   comparing across chain boundaries without copying.
+
+   @return 1 if the next len bytes equal prefix, or 0 otherwise (including
+     when fewer than len bytes remain).
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_iter_match(const struct evbuffer_iter *it, const void *prefix,
+    size_t len);
+
+/**
+   Compute the CRC32C (Castagnoli) checksum of a range of an evbuffer,
+   chain by chain, without copying it.
+
+   Uses the SSE4.2 crc32 instruction when the CPU has it.
+
+   @param buf the evbuffer to checksum
+   @param start where the range starts, or NULL for the front of the buffer
+   @param len the length of the range, or -1 for everything up to the end
+   @param crc on input, the checksum to continue from (0 to start a new
+     one); on output, the checksum including the range
+   @return 0 on success, or -1 if the range runs past the end of the buffer
+     or includes file data that the buffer will send with sendfile()
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_crc32c(struct evbuffer *buf, const struct evbuffer_ptr *start,
+    ev_ssize_t len, ev_uint32_t *crc);
+
+/**
+   Compute a 64-bit FNV-1a hash of a range of an evbuffer, chain by chain,
+   without copying it.  This is not a cryptographic hash.
+
+   @param buf the evbuffer to hash
+   @param start where the range starts, or NULL for the front of the buffer
+   @param len the length of the range, or -1 for everything up to the end
+   @param hash set to the hash of the range
+   @return 0 on success, or -1 if the range runs past the end of the buffer
+     or includes file data that the buffer will send with sendfile()
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_hash64(struct evbuffer *buf, const struct evbuffer_ptr *start,
+    ev_ssize_t len, ev_uint64_t *hash);
+
+/**
+   Return the running CRC32C of an evbuffer that has
+   EVBUFFER_FLAG_RUNNING_CRC32C set.
+
+   @see EVBUFFER_FLAG_RUNNING_CRC32C
+ */
+EVENT2_EXPORT_SYMBOL
+ev_uint32_t evbuffer_get_running_crc32c(struct evbuffer *buf);
+
+/**
+   Usage statistics for the huge-page chain arena shared by every evbuffer
+   with EVBUFFER_FLAG_ARENA set.
+
+   @see evbuffer_arena_get_stats()
+ */
+struct evbuffer_arena_stats {
+    /** Size of each region mapped from the system */
+    size_t region_size;
+    /** Size of each chain slot within a region */
+    size_t slot_size;
+    /** Number of regions mapped so far */
+    size_t n_regions;
+    /** How many of those regions are backed by MAP_HUGETLB pages; the
+        rest rely on transparent huge pages */
+    size_t n_hugetlb_regions;
+    /** Total number of chain slots in all regions */
+    size_t n_slots;
+    /** Number of slots currently holding a chain */
+    size_t n_slots_used;
+};
+
+/**
+   Report how much of the huge-page chain arena is in use.  Regions, once
+   mapped, are kept for the life of the process.
+
+   @param stats set to the current arena statistics
+   @return 0 on success, or -1 if this platform has no arena, in which case
+     EVBUFFER_FLAG_ARENA has no effect
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_arena_get_stats(struct evbuffer_arena_stats *stats);
+
 
 /** Structure passed to an evbuffer_cb_func evbuffer callback
 
@@ -1076,6 +1527,24 @@ struct event_base;
 EVENT2_EXPORT_SYMBOL
 int evbuffer_defer_callbacks(struct evbuffer *buffer, struct event_base *base);
 
+/**
+   Free the chains of large drains from inside the event loop, a bounded
+   batch at a time, instead of all at once inside evbuffer_drain().
+
+   Once this is set, a drain (or remove) of a megabyte or more just
+   unlinks the drained chains; base's loop then frees them at the lowest
+   priority, a few dozen per loop iteration, so that emptying a huge
+   buffer never stalls the loop.  Any cleanup functions of drained
+   reference chains run at that point too.  Every bufferevent does this
+   for its input and output buffers.
+
+   @param buffer the evbuffer to change
+   @param base the event_base whose loop frees the drained chains
+   @return 0 on success, or -1 if buffer already uses another base
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_defer_release(struct evbuffer *buffer, struct event_base *base);
+
 /**
   Append data from 1 or more iovec's to an evbuffer
 
@@ -1092,6 +1561,150 @@ int evbuffer_defer_callbacks(struct evbuffer *buffer, struct event_base *base);
 EVENT2_EXPORT_SYMBOL
 size_t evbuffer_add_iovec(struct evbuffer * buffer, struct evbuffer_iovec * vec, int n_vec);
 
+/**
+  Coalesce runs of small adjacent chains in an evbuffer into larger chains.
+
+  Buffers built from many small evbuffer_add() or evbuffer_add_buffer()
+  calls can end up as hundreds of tiny chains, which makes writing them
+  out take many system calls and makes evbuffer_ptr_set() and
+  evbuffer_peek() slow.  This function copies the contents of runs of
+  small chains into single larger chains.  Pinned chains and chains sent
+  with sendfile are left alone.  The contents of the buffer do not change,
+  but any evbuffer_ptr into it is invalidated.
+
+  evbuffer_write() and evbuffer_write_atmost() do this automatically for
+  the data they are about to write when it is spread across more small
+  chains than they can write in one call.
+
+  @param buf the evbuffer to compact
+  @return the number of chains removed, or -1 on error.
+*/
+EVENT2_EXPORT_SYMBOL
+int evbuffer_compact(struct evbuffer *buf);
+
+/**
+  Set the maximum number of bytes of chain memory that each thread may keep
+  cached for reuse.
+
+  When the cache is enabled, freed evbuffer chains of the common sizes (the
+  power-of-two sizes from the minimum chain allocation up to 64 times that
+  size) are not returned to the allocator.  Instead, they are kept on a
+  per-thread freelist and handed back out by the next evbuffer operation
+  in the same thread that needs a chain of the same size.  This removes
+  malloc() and free() from steady-state read/write loops.
+
+  The cache is disabled (limit 0) by default.  Lowering the limit does not
+  release memory that is already cached; use evbuffer_chain_cache_trim()
+  for that.  A thread that exits while holding cached chains leaks them, so
+  long-lived worker threads that use evbuffers should call
+  evbuffer_chain_cache_trim(0) before they exit.
+
+  @param max_bytes the largest amount of chain memory each thread may keep
+     cached, or 0 to disable caching.
+  @return 0 on success, or -1 if per-thread caching is not supported on
+     this platform.
+*/
+EVENT2_EXPORT_SYMBOL
+int evbuffer_chain_cache_set_limit(size_t max_bytes);
+
+/**
+  Release chains from the calling thread's chain cache.
+
+  @param keep_bytes the amount of cached memory to keep; chains are freed
+     until no more than this many bytes remain in the cache.
+  @return the number of bytes that were returned to the allocator.
+  @see evbuffer_chain_cache_set_limit()
+*/
+EVENT2_EXPORT_SYMBOL
+size_t evbuffer_chain_cache_trim(size_t keep_bytes);
+
+/** Memory level for evbuffer_mem_cb: usage is back below the limits. */
+#define EVBUFFER_MEM_NORMAL 0
+/** Memory level for evbuffer_mem_cb: usage has reached the soft limit. */
+#define EVBUFFER_MEM_SOFT 1
+/** Memory level for evbuffer_mem_cb: usage has reached the hard limit. */
+#define EVBUFFER_MEM_HARD 2
+
+/**
+  Type definition for a callback that is invoked when evbuffer memory usage
+  moves from one level to another.
+
+  @param base the event_base whose usage changed, or NULL for the global
+     usage.
+  @param bytes the number of bytes in use when the level changed.
+  @param level the new level: EVBUFFER_MEM_NORMAL, EVBUFFER_MEM_SOFT, or
+     EVBUFFER_MEM_HARD.
+  @param arg the argument passed when the limits were set.
+  @see event_base_set_evbuffer_mem_limits(), evbuffer_set_global_mem_limits()
+*/
+typedef void (*evbuffer_mem_cb)(struct event_base *base, size_t bytes,
+    int level, void *arg);
+
+/**
+  Account for the memory used by the evbuffers of all bufferevents on an
+  event_base, and apply backpressure when it grows too large.
+
+  Usage is the total number of bytes of data held in the input and output
+  buffers of the bufferevents created on this base after accounting was
+  turned on, either by this function or by evbuffer_set_global_mem_limits().
+
+  When usage reaches hard_limit, every bufferevent whose input buffer
+  grows stops reading until usage falls below soft_limit again (or below
+  hard_limit if there is no soft limit).  The callback, if any, is invoked
+  from the event loop each time usage moves between the normal, soft and
+  hard levels.
+
+  @param base the event_base to account for
+  @param soft_limit the soft limit in bytes, or 0 for none
+  @param hard_limit the hard limit in bytes, or 0 for none
+  @param cb a callback to invoke on level changes, or NULL
+  @param arg an argument for the callback
+  @return 0 on success, or -1 if soft_limit is above hard_limit or on
+     allocation failure.
+*/
+EVENT2_EXPORT_SYMBOL
+int event_base_set_evbuffer_mem_limits(struct event_base *base,
+    size_t soft_limit, size_t hard_limit, evbuffer_mem_cb cb, void *arg);
+
+/**
+  Return the number of bytes accounted to an event_base's bufferevents.
+
+  @see event_base_set_evbuffer_mem_limits()
+*/
+EVENT2_EXPORT_SYMBOL
+size_t event_base_get_evbuffer_mem(struct event_base *base);
+
+/**
+  Account for the memory used by all evbuffers in the process.
+
+  Once this has been called, every evbuffer created afterwards counts
+  towards a process-wide usage total.  When the total reaches hard_limit,
+  bufferevents stop reading just as with
+  event_base_set_evbuffer_mem_limits(), until the total falls back below
+  soft_limit.
+
+  The callback is invoked as soon as the level changes, in whatever
+  thread made the change and while that thread holds the lock on the
+  evbuffer it was modifying, so it must not block or modify evbuffers.
+
+  @param soft_limit the soft limit in bytes, or 0 for none
+  @param hard_limit the hard limit in bytes, or 0 for none
+  @param cb a callback to invoke on level changes, or NULL
+  @param arg an argument for the callback
+  @return 0 on success, or -1 if soft_limit is above hard_limit.
+*/
+EVENT2_EXPORT_SYMBOL
+int evbuffer_set_global_mem_limits(size_t soft_limit, size_t hard_limit,
+    evbuffer_mem_cb cb, void *arg);
+
+/**
+  Return the number of bytes accounted to all evbuffers in the process.
+
+  @see evbuffer_set_global_mem_limits()
+*/
+EVENT2_EXPORT_SYMBOL
+size_t evbuffer_get_global_mem(void);
+
 #ifdef __cplusplus
 }
 #endif
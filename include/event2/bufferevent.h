@@ -204,7 +204,15 @@ enum bufferevent_options {
 	* BEV_OPT_DEFER_CALLBACKS also be set; a future version of Libevent
 	* might remove the requirement.*/
     // 在执行回调的时候不进行锁定
-	BEV_OPT_UNLOCK_CALLBACKS = (1<<3)
+	BEV_OPT_UNLOCK_CALLBACKS = (1<<3),
+
+	/** If set, a socket bufferevent doesn't start writing as soon as data
+	 * is added to its output, but once at the end of the current
+	 * iteration of the event loop, so that everything added during that
+	 * iteration goes out in a single writev().  When that takes more than
+	 * one write, every write but the last is sent with MSG_MORE, where
+	 * available.  Other kinds of bufferevent ignore this flag. */
+	BEV_OPT_COALESCE_WRITES = (1<<4)
 };
 
 /**
@@ -268,6 +276,14 @@ struct evdns_base;
        ::1		(ipv6address)
        [::1]		([ipv6address])
 
+   If the name resolves to more than one address, and the bufferevent does
+   not already have a socket, the addresses are tried in parallel as in
+   RFC 8305 ("Happy Eyeballs"): a new attempt starts every 250 msec, or as
+   soon as the previous one fails, alternating between IPv6 and IPv4, and
+   the first socket to connect becomes the bufferevent's.  The others are
+   closed.  The write timeout, if any, applies to each attempt.  If every
+   attempt fails, the event callback gets the error from the last one.
+
    Performance note: If you do not provide an evdns_base, this function
    may block while it waits for a DNS response.	 This is probably not
    what you want.
@@ -895,8 +911,62 @@ int bufferevent_rate_limit_group_set_min_share(
 	struct bufferevent_rate_limit_group *, size_t);
 
 /**
-   Free a rate-limiting group.  The group must have no members when
-   this function is called.
+   Nest a rate-limiting group inside another one.
+
+   Every byte that a member of the group reads or writes is then drawn
+   from the parent's buckets too, and from its parent's, and so on up;
+   so, for example, per-connection limits can sit inside per-tenant groups
+   that sit inside one group for the whole network interface.  Each group
+   shares its bucket among all the bufferevents below it.  When a group
+   runs dry, the bufferevents below it notice on their next read or
+   write and wait in line; when it refills, it wakes them in turn.
+
+   The group must not have any bufferevents in it, or in any group below
+   it, when it is moved.
+
+   @param group the group to move
+   @param parent the group to put it in, or NULL to make it a top-level
+     group again
+   @return 0 on success, or -1 if the group is not empty or sharded, or
+     if parent is sharded, the group itself or a group below it.
+*/
+EVENT2_EXPORT_SYMBOL
+int bufferevent_rate_limit_group_set_parent(
+	struct bufferevent_rate_limit_group *group,
+	struct bufferevent_rate_limit_group *parent);
+
+/**
+   Let every event_base whose bufferevents are in a rate-limiting group
+   keep a private cache of the group's tokens.
+
+   Normally, every read and write by a member of a group takes the group's
+   lock, which serializes bufferevents running in different threads.  With
+   a batch size set, each event_base instead takes 'batch' bytes at a time
+   from the group's buckets, and its bufferevents spend them with atomic
+   operations only, going back to the group when the cache runs out.
+
+   The price is precision: up to 'batch' bytes per event_base can be
+   cached and not yet spent, so a group can briefly exceed its limits by
+   that much, and bufferevent_rate_limit_group_get_read_limit() and
+   friends don't count cached tokens.  The group's min-share is not
+   applied to cached tokens.
+
+   The group must not have any members, and may not have a parent or
+   groups below it.
+
+   @param group the group to shard
+   @param batch how many bytes to take at a time, or 0 to stop sharding
+   @return 0 on success, or -1 if the group is not empty or nested, or if
+     this platform lacks the atomic operations needed.
+*/
+EVENT2_EXPORT_SYMBOL
+int bufferevent_rate_limit_group_set_shard_batch(
+	struct bufferevent_rate_limit_group *group, size_t batch);
+
+/**
+   Free a rate-limiting group.  The group must have no members and no
+   groups below it when this function is called.  If it has a parent, it
+   is removed from it.
 */
 EVENT2_EXPORT_SYMBOL
 void bufferevent_rate_limit_group_free(struct bufferevent_rate_limit_group *);
@@ -39,8 +39,9 @@
 extern "C" {
 #endif
 
-/* This is what openssl's SSL objects are underneath. */
+/* This is what openssl's SSL and SSL_CTX objects are underneath. */
 struct ssl_st;
+struct ssl_ctx_st;
 
 /**
    The state of an SSL object to be used when creating a new
@@ -115,6 +116,94 @@ EVENT2_EXPORT_SYMBOL
 void bufferevent_openssl_set_allow_dirty_shutdown(struct bufferevent *bev,
     int allow_dirty_shutdown);
 
+/** Ask OpenSSL to hand record encryption over to the kernel (kTLS).
+
+    This only works for bufferevents made with
+    bufferevent_openssl_socket_new(), and must be called before the
+    handshake finishes: OpenSSL sets kTLS up when it installs the session
+    keys.  If the kernel takes the sending keys, the bufferevent writes
+    plaintext to the socket itself, and file segments added to its output
+    with evbuffer_add_file() go out with sendfile().  If the kernel or
+    OpenSSL can't do it (for example because the "tls" module isn't
+    loaded), everything keeps working through SSL_write() as usual; use
+    bufferevent_openssl_get_ktls_send() to find out which happened.
+
+    A bufferevent using kTLS cannot be renegotiated.
+
+    @return 0 on success, or -1 if this is not a socket-based SSL
+      bufferevent, the handshake is already done or offloaded to another
+      thread, or OpenSSL was built without kTLS support.
+*/
+EVENT2_EXPORT_SYMBOL
+int bufferevent_openssl_set_ktls(struct bufferevent *bev, int enable);
+
+/** Return 1 if the kernel is encrypting what an SSL bufferevent sends, 0
+    if it isn't, or -1 if this is not an SSL bufferevent. */
+EVENT2_EXPORT_SYMBOL
+int bufferevent_openssl_get_ktls_send(struct bufferevent *bev);
+
+/** Choose the size of the TLS records an SSL bufferevent sends.
+
+    An SSL bufferevent packs its output into records of up to 16KB, the
+    largest TLS allows, gathering small pieces of its output buffer
+    together.  Large records cost the least per byte, but the peer can't
+    decrypt any of a record until all of it has arrived; while the
+    connection's congestion window is still small, that delays the first
+    bytes.  With dynamic record sizing, the bufferevent sends records of
+    at most small_size bytes (about 1300 fits one packet) until it has sent
+    warmup bytes, and full-size records after that.
+
+    @param bev an SSL bufferevent
+    @param small_size the payload of each record while warming up, or 0 to
+      always send full-size records (the default)
+    @param warmup how many bytes to send in small records
+    @param idle if not NULL, after this long without sending anything,
+      start over with small records
+    @return 0 on success, or -1 if this is not an SSL bufferevent or
+      small_size is larger than 16384.
+*/
+EVENT2_EXPORT_SYMBOL
+int bufferevent_openssl_set_record_sizing(struct bufferevent *bev,
+    size_t small_size, size_t warmup, const struct timeval *idle);
+
+/** A function that arranges for job(job_arg) to run soon, on some thread
+    other than the one running the event loop.
+
+    @see bufferevent_openssl_set_handshake_offload()
+*/
+typedef void (*bufferevent_ssl_offload_cb)(void (*job)(void *),
+    void *job_arg, void *arg);
+
+/** Run the handshake's SSL_do_handshake() calls off the event loop's
+    thread.
+
+    Full handshakes are expensive, and a burst of them can keep the event
+    loop busy long enough that established connections starve.  With an
+    offload callback set, every time the bufferevent would call
+    SSL_do_handshake() it instead stops watching the socket and passes a
+    job to cb, along with arg; cb should hand the job to a worker thread
+    (or pool) and return.  The job does the SSL work, then wakes the event
+    loop, which goes on with the handshake as usual.  Until then, leave
+    the SSL object alone: bufferevent_setfd(), bufferevent_ssl_renegotiate()
+    and bufferevent_openssl_set_ktls() fail while a job is in progress.
+
+    Threading must be enabled (see evthread_use_pthreads()) before the
+    bufferevent's event_base is created, and the bufferevent must have been
+    made with bufferevent_openssl_socket_new().  The bufferevent stays
+    allocated until the job has reported back, even if you free it.
+
+    @param bev an SSL bufferevent; set this before the handshake starts
+      to keep all of it off the loop
+    @param cb the function that dispatches jobs, or NULL to run the
+      handshake on the loop again
+    @param arg passed to cb
+    @return 0 on success, or -1 if this is not a socket-based SSL
+      bufferevent, a job is in progress, or threading isn't enabled.
+*/
+EVENT2_EXPORT_SYMBOL
+int bufferevent_openssl_set_handshake_offload(struct bufferevent *bev,
+    bufferevent_ssl_offload_cb cb, void *arg);
+
 /** Return the underlying openssl SSL * object for an SSL bufferevent. */
 EVENT2_EXPORT_SYMBOL
 struct ssl_st *
@@ -124,6 +213,94 @@ bufferevent_openssl_get_ssl(struct bufferevent *bufev);
 EVENT2_EXPORT_SYMBOL
 int bufferevent_ssl_renegotiate(struct bufferevent *bev);
 
+/** A server-side TLS session cache that several SSL_CTXs can share.
+
+    OpenSSL keeps resumable sessions, and the keys for session tickets, in
+    each SSL_CTX, behind one lock.  A server that runs one event_base per
+    thread, each with its own SSL_CTX, can't resume a session that started
+    on another thread, and a single shared SSL_CTX makes every handshake
+    contend for the cache lock.  Attach the SSL_CTXs to one of these
+    instead: sessions are spread over shards that each have their own
+    lock, and tickets issued by any of the SSL_CTXs work with all of them.
+
+    @see bufferevent_ssl_session_cache_new()
+*/
+struct bufferevent_ssl_session_cache;
+
+/** Counters for a bufferevent_ssl_session_cache. */
+struct bufferevent_ssl_session_cache_stats {
+	/** Sessions in the cache right now. */
+	size_t n_sessions;
+	/** Lookups by session id that found a session, or didn't. */
+	ev_uint64_t hits;
+	ev_uint64_t misses;
+	/** Sessions added, and sessions dropped to make room for them. */
+	ev_uint64_t stored;
+	ev_uint64_t evicted;
+	/** Tickets handed out. */
+	ev_uint64_t tickets_issued;
+	/** Tickets accepted with the current key, or with the previous key
+	    (in which case the client gets a new ticket too). */
+	ev_uint64_t tickets_resumed;
+	ev_uint64_t tickets_renewed;
+	/** Tickets whose key we no longer have. */
+	ev_uint64_t tickets_unknown;
+};
+
+/** Create a session cache.
+
+    The cache has n_shards shards, each with room for
+    max_sessions / n_shards sessions; when a shard is full, the session
+    used longest ago goes.  A couple of shards per thread is plenty.  The
+    cache starts out with a fresh ticket key.
+
+    If threading is enabled (see evthread_use_pthreads()) when you create
+    it, the cache may be used from any number of threads.
+
+    @return the new cache, or NULL if n_shards is 0, max_sessions is less
+      than n_shards, or we ran out of memory.
+*/
+EVENT2_EXPORT_SYMBOL
+struct bufferevent_ssl_session_cache *
+bufferevent_ssl_session_cache_new(unsigned n_shards, size_t max_sessions);
+
+/** Free a session cache.  Every SSL_CTX attached to it must have been
+    freed first. */
+EVENT2_EXPORT_SYMBOL
+void bufferevent_ssl_session_cache_free(
+    struct bufferevent_ssl_session_cache *cache);
+
+/** Make a server SSL_CTX keep its sessions, and its ticket keys, in a
+    shared cache.
+
+    This replaces the SSL_CTX's session cache mode, its session cache
+    callbacks and its ticket key callback.  Sessions are only resumed if
+    their session id context matches, as usual.
+
+    @return 0 on success, -1 on failure.
+*/
+EVENT2_EXPORT_SYMBOL
+int bufferevent_ssl_session_cache_attach(
+    struct bufferevent_ssl_session_cache *cache, struct ssl_ctx_st *ctx);
+
+/** Start encrypting new tickets with a new, random key.
+
+    Tickets made with the key before are still accepted (and replaced), but
+    ones made with any key older than that are not.  Rotate the key every
+    few hours, so that a stolen key exposes as few sessions as possible.
+
+    @return 0 on success, -1 if we couldn't make a new key.
+*/
+EVENT2_EXPORT_SYMBOL
+int bufferevent_ssl_session_cache_rotate_ticket_key(
+    struct bufferevent_ssl_session_cache *cache);
+
+/** Fill in stats with the counters for a session cache. */
+EVENT2_EXPORT_SYMBOL
+void bufferevent_ssl_session_cache_get_stats(
+    struct bufferevent_ssl_session_cache *cache,
+    struct bufferevent_ssl_session_cache_stats *stats);
+
 /** Return the most recent OpenSSL error reported on an SSL bufferevent. */
 EVENT2_EXPORT_SYMBOL
 unsigned long bufferevent_get_openssl_error(struct bufferevent *bev);
@@ -594,7 +594,14 @@ enum event_base_config_flag {
 	 */
     // 通常情况下，libevent使用最快的monotonic计时器实现自己的计时和超时控制；
     // 此模式下，会使用性能较低但是准确性更高的计时器
-	EVENT_BASE_FLAG_PRECISE_TIMER = 0x20
+	EVENT_BASE_FLAG_PRECISE_TIMER = 0x20,
+
+	/** Set EVBUFFER_FLAG_ARENA on the input and output buffers of every
+	    bufferevent created on this base, so that their chains come from
+	    the huge-page arena.
+	 */
+    // 此base上创建的bufferevent的输入输出缓冲区都从大页内存池分配chain
+	EVENT_BASE_FLAG_EVBUFFER_ARENA = 0x40
 };
 
 /**
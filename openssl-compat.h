@@ -30,6 +30,9 @@ static inline BIO_METHOD *BIO_meth_new(int type, const char *name)
 
 #define TLS_method SSLv23_method
 
+#define SSL_SESSION_up_ref(s) \
+	CRYPTO_add(&(s)->references, 1, CRYPTO_LOCK_SSL_SESSION)
+
 #endif /* OPENSSL_VERSION_NUMBER < 0x10100000L */
 
 #endif /* OPENSSL_COMPAT_H */
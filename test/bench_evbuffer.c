@@ -0,0 +1,446 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks for the evbuffer layer.  Each benchmark moves "size"
+ * bytes through an evbuffer in pieces of "chunk" bytes, "iterations"
+ * times over, and reports the time taken and the resulting throughput.
+ *
+ *   bench_evbuffer [-n iterations] [-s size] [-c chunk] [-t benchmark] [-m]
+ *
+ * -t runs only the named benchmark (it may be given more than once); -m
+ * prints one tab-separated line per benchmark instead of a table, for
+ * scripts that keep track of regressions.
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef EVENT__HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#include <signal.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef EVENT__HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <errno.h>
+#include <getopt.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+static size_t size = 4 * 1024 * 1024;
+static size_t chunk = 4096;
+static int iterations = 20;
+
+static char *data;
+
+/* A benchmark runs one iteration and returns the number of bytes it moved,
+ * or -1 on error. */
+typedef ev_ssize_t (*bench_fn)(void);
+
+static ev_ssize_t
+bench_add_drain(void)
+{
+	struct evbuffer *buf = evbuffer_new();
+	size_t n;
+
+	for (n = 0; n < size; n += chunk)
+		evbuffer_add(buf, data + n, chunk);
+	while (evbuffer_get_length(buf))
+		evbuffer_drain(buf, chunk);
+	evbuffer_free(buf);
+	return (ev_ssize_t)size;
+}
+
+static ev_ssize_t
+bench_expand(void)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer_iovec v[1];
+	size_t n;
+
+	for (n = 0; n < size; n += chunk) {
+		if (evbuffer_expand(buf, chunk) < 0 ||
+		    evbuffer_reserve_space(buf, chunk, v, 1) != 1)
+			goto err;
+		memcpy(v[0].iov_base, data + n, chunk);
+		v[0].iov_len = chunk;
+		if (evbuffer_commit_space(buf, v, 1) < 0)
+			goto err;
+	}
+	evbuffer_free(buf);
+	return (ev_ssize_t)size;
+err:
+	evbuffer_free(buf);
+	return -1;
+}
+
+static ev_ssize_t
+bench_readln(void)
+{
+	struct evbuffer *buf = evbuffer_new();
+	char *line;
+	size_t n, len, total = 0;
+
+	for (n = 0; n < size; n += chunk) {
+		evbuffer_add(buf, data + n, chunk - 2);
+		evbuffer_add(buf, "\r\n", 2);
+	}
+	while ((line = evbuffer_readln(buf, &len, EVBUFFER_EOL_CRLF))) {
+		total += len + 2;
+		free(line);
+	}
+	evbuffer_free(buf);
+	return (ev_ssize_t)total;
+}
+
+static ev_ssize_t
+bench_search(void)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer_ptr p;
+	static const char needle[] = "needle!";
+	size_t n;
+
+	for (n = 0; n < size; n += chunk)
+		evbuffer_add(buf, data + n, chunk);
+	evbuffer_add(buf, needle, sizeof(needle) - 1);
+	p = evbuffer_search(buf, needle, sizeof(needle) - 1, NULL);
+	evbuffer_free(buf);
+	return p.pos == (ev_ssize_t)size ? (ev_ssize_t)size : -1;
+}
+
+static ev_ssize_t
+bench_pullup(void)
+{
+	struct evbuffer *buf = evbuffer_new();
+	size_t n;
+	int ok;
+
+	for (n = 0; n < size; n += chunk)
+		evbuffer_add(buf, data + n, chunk);
+	ok = evbuffer_pullup(buf, -1) != NULL;
+	evbuffer_free(buf);
+	return ok ? (ev_ssize_t)size : -1;
+}
+
+static ev_ssize_t
+bench_add_buffer(void)
+{
+	struct evbuffer *src = evbuffer_new(), *dst = evbuffer_new();
+	size_t n;
+
+	for (n = 0; n < size; n += chunk) {
+		evbuffer_add(src, data + n, chunk);
+		evbuffer_add_buffer(dst, src);
+	}
+	n = evbuffer_get_length(dst);
+	evbuffer_free(src);
+	evbuffer_free(dst);
+	return (ev_ssize_t)n;
+}
+
+static ev_ssize_t
+bench_reference(void)
+{
+	struct evbuffer *buf = evbuffer_new();
+	size_t n;
+
+	for (n = 0; n < size; n += chunk)
+		evbuffer_add_reference(buf, data + n, chunk, NULL, NULL);
+	while (evbuffer_get_length(buf))
+		evbuffer_drain(buf, chunk);
+	evbuffer_free(buf);
+	return (ev_ssize_t)size;
+}
+
+static struct evbuffer_file_segment *segment;
+
+static ev_ssize_t
+bench_file_segment(void)
+{
+	struct evbuffer *buf = evbuffer_new();
+	char *out = malloc(chunk);
+	size_t n;
+	ev_ssize_t result = (ev_ssize_t)size;
+
+	for (n = 0; n < size; n += chunk) {
+		if (evbuffer_add_file_segment(buf, segment, n, chunk) < 0 ||
+		    evbuffer_remove(buf, out, chunk) != (int)chunk) {
+			result = -1;
+			break;
+		}
+	}
+	free(out);
+	evbuffer_free(buf);
+	return result;
+}
+
+static evutil_socket_t pair[2] = { -1, -1 };
+
+static int
+would_block(void)
+{
+	int err = EVUTIL_SOCKET_ERROR();
+#ifdef _WIN32
+	return err == WSAEWOULDBLOCK || err == WSAEINTR;
+#else
+	if (err == EAGAIN || err == EINTR)
+		return 1;
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+	if (err == EWOULDBLOCK)
+		return 1;
+#endif
+	return 0;
+#endif
+}
+
+static ev_ssize_t
+bench_socket(void)
+{
+	struct evbuffer *out = evbuffer_new(), *in = evbuffer_new();
+	size_t n;
+	ev_ssize_t result = (ev_ssize_t)size;
+
+	evbuffer_set_max_read(in, chunk);
+	evbuffer_add_reference(out, data, size, NULL, NULL);
+	for (n = 0; n < size; ) {
+		int r;
+		if (evbuffer_get_length(out) &&
+		    evbuffer_write(out, pair[0]) < 0 && !would_block()) {
+			result = -1;
+			break;
+		}
+		r = evbuffer_read(in, pair[1], -1);
+		if (r < 0 && !would_block()) {
+			result = -1;
+			break;
+		} else if (r == 0) {
+			result = -1;
+			break;
+		} else if (r > 0) {
+			n += r;
+			evbuffer_drain(in, r);
+		}
+	}
+	evbuffer_free(out);
+	evbuffer_free(in);
+	return result;
+}
+
+static struct benchmark {
+	const char *name;
+	bench_fn fn;
+	int selected;
+} benchmarks[] = {
+	{ "add_drain", bench_add_drain, 0 },
+	{ "expand", bench_expand, 0 },
+	{ "readln", bench_readln, 0 },
+	{ "search", bench_search, 0 },
+	{ "pullup", bench_pullup, 0 },
+	{ "add_buffer", bench_add_buffer, 0 },
+	{ "reference", bench_reference, 0 },
+	{ "file_segment", bench_file_segment, 0 },
+	{ "socket", bench_socket, 0 },
+	{ NULL, NULL, 0 }
+};
+
+static int
+setup_file_segment(void)
+{
+	FILE *f = tmpfile();
+	int fd;
+
+	if (f == NULL)
+		return -1;
+	if (fwrite(data, 1, size, f) != size || fflush(f) != 0) {
+		fclose(f);
+		return -1;
+	}
+	fd = dup(fileno(f));
+	fclose(f);
+	if (fd < 0)
+		return -1;
+	segment = evbuffer_file_segment_new(fd, 0, size,
+	    EVBUF_FS_CLOSE_ON_FREE);
+	if (segment == NULL) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+setup_socketpair(void)
+{
+#ifdef _WIN32
+	if (evutil_socketpair(AF_INET, SOCK_STREAM, 0, pair) == -1)
+		return -1;
+#else
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+		return -1;
+#endif
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+	return 0;
+}
+
+static void
+usage(const char *prog)
+{
+	struct benchmark *b;
+
+	fprintf(stderr, "usage: %s [-n iterations] [-s size] [-c chunk] "
+	    "[-t benchmark] [-m]\nbenchmarks:", prog);
+	for (b = benchmarks; b->name; ++b)
+		fprintf(stderr, " %s", b->name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct benchmark *b;
+	int c, i, machine = 0, any_selected = 0;
+	size_t n;
+
+#ifdef _WIN32
+	WSADATA WSAData;
+	WSAStartup(0x101, &WSAData);
+#else
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+		return (1);
+#endif
+
+	while ((c = getopt(argc, argv, "n:s:c:t:m")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			size = (size_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			chunk = (size_t)strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			for (b = benchmarks; b->name; ++b) {
+				if (!strcmp(b->name, optarg))
+					break;
+			}
+			if (!b->name)
+				usage(argv[0]);
+			b->selected = any_selected = 1;
+			break;
+		case 'm':
+			machine = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (iterations <= 0 || chunk < 2 || size < chunk)
+		usage(argv[0]);
+	/* Every benchmark moves whole chunks. */
+	size -= size % chunk;
+
+	if ((data = malloc(size)) == NULL) {
+		fprintf(stderr, "Cannot allocate %lu bytes\n",
+		    (unsigned long)size);
+		exit(1);
+	}
+	for (n = 0; n < size; ++n)
+		data[n] = 'a' + (char)(n % 26);
+
+	if (setup_file_segment() < 0 || setup_socketpair() < 0) {
+		perror("setup");
+		exit(1);
+	}
+
+	if (machine)
+		printf("#benchmark\titerations\tsize\tchunk\tusec\tMB/s\n");
+	else
+		printf("%-14s %12s %12s\n", "benchmark", "usec/iter", "MB/s");
+
+	for (b = benchmarks; b->name; ++b) {
+		struct timeval start, end, diff;
+		double usec, total = 0, mbps;
+		int failed = 0;
+
+		if (any_selected && !b->selected)
+			continue;
+
+		evutil_gettimeofday(&start, NULL);
+		for (i = 0; i < iterations; ++i) {
+			ev_ssize_t r = b->fn();
+			if (r < 0) {
+				failed = 1;
+				break;
+			}
+			total += (double)r;
+		}
+		evutil_gettimeofday(&end, NULL);
+
+		if (failed) {
+			fprintf(stderr, "%s: failed\n", b->name);
+			continue;
+		}
+		evutil_timersub(&end, &start, &diff);
+		usec = diff.tv_sec * 1000000.0 + diff.tv_usec;
+		mbps = usec > 0 ? total / usec : 0;
+		if (machine)
+			printf("%s\t%d\t%lu\t%lu\t%.0f\t%.2f\n", b->name,
+			    iterations, (unsigned long)size,
+			    (unsigned long)chunk, usec, mbps);
+		else
+			printf("%-14s %12.1f %12.2f\n", b->name,
+			    usec / iterations, mbps);
+	}
+
+	evbuffer_file_segment_free(segment);
+	evutil_closesocket(pair[0]);
+	evutil_closesocket(pair[1]);
+	free(data);
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+	return (0);
+}
@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Benchmark for a rate-limiting group shared by several threads.  Each
+ * thread runs its own event_base with "conns" socketpairs, and pumps data
+ * through them in pieces of at most "chunk" bytes; every reader and writer
+ * belongs to the same group, whose limits are too high to ever matter, so
+ * that what we measure is the cost of charging the group.  We run with
+ * 1, 2, 4, ... up to "threads" threads and report the total throughput.
+ *
+ *   bench_ratelim [-t threads] [-c conns] [-s chunk] [-d seconds] [-b batch]
+ *
+ * -b gives each base a cache of that many bytes of the group's tokens (see
+ * bufferevent_rate_limit_group_set_shard_batch()); the default, 0, makes
+ * every read and write take the group's lock.
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#ifdef EVENT__HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <signal.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef EVENT__HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <getopt.h>
+#ifdef EVENT__HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+
+#ifdef EVENT__HAVE_PTHREADS
+
+static int max_threads = 4;
+static int conns = 16;
+static size_t chunk = 1024;
+static int seconds = 2;
+static size_t batch = 0;
+
+static struct bufferevent_rate_limit_group *group;
+static char *data;
+
+struct worker {
+	pthread_t thread;
+	struct event_base *base;
+	struct bufferevent **bevs;
+	int failed;
+};
+
+static void
+write_cb(struct bufferevent *bev, void *arg)
+{
+	bufferevent_write(bev, data, chunk * 4);
+}
+
+static void
+read_cb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	evbuffer_drain(input, evbuffer_get_length(input));
+}
+
+static void *
+run_worker(void *arg)
+{
+	struct worker *w = arg;
+	struct timeval tv = { seconds, 0 };
+
+	event_base_loopexit(w->base, &tv);
+	if (event_base_dispatch(w->base) < 0)
+		w->failed = 1;
+	return NULL;
+}
+
+static int
+setup_worker(struct worker *w)
+{
+	evutil_socket_t pair[2];
+	int i, j;
+
+	w->base = event_base_new();
+	w->bevs = calloc(conns * 2, sizeof(struct bufferevent *));
+	if (!w->base || !w->bevs)
+		return -1;
+	for (i = 0; i < conns; ++i) {
+		if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+			return -1;
+		for (j = 0; j < 2; ++j) {
+			struct bufferevent *bev;
+			evutil_make_socket_nonblocking(pair[j]);
+			bev = bufferevent_socket_new(w->base, pair[j],
+			    BEV_OPT_CLOSE_ON_FREE|BEV_OPT_THREADSAFE);
+			if (!bev)
+				return -1;
+			w->bevs[i * 2 + j] = bev;
+			/* Small reads and writes, so that we charge the group
+			 * as often as possible per byte. */
+			bufferevent_set_max_single_read(bev, chunk);
+			bufferevent_set_max_single_write(bev, chunk);
+			if (bufferevent_add_to_rate_limit_group(bev, group) < 0)
+				return -1;
+			if (j == 0) {
+				bufferevent_setcb(bev, NULL, write_cb, NULL,
+				    NULL);
+				bufferevent_setwatermark(bev, EV_WRITE,
+				    chunk, 0);
+				bufferevent_enable(bev, EV_WRITE);
+				write_cb(bev, NULL);
+			} else {
+				bufferevent_setcb(bev, read_cb, NULL, NULL,
+				    NULL);
+				bufferevent_enable(bev, EV_READ);
+			}
+		}
+	}
+	return 0;
+}
+
+static void
+free_worker(struct worker *w)
+{
+	int i;
+	if (w->bevs) {
+		for (i = 0; i < conns * 2; ++i) {
+			if (w->bevs[i])
+				bufferevent_free(w->bevs[i]);
+		}
+		free(w->bevs);
+	}
+	if (w->base) {
+		/* Let the bufferevents finish leaving the group. */
+		event_base_loop(w->base, EVLOOP_NONBLOCK);
+		event_base_free(w->base);
+	}
+}
+
+/* Run the benchmark with n threads; return the number of bytes moved per
+ * second, or -1 on error. */
+static double
+run(struct event_base *group_base, struct ev_token_bucket_cfg *cfg,
+    int n)
+{
+	struct worker *workers;
+	struct timeval start, end, diff;
+	ev_uint64_t total_read = 0;
+	double elapsed;
+	int i, failed = 0;
+
+	group = bufferevent_rate_limit_group_new(group_base, cfg);
+	if (!group)
+		return -1;
+	if (batch &&
+	    bufferevent_rate_limit_group_set_shard_batch(group, batch) < 0) {
+		fprintf(stderr, "Sharding is not supported here.\n");
+		bufferevent_rate_limit_group_free(group);
+		return -1;
+	}
+
+	workers = calloc(n, sizeof(struct worker));
+	if (!workers)
+		return -1;
+	for (i = 0; i < n; ++i) {
+		if (setup_worker(&workers[i]) < 0) {
+			fprintf(stderr, "Couldn't set up thread %d.\n", i);
+			failed = 1;
+			goto done;
+		}
+	}
+
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < n; ++i) {
+		if (pthread_create(&workers[i].thread, NULL, run_worker,
+			&workers[i]) != 0) {
+			n = i;
+			failed = 1;
+			break;
+		}
+	}
+	for (i = 0; i < n; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		failed |= workers[i].failed;
+	}
+	evutil_gettimeofday(&end, NULL);
+	bufferevent_rate_limit_group_get_totals(group, &total_read, NULL);
+
+done:
+	for (i = 0; i < n; ++i)
+		free_worker(&workers[i]);
+	free(workers);
+	bufferevent_rate_limit_group_free(group);
+	if (failed)
+		return -1;
+
+	evutil_timersub(&end, &start, &diff);
+	elapsed = diff.tv_sec + diff.tv_usec / 1000000.0;
+	return total_read / elapsed;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t threads] [-c conns] [-s chunk] "
+	    "[-d seconds] [-b batch]\n", prog);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct event_base *group_base;
+	struct ev_token_bucket_cfg *cfg;
+	struct timeval tick = { 1, 0 };
+	double rate;
+	int c, n;
+
+	while ((c = getopt(argc, argv, "t:c:s:d:b:")) != -1) {
+		switch (c) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'c':
+			conns = atoi(optarg);
+			break;
+		case 's':
+			chunk = (size_t)atol(optarg);
+			break;
+		case 'd':
+			seconds = atoi(optarg);
+			break;
+		case 'b':
+			batch = (size_t)atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_threads < 1 || conns < 1 || !chunk || seconds < 1)
+		usage(argv[0]);
+
+#ifndef _WIN32
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+		return 1;
+#endif
+	if (evthread_use_pthreads() < 0)
+		return 1;
+
+	data = malloc(chunk * 4);
+	if (!data)
+		return 1;
+	memset(data, 'x', chunk * 4);
+
+	/* The group's refill timer lives here; we never need it to run. */
+	group_base = event_base_new();
+	cfg = ev_token_bucket_cfg_new(EV_RATE_LIMIT_MAX, EV_RATE_LIMIT_MAX,
+	    EV_RATE_LIMIT_MAX, EV_RATE_LIMIT_MAX, &tick);
+	if (!group_base || !cfg)
+		return 1;
+
+	printf("%-8s %-8s %12s\n", "threads", "batch", "MB/s");
+	for (n = 1; ; n = n * 2 > max_threads ? max_threads : n * 2) {
+		rate = run(group_base, cfg, n);
+		if (rate < 0)
+			return 1;
+		printf("%-8d %-8lu %12.1f\n", n, (unsigned long)batch,
+		    rate / (1024 * 1024));
+		if (n == max_threads)
+			break;
+	}
+
+	ev_token_bucket_cfg_free(cfg);
+	event_base_free(group_base);
+	free(data);
+	return 0;
+}
+
+#else
+
+int
+main(int argc, char **argv)
+{
+	fprintf(stderr, "bench_ratelim needs pthreads.\n");
+	return 0;
+}
+
+#endif
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Small-message request/response over socketpairs.  Each of "conns"
+ * clients sends a request made of "pieces" writes of "size" bytes; the
+ * server answers each whole request the same way, and the client sends the
+ * next request as soon as it has the whole answer.  We report round trips
+ * per second.  -C gives every bufferevent BEV_OPT_COALESCE_WRITES.
+ *
+ *   bench_reqresp [-c conns] [-n pieces] [-s size] [-d seconds] [-C]
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#ifdef EVENT__HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <signal.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef EVENT__HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <getopt.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+
+static int conns = 64;
+static int pieces = 4;
+static size_t size = 32;
+static int seconds = 2;
+static int options = 0;
+
+static char *data;
+static ev_uint64_t n_round_trips;
+
+/* Send one message, a piece at a time. */
+static void
+send_message(struct bufferevent *bev)
+{
+	int i;
+	for (i = 0; i < pieces; ++i)
+		bufferevent_write(bev, data, size);
+}
+
+/* Both sides: answer every whole message in the input.  Only the client
+ * counts. */
+static void
+read_cb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	size_t msg_len = pieces * size;
+	int is_client = arg != NULL;
+
+	while (evbuffer_get_length(input) >= msg_len) {
+		evbuffer_drain(input, msg_len);
+		if (is_client)
+			++n_round_trips;
+		send_message(bev);
+	}
+}
+
+static void
+event_cb(struct bufferevent *bev, short what, void *arg)
+{
+	fprintf(stderr, "Unexpected event %d\n", (int)what);
+	event_base_loopbreak(bufferevent_get_base(bev));
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-c conns] [-n pieces] [-s size] "
+	    "[-d seconds] [-C]\n", prog);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct event_base *base;
+	struct bufferevent **bevs;
+	evutil_socket_t pair[2];
+	struct timeval start, end, diff, tv;
+	double elapsed;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "c:n:s:d:C")) != -1) {
+		switch (c) {
+		case 'c':
+			conns = atoi(optarg);
+			break;
+		case 'n':
+			pieces = atoi(optarg);
+			break;
+		case 's':
+			size = (size_t)atol(optarg);
+			break;
+		case 'd':
+			seconds = atoi(optarg);
+			break;
+		case 'C':
+			options |= BEV_OPT_COALESCE_WRITES;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (conns < 1 || pieces < 1 || !size || seconds < 1)
+		usage(argv[0]);
+
+#ifndef _WIN32
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+		return 1;
+#endif
+
+	data = malloc(size);
+	bevs = calloc(conns * 2, sizeof(struct bufferevent *));
+	base = event_base_new();
+	if (!data || !bevs || !base)
+		return 1;
+	memset(data, 'x', size);
+
+	for (i = 0; i < conns; ++i) {
+		if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+			return 1;
+		evutil_make_socket_nonblocking(pair[0]);
+		evutil_make_socket_nonblocking(pair[1]);
+		bevs[i * 2] = bufferevent_socket_new(base, pair[0],
+		    BEV_OPT_CLOSE_ON_FREE|options);
+		bevs[i * 2 + 1] = bufferevent_socket_new(base, pair[1],
+		    BEV_OPT_CLOSE_ON_FREE|options);
+		if (!bevs[i * 2] || !bevs[i * 2 + 1])
+			return 1;
+		bufferevent_setcb(bevs[i * 2], read_cb, NULL, event_cb, base);
+		bufferevent_setcb(bevs[i * 2 + 1], read_cb, NULL, event_cb,
+		    NULL);
+		bufferevent_enable(bevs[i * 2], EV_READ|EV_WRITE);
+		bufferevent_enable(bevs[i * 2 + 1], EV_READ|EV_WRITE);
+		send_message(bevs[i * 2]);
+	}
+
+	tv.tv_sec = seconds;
+	tv.tv_usec = 0;
+	event_base_loopexit(base, &tv);
+	evutil_gettimeofday(&start, NULL);
+	event_base_dispatch(base);
+	evutil_gettimeofday(&end, NULL);
+
+	evutil_timersub(&end, &start, &diff);
+	elapsed = diff.tv_sec + diff.tv_usec / 1000000.0;
+	printf("%s, %d conns, %d x %lu bytes: %.0f round trips/s\n",
+	    options ? "coalesced" : "plain", conns, pieces,
+	    (unsigned long)size, n_round_trips / elapsed);
+
+	for (i = 0; i < conns * 2; ++i)
+		bufferevent_free(bevs[i]);
+	event_base_free(base);
+	free(bevs);
+	free(data);
+	return 0;
+}
@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * TLS throughput over a socketpair.  One SSL bufferevent keeps its output
+ * topped up with pieces of "chunk" bytes; the other drains its input.  By
+ * default both are filters on top of socket bufferevents, which is the
+ * path this benchmark is mostly meant for; -S makes them socket-based
+ * instead, and -R turns off OpenSSL's read-ahead for filters, so that
+ * every record takes two trips through the BIO.
+ *
+ *   bench_ssl [-d seconds] [-s chunk] [-S] [-R]
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#ifdef EVENT__HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <signal.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef EVENT__HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <getopt.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/bufferevent_ssl.h>
+#include <event2/util.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+static int seconds = 2;
+static size_t chunk = 16384;
+static int use_sockets = 0;
+static int no_read_ahead = 0;
+
+static char *data;
+static ev_uint64_t total_read;
+static int n_connected;
+
+static void
+write_cb(struct bufferevent *bev, void *arg)
+{
+	bufferevent_write(bev, data, chunk);
+}
+
+static void
+read_cb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	total_read += evbuffer_get_length(input);
+	evbuffer_drain(input, evbuffer_get_length(input));
+}
+
+static void
+event_cb(struct bufferevent *bev, short what, void *arg)
+{
+	struct timeval *start = arg;
+
+	if (what & BEV_EVENT_CONNECTED) {
+		if (++n_connected == 2)
+			evutil_gettimeofday(start, NULL);
+		return;
+	}
+	fprintf(stderr, "Unexpected event %d\n", (int)what);
+	event_base_loopbreak(bufferevent_get_base(bev));
+}
+
+/* Make a throwaway key and self-signed certificate for the server. */
+static int
+setup_server_ctx(SSL_CTX *ctx)
+{
+	EVP_PKEY *pkey = NULL;
+	EVP_PKEY_CTX *kctx;
+	X509 *x509 = NULL;
+	X509_NAME *name;
+	int r = -1;
+
+	kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+	if (!kctx || EVP_PKEY_keygen_init(kctx) <= 0 ||
+	    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx,
+		NID_X9_62_prime256v1) <= 0 ||
+	    EVP_PKEY_keygen(kctx, &pkey) <= 0)
+		goto done;
+	if (!(x509 = X509_new()))
+		goto done;
+	ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+	X509_gmtime_adj(X509_get_notBefore(x509), 0);
+	X509_gmtime_adj(X509_get_notAfter(x509), 3600);
+	X509_set_pubkey(x509, pkey);
+	name = X509_get_subject_name(x509);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+	    (const unsigned char *)"bench.example.com", -1, -1, 0);
+	X509_set_issuer_name(x509, name);
+	if (!X509_sign(x509, pkey, EVP_sha256()))
+		goto done;
+	if (SSL_CTX_use_certificate(ctx, x509) != 1 ||
+	    SSL_CTX_use_PrivateKey(ctx, pkey) != 1)
+		goto done;
+	r = 0;
+done:
+	if (kctx)
+		EVP_PKEY_CTX_free(kctx);
+	if (pkey)
+		EVP_PKEY_free(pkey);
+	if (x509)
+		X509_free(x509);
+	return r;
+}
+
+static struct bufferevent *
+make_bev(struct event_base *base, SSL_CTX *ctx, evutil_socket_t fd,
+    enum bufferevent_ssl_state state)
+{
+	struct bufferevent *underlying, *bev;
+	SSL *ssl = SSL_new(ctx);
+
+	if (!ssl)
+		return NULL;
+	if (use_sockets)
+		return bufferevent_openssl_socket_new(base, fd, ssl, state,
+		    BEV_OPT_CLOSE_ON_FREE);
+
+	underlying = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (!underlying)
+		return NULL;
+	/* Otherwise the writer encrypts everything we give it at once, and
+	 * nothing tells us to slow down. */
+	bufferevent_setwatermark(underlying, EV_WRITE, 0, 65536);
+	bev = bufferevent_openssl_filter_new(base, underlying, ssl, state,
+	    BEV_OPT_CLOSE_ON_FREE);
+	if (bev && no_read_ahead)
+		SSL_set_read_ahead(ssl, 0);
+	return bev;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d seconds] [-s chunk] [-S] [-R]\n",
+	    prog);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct event_base *base;
+	struct bufferevent *client, *server;
+	SSL_CTX *client_ctx, *server_ctx;
+	evutil_socket_t pair[2];
+	struct timeval start, end, diff, tv;
+	double elapsed;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:s:SR")) != -1) {
+		switch (c) {
+		case 'd':
+			seconds = atoi(optarg);
+			break;
+		case 's':
+			chunk = (size_t)atol(optarg);
+			break;
+		case 'S':
+			use_sockets = 1;
+			break;
+		case 'R':
+			no_read_ahead = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (seconds < 1 || !chunk)
+		usage(argv[0]);
+
+#ifndef _WIN32
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+		return 1;
+#endif
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	SSL_library_init();
+	SSL_load_error_strings();
+	OpenSSL_add_all_algorithms();
+#endif
+
+	data = malloc(chunk);
+	if (!data)
+		return 1;
+	memset(data, 'x', chunk);
+
+	client_ctx = SSL_CTX_new(SSLv23_method());
+	server_ctx = SSL_CTX_new(SSLv23_method());
+	if (!client_ctx || !server_ctx || setup_server_ctx(server_ctx) < 0) {
+		ERR_print_errors_fp(stderr);
+		return 1;
+	}
+
+	base = event_base_new();
+	if (!base)
+		return 1;
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+		return 1;
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+
+	client = make_bev(base, client_ctx, pair[0],
+	    BUFFEREVENT_SSL_CONNECTING);
+	server = make_bev(base, server_ctx, pair[1],
+	    BUFFEREVENT_SSL_ACCEPTING);
+	if (!client || !server)
+		return 1;
+
+	/* The clock starts once both sides are connected. */
+	bufferevent_setcb(client, NULL, write_cb, event_cb, &start);
+	bufferevent_setcb(server, read_cb, NULL, event_cb, &start);
+	bufferevent_setwatermark(client, EV_WRITE, chunk, 0);
+	bufferevent_enable(client, EV_WRITE);
+	bufferevent_enable(server, EV_READ);
+	write_cb(client, NULL);
+
+	tv.tv_sec = seconds;
+	tv.tv_usec = 0;
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+	evutil_gettimeofday(&end, NULL);
+
+	if (n_connected != 2) {
+		fprintf(stderr, "The handshake didn't finish.\n");
+		return 1;
+	}
+	evutil_timersub(&end, &start, &diff);
+	elapsed = diff.tv_sec + diff.tv_usec / 1000000.0;
+	printf("%s%s, chunk %lu: %.1f MB/s\n",
+	    use_sockets ? "socket" : "filter",
+	    use_sockets ? "" : (no_read_ahead ? " without read-ahead" : ""),
+	    (unsigned long)chunk, total_read / elapsed / (1024 * 1024));
+
+	bufferevent_free(client);
+	bufferevent_free(server);
+	event_base_free(base);
+	SSL_CTX_free(client_ctx);
+	SSL_CTX_free(server_ctx);
+	free(data);
+	return 0;
+}
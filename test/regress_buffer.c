@@ -90,7 +90,13 @@ evbuffer_validate_(struct evbuffer *buf)
 		if (chain->next == NULL) {
 			tt_assert(buf->last == chain);
 		}
-		tt_assert(chain->buffer_len >= chain->misalign + chain->off);
+		if (chain->flags & EVBUFFER_RING) {
+			/* Ring data may run on into the second mapping. */
+			tt_assert(chain->buffer_len >= chain->off);
+			tt_assert(chain->buffer_len > (size_t)chain->misalign);
+		} else {
+			tt_assert(chain->buffer_len >= chain->misalign + chain->off);
+		}
 		chain = chain->next;
 	}
 
@@ -120,6 +126,16 @@ evbuffer_validate_(struct evbuffer *buf)
 	return 0;
 }
 
+static int
+evbuffer_count_chains(const struct evbuffer *buf)
+{
+	const struct evbuffer_chain *chain;
+	int n = 0;
+	for (chain = buf->first; chain; chain = chain->next)
+		++n;
+	return n;
+}
+
 static void
 evbuffer_get_waste(struct evbuffer *buf, size_t *allocatedp, size_t *wastedp, size_t *usedp)
 {
@@ -2029,6 +2045,830 @@ end:
 		evbuffer_free(buf2);
 }
 
+static void
+test_evbuffer_broadcast(void *ptr)
+{
+	struct evbuffer *src = evbuffer_new();
+	struct evbuffer *tmp = evbuffer_new();
+	struct evbuffer *outs[20];
+	struct evbuffer_chain *payload;
+	char expect[301], got[300];
+	int i;
+
+	memset(outs, 0, sizeof(outs));
+	for (i = 0; i < 20; ++i)
+		outs[i] = evbuffer_new();
+
+	/* Nothing to send is trivially sent everywhere. */
+	tt_int_op(evbuffer_add_buffer_broadcast(outs, 20, src), ==, 20);
+	tt_int_op(evbuffer_get_length(outs[0]), ==, 0);
+
+	/* Build the payload out of several chains. */
+	for (i = 0; i < 30; ++i) {
+		evutil_snprintf(expect+i*10, 11, "item %4d\n", i);
+		evbuffer_add(tmp, expect+i*10, 10);
+		evbuffer_add_buffer(src, tmp);
+	}
+	evbuffer_freeze(outs[5], 0);
+
+	tt_int_op(evbuffer_add_buffer_broadcast(outs, 20, src), ==, 19);
+	evbuffer_validate(src);
+	tt_int_op(evbuffer_get_length(src), ==, 300);
+	payload = src->first;
+	tt_int_op(payload->off, ==, 300);
+	/* One reference for src, one for each of 19 destinations. */
+	tt_int_op(payload->refcnt, ==, 20);
+	tt_int_op(evbuffer_get_length(outs[5]), ==, 0);
+	for (i = 0; i < 20; ++i) {
+		if (i == 5)
+			continue;
+		evbuffer_validate(outs[i]);
+		tt_int_op(evbuffer_count_chains(outs[i]), ==, 1);
+		tt_assert(outs[i]->first->buffer == payload->buffer);
+		tt_int_op(evbuffer_copyout(outs[i], got, 300), ==, 300);
+		tt_assert(!memcmp(got, expect, 300));
+	}
+
+	/* The publisher can let go at once; the payload lives on until the
+	 * last subscriber drains it. */
+	evbuffer_free(src);
+	src = NULL;
+	for (i = 0; i < 19; ++i) {
+		if (i == 5)
+			continue;
+		evbuffer_drain(outs[i], 100);
+		evbuffer_drain(outs[i], 200);
+	}
+	/* outs[19], and src's own reference, which goes away along with
+	 * src once nobody refers to it. */
+	tt_int_op(payload->refcnt, ==, 2);
+	tt_int_op(evbuffer_remove(outs[19], got, 300), ==, 300);
+	tt_assert(!memcmp(got, expect, 300));
+
+	/* Ring buffers can't be the source. */
+	src = evbuffer_new();
+	if (evbuffer_set_ring(src, 100) == 0) {
+		evbuffer_add(src, "x", 1);
+		tt_int_op(evbuffer_add_buffer_broadcast(outs, 20, src), ==, -1);
+	}
+
+end:
+	for (i = 0; i < 20; ++i)
+		if (outs[i])
+			evbuffer_free(outs[i]);
+	if (src)
+		evbuffer_free(src);
+	evbuffer_free(tmp);
+}
+
+static void
+global_mem_level_cb(struct event_base *base, size_t bytes, int level,
+    void *arg)
+{
+	int *levelp = arg;
+	*levelp = level;
+}
+
+static void
+test_evbuffer_global_mem(void *ptr)
+{
+	struct evbuffer *buf = NULL;
+	size_t mem;
+	char data[1000];
+	int level = -1;
+
+	memset(data, 'x', sizeof(data));
+	tt_int_op(evbuffer_set_global_mem_limits(2000, 1000, NULL, NULL),
+	    ==, -1);
+	tt_int_op(evbuffer_set_global_mem_limits(0, 0, NULL, NULL), ==, 0);
+	mem = evbuffer_get_global_mem();
+
+	buf = evbuffer_new();
+	tt_assert(buf);
+	evbuffer_add(buf, data, sizeof(data));
+	tt_int_op(evbuffer_get_global_mem(), ==, mem + 1000);
+
+	/* Changing the limits reports the new level at once. */
+	tt_int_op(evbuffer_set_global_mem_limits(mem + 500, mem + 1500,
+		global_mem_level_cb, &level), ==, 0);
+	tt_int_op(level, ==, EVBUFFER_MEM_SOFT);
+	evbuffer_add(buf, data, 600);
+	tt_int_op(level, ==, EVBUFFER_MEM_HARD);
+	evbuffer_drain(buf, 600);
+	tt_int_op(level, ==, EVBUFFER_MEM_HARD);
+	evbuffer_drain(buf, 600);
+	tt_int_op(level, ==, EVBUFFER_MEM_NORMAL);
+	tt_int_op(evbuffer_get_global_mem(), ==, mem + 400);
+
+	evbuffer_free(buf);
+	buf = NULL;
+	tt_int_op(evbuffer_get_global_mem(), ==, mem);
+end:
+	evbuffer_set_global_mem_limits(0, 0, NULL, NULL);
+	if (buf)
+		evbuffer_free(buf);
+}
+
+/* Check that evbuffer_add_fmt() agrees with evutil_snprintf(). */
+#define CHECK_ADD_FMT(buf, ...) do {					\
+		char expect_[256];					\
+		int n_ = evutil_snprintf(expect_, sizeof(expect_), __VA_ARGS__); \
+		evbuffer_drain((buf), evbuffer_get_length(buf));	\
+		tt_int_op(evbuffer_add_fmt((buf), __VA_ARGS__), ==, n_); \
+		tt_int_op(evbuffer_get_length(buf), ==, n_);		\
+		if (n_ > 0)						\
+			tt_assert(!memcmp(evbuffer_pullup((buf), -1),	\
+				expect_, n_));				\
+	} while (0)
+
+static void
+test_evbuffer_add_fmt(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	char *s;
+
+	tt_int_op(evbuffer_add_u64(buf, 0), ==, 1);
+	tt_int_op(evbuffer_add(buf, " ", 1), ==, 0);
+	tt_int_op(evbuffer_add_u64(buf, EV_UINT64_MAX), ==, 20);
+	tt_int_op(evbuffer_add(buf, " ", 1), ==, 0);
+	tt_int_op(evbuffer_add_i64(buf, EV_INT64_MIN), ==, 20);
+	tt_int_op(evbuffer_add(buf, " ", 1), ==, 0);
+	tt_int_op(evbuffer_add_i64(buf, 99), ==, 2);
+	tt_int_op(evbuffer_add(buf, " ", 1), ==, 0);
+	tt_int_op(evbuffer_add_hex(buf, 0xdeadbeefULL), ==, 8);
+	tt_int_op(evbuffer_add(buf, " ", 1), ==, 0);
+	tt_int_op(evbuffer_add_hex(buf, 0), ==, 1);
+	s = (char *)evbuffer_pullup(buf, -1);
+	tt_int_op(evbuffer_get_length(buf), ==, 57);
+	tt_assert(!memcmp(s, "0 18446744073709551615 -9223372036854775808 "
+		"99 deadbeef 0", 57));
+
+	CHECK_ADD_FMT(buf, "GET %s HTTP/%d.%d\r\n", "/index.html", 1, 1);
+	CHECK_ADD_FMT(buf, "%s: %s\r\n", "Content-Type", "text/html");
+	CHECK_ADD_FMT(buf, "%x|%X|%u|%c|%%|%i", 0xabcU, 0xabcU, 4000000000U,
+	    'q', -7);
+	CHECK_ADD_FMT(buf, "%ld %lu %lld %llu", -123456789L, 123456789UL,
+	    (long long)EV_INT64_MIN, (unsigned long long)EV_UINT64_MAX);
+	CHECK_ADD_FMT(buf, "%zu %zx", (size_t)12345, (size_t)0xfff);
+	CHECK_ADD_FMT(buf, "%d %d %d", 0, -1, 2147483647);
+	CHECK_ADD_FMT(buf, "%s", "");
+	CHECK_ADD_FMT(buf, "no conversions");
+	/* These go through vsnprintf. */
+	CHECK_ADD_FMT(buf, "%5d|%-3s|%.2f", 42, "a", 1.5);
+	CHECK_ADD_FMT(buf, "%08x %s", 0x1234U, "tail");
+
+	/* Ring buffers wrap the formatted text around their end. */
+	evbuffer_free(buf);
+	buf = evbuffer_new();
+	if (evbuffer_set_ring(buf, 4096) == 0) {
+		char pad[4090];
+		memset(pad, 'p', sizeof(pad));
+		evbuffer_add(buf, pad, sizeof(pad));
+		evbuffer_drain(buf, sizeof(pad));
+		tt_int_op(evbuffer_add_fmt(buf, "%s=%d", "value", 123456), ==, 12);
+		tt_int_op(evbuffer_remove(buf, pad, sizeof(pad)), ==, 12);
+		tt_assert(!memcmp(pad, "value=123456", 12));
+	}
+
+	/* A frozen buffer refuses new data. */
+	evbuffer_freeze(buf, 0);
+	tt_int_op(evbuffer_add_u64(buf, 1), ==, -1);
+	tt_int_op(evbuffer_add_fmt(buf, "%d", 1), ==, -1);
+	evbuffer_unfreeze(buf, 0);
+
+end:
+	evbuffer_free(buf);
+}
+
+static void
+test_evbuffer_iter(void *ptr)
+{
+	/* Three chains, so that fields can straddle the boundaries. */
+	static const char c1[] = "GET /x HTTP/1.1\r\n\x34";
+	static const char c2[] = "\x12\x78\x56\x34\x12\xe5\x8e";
+	static const char c3[] = "\x26\x01\x02\x03\x04\x05\x06\x07\x08\xff";
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer_iter it;
+	unsigned char scratch[16];
+	const unsigned char *p;
+	ev_uint16_t u16;
+	ev_uint32_t u32;
+	ev_uint64_t u64;
+	char word[4];
+
+	evbuffer_add_reference(buf, c1, sizeof(c1) - 1, NULL, NULL);
+	evbuffer_add_reference(buf, c2, sizeof(c2) - 1, NULL, NULL);
+	evbuffer_add_reference(buf, c3, sizeof(c3) - 1, NULL, NULL);
+
+	tt_int_op(evbuffer_iter_init(&it, buf, 100), ==, -1);
+	tt_int_op(evbuffer_iter_init(&it, buf, 0), ==, 0);
+	tt_int_op(evbuffer_iter_remaining(&it), ==, evbuffer_get_length(buf));
+
+	/* Inside a chain, we read in place. */
+	tt_assert(evbuffer_iter_match(&it, "GET ", 4));
+	tt_assert(!evbuffer_iter_match(&it, "PUT ", 4));
+	p = evbuffer_iter_peek(&it, 3, NULL);
+	tt_ptr_op(p, ==, c1);
+	tt_int_op(evbuffer_iter_read(&it, word, 3), ==, 0);
+	tt_assert(!memcmp(word, "GET", 3));
+	tt_int_op(evbuffer_iter_advance(&it, sizeof(c1) - 1 - 4), ==, 0);
+
+	/* Across a chain boundary, we need scratch space. */
+	tt_ptr_op(evbuffer_iter_peek(&it, 2, NULL), ==, NULL);
+	p = evbuffer_iter_peek(&it, 2, scratch);
+	tt_ptr_op(p, ==, scratch);
+	tt_assert(evbuffer_iter_match(&it, "\x34\x12\x78", 3));
+	tt_int_op(evbuffer_iter_read_le16(&it, &u16), ==, 0);
+	tt_int_op(u16, ==, 0x1234);
+	tt_int_op(evbuffer_iter_read_le32(&it, &u32), ==, 0);
+	tt_int_op(u32, ==, 0x12345678);
+
+	/* 624485 is e5 8e 26 in LEB128, split over two chains. */
+	tt_int_op(evbuffer_iter_read_varint(&it, &u64), ==, 0);
+	tt_int_op(u64, ==, 624485);
+	tt_int_op(evbuffer_iter_read_le64(&it, &u64), ==, 0);
+	tt_assert(u64 == (((ev_uint64_t)0x08070605) << 32 | 0x04030201));
+
+	/* Running off the end fails and leaves the iterator alone. */
+	tt_int_op(evbuffer_iter_remaining(&it), ==, 1);
+	tt_int_op(evbuffer_iter_read_le16(&it, &u16), ==, -1);
+	tt_int_op(evbuffer_iter_read_varint(&it, &u64), ==, -1);
+	tt_assert(!evbuffer_iter_match(&it, "\xff\x00", 2));
+	tt_int_op(evbuffer_iter_remaining(&it), ==, 1);
+	tt_int_op(evbuffer_iter_advance(&it, 2), ==, -1);
+	tt_int_op(evbuffer_iter_advance(&it, 1), ==, 0);
+	tt_ptr_op(evbuffer_iter_peek(&it, 1, scratch), ==, NULL);
+
+	/* A varint may not go past 64 bits. */
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+	memset(scratch, 0xff, 9);
+	scratch[9] = 0x02;
+	evbuffer_add(buf, scratch, 10);
+	evbuffer_iter_init(&it, buf, 0);
+	tt_int_op(evbuffer_iter_read_varint(&it, &u64), ==, -1);
+	scratch[9] = 0x01;
+	evbuffer_drain(buf, 10);
+	evbuffer_add(buf, scratch, 10);
+	evbuffer_iter_init(&it, buf, 0);
+	tt_int_op(evbuffer_iter_read_varint(&it, &u64), ==, 0);
+	tt_assert(u64 == EV_UINT64_MAX);
+
+end:
+	evbuffer_free(buf);
+}
+
+static void
+test_evbuffer_arena(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *plain = evbuffer_new();
+	struct evbuffer_arena_stats st;
+	size_t used_before;
+	char data[3000], out[3000];
+	int i;
+
+	for (i = 0; i < (int)sizeof(data); ++i)
+		data[i] = (char)(i * 7);
+
+	if (evbuffer_arena_get_stats(&st) < 0)
+		tt_skip();
+	used_before = st.n_slots_used;
+
+	/* Buffers without the flag stay out of the arena. */
+	evbuffer_add(plain, data, sizeof(data));
+	tt_int_op(evbuffer_arena_get_stats(&st), ==, 0);
+	tt_int_op(st.n_slots_used, ==, used_before);
+
+	tt_int_op(evbuffer_set_flags(buf, EVBUFFER_FLAG_ARENA), ==, 0);
+	for (i = 0; i < 4; ++i)
+		evbuffer_add(buf, data, sizeof(data));
+	tt_int_op(evbuffer_arena_get_stats(&st), ==, 0);
+	tt_int_op(st.n_regions, >=, 1);
+	tt_int_op(st.region_size, ==, 2 << 20);
+	tt_int_op(st.n_slots, ==, st.n_regions * (st.region_size / st.slot_size));
+	tt_int_op(st.n_slots_used, >, used_before);
+	tt_int_op(st.n_slots_used, <=, st.n_slots);
+	evbuffer_validate(buf);
+
+	/* Moving arena chains to another buffer keeps them alive. */
+	evbuffer_add_buffer(plain, buf);
+	tt_int_op(evbuffer_get_length(plain), ==, 5 * sizeof(data));
+	for (i = 0; i < 5; ++i) {
+		tt_int_op(evbuffer_remove(plain, out, sizeof(out)), ==,
+		    sizeof(out));
+		tt_assert(!memcmp(out, data, sizeof(data)));
+	}
+	evbuffer_validate(plain);
+
+	/* Chains too big for a slot come from malloc. */
+	tt_int_op(evbuffer_arena_get_stats(&st), ==, 0);
+	tt_int_op(st.n_slots_used, ==, used_before);
+	evbuffer_expand(buf, 3 * st.slot_size);
+	evbuffer_add(buf, data, 1);
+	tt_int_op(evbuffer_arena_get_stats(&st), ==, 0);
+	tt_int_op(st.n_slots_used, ==, used_before);
+
+	evbuffer_free(buf);
+	buf = NULL;
+	tt_int_op(evbuffer_arena_get_stats(&st), ==, 0);
+	tt_int_op(st.n_slots_used, ==, used_before);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+	evbuffer_free(plain);
+}
+
+/* Return how many bytes of buf are held in memory rather than in file
+ * segments. */
+static size_t
+evbuffer_bytes_in_memory(struct evbuffer *buf)
+{
+	struct evbuffer_chain *chain;
+	size_t n = 0;
+
+	for (chain = buf->first; chain; chain = chain->next)
+		if (!(chain->flags & EVBUFFER_FILESEGMENT))
+			n += chain->off;
+	return n;
+}
+
+static void
+test_evbuffer_spill(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *out = evbuffer_new();
+	char data[1000], got[1000];
+	char *big = NULL, *tmpfilename = NULL;
+	const size_t big_len = 300000;
+	int fd = -1, i;
+	size_t n;
+
+	for (i = 0; i < (int)sizeof(data); ++i)
+		data[i] = (char)(i * 13);
+
+	if (evbuffer_set_spill(buf, 4096, NULL) < 0)
+		tt_skip();
+
+	/* Less than a batch past the threshold: everything stays put. */
+	for (i = 0; i < 60; ++i) {
+		data[0] = (char)i;
+		evbuffer_add(buf, data, sizeof(data));
+	}
+	tt_int_op(evbuffer_bytes_in_memory(buf), ==, 60 * sizeof(data));
+
+	for (; i < 200; ++i) {
+		data[0] = (char)i;
+		evbuffer_add(buf, data, sizeof(data));
+	}
+	evbuffer_validate(buf);
+	tt_int_op(evbuffer_get_length(buf), ==, 200 * sizeof(data));
+	tt_int_op(evbuffer_bytes_in_memory(buf), <, 4096 + 65536 + 2 * 4096);
+
+	for (i = 0; i < 200; ++i) {
+		tt_int_op(evbuffer_remove(buf, got, sizeof(got)), ==,
+		    sizeof(got));
+		data[0] = (char)i;
+		tt_assert(!memcmp(got, data, sizeof(data)));
+	}
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+
+	/* A single large chain is split at the threshold, and the part past
+	 * it goes out through sendfile where we have it. */
+	big = malloc(big_len);
+	tt_assert(big);
+	for (n = 0; n < big_len; ++n)
+		big[n] = (char)(n * 7 + n / 1000);
+	evbuffer_set_flags(out, EVBUFFER_FLAG_DRAINS_TO_FD);
+	tt_int_op(evbuffer_set_spill(out, 1000, NULL), ==, 0);
+	evbuffer_add(out, big, big_len);
+	evbuffer_validate(out);
+	tt_int_op(evbuffer_get_length(out), ==, big_len);
+	tt_int_op(evbuffer_bytes_in_memory(out), ==, 1000);
+
+	fd = regress_make_tmpfile("", 0, &tmpfilename);
+	tt_int_op(fd, >=, 0);
+	while (evbuffer_get_length(out)) {
+		int r = evbuffer_write(out, fd);
+		tt_int_op(r, >, 0);
+	}
+	tt_int_op(lseek(fd, 0, SEEK_SET), ==, 0);
+	for (n = 0; n < big_len; n += sizeof(got)) {
+		tt_int_op(read(fd, got, sizeof(got)), ==, sizeof(got));
+		tt_assert(!memcmp(got, big + n, sizeof(got)));
+	}
+
+	/* Turning it off keeps new data in memory. */
+	tt_int_op(evbuffer_set_spill(out, 0, NULL), ==, 0);
+	evbuffer_add(out, big, big_len);
+	tt_int_op(evbuffer_bytes_in_memory(out), ==, big_len);
+
+end:
+	evbuffer_free(buf);
+	evbuffer_free(out);
+	if (big)
+		free(big);
+	if (fd >= 0)
+		close(fd);
+	if (tmpfilename) {
+		unlink(tmpfilename);
+		free(tmpfilename);
+	}
+}
+
+static void
+test_evbuffer_spill_deferred(void *ptr)
+{
+	struct event_base *base = event_base_new();
+	struct evbuffer *buf = NULL, *sync = NULL, *all = evbuffer_new();
+	const size_t piece = 65536;
+	char *big = NULL, *got = NULL;
+	ev_uint32_t expect;
+	size_t n;
+	int i;
+
+	tt_assert(base);
+	tt_int_op(evbuffer_set_global_mem_limits(0, 0, NULL, NULL), ==, 0);
+	buf = evbuffer_new();
+	sync = evbuffer_new();
+	big = malloc(piece);
+	got = malloc(piece);
+	tt_assert(big && got);
+	for (n = 0; n < piece; ++n)
+		big[n] = (char)(n * 11 + n / 999);
+
+	/* With no event loop the spill happens as the data comes in; the
+	 * running CRC has seen it all first. */
+	evbuffer_set_flags(sync, EVBUFFER_FLAG_RUNNING_CRC32C);
+	if (evbuffer_set_spill(sync, 1000, NULL) < 0)
+		tt_skip();
+	for (i = 0; i < 64; ++i) {
+		big[0] = (char)i;
+		evbuffer_add(sync, big, piece);
+		evbuffer_add(all, big, piece);
+	}
+	evbuffer_validate(sync);
+	tt_int_op(evbuffer_bytes_in_memory(sync), ==, 1000);
+	expect = 0;
+	evbuffer_crc32c(all, NULL, -1, &expect);
+	tt_int_op(evbuffer_get_running_crc32c(sync), ==, expect);
+	/* Only what is still in memory is charged.  ("all" came before
+	 * accounting was turned on, so it isn't.) */
+	tt_int_op(evbuffer_get_global_mem(), ==, 1000);
+
+	/* With one, adding data doesn't wait on the disk. */
+	evbuffer_defer_callbacks(buf, base);
+	evbuffer_set_flags(buf, EVBUFFER_FLAG_RUNNING_CRC32C);
+	tt_int_op(evbuffer_set_spill(buf, 1000, NULL), ==, 0);
+	for (i = 0; i < 16; ++i) {
+		big[0] = (char)i;
+		evbuffer_add(buf, big, piece);
+	}
+	tt_int_op(evbuffer_bytes_in_memory(buf), ==, 16 * piece);
+	tt_int_op(evbuffer_get_global_mem(), ==, 1000 + 16 * piece);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	evbuffer_validate(buf);
+	tt_int_op(evbuffer_get_length(buf), ==, 16 * piece);
+	tt_int_op(evbuffer_bytes_in_memory(buf), ==, 1000);
+	tt_int_op(evbuffer_get_global_mem(), ==, 2000);
+
+	/* Draining spilled data doesn't uncharge it twice. */
+	evbuffer_drain(buf, 4 * piece);
+	tt_int_op(evbuffer_get_global_mem(), ==, 1000);
+	for (i = 4; i < 16; ++i) {
+		tt_int_op(evbuffer_remove(buf, got, piece), ==, piece);
+		big[0] = (char)i;
+		tt_assert(!memcmp(got, big, piece));
+	}
+	tt_int_op(evbuffer_get_global_mem(), ==, 1000);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+	if (sync)
+		evbuffer_free(sync);
+	if (all)
+		evbuffer_free(all);
+	if (big)
+		free(big);
+	if (got)
+		free(got);
+	if (base)
+		event_base_free(base);
+}
+
+static void
+test_evbuffer_read_large(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *tmp = evbuffer_new();
+	struct evbuffer_iovec v[64];
+	evutil_socket_t pair[2] = { -1, -1 };
+	char *data = NULL, *got = NULL;
+	const size_t data_len = 1 << 20;
+	size_t sent = 0, n;
+	int i, r;
+
+	/* Reserving lots of space in many vectors spreads it over several
+	 * chains instead of one huge one. */
+	r = evbuffer_reserve_space(tmp, data_len, v, 64);
+	tt_int_op(r, >, 4);
+	for (i = 0, n = 0; i < r; ++i)
+		n += v[i].iov_len;
+	tt_int_op(n, >=, data_len);
+	tt_int_op(v[0].iov_len, <, data_len / 4);
+	evbuffer_validate(tmp);
+
+	tt_int_op(evbuffer_get_max_read(buf), ==, 4096);
+	tt_int_op(evbuffer_set_max_read(buf, data_len), ==, 0);
+	tt_int_op(evbuffer_get_max_read(buf), ==, data_len);
+	if (sizeof(size_t) > sizeof(int)) {
+		tt_int_op(evbuffer_set_max_read(buf, (size_t)EV_INT32_MAX + 1), ==, -1);
+		tt_int_op(evbuffer_get_max_read(buf), ==, data_len);
+	}
+
+	data = malloc(data_len);
+	got = malloc(data_len);
+	tt_assert(data && got);
+	for (n = 0; n < data_len; ++n)
+		data[n] = (char)(n * 31 + n / 4096);
+
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+		tt_abort_msg("socketpair failed");
+	evutil_make_socket_nonblocking(pair[0]);
+	/* Ask for big socket buffers so that a lot can be queued at once. */
+	r = (int)data_len;
+	setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, (void *)&r, sizeof(r));
+	setsockopt(pair[1], SOL_SOCKET, SO_RCVBUF, (void *)&r, sizeof(r));
+	while (sent < data_len) {
+		ev_ssize_t w = send(pair[0], data + sent, data_len - sent, 0);
+		if (w <= 0)
+			break;
+		sent += w;
+	}
+	TT_BLATHER(("%d bytes queued", (int)sent));
+	tt_int_op(sent, >, 0);
+
+	/* One read takes everything that is queued, as long as it's no more
+	 * than max_read, and keeps no empty chains afterwards. */
+	r = evbuffer_read(buf, pair[1], -1);
+	tt_int_op(r, ==, sent);
+	evbuffer_validate(buf);
+	tt_int_op(evbuffer_get_length(buf), ==, sent);
+	tt_int_op(buf->last->off, >, 0);
+	if (sent > 4 * v[0].iov_len)
+		tt_int_op(evbuffer_count_chains(buf), >, 4);
+	tt_int_op(evbuffer_remove(buf, got, sent), ==, sent);
+	tt_assert(!memcmp(got, data, sent));
+
+	/* 0 restores the default. */
+	tt_int_op(evbuffer_set_max_read(buf, 0), ==, 0);
+	tt_int_op(evbuffer_get_max_read(buf), ==, 4096);
+
+end:
+	if (pair[0] >= 0)
+		evutil_closesocket(pair[0]);
+	if (pair[1] >= 0)
+		evutil_closesocket(pair[1]);
+	if (data)
+		free(data);
+	if (got)
+		free(got);
+	evbuffer_free(buf);
+	evbuffer_free(tmp);
+}
+
+/* Count the chain, and stop the loop once the current batch is done. */
+static void
+release_done_cb(const void *data, size_t len, void *base)
+{
+	++ref_done_cb_called_count;
+	event_base_loopbreak(base);
+}
+
+static void
+test_evbuffer_deferred_release(void *ptr)
+{
+	struct event_base *base = event_base_new();
+	struct evbuffer *buf = evbuffer_new();
+	static char chunk[8192];
+	const size_t n_chunks = 256;
+	size_t i;
+
+	ref_done_cb_called_count = 0;
+	tt_int_op(evbuffer_defer_release(buf, NULL), ==, -1);
+	tt_int_op(evbuffer_defer_release(buf, base), ==, 0);
+	tt_int_op(evbuffer_defer_release(buf, base), ==, 0);
+
+	for (i = 0; i < n_chunks; ++i)
+		evbuffer_add_reference(buf, chunk, sizeof(chunk),
+		    release_done_cb, base);
+
+	/* Small drains still free their chains right away. */
+	evbuffer_drain(buf, 64 * sizeof(chunk));
+	tt_int_op(ref_done_cb_called_count, ==, 64);
+
+	/* A big one leaves the chains to the loop, which frees them a batch
+	 * at a time. */
+	evbuffer_drain(buf, 191 * sizeof(chunk) + 100);
+	evbuffer_validate(buf);
+	tt_int_op(evbuffer_get_length(buf), ==, sizeof(chunk) - 100);
+	tt_int_op(ref_done_cb_called_count, ==, 64);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	tt_int_op(ref_done_cb_called_count, ==, 128);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	tt_int_op(ref_done_cb_called_count, ==, 192);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	tt_int_op(ref_done_cb_called_count, ==, 255);
+
+	/* Draining everything works the same way, and the chains outlive
+	 * the buffer itself. */
+	for (i = 0; i < n_chunks; ++i)
+		evbuffer_add_reference(buf, chunk, sizeof(chunk),
+		    release_done_cb, base);
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+	tt_int_op(ref_done_cb_called_count, ==, 255);
+	evbuffer_add(buf, "x", 1);
+	evbuffer_validate(buf);
+	evbuffer_free(buf);
+	buf = NULL;
+	tt_int_op(ref_done_cb_called_count, ==, 255);
+	for (i = 0; i < 5; ++i)
+		event_base_loop(base, EVLOOP_NONBLOCK);
+	tt_int_op(ref_done_cb_called_count, ==, 512);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+	event_base_free(base);
+}
+
+static void
+test_evbuffer_crc32c(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *tmp = evbuffer_new();
+	struct evbuffer *all = evbuffer_new();
+	struct evbuffer_ptr pos;
+	struct evbuffer_iovec v;
+	ev_uint32_t crc, expect;
+	ev_uint64_t hash;
+	char big[5000];
+	int i;
+
+	/* The standard check value, split over three chains. */
+	evbuffer_add_reference(buf, "123", 3, NULL, NULL);
+	evbuffer_add_reference(buf, "4567", 4, NULL, NULL);
+	evbuffer_add_reference(buf, "89", 2, NULL, NULL);
+	crc = 0;
+	tt_int_op(evbuffer_crc32c(buf, NULL, -1, &crc), ==, 0);
+	tt_int_op(crc, ==, 0xe3069283);
+
+	/* Continuing a checksum over two ranges gives the same answer. */
+	crc = 0;
+	tt_int_op(evbuffer_crc32c(buf, NULL, 5, &crc), ==, 0);
+	evbuffer_ptr_set(buf, &pos, 5, EVBUFFER_PTR_SET);
+	tt_int_op(evbuffer_crc32c(buf, &pos, 4, &crc), ==, 0);
+	tt_int_op(crc, ==, 0xe3069283);
+	tt_int_op(evbuffer_crc32c(buf, &pos, 5, &crc), ==, -1);
+
+	hash = 0;
+	tt_int_op(evbuffer_hash64(buf, NULL, 0, &hash), ==, 0);
+	tt_assert(hash == ((((ev_uint64_t)0xcbf29ce4) << 32) | 0x84222325));
+	evbuffer_ptr_set(buf, &pos, 8, EVBUFFER_PTR_SET);
+	tt_int_op(evbuffer_hash64(buf, &pos, -1, &hash), ==, 0);
+	/* FNV-1a 64 of "9" */
+	tt_assert(hash == ((((ev_uint64_t)0xaf63b44c) << 32) | 0x8601a894));
+	tt_int_op(evbuffer_hash64(buf, &pos, 2, &hash), ==, -1);
+
+	/* Long unaligned runs take the word-at-a-time path, if there is
+	 * one; check it against the byte-at-a-time answer. */
+	for (i = 0; i < (int)sizeof(big); ++i)
+		big[i] = (char)(i * 7 + 3);
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+	evbuffer_add(buf, big + 1, sizeof(big) - 1);
+	crc = 0;
+	evbuffer_crc32c(buf, NULL, -1, &crc);
+	expect = 0;
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+	for (i = 1; i < (int)sizeof(big); ++i) {
+		evbuffer_add(tmp, big + i, 1);
+		evbuffer_crc32c(tmp, NULL, -1, &expect);
+		evbuffer_drain(tmp, 1);
+	}
+	tt_int_op(crc, ==, expect);
+
+	/* A running checksum follows appends through every path. */
+	evbuffer_add(buf, "skipped", 7);
+	tt_int_op(evbuffer_set_flags(buf, EVBUFFER_FLAG_RUNNING_CRC32C), ==, 0);
+	tt_int_op(evbuffer_get_running_crc32c(buf), ==, 0);
+	evbuffer_add(buf, big, 100);
+	evbuffer_add(all, big, 100);
+	evbuffer_drain(buf, 50);
+	evbuffer_prepend(buf, "front", 5);
+	evbuffer_add_reference(buf, big + 100, 3000, NULL, NULL);
+	evbuffer_add(all, big + 100, 3000);
+	evbuffer_add(tmp, big + 3100, 1000);
+	evbuffer_add_buffer(buf, tmp);
+	evbuffer_add(all, big + 3100, 1000);
+	tt_int_op(evbuffer_reserve_space(buf, 200, &v, 1), ==, 1);
+	memcpy(v.iov_base, big + 4100, 200);
+	v.iov_len = 200;
+	evbuffer_commit_space(buf, &v, 1);
+	evbuffer_add(all, big + 4100, 200);
+	evbuffer_add_printf(buf, "%d", 12345);
+	evbuffer_add(all, "12345", 5);
+
+	expect = 0;
+	evbuffer_crc32c(all, NULL, -1, &expect);
+	tt_int_op(evbuffer_get_running_crc32c(buf), ==, expect);
+
+end:
+	evbuffer_free(buf);
+	evbuffer_free(tmp);
+	evbuffer_free(all);
+}
+
+static void
+test_evbuffer_crc32c_sendfile(void *ptr)
+{
+	struct evbuffer *src = evbuffer_new();
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *all = evbuffer_new();
+	ev_uint32_t crc, expect;
+	ev_uint64_t hash;
+	char *data = NULL, *tmpfilename = NULL, *tmpfilename2 = NULL;
+	size_t datalen = 100000, n;
+	int fd, fd2, sendfile_src;
+
+	data = malloc(datalen);
+	tt_assert(data);
+	for (n = 0; n < datalen; ++n)
+		data[n] = (char)(n * 13 + n / 517);
+	fd = regress_make_tmpfile(data, datalen, &tmpfilename);
+	tt_int_op(fd, >=, 0);
+	fd2 = regress_make_tmpfile(data, datalen, &tmpfilename2);
+	tt_int_op(fd2, >=, 0);
+
+	/* We can't checksum data that only lives in a file, but we
+	 * mustn't crash trying. */
+	evbuffer_set_flags(src, EVBUFFER_FLAG_DRAINS_TO_FD);
+	tt_int_op(evbuffer_add_file(src, fd, 0, datalen), ==, 0);
+	sendfile_src = (src->first->flags & EVBUFFER_SENDFILE) != 0;
+	if (sendfile_src) {
+		crc = 0;
+		tt_int_op(evbuffer_crc32c(src, NULL, -1, &crc), ==, -1);
+		tt_int_op(crc, ==, 0);
+		tt_int_op(evbuffer_hash64(src, NULL, -1, &hash), ==, -1);
+	}
+
+	/* A running CRC makes file segments come into memory, even on a
+	 * buffer that drains to a fd. */
+	evbuffer_set_flags(buf,
+	    EVBUFFER_FLAG_DRAINS_TO_FD|EVBUFFER_FLAG_RUNNING_CRC32C);
+	evbuffer_add(buf, "abc", 3);
+	evbuffer_add(all, "abc", 3);
+	tt_int_op(evbuffer_add_file(buf, fd2, 0, datalen), ==, 0);
+	evbuffer_add(all, data, datalen);
+	tt_assert(!(buf->last->flags & EVBUFFER_SENDFILE));
+	expect = 0;
+	tt_int_op(evbuffer_crc32c(all, NULL, -1, &expect), ==, 0);
+	tt_int_op(evbuffer_get_running_crc32c(buf), ==, expect);
+	crc = 0;
+	tt_int_op(evbuffer_crc32c(buf, NULL, -1, &crc), ==, 0);
+	tt_int_op(crc, ==, expect);
+
+	/* Moving sendfile data in stops the running CRC where it was. */
+	evbuffer_add_buffer(buf, src);
+	evbuffer_add(buf, "more", 4);
+	tt_int_op(evbuffer_get_length(buf), ==, 7 + 2 * datalen);
+	if (sendfile_src) {
+		tt_assert(!(buf->flags & EVBUFFER_FLAG_RUNNING_CRC32C));
+	} else {
+		evbuffer_add(all, data, datalen);
+		evbuffer_add(all, "more", 4);
+		expect = 0;
+		evbuffer_crc32c(all, NULL, -1, &expect);
+	}
+	tt_int_op(evbuffer_get_running_crc32c(buf), ==, expect);
+
+end:
+	evbuffer_free(src);
+	evbuffer_free(buf);
+	evbuffer_free(all);
+	if (data)
+		free(data);
+	if (tmpfilename) {
+		unlink(tmpfilename);
+		free(tmpfilename);
+	}
+	if (tmpfilename2) {
+		unlink(tmpfilename2);
+		free(tmpfilename2);
+	}
+}
+
 static void
 check_prepend(struct evbuffer *buffer,
     const struct evbuffer_cb_info *cbinfo,
@@ -2482,6 +3322,307 @@ end:
 		evbuffer_free(buf);
 }
 
+static void
+test_evbuffer_compact(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *tmp = evbuffer_new();
+	char expect[3001], got[3000];
+	evutil_socket_t pair[2] = { -1, -1 };
+	int i, n_chains;
+
+	/* 300 ten-byte chains, with a reference chain in the middle. */
+	for (i = 0; i < 300; ++i) {
+		evutil_snprintf(expect+i*10, 11, "line %4d\n", i);
+		if (i == 150) {
+			evbuffer_add_reference(buf, expect+i*10, 10,
+			    NULL, NULL);
+			continue;
+		}
+		evbuffer_add(tmp, expect+i*10, 10);
+		evbuffer_add_buffer(buf, tmp);
+	}
+	evbuffer_validate(buf);
+	tt_int_op(evbuffer_count_chains(buf), ==, 300);
+
+	tt_int_op(evbuffer_compact(buf), ==, 299);
+	evbuffer_validate(buf);
+	tt_int_op(evbuffer_count_chains(buf), ==, 1);
+	tt_int_op(evbuffer_get_length(buf), ==, 3000);
+	tt_int_op(evbuffer_copyout(buf, got, 3000), ==, 3000);
+	tt_assert(!memcmp(got, expect, 3000));
+
+	/* Nothing left to do; appending still works afterwards. */
+	tt_int_op(evbuffer_compact(buf), ==, 0);
+	evbuffer_add(buf, "x", 1);
+	evbuffer_validate(buf);
+	evbuffer_drain(buf, 3001);
+
+	/* Writing a buffer with more small chains than one writev takes
+	 * compacts them first, so it all goes out in one call. */
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+		tt_abort_msg("socketpair failed");
+	for (i = 0; i < 300; ++i) {
+		evbuffer_add(tmp, expect+i*10, 10);
+		evbuffer_add_buffer(buf, tmp);
+	}
+	n_chains = evbuffer_count_chains(buf);
+	tt_int_op(n_chains, ==, 300);
+	tt_int_op(evbuffer_write(buf, pair[0]), ==, 3000);
+	evbuffer_validate(buf);
+	tt_int_op(recv(pair[1], got, sizeof(got), 0), ==, 3000);
+	tt_assert(!memcmp(got, expect, 3000));
+
+end:
+	if (pair[0] >= 0)
+		evutil_closesocket(pair[0]);
+	if (pair[1] >= 0)
+		evutil_closesocket(pair[1]);
+	evbuffer_free(buf);
+	evbuffer_free(tmp);
+}
+
+static void
+test_evbuffer_ring(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *tmp = evbuffer_new();
+	struct evbuffer_chain *ring;
+	evutil_socket_t pair[2] = { -1, -1 };
+	char *data = NULL, *got = NULL;
+	unsigned char *p;
+	size_t cap, i;
+
+	evbuffer_add(buf, "x", 1);
+	tt_int_op(evbuffer_set_ring(buf, 100), ==, -1);
+	evbuffer_drain(buf, 1);
+	if (evbuffer_set_ring(buf, 100) < 0)
+		tt_skip();
+	evbuffer_validate(buf);
+	tt_int_op(evbuffer_set_ring(buf, 100), ==, -1);
+	tt_int_op(evbuffer_set_flags(buf, EVBUFFER_FLAG_RING), ==, -1);
+	tt_int_op(evbuffer_clear_flags(buf, EVBUFFER_FLAG_RING), ==, -1);
+
+	ring = buf->first;
+	cap = ring->buffer_len;
+	tt_int_op(cap, >=, 100);
+	data = malloc(cap * 2);
+	got = malloc(cap * 2);
+	tt_assert(data && got);
+	for (i = 0; i < cap * 2; ++i)
+		data[i] = (char)(i % 251);
+
+	/* Fill it exactly; one more byte doesn't fit. */
+	tt_int_op(evbuffer_add(buf, data, cap), ==, 0);
+	tt_int_op(evbuffer_add(buf, "x", 1), ==, -1);
+	tt_int_op(evbuffer_add_reference(buf, "x", 1, NULL, NULL), ==, -1);
+	tt_int_op(evbuffer_get_length(buf), ==, cap);
+
+	/* Drain most of it and add more, so the data wraps.  It is still
+	 * in one piece, and pullup doesn't copy. */
+	evbuffer_drain(buf, cap - 10);
+	tt_int_op(evbuffer_add(buf, data + cap, 100), ==, 0);
+	evbuffer_validate(buf);
+	tt_assert(buf->first == ring && buf->last == ring);
+	tt_int_op(evbuffer_get_contiguous_space(buf), ==, 110);
+	p = evbuffer_pullup(buf, -1);
+	tt_assert(p == ring->buffer + ring->misalign);
+	tt_assert(!memcmp(p, data + cap - 10, 110));
+
+	/* Drain across the end of the first mapping. */
+	evbuffer_drain(buf, 50);
+	evbuffer_validate(buf);
+	tt_int_op(ring->misalign, ==, 40);
+	tt_int_op(evbuffer_remove(buf, got, 60), ==, 60);
+	tt_assert(!memcmp(got, data + cap + 40, 60));
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+
+	/* Prepend into the space before the data, wrapping backwards. */
+	ring->misalign = 5;
+	tt_int_op(evbuffer_add(buf, data + 10, 10), ==, 0);
+	tt_int_op(evbuffer_prepend(buf, data, 10), ==, 0);
+	evbuffer_validate(buf);
+	tt_int_op(ring->misalign, ==, cap - 5);
+	tt_int_op(evbuffer_copyout(buf, got, 20), ==, 20);
+	tt_assert(!memcmp(got, data, 20));
+
+	/* Moving data in and out of a ring copies it. */
+	evbuffer_add(tmp, data + 20, 30);
+	tt_int_op(evbuffer_add_buffer(buf, tmp), ==, 0);
+	tt_int_op(evbuffer_get_length(tmp), ==, 0);
+	tt_int_op(evbuffer_remove_buffer(buf, tmp, 25), ==, 25);
+	tt_int_op(evbuffer_get_length(buf), ==, 25);
+	tt_int_op(evbuffer_add_buffer(tmp, buf), ==, 0);
+	evbuffer_validate(buf);
+	evbuffer_validate(tmp);
+	tt_assert(buf->first == ring);
+	tt_int_op(evbuffer_get_length(tmp), ==, 50);
+	tt_int_op(evbuffer_copyout(tmp, got, 50), ==, 50);
+	tt_assert(!memcmp(got, data, 50));
+	tt_int_op(evbuffer_add_buffer_reference(buf, tmp), ==, -1);
+
+	/* Only as much as fits moves into a nearly-full ring. */
+	evbuffer_add(buf, data, cap - 20);
+	tt_int_op(evbuffer_remove_buffer(tmp, buf, 50), ==, 20);
+	tt_int_op(evbuffer_add_buffer(buf, tmp), ==, -1);
+	tt_int_op(evbuffer_get_length(tmp), ==, 30);
+	evbuffer_drain(buf, cap);
+
+	/* Reads go straight into the ring, and stop when it's full. */
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+		tt_abort_msg("socketpair failed");
+	evutil_make_socket_nonblocking(pair[1]);
+	evbuffer_add(buf, data, cap - 30);
+	evbuffer_drain(buf, cap - 30);
+	tt_int_op(send(pair[0], data, 100, 0), ==, 100);
+	tt_int_op(evbuffer_read(buf, pair[1], -1), ==, 100);
+	evbuffer_validate(buf);
+	tt_assert(!memcmp(evbuffer_pullup(buf, -1), data, 100));
+	evbuffer_add(buf, data, cap - 100);
+	tt_int_op(send(pair[0], data, 1, 0), ==, 1);
+	tt_int_op(evbuffer_read(buf, pair[1], -1), ==, -1);
+
+end:
+	if (pair[0] >= 0)
+		evutil_closesocket(pair[0]);
+	if (pair[1] >= 0)
+		evutil_closesocket(pair[1]);
+	if (data)
+		free(data);
+	if (got)
+		free(got);
+	evbuffer_free(buf);
+	evbuffer_free(tmp);
+}
+
+/* Byte number n of the stream used by test_evbuffer_chain_index. */
+#define CHAIN_INDEX_BYTE(n) ((char)(((n) * 7 + 3) & 0xff))
+
+static void
+test_evbuffer_chain_index(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *tmp = evbuffer_new();
+	struct evbuffer_ptr p;
+	char data[256], got[16];
+	size_t head = 0, tail = 0, len, off;
+	ev_uint32_t seed = 1234;
+	int i, j, k;
+
+	tt_int_op(evbuffer_enable_locking(buf, NULL), ==, 0);
+	tt_int_op(evbuffer_set_flags(buf, EVBUFFER_FLAG_CHAIN_INDEX), ==, 0);
+
+	for (i = 0; i < 40; ++i) {
+		/* Append a few chains of assorted sizes. */
+		for (j = 0; j < 50; ++j) {
+			seed = seed * 1103515245 + 12345;
+			len = 1 + (seed >> 16) % sizeof(data);
+			for (k = 0; k < (int)len; ++k)
+				data[k] = CHAIN_INDEX_BYTE(tail + k);
+			evbuffer_add(tmp, data, len);
+			evbuffer_add_buffer(buf, tmp);
+			tail += len;
+		}
+		evbuffer_validate(buf);
+		tt_int_op(evbuffer_get_length(buf), ==, tail - head);
+
+		/* Look at random positions, both absolutely and relative
+		 * to where we were. */
+		for (j = 0; j < 200; ++j) {
+			seed = seed * 1103515245 + 12345;
+			off = (seed >> 8) % (tail - head);
+			tt_int_op(evbuffer_ptr_set(buf, &p, off,
+				EVBUFFER_PTR_SET), ==, 0);
+			tt_int_op(p.pos, ==, off);
+			tt_int_op(evbuffer_copyout_from(buf, &p, got, 1), ==, 1);
+			tt_int_op(got[0], ==, CHAIN_INDEX_BYTE(head + off));
+			if (off + 300 < tail - head) {
+				tt_int_op(evbuffer_ptr_set(buf, &p, 300,
+					EVBUFFER_PTR_ADD), ==, 0);
+				tt_int_op(evbuffer_copyout_from(buf, &p,
+					got, 1), ==, 1);
+				tt_int_op(got[0], ==,
+				    CHAIN_INDEX_BYTE(head + off + 300));
+			}
+		}
+
+		/* The position just past the end is still valid. */
+		tt_int_op(evbuffer_ptr_set(buf, &p, tail - head,
+			EVBUFFER_PTR_SET), ==, 0);
+		tt_assert(p.internal_.chain == NULL);
+		tt_int_op(evbuffer_ptr_set(buf, &p, tail - head + 1,
+			EVBUFFER_PTR_SET), ==, -1);
+
+		/* Drain part of the front, sometimes in the middle of a
+		 * chain. */
+		seed = seed * 1103515245 + 12345;
+		len = (seed >> 8) % ((tail - head) / 2);
+		evbuffer_drain(buf, len);
+		head += len;
+
+		/* Every so often, shuffle the chains around. */
+		if (i % 10 == 5) {
+			data[0] = CHAIN_INDEX_BYTE(head - 1);
+			evbuffer_prepend(buf, data, 1);
+			--head;
+		} else if (i % 10 == 9) {
+			evbuffer_pullup(buf, 1000);
+		}
+	}
+
+end:
+	evbuffer_free(buf);
+	evbuffer_free(tmp);
+}
+#undef CHAIN_INDEX_BYTE
+
+static void
+test_evbuffer_chain_cache(void *dummy)
+{
+	struct evbuffer *buf = NULL;
+	struct evbuffer_chain *chain;
+	char data[100];
+
+	(void)dummy;
+	memset(data, 'x', sizeof(data));
+
+	if (evbuffer_chain_cache_set_limit(64*1024) < 0)
+		tt_skip();
+
+	/* A freed chain goes into the cache and comes right back out. */
+	buf = evbuffer_new();
+	tt_assert(buf);
+	evbuffer_add(buf, data, sizeof(data));
+	chain = buf->first;
+	tt_assert(chain);
+	evbuffer_drain(buf, sizeof(data));
+	tt_assert(buf->first == NULL);
+	evbuffer_add(buf, data, sizeof(data));
+	tt_assert(buf->first == chain);
+	evbuffer_validate(buf);
+	tt_int_op(evbuffer_get_length(buf), ==, sizeof(data));
+	evbuffer_free(buf);
+
+	/* Once freed, the buffer's chain is cached; trimming releases it. */
+	tt_int_op(evbuffer_chain_cache_trim(0), >=, MIN_BUFFER_SIZE);
+	tt_int_op(evbuffer_chain_cache_trim(0), ==, 0);
+
+	/* With caching off, nothing is retained. */
+	evbuffer_chain_cache_set_limit(0);
+	buf = evbuffer_new();
+	tt_assert(buf);
+	evbuffer_add(buf, data, sizeof(data));
+	evbuffer_free(buf);
+	buf = NULL;
+	tt_int_op(evbuffer_chain_cache_trim(0), ==, 0);
+
+end:
+	evbuffer_chain_cache_set_limit(0);
+	evbuffer_chain_cache_trim(0);
+	if (buf)
+		evbuffer_free(buf);
+}
+
 static void *
 setup_passthrough(const struct testcase_t *testcase)
 {
@@ -2526,6 +3667,7 @@ struct testcase_t evbuffer_testcases[] = {
 	{ "add_reference", test_evbuffer_add_reference, 0, NULL, NULL },
 	{ "multicast", test_evbuffer_multicast, 0, NULL, NULL },
 	{ "multicast_drain", test_evbuffer_multicast_drain, 0, NULL, NULL },
+	{ "broadcast", test_evbuffer_broadcast, 0, NULL, NULL },
 	{ "prepend", test_evbuffer_prepend, TT_FORK, NULL, NULL },
 	{ "peek", test_evbuffer_peek, 0, NULL, NULL },
 	{ "peek_first_gt", test_evbuffer_peek_first_gt, 0, NULL, NULL },
@@ -2533,6 +3675,20 @@ struct testcase_t evbuffer_testcases[] = {
 	{ "freeze_end", test_evbuffer_freeze, 0, &nil_setup, (void*)"end" },
 	{ "add_iovec", test_evbuffer_add_iovec, 0, NULL, NULL},
 	{ "copyout", test_evbuffer_copyout, 0, NULL, NULL},
+	{ "compact", test_evbuffer_compact, 0, NULL, NULL },
+	{ "chain_index", test_evbuffer_chain_index, 0, NULL, NULL },
+	{ "ring", test_evbuffer_ring, 0, NULL, NULL },
+	{ "global_mem", test_evbuffer_global_mem, TT_FORK, NULL, NULL },
+	{ "add_fmt", test_evbuffer_add_fmt, 0, NULL, NULL },
+	{ "iter", test_evbuffer_iter, 0, NULL, NULL },
+	{ "crc32c", test_evbuffer_crc32c, 0, NULL, NULL },
+	{ "crc32c_sendfile", test_evbuffer_crc32c_sendfile, 0, NULL, NULL },
+	{ "arena", test_evbuffer_arena, 0, NULL, NULL },
+	{ "spill", test_evbuffer_spill, 0, NULL, NULL },
+	{ "spill_deferred", test_evbuffer_spill_deferred, TT_FORK, NULL, NULL },
+	{ "read_large", test_evbuffer_read_large, 0, NULL, NULL },
+	{ "deferred_release", test_evbuffer_deferred_release, TT_FORK, NULL, NULL },
+	{ "chain_cache", test_evbuffer_chain_cache, TT_FORK, NULL, NULL },
 	{ "file_segment_add_cleanup_cb", test_evbuffer_file_segment_add_cleanup_cb, 0, NULL, NULL },
 
 #define ADDFILE_TEST(name, parameters)					\
@@ -1327,6 +1327,521 @@ end:
 		bufferevent_free(filter);
 }
 
+struct bufferevent_mem_info {
+	int n_calls;
+	int level;
+	size_t bytes;
+	struct event_base *base;
+};
+
+static void
+bufferevent_mem_record_cb(struct event_base *base, size_t bytes, int level,
+    void *arg)
+{
+	struct bufferevent_mem_info *info = arg;
+	++info->n_calls;
+	info->level = level;
+	info->bytes = bytes;
+	info->base = base;
+}
+
+static void
+test_bufferevent_mem_limits(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	struct bufferevent_mem_info info;
+	struct evbuffer *input;
+	char payload[8192];
+	int i;
+
+	memset(&info, 0, sizeof(info));
+	memset(payload, 'x', sizeof(payload));
+
+	tt_int_op(event_base_set_evbuffer_mem_limits(data->base, 8000, 4000,
+		NULL, NULL), ==, -1);
+	tt_int_op(event_base_set_evbuffer_mem_limits(data->base, 1024, 4096,
+		bufferevent_mem_record_cb, &info), ==, 0);
+	tt_int_op(event_base_get_evbuffer_mem(data->base), ==, 0);
+
+	bev = bufferevent_socket_new(data->base, data->pair[0], 0);
+	tt_assert(bev);
+	input = bufferevent_get_input(bev);
+	bufferevent_enable(bev, EV_READ);
+
+	/* The first read reaches the hard limit; we must stop reading with
+	 * the rest of the data still in the socket. */
+	tt_int_op(send(data->pair[1], payload, sizeof(payload), 0), ==,
+	    sizeof(payload));
+	for (i = 0; i < 5; ++i)
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(evbuffer_get_length(input), ==, 4096);
+	tt_int_op(event_base_get_evbuffer_mem(data->base), ==, 4096);
+	tt_assert(BEV_UPCAST(bev)->read_suspended & BEV_SUSPEND_MEM);
+	tt_int_op(info.n_calls, ==, 1);
+	tt_int_op(info.level, ==, EVBUFFER_MEM_HARD);
+	tt_int_op(info.bytes, ==, 4096);
+	tt_ptr_op(info.base, ==, data->base);
+
+	/* Dropping below the soft limit resumes reading, which takes us
+	 * straight back to the hard limit. */
+	evbuffer_drain(input, 3500);
+	tt_int_op(event_base_get_evbuffer_mem(data->base), ==, 596);
+	for (i = 0; i < 5; ++i)
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(evbuffer_get_length(input), ==, 596 + 4096);
+	tt_assert(BEV_UPCAST(bev)->read_suspended & BEV_SUSPEND_MEM);
+	tt_int_op(info.n_calls, ==, 3);
+	tt_int_op(info.level, ==, EVBUFFER_MEM_HARD);
+
+	/* Draining to the soft limit is not enough to leave the hard level. */
+	evbuffer_drain(input, 596 + 4096 - 2000);
+	for (i = 0; i < 3; ++i)
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_assert(BEV_UPCAST(bev)->read_suspended & BEV_SUSPEND_MEM);
+	tt_int_op(info.n_calls, ==, 3);
+
+	evbuffer_drain(input, 2000);
+	for (i = 0; i < 3; ++i)
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_assert(!(BEV_UPCAST(bev)->read_suspended & BEV_SUSPEND_MEM));
+	tt_int_op(info.n_calls, ==, 4);
+	tt_int_op(info.level, ==, EVBUFFER_MEM_NORMAL);
+	tt_int_op(event_base_get_evbuffer_mem(data->base), ==, 0);
+
+	/* Freeing a bufferevent uncharges its buffers once it has been
+	 * finalized. */
+	tt_int_op(bufferevent_write(bev, "hello", 5), ==, 0);
+	tt_int_op(event_base_get_evbuffer_mem(data->base), ==, 5);
+	bufferevent_free(bev);
+	bev = NULL;
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(event_base_get_evbuffer_mem(data->base), ==, 0);
+
+	/* So does freeing one that is suspended: the account lets go of it
+	 * rather than keeping it, and its charge, alive. */
+	bev = bufferevent_socket_new(data->base, data->pair[0], 0);
+	tt_assert(bev);
+	bufferevent_enable(bev, EV_READ);
+	tt_int_op(send(data->pair[1], payload, sizeof(payload), 0), ==,
+	    sizeof(payload));
+	for (i = 0; i < 5; ++i)
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_assert(BEV_UPCAST(bev)->read_suspended & BEV_SUSPEND_MEM);
+	tt_int_op(event_base_get_evbuffer_mem(data->base), ==, 4096);
+	bufferevent_free(bev);
+	bev = NULL;
+	for (i = 0; i < 3; ++i)
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(event_base_get_evbuffer_mem(data->base), ==, 0);
+end:
+	if (bev)
+		bufferevent_free(bev);
+}
+
+static void
+ring_full_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	short *events = arg;
+	*events |= what;
+}
+
+static void
+test_bufferevent_ring_full(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	struct evbuffer *input;
+	char payload[10000], got[10000];
+	size_t cap, n = 0, len;
+	short events = 0;
+	int i;
+
+	for (i = 0; i < (int)sizeof(payload); ++i)
+		payload[i] = (char)(i * 7 + i / 251);
+
+	bev = bufferevent_socket_new(data->base, data->pair[0], 0);
+	tt_assert(bev);
+	input = bufferevent_get_input(bev);
+	if (evbuffer_set_ring(input, 4096) < 0)
+		tt_skip();
+	bufferevent_setcb(bev, NULL, NULL, ring_full_eventcb, &events);
+	bufferevent_enable(bev, EV_READ);
+
+	tt_int_op(send(data->pair[1], payload, sizeof(payload), 0), ==,
+	    sizeof(payload));
+	for (i = 0; i < 5; ++i)
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+	cap = evbuffer_get_length(input);
+	if (cap >= sizeof(payload))
+		tt_skip();
+
+	/* With no watermark set, a full ring stops reading without any
+	 * error, and each drain lets the rest in. */
+	tt_int_op(events, ==, 0);
+	while (n < sizeof(payload)) {
+		tt_assert(BEV_UPCAST(bev)->read_suspended & BEV_SUSPEND_WM ||
+		    n + evbuffer_get_length(input) == sizeof(payload));
+		len = evbuffer_get_length(input);
+		tt_assert(len > 0);
+		tt_int_op(evbuffer_remove(input, got + n, len), ==, len);
+		n += len;
+		for (i = 0; i < 5; ++i)
+			event_base_loop(data->base, EVLOOP_NONBLOCK);
+	}
+	tt_int_op(events, ==, 0);
+	tt_assert(!memcmp(got, payload, sizeof(payload)));
+	tt_assert(!(BEV_UPCAST(bev)->read_suspended & BEV_SUSPEND_WM));
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+}
+
+static void
+test_bufferevent_rate_limit_tree(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct timeval tick = { 10, 0 };
+	struct ev_token_bucket_cfg *nic_cfg = NULL, *tenant_cfg = NULL;
+	struct bufferevent_rate_limit_group *nic = NULL;
+	struct bufferevent_rate_limit_group *tenant[2] = { NULL, NULL };
+	struct bufferevent *bev[2] = { NULL, NULL };
+	evutil_socket_t pair2[2] = { -1, -1 };
+	ev_uint64_t nic_written, written[2];
+	char payload[65536];
+	int i;
+
+	memset(payload, 'x', sizeof(payload));
+	tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair2), ==, 0);
+	evutil_make_socket_nonblocking(pair2[0]);
+
+	/* Two tenants with plenty of room each, sharing one small budget
+	 * that doesn't refill while we're looking. */
+	nic_cfg = ev_token_bucket_cfg_new(1<<20, 1<<20, 4096, 4096, &tick);
+	tenant_cfg = ev_token_bucket_cfg_new(1<<20, 1<<20, 1<<20, 1<<20,
+	    &tick);
+	tt_assert(nic_cfg && tenant_cfg);
+	nic = bufferevent_rate_limit_group_new(data->base, nic_cfg);
+	for (i = 0; i < 2; ++i) {
+		tenant[i] = bufferevent_rate_limit_group_new(data->base,
+		    tenant_cfg);
+		tt_assert(tenant[i]);
+		tt_int_op(bufferevent_rate_limit_group_set_parent(tenant[i],
+			nic), ==, 0);
+	}
+	tt_int_op(bufferevent_rate_limit_group_set_parent(nic, tenant[0]),
+	    ==, -1);
+	tt_int_op(bufferevent_rate_limit_group_set_parent(nic, nic), ==, -1);
+
+	bev[0] = bufferevent_socket_new(data->base, data->pair[0], 0);
+	bev[1] = bufferevent_socket_new(data->base, pair2[0], 0);
+	for (i = 0; i < 2; ++i) {
+		tt_assert(bev[i]);
+		tt_int_op(bufferevent_add_to_rate_limit_group(bev[i],
+			tenant[i]), ==, 0);
+		tt_int_op(bufferevent_write(bev[i], payload, sizeof(payload)),
+		    ==, 0);
+	}
+	/* Groups with members can't be moved. */
+	tt_int_op(bufferevent_rate_limit_group_set_parent(tenant[0], NULL),
+	    ==, -1);
+
+	for (i = 0; i < 10; ++i)
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+
+	/* Everything written came out of the shared budget, which stopped
+	 * both tenants once it ran out. */
+	bufferevent_rate_limit_group_get_totals(nic, NULL, &nic_written);
+	bufferevent_rate_limit_group_get_totals(tenant[0], NULL, &written[0]);
+	bufferevent_rate_limit_group_get_totals(tenant[1], NULL, &written[1]);
+	TT_BLATHER(("wrote %d + %d", (int)written[0], (int)written[1]));
+	tt_int_op(nic_written, >=, 4096);
+	tt_int_op(nic_written, <=, 4096 + 64);
+	tt_int_op(written[0] + written[1], ==, nic_written);
+	tt_int_op(written[0], >, 0);
+	tt_int_op(written[1], >, 0);
+	for (i = 0; i < 2; ++i) {
+		tt_assert(BEV_UPCAST(bev[i])->write_suspended &
+		    BEV_SUSPEND_BW_GROUP);
+		tt_ptr_op(BEV_UPCAST(bev[i])->rate_limiting->write_waiting_on,
+		    ==, nic);
+		tt_int_op(bufferevent_get_max_to_write(bev[i]), ==, 0);
+	}
+
+	/* Topping up the shared budget wakes both of them. */
+	bufferevent_rate_limit_group_decrement_write(nic, -8192);
+	for (i = 0; i < 2; ++i) {
+		tt_assert(!(BEV_UPCAST(bev[i])->write_suspended &
+			BEV_SUSPEND_BW_GROUP));
+		tt_ptr_op(BEV_UPCAST(bev[i])->rate_limiting->write_waiting_on,
+		    ==, NULL);
+	}
+	for (i = 0; i < 10; ++i)
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+	bufferevent_rate_limit_group_get_totals(nic, NULL, &nic_written);
+	tt_int_op(nic_written, >=, 4096 + 8192);
+	tt_int_op(nic_written, <=, 4096 + 8192 + 128);
+
+end:
+	for (i = 0; i < 2; ++i) {
+		if (bev[i])
+			bufferevent_free(bev[i]);
+	}
+	/* Let them leave their groups. */
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	for (i = 0; i < 2; ++i) {
+		if (tenant[i])
+			bufferevent_rate_limit_group_free(tenant[i]);
+	}
+	if (nic)
+		bufferevent_rate_limit_group_free(nic);
+	if (nic_cfg)
+		ev_token_bucket_cfg_free(nic_cfg);
+	if (tenant_cfg)
+		ev_token_bucket_cfg_free(tenant_cfg);
+	if (pair2[0] >= 0)
+		evutil_closesocket(pair2[0]);
+	if (pair2[1] >= 0)
+		evutil_closesocket(pair2[1]);
+}
+
+static void
+test_bufferevent_rate_limit_queue(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct timeval tick = { 10, 0 };
+	struct ev_token_bucket_cfg *cfg = NULL;
+	struct bufferevent_rate_limit_group *g = NULL;
+	struct bufferevent *bev[8];
+	struct bufferevent_private *bevp;
+	int i;
+
+	memset(bev, 0, sizeof(bev));
+	cfg = ev_token_bucket_cfg_new(1000, 1000, 1000, 1000, &tick);
+	tt_assert(cfg);
+	g = bufferevent_rate_limit_group_new(data->base, cfg);
+	tt_assert(g);
+	bufferevent_rate_limit_group_set_min_share(g, 100);
+	for (i = 0; i < 8; ++i) {
+		bev[i] = bufferevent_socket_new(data->base, -1, 0);
+		tt_assert(bev[i]);
+		tt_int_op(bufferevent_add_to_rate_limit_group(bev[i], g),
+		    ==, 0);
+	}
+
+	/* Running dry doesn't visit the members; each one gets in line
+	 * when it next asks how much it may write. */
+	bufferevent_rate_limit_group_decrement_write(g,
+	    bufferevent_rate_limit_group_get_write_limit(g));
+	for (i = 0; i < 8; ++i) {
+		bevp = BEV_UPCAST(bev[i]);
+		tt_assert(!(bevp->write_suspended & BEV_SUSPEND_BW_GROUP));
+		tt_int_op(bufferevent_get_max_to_write(bev[i]), ==, 0);
+		tt_assert(bevp->write_suspended & BEV_SUSPEND_BW_GROUP);
+		tt_ptr_op(bevp->rate_limiting->write_waiting_on, ==, g);
+	}
+
+	/* 250 bytes at a 100-byte minimum share is enough for three of
+	 * them: the three that have waited longest. */
+	bufferevent_rate_limit_group_decrement_write(g, -250);
+	for (i = 0; i < 8; ++i) {
+		bevp = BEV_UPCAST(bev[i]);
+		tt_ptr_op(bevp->rate_limiting->write_waiting_on, ==,
+		    i < 3 ? NULL : g);
+		tt_int_op(!!(bevp->write_suspended & BEV_SUSPEND_BW_GROUP),
+		    ==, i >= 3);
+	}
+
+	/* Once those three run it dry again, they go to the back of the
+	 * line, and the next refill wakes the next three. */
+	bufferevent_rate_limit_group_decrement_write(g, 250);
+	for (i = 0; i < 3; ++i)
+		tt_int_op(bufferevent_get_max_to_write(bev[i]), ==, 0);
+	bufferevent_rate_limit_group_decrement_write(g, -250);
+	for (i = 0; i < 8; ++i) {
+		bevp = BEV_UPCAST(bev[i]);
+		tt_ptr_op(bevp->rate_limiting->write_waiting_on, ==,
+		    (i >= 3 && i < 6) ? NULL : g);
+	}
+
+	/* Leaving the group also leaves the line. */
+	bufferevent_free(bev[6]);
+	bev[6] = NULL;
+	bufferevent_rate_limit_group_decrement_write(g, 250);
+	bufferevent_rate_limit_group_decrement_write(g, -1000);
+	for (i = 0; i < 8; ++i) {
+		if (bev[i])
+			tt_ptr_op(BEV_UPCAST(bev[i])->rate_limiting->
+			    write_waiting_on, ==, NULL);
+	}
+
+end:
+	for (i = 0; i < 8; ++i) {
+		if (bev[i])
+			bufferevent_free(bev[i]);
+	}
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	if (g)
+		bufferevent_rate_limit_group_free(g);
+	if (cfg)
+		ev_token_bucket_cfg_free(cfg);
+}
+
+static void
+test_bufferevent_rate_limit_shard(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct timeval tick = { 10, 0 };
+	struct ev_token_bucket_cfg *cfg = NULL;
+	struct bufferevent_rate_limit_group *g = NULL, *g2 = NULL;
+	struct bufferevent *bev = NULL;
+	ev_uint64_t written;
+	char payload[65536];
+	int i;
+
+	memset(payload, 'x', sizeof(payload));
+	cfg = ev_token_bucket_cfg_new(1<<20, 1<<20, 4096, 4096, &tick);
+	tt_assert(cfg);
+	g = bufferevent_rate_limit_group_new(data->base, cfg);
+	g2 = bufferevent_rate_limit_group_new(data->base, cfg);
+	tt_assert(g && g2);
+#ifndef EVUTIL_HAVE_ATOMICS_
+	tt_int_op(bufferevent_rate_limit_group_set_shard_batch(g, 1024), ==,
+	    -1);
+	tt_skip();
+#endif
+	tt_int_op(bufferevent_rate_limit_group_set_shard_batch(g, 1024), ==, 0);
+	/* Sharded groups don't nest. */
+	tt_int_op(bufferevent_rate_limit_group_set_parent(g, g2), ==, -1);
+	tt_int_op(bufferevent_rate_limit_group_set_parent(g2, g), ==, -1);
+
+	bev = bufferevent_socket_new(data->base, data->pair[0], 0);
+	tt_assert(bev);
+	tt_int_op(bufferevent_add_to_rate_limit_group(bev, g), ==, 0);
+	tt_int_op(bufferevent_rate_limit_group_set_shard_batch(g, 0), ==, -1);
+
+	/* Our base takes one batch from the group, and we may write all of
+	 * it without going back. */
+	tt_int_op(bufferevent_get_max_to_write(bev), ==, 1024);
+	tt_int_op(bufferevent_rate_limit_group_get_write_limit(g), ==, 3072);
+
+	tt_int_op(bufferevent_write(bev, payload, sizeof(payload)), ==, 0);
+	for (i = 0; i < 10; ++i)
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+
+	/* Nothing is overdrawn: we stop exactly when the group is dry. */
+	bufferevent_rate_limit_group_get_totals(g, NULL, &written);
+	tt_int_op(written, ==, 4096);
+	tt_int_op(bufferevent_rate_limit_group_get_write_limit(g), ==, 0);
+	tt_assert(BEV_UPCAST(bev)->write_suspended & BEV_SUSPEND_BW_GROUP);
+	tt_ptr_op(BEV_UPCAST(bev)->rate_limiting->write_waiting_on, ==, g);
+
+	bufferevent_rate_limit_group_decrement_write(g, -2048);
+	tt_assert(!(BEV_UPCAST(bev)->write_suspended & BEV_SUSPEND_BW_GROUP));
+	for (i = 0; i < 10; ++i)
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+	bufferevent_rate_limit_group_get_totals(g, NULL, &written);
+	tt_int_op(written, ==, 4096 + 2048);
+
+	bufferevent_rate_limit_group_reset_totals(g);
+	bufferevent_rate_limit_group_get_totals(g, NULL, &written);
+	tt_int_op(written, ==, 0);
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	if (g)
+		bufferevent_rate_limit_group_free(g);
+	if (g2)
+		bufferevent_rate_limit_group_free(g2);
+	if (cfg)
+		ev_token_bucket_cfg_free(cfg);
+}
+
+static void
+coalesce_write_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bufferevent **bevs = arg;
+	int i;
+
+	for (i = 0; i < 2; ++i) {
+		bufferevent_write(bevs[i], "abc", 3);
+		bufferevent_write(bevs[i], "def", 3);
+		bufferevent_write(bevs[i], "ghi", 3);
+	}
+}
+
+static void
+test_bufferevent_coalesce_writes(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bevs[2] = { NULL, NULL };
+	evutil_socket_t pair[2] = { -1, -1 };
+	struct event *ev = NULL;
+	struct evbuffer *expect = NULL;
+	char buf[4096];
+	size_t got = 0, total;
+	int i, n;
+
+	tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair), ==, 0);
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+
+	bevs[0] = bufferevent_socket_new(data->base, data->pair[0],
+	    BEV_OPT_COALESCE_WRITES);
+	bevs[1] = bufferevent_socket_new(data->base, pair[0], 0);
+	tt_assert(bevs[0] && bevs[1]);
+
+	/* Writes made from a callback go out in the same loop iteration
+	 * with the flag, and have to wait for the next one without it. */
+	ev = event_new(data->base, -1, 0, coalesce_write_cb, bevs);
+	tt_assert(ev);
+	event_active(ev, EV_TIMEOUT, 1);
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bevs[0])), ==, 0);
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bevs[1])), ==, 9);
+	tt_int_op(recv(data->pair[1], buf, sizeof(buf), 0), ==, 9);
+	tt_mem_op(buf, ==, "abcdefghi", 9);
+
+	/* More than the socket takes at once: the rest goes out as it
+	 * becomes writable. */
+	expect = evbuffer_new();
+	for (i = 0; i < 100000; ++i)
+		evbuffer_add_printf(expect, "%d\n", i * 7);
+	total = evbuffer_get_length(expect);
+	for (i = 0; i < 100; ++i) {
+		tt_int_op(bufferevent_write(bevs[0],
+			(char *)evbuffer_pullup(expect, -1) + total * i / 100,
+			total * (i + 1) / 100 - total * i / 100), ==, 0);
+	}
+	for (i = 0; i < 10000 && got < total; ++i) {
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+		while ((n = recv(data->pair[1], buf, sizeof(buf), 0)) > 0) {
+			tt_mem_op(buf, ==,
+			    (char *)evbuffer_pullup(expect, -1) + got, n);
+			got += n;
+		}
+	}
+	tt_int_op(got, ==, total);
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bevs[0])), ==, 0);
+
+end:
+	if (ev)
+		event_free(ev);
+	if (expect)
+		evbuffer_free(expect);
+	if (bevs[0])
+		bufferevent_free(bevs[0]);
+	if (bevs[1])
+		bufferevent_free(bevs[1]);
+	if (pair[0] >= 0)
+		evutil_closesocket(pair[0]);
+	if (pair[1] >= 0)
+		evutil_closesocket(pair[1]);
+}
+
 struct testcase_t bufferevent_testcases[] = {
 
 	LEGACY(bufferevent, TT_ISOLATED),
@@ -1402,6 +1917,24 @@ struct testcase_t bufferevent_testcases[] = {
 	{ "bufferevent_filter_data_stuck",
 	  test_bufferevent_filter_data_stuck,
 	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_mem_limits",
+	  test_bufferevent_mem_limits,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "bufferevent_ring_full",
+	  test_bufferevent_ring_full,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "bufferevent_rate_limit_tree",
+	  test_bufferevent_rate_limit_tree,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "bufferevent_rate_limit_queue",
+	  test_bufferevent_rate_limit_queue,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_rate_limit_shard",
+	  test_bufferevent_rate_limit_shard,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "bufferevent_coalesce_writes",
+	  test_bufferevent_coalesce_writes,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
 
 	END_OF_TESTCASES,
 };
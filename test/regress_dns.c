@@ -67,7 +67,9 @@
 #include "event2/event_struct.h"
 #include "event2/util.h"
 #include "event2/listener.h"
+#include "event2/buffer.h"
 #include "event2/bufferevent.h"
+#include "bufferevent-internal.h"
 #include "log-internal.h"
 #include "regress.h"
 #include "regress_testutils.h"
@@ -1122,6 +1124,19 @@ be_getaddrinfo_server_cb(struct evdns_server_request *req, void *data)
 				evdns_server_request_drop(req);
 				return;
 			}
+		} else if (qtype == EVDNS_TYPE_A &&
+		    (!evutil_ascii_strcasecmp(qname, "several.example.com") ||
+		     !evutil_ascii_strcasecmp(qname, "refusing.example.com"))) {
+			/* Nothing listens on 127.0.0.2 or 127.0.0.3. */
+			ev_uint32_t addrs[2];
+			addrs[0] = htonl(0x7f000002);
+			addrs[1] = htonl(
+			    !evutil_ascii_strcasecmp(qname,
+				"several.example.com") ?
+			    0x7f000001 : 0x7f000003);
+			evdns_server_request_add_a_reply(req, qname,
+			    2, addrs, 2000);
+			added_any = 1;
 		} else if (!evutil_ascii_strcasecmp(qname,
 			"all-timeout.example.com")) {
 			/* drop all requests */
@@ -1316,6 +1331,311 @@ end:
 		bufferevent_free(be5);
 }
 
+/* Bufferevent event callback for the connect_hostname_race test. */
+static void
+be_connect_race_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+	struct be_conn_hostname_result *got = ctx;
+
+	if (got->what) {
+		TT_FAIL(("Two events on one bufferevent. %d,%d",
+			got->what, (int)what));
+		return;
+	}
+	got->what = what;
+	got->dnserr = EVUTIL_SOCKET_ERROR();
+	if (++total_connected_or_failed == 2)
+		event_base_loopexit(be_connect_hostname_base, NULL);
+}
+
+static void
+test_bufferevent_connect_hostname_race(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evconnlistener *listener = NULL;
+	struct bufferevent *be1 = NULL, *be2 = NULL;
+	struct be_conn_hostname_result be1_outcome = {0,0},
+	       be2_outcome = {0,0};
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port = NULL;
+	struct sockaddr_in sin, peer;
+	ev_socklen_t peerlen = sizeof(peer);
+	struct timeval tv = { 5, 0 };
+	int listener_port = -1;
+	ev_uint16_t dns_port = 0;
+	int n_accept = 0, n_dns = 0;
+	char buf[128];
+
+	be_connect_hostname_base = data->base;
+	total_connected_or_failed = 0;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001); /* 127.0.0.1 */
+	listener = evconnlistener_new_bind(data->base, nil_accept_cb,
+	    &n_accept, LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_EXEC,
+	    -1, (struct sockaddr *)&sin, sizeof(sin));
+	tt_assert(listener);
+	listener_port = regress_get_socket_port(
+		evconnlistener_get_fd(listener));
+
+	port = regress_get_dnsserver(data->base, &dns_port, NULL,
+	    be_getaddrinfo_server_cb, &n_dns);
+	tt_assert(port);
+	dns = evdns_base_new(data->base, 0);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)dns_port);
+	evdns_base_nameserver_ip_add(dns, buf);
+
+	be1 = bufferevent_socket_new(data->base, -1, BEV_OPT_CLOSE_ON_FREE);
+	be2 = bufferevent_socket_new(data->base, -1, BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(be1, NULL, NULL, be_connect_race_event_cb,
+	    &be1_outcome);
+	bufferevent_setcb(be2, NULL, NULL, be_connect_race_event_cb,
+	    &be2_outcome);
+	/* Where 127.0.0.2 doesn't refuse at once, we want a timeout rather
+	 * than a hang. */
+	bufferevent_set_timeouts(be1, NULL, &tv);
+	bufferevent_set_timeouts(be2, NULL, &tv);
+
+	/* The first address is dead; we should end up on the second. */
+	tt_assert(!bufferevent_socket_connect_hostname(be1, dns, AF_INET,
+		"several.example.com", listener_port));
+	/* Both addresses are dead. */
+	tt_assert(!bufferevent_socket_connect_hostname(be2, dns, AF_INET,
+		"refusing.example.com", listener_port));
+
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	tt_int_op(be1_outcome.what, ==, BEV_EVENT_CONNECTED);
+	tt_int_op(bufferevent_socket_get_dns_error(be1), ==, 0);
+	tt_assert(bufferevent_getfd(be1) >= 0);
+	tt_int_op(getpeername(bufferevent_getfd(be1),
+		(struct sockaddr *)&peer, &peerlen), ==, 0);
+	tt_int_op(ntohl(peer.sin_addr.s_addr), ==, 0x7f000001);
+	tt_int_op(ntohs(peer.sin_port), ==, listener_port);
+
+	tt_assert(be2_outcome.what & (BEV_EVENT_ERROR|BEV_EVENT_TIMEOUT));
+	tt_int_op(bufferevent_getfd(be2), <, 0);
+	if (be2_outcome.what == BEV_EVENT_ERROR)
+		tt_int_op(be2_outcome.dnserr, ==, ECONNREFUSED);
+
+	tt_int_op(n_dns, ==, 2);
+
+end:
+	if (listener)
+		evconnlistener_free(listener);
+	if (port)
+		evdns_close_server_port(port);
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (be1)
+		bufferevent_free(be1);
+	if (be2)
+		bufferevent_free(be2);
+}
+
+struct race_free_state {
+	struct bufferevent *bev;
+	int freed;
+};
+
+/* Runs at a higher priority than the bufferevent's events, in the same
+ * iteration in which the winning attempt becomes writable: the listener is
+ * readable as soon as the connection is made.  Free the bufferevent while
+ * that attempt's event is active. */
+static void
+race_free_accept_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct race_free_state *st = arg;
+	evutil_socket_t s;
+
+	if ((s = accept(fd, NULL, NULL)) >= 0)
+		evutil_closesocket(s);
+	if (st->bev && BEV_UPCAST(st->bev)->connect_race) {
+		bufferevent_free(st->bev);
+		st->bev = NULL;
+		st->freed = 1;
+	}
+}
+
+static void
+test_bufferevent_connect_hostname_race_free(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evconnlistener *listener = NULL;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port = NULL;
+	struct event *ev = NULL;
+	struct race_free_state st;
+	struct be_conn_hostname_result outcome = {0,0};
+	struct sockaddr_in sin;
+	struct timeval tv = { 0, 300000 };
+	int listener_port = -1;
+	ev_uint16_t dns_port = 0;
+	int n_dns = 0;
+	char buf[128];
+
+	memset(&st, 0, sizeof(st));
+	tt_int_op(event_base_priority_init(data->base, 2), ==, 0);
+
+	/* We accept by hand, at priority 0. */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001); /* 127.0.0.1 */
+	listener = evconnlistener_new_bind(data->base, NULL, NULL,
+	    LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_EXEC|LEV_OPT_DISABLED,
+	    -1, (struct sockaddr *)&sin, sizeof(sin));
+	tt_assert(listener);
+	listener_port = regress_get_socket_port(
+		evconnlistener_get_fd(listener));
+	ev = event_new(data->base, evconnlistener_get_fd(listener),
+	    EV_READ|EV_PERSIST, race_free_accept_cb, &st);
+	tt_assert(ev);
+	event_priority_set(ev, 0);
+	event_add(ev, NULL);
+
+	port = regress_get_dnsserver(data->base, &dns_port, NULL,
+	    be_getaddrinfo_server_cb, &n_dns);
+	tt_assert(port);
+	dns = evdns_base_new(data->base, 0);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)dns_port);
+	evdns_base_nameserver_ip_add(dns, buf);
+
+	st.bev = bufferevent_socket_new(data->base, -1, BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(st.bev);
+	bufferevent_setcb(st.bev, NULL, NULL, be_connect_race_event_cb,
+	    &outcome);
+	tt_assert(!bufferevent_socket_connect_hostname(st.bev, dns, AF_INET,
+		"several.example.com", listener_port));
+
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	tt_assert(st.freed);
+	tt_int_op(outcome.what, ==, 0);
+
+end:
+	if (ev)
+		event_free(ev);
+	if (st.bev)
+		bufferevent_free(st.bev);
+	if (listener)
+		evconnlistener_free(listener);
+	if (port)
+		evdns_close_server_port(port);
+	if (dns)
+		evdns_base_free(dns, 0);
+}
+
+struct race_restart_state {
+	struct bufferevent *bev;
+	struct evdns_base *dns;
+	int port;
+	int restarted;
+	int n_connected;
+};
+
+/* As race_free_accept_cb, but start over with a new lookup while the
+ * first race is still running. */
+static void
+race_restart_accept_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct race_restart_state *st = arg;
+	evutil_socket_t s;
+
+	if ((s = accept(fd, NULL, NULL)) >= 0)
+		evutil_closesocket(s);
+	if (!st->restarted && BEV_UPCAST(st->bev)->connect_race) {
+		st->restarted = 1;
+		bufferevent_socket_connect_hostname(st->bev, st->dns,
+		    AF_INET, "several.example.com", st->port);
+		tt_ptr_op(BEV_UPCAST(st->bev)->connect_race, ==, NULL);
+	}
+end:
+	;
+}
+
+static void
+race_restart_event_cb(struct bufferevent *bev, short what, void *arg)
+{
+	struct race_restart_state *st = arg;
+
+	if (what & BEV_EVENT_CONNECTED) {
+		if (++st->n_connected == 1)
+			event_base_loopexit(bufferevent_get_base(bev), NULL);
+	}
+}
+
+static void
+test_bufferevent_connect_hostname_race_restart(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evconnlistener *listener = NULL;
+	struct evdns_server_port *port = NULL;
+	struct event *ev = NULL;
+	struct race_restart_state st;
+	struct sockaddr_in sin, peer;
+	ev_socklen_t peerlen = sizeof(peer);
+	struct timeval tv = { 5, 0 };
+	ev_uint16_t dns_port = 0;
+	int n_dns = 0;
+	char buf[128];
+
+	memset(&st, 0, sizeof(st));
+	tt_int_op(event_base_priority_init(data->base, 2), ==, 0);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001); /* 127.0.0.1 */
+	listener = evconnlistener_new_bind(data->base, NULL, NULL,
+	    LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_EXEC|LEV_OPT_DISABLED,
+	    -1, (struct sockaddr *)&sin, sizeof(sin));
+	tt_assert(listener);
+	st.port = regress_get_socket_port(evconnlistener_get_fd(listener));
+	ev = event_new(data->base, evconnlistener_get_fd(listener),
+	    EV_READ|EV_PERSIST, race_restart_accept_cb, &st);
+	tt_assert(ev);
+	event_priority_set(ev, 0);
+	event_add(ev, NULL);
+
+	port = regress_get_dnsserver(data->base, &dns_port, NULL,
+	    be_getaddrinfo_server_cb, &n_dns);
+	tt_assert(port);
+	st.dns = evdns_base_new(data->base, 0);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)dns_port);
+	evdns_base_nameserver_ip_add(st.dns, buf);
+
+	st.bev = bufferevent_socket_new(data->base, -1, BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(st.bev);
+	bufferevent_setcb(st.bev, NULL, NULL, race_restart_event_cb, &st);
+	tt_assert(!bufferevent_socket_connect_hostname(st.bev, st.dns,
+		AF_INET, "several.example.com", st.port));
+
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	/* The first race was dropped; the second one connected, once. */
+	tt_assert(st.restarted);
+	tt_int_op(n_dns, ==, 2);
+	tt_int_op(st.n_connected, ==, 1);
+	tt_ptr_op(BEV_UPCAST(st.bev)->connect_race, ==, NULL);
+	tt_int_op(getpeername(bufferevent_getfd(st.bev),
+		(struct sockaddr *)&peer, &peerlen), ==, 0);
+	tt_int_op(ntohs(peer.sin_port), ==, st.port);
+
+end:
+	if (ev)
+		event_free(ev);
+	if (st.bev)
+		bufferevent_free(st.bev);
+	if (listener)
+		evconnlistener_free(listener);
+	if (port)
+		evdns_close_server_port(port);
+	if (st.dns)
+		evdns_base_free(st.dns, 0);
+}
 
 struct gai_outcome {
 	int err;
@@ -2138,6 +2458,15 @@ struct testcase_t dns_testcases[] = {
 	{ "inflight", dns_inflight_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "bufferevent_connect_hostname", test_bufferevent_connect_hostname,
 	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_connect_hostname_race",
+	  test_bufferevent_connect_hostname_race,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_connect_hostname_race_free",
+	  test_bufferevent_connect_hostname_race_free,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_connect_hostname_race_restart",
+	  test_bufferevent_connect_hostname_race_restart,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "disable_when_inactive", dns_disable_when_inactive_test,
 	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "disable_when_inactive_no_ns", dns_disable_when_inactive_no_ns_test,
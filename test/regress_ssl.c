@@ -50,6 +50,7 @@
 #include "event2/listener.h"
 
 #include "regress.h"
+#include "regress_thread.h"
 #include "tinytest.h"
 #include "tinytest_macros.h"
 
@@ -733,6 +734,720 @@ end:
 	;
 }
 
+struct ktls_test {
+	struct evbuffer *expect;
+	struct evbuffer *got;
+	int filefd;
+	int ktls_send;
+};
+
+static void
+ktls_readcb(struct bufferevent *bev, void *ctx)
+{
+	struct ktls_test *kt = ctx;
+	bufferevent_read_buffer(bev, kt->got);
+	if (evbuffer_get_length(kt->got) >= evbuffer_get_length(kt->expect))
+		event_base_loopexit(bufferevent_get_base(bev), NULL);
+}
+
+static void
+ktls_eventcb(struct bufferevent *bev, short what, void *ctx)
+{
+	struct ktls_test *kt = ctx;
+	struct evbuffer *output = bufferevent_get_output(bev);
+	size_t len = evbuffer_get_length(kt->expect) - 6;
+
+	if (what & BEV_EVENT_CONNECTED) {
+		/* Too late to change our minds. */
+		tt_int_op(bufferevent_openssl_set_ktls(bev, 0), ==, -1);
+		kt->ktls_send = bufferevent_openssl_get_ktls_send(bev);
+		evbuffer_add(output, "head\n", 5);
+		/* The buffer owns the file from here on. */
+		tt_int_op(evbuffer_add_file(output, kt->filefd, 0, len), ==, 0);
+		kt->filefd = -1;
+		evbuffer_add(output, "\n", 1);
+	} else if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		TT_FAIL(("Unexpected event %d", (int)what));
+		event_base_loopexit(bufferevent_get_base(bev), NULL);
+	}
+end:
+	;
+}
+
+static void
+ktls_client_eventcb(struct bufferevent *bev, short what, void *ctx)
+{
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		TT_FAIL(("Unexpected event %d", (int)what));
+		event_base_loopexit(bufferevent_get_base(bev), NULL);
+	}
+}
+
+static void
+regress_bufferevent_openssl_ktls(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct sockaddr_in sin;
+	ev_socklen_t slen = sizeof(sin);
+	evutil_socket_t lfd = -1, fd[2] = { -1, -1 };
+	struct bufferevent *client = NULL, *server = NULL;
+	SSL *ssl;
+	struct ktls_test kt;
+	char *filename = NULL;
+	char *contents = NULL;
+	const size_t len = 256 * 1024;
+	size_t i;
+
+	memset(&kt, 0, sizeof(kt));
+	kt.filefd = -1;
+	init_ssl();
+
+	/* The kernel only does TLS on TCP, so we need a real connection. */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	tt_assert(lfd >= 0);
+	tt_int_op(bind(lfd, (struct sockaddr *)&sin, sizeof(sin)), ==, 0);
+	tt_int_op(listen(lfd, 1), ==, 0);
+	tt_int_op(getsockname(lfd, (struct sockaddr *)&sin, &slen), ==, 0);
+	fd[0] = socket(AF_INET, SOCK_STREAM, 0);
+	tt_assert(fd[0] >= 0);
+	tt_int_op(connect(fd[0], (struct sockaddr *)&sin, sizeof(sin)), ==, 0);
+	fd[1] = accept(lfd, NULL, NULL);
+	tt_assert(fd[1] >= 0);
+	evutil_make_socket_nonblocking(fd[0]);
+	evutil_make_socket_nonblocking(fd[1]);
+
+	contents = malloc(len);
+	tt_assert(contents);
+	for (i = 0; i < len; ++i)
+		contents[i] = 'a' + (i % 26);
+	kt.filefd = regress_make_tmpfile(contents, len, &filename);
+	tt_assert(kt.filefd >= 0);
+	kt.expect = evbuffer_new();
+	kt.got = evbuffer_new();
+	evbuffer_add(kt.expect, "head\n", 5);
+	evbuffer_add(kt.expect, contents, len);
+	evbuffer_add(kt.expect, "\n", 1);
+
+	ssl = SSL_new(get_ssl_ctx());
+	tt_assert(ssl);
+	client = bufferevent_openssl_socket_new(data->base, fd[0], ssl,
+	    BUFFEREVENT_SSL_CONNECTING, BEV_OPT_CLOSE_ON_FREE);
+	fd[0] = -1;
+	ssl = SSL_new(get_ssl_ctx());
+	tt_assert(ssl);
+	SSL_use_certificate(ssl, ssl_getcert());
+	SSL_use_PrivateKey(ssl, ssl_getkey());
+	server = bufferevent_openssl_socket_new(data->base, fd[1], ssl,
+	    BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+	fd[1] = -1;
+	tt_assert(client && server);
+
+#ifdef SSL_OP_ENABLE_KTLS
+	tt_int_op(bufferevent_openssl_set_ktls(client, 1), ==, 0);
+	tt_int_op(bufferevent_openssl_set_ktls(server, 1), ==, 0);
+#else
+	tt_int_op(bufferevent_openssl_set_ktls(server, 1), ==, -1);
+#endif
+
+	bufferevent_setcb(client, ktls_readcb, NULL, ktls_client_eventcb,
+	    &kt);
+	bufferevent_setcb(server, NULL, NULL, ktls_eventcb, &kt);
+	/* The client only reads; the server sends when it is connected. */
+	bufferevent_enable(client, EV_READ);
+	bufferevent_enable(server, EV_READ|EV_WRITE);
+
+	event_base_dispatch(data->base);
+
+	/* Whether or not the kernel could take over, the data is intact. */
+	TT_BLATHER(("kTLS %s", kt.ktls_send == 1 ? "on" : "unavailable"));
+	tt_int_op(kt.ktls_send, >=, 0);
+	tt_int_op(evbuffer_get_length(kt.got), ==,
+	    evbuffer_get_length(kt.expect));
+	tt_assert(!memcmp(evbuffer_pullup(kt.got, -1),
+		evbuffer_pullup(kt.expect, -1), evbuffer_get_length(kt.expect)));
+
+end:
+	if (client)
+		bufferevent_free(client);
+	if (server)
+		bufferevent_free(server);
+	if (kt.expect)
+		evbuffer_free(kt.expect);
+	if (kt.got)
+		evbuffer_free(kt.got);
+	if (kt.filefd >= 0)
+		close(kt.filefd);
+	if (filename) {
+		unlink(filename);
+		free(filename);
+	}
+	if (contents)
+		free(contents);
+	if (lfd >= 0)
+		evutil_closesocket(lfd);
+	if (fd[0] >= 0)
+		evutil_closesocket(fd[0]);
+	if (fd[1] >= 0)
+		evutil_closesocket(fd[1]);
+}
+
+struct record_test {
+	struct bufferevent *client;
+	int n_records;
+	size_t n_got;
+	int phase;
+};
+
+static char record_chunk[100];
+
+/* Each record the client sends is one write into its underlying output. */
+static void
+record_count_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info,
+    void *arg)
+{
+	struct record_test *rt = arg;
+	if (info->n_added)
+		++rt->n_records;
+}
+
+/* Send 64 small chains in one go. */
+static void
+record_send(struct record_test *rt)
+{
+	struct evbuffer *tmp = evbuffer_new();
+	int i;
+
+	for (i = 0; i < 64; ++i)
+		evbuffer_add_reference(tmp, record_chunk,
+		    sizeof(record_chunk), NULL, NULL);
+	rt->n_records = 0;
+	bufferevent_write_buffer(rt->client, tmp);
+	evbuffer_free(tmp);
+}
+
+static void
+record_readcb(struct bufferevent *bev, void *ctx)
+{
+	struct record_test *rt = ctx;
+	struct evbuffer *input = bufferevent_get_input(bev);
+
+	rt->n_got += evbuffer_get_length(input);
+	evbuffer_drain(input, evbuffer_get_length(input));
+	if (rt->n_got < 64 * sizeof(record_chunk))
+		return;
+	rt->n_got = 0;
+	if (rt->phase++ == 0) {
+		/* All 6400 bytes fit in one record. */
+		tt_int_op(rt->n_records, ==, 1);
+		/* 3000 bytes in 1000-byte records, then the rest at once. */
+		tt_int_op(bufferevent_openssl_set_record_sizing(rt->client,
+			1000, 64 * sizeof(record_chunk) + 3000, NULL), ==, 0);
+		record_send(rt);
+		return;
+	}
+	tt_int_op(rt->n_records, ==, 4);
+end:
+	event_base_loopexit(bufferevent_get_base(bev), NULL);
+}
+
+static void
+record_eventcb(struct bufferevent *bev, short what, void *ctx)
+{
+	struct record_test *rt = ctx;
+
+	if (what & BEV_EVENT_CONNECTED) {
+		if (bev == rt->client)
+			record_send(rt);
+	} else if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		TT_FAIL(("Unexpected event %d", (int)what));
+		event_base_loopexit(bufferevent_get_base(bev), NULL);
+	}
+}
+
+static void
+regress_bufferevent_openssl_records(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *pair[2] = { NULL, NULL };
+	struct bufferevent *server = NULL;
+	struct record_test rt;
+	struct timeval tv = { 10, 0 };
+	SSL *ssl;
+
+	memset(&rt, 0, sizeof(rt));
+	memset(record_chunk, 'r', sizeof(record_chunk));
+	init_ssl();
+
+	tt_int_op(bufferevent_pair_new(data->base, 0, pair), ==, 0);
+	ssl = SSL_new(get_ssl_ctx());
+	tt_assert(ssl);
+	rt.client = bufferevent_openssl_filter_new(data->base, pair[0], ssl,
+	    BUFFEREVENT_SSL_CONNECTING, BEV_OPT_CLOSE_ON_FREE);
+	ssl = SSL_new(get_ssl_ctx());
+	tt_assert(ssl);
+	SSL_use_certificate(ssl, ssl_getcert());
+	SSL_use_PrivateKey(ssl, ssl_getkey());
+	server = bufferevent_openssl_filter_new(data->base, pair[1], ssl,
+	    BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(rt.client && server);
+
+	tt_int_op(bufferevent_openssl_set_record_sizing(rt.client,
+		16385, 0, NULL), ==, -1);
+	tt_int_op(bufferevent_openssl_set_record_sizing(pair[0],
+		1000, 0, NULL), ==, -1);
+
+	evbuffer_add_cb(bufferevent_get_output(pair[0]), record_count_cb,
+	    &rt);
+	bufferevent_setcb(rt.client, NULL, NULL, record_eventcb, &rt);
+	bufferevent_setcb(server, record_readcb, NULL, record_eventcb, &rt);
+	bufferevent_enable(rt.client, EV_READ|EV_WRITE);
+	bufferevent_enable(server, EV_READ|EV_WRITE);
+
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	tt_int_op(rt.phase, ==, 2);
+
+end:
+	if (rt.client)
+		bufferevent_free(rt.client);
+	if (server)
+		bufferevent_free(server);
+}
+
+struct read_ahead_test {
+	struct evbuffer *expect;
+	struct evbuffer *got;
+};
+
+/* Take a little at a time, stopping as soon as we are under the watermark,
+ * so that OpenSSL is often left holding records it read ahead while our
+ * reading is suspended. */
+static void
+read_ahead_readcb(struct bufferevent *bev, void *ctx)
+{
+	struct read_ahead_test *rat = ctx;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	int n;
+
+	/* Draining the input can resume reading and call us again from in
+	 * here, so the data has to be in rat->got before that happens. */
+	do {
+		n = evbuffer_remove_buffer(input, rat->got, 700);
+	} while (n > 0 && evbuffer_get_length(input) >= 1000);
+	if (evbuffer_get_length(rat->got) >= evbuffer_get_length(rat->expect))
+		event_base_loopexit(bufferevent_get_base(bev), NULL);
+}
+
+static void
+read_ahead_eventcb(struct bufferevent *bev, short what, void *ctx)
+{
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		TT_FAIL(("Unexpected event %d", (int)what));
+		event_base_loopexit(bufferevent_get_base(bev), NULL);
+	}
+}
+
+static void
+regress_bufferevent_openssl_read_ahead(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *pair[2] = { NULL, NULL };
+	struct bufferevent *client = NULL, *server = NULL;
+	struct read_ahead_test rat;
+	struct timeval tv = { 10, 0 };
+	SSL *ssl;
+	int i;
+
+	memset(&rat, 0, sizeof(rat));
+	init_ssl();
+	rat.expect = evbuffer_new();
+	rat.got = evbuffer_new();
+	for (i = 0; i < 100000; ++i)
+		evbuffer_add_printf(rat.expect, "%d\n", i);
+
+	tt_int_op(bufferevent_pair_new(data->base, 0, pair), ==, 0);
+	ssl = SSL_new(get_ssl_ctx());
+	tt_assert(ssl);
+	client = bufferevent_openssl_filter_new(data->base, pair[0], ssl,
+	    BUFFEREVENT_SSL_CONNECTING, BEV_OPT_CLOSE_ON_FREE);
+	ssl = SSL_new(get_ssl_ctx());
+	tt_assert(ssl);
+	SSL_use_certificate(ssl, ssl_getcert());
+	SSL_use_PrivateKey(ssl, ssl_getkey());
+	server = bufferevent_openssl_filter_new(data->base, pair[1], ssl,
+	    BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(client && server);
+	tt_int_op(SSL_get_read_ahead(ssl), ==, 1);
+
+	bufferevent_setwatermark(server, EV_READ, 0, 1000);
+	bufferevent_setcb(client, NULL, NULL, read_ahead_eventcb, &rat);
+	bufferevent_setcb(server, read_ahead_readcb, NULL, read_ahead_eventcb,
+	    &rat);
+	bufferevent_enable(client, EV_READ|EV_WRITE);
+	bufferevent_enable(server, EV_READ|EV_WRITE);
+	tt_int_op(bufferevent_write(client,
+		evbuffer_pullup(rat.expect, -1),
+		evbuffer_get_length(rat.expect)), ==, 0);
+
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	tt_int_op(evbuffer_get_length(rat.got), ==,
+	    evbuffer_get_length(rat.expect));
+	tt_assert(!memcmp(evbuffer_pullup(rat.got, -1),
+		evbuffer_pullup(rat.expect, -1), evbuffer_get_length(rat.expect)));
+
+end:
+	if (client)
+		bufferevent_free(client);
+	if (server)
+		bufferevent_free(server);
+	if (rat.expect)
+		evbuffer_free(rat.expect);
+	if (rat.got)
+		evbuffer_free(rat.got);
+}
+
+static void
+resume_eventcb(struct bufferevent *bev, short what, void *ctx)
+{
+	int *n_connected = ctx;
+
+	if (what & BEV_EVENT_CONNECTED) {
+		if (++*n_connected == 2)
+			event_base_loopexit(bufferevent_get_base(bev), NULL);
+	} else if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		TT_FAIL(("Unexpected event %d", (int)what));
+		event_base_loopexit(bufferevent_get_base(bev), NULL);
+	}
+}
+
+/* Connect to a server using server_ctx over TLS 1.2, offering *session if
+ * it is set, and replace *session with the one we end up with.  Return 1
+ * if the session was resumed, 0 if not, -1 on failure. */
+static int
+resume_connect(struct event_base *base, SSL_CTX *server_ctx,
+    SSL_SESSION **session, int no_ticket)
+{
+	evutil_socket_t pair[2];
+	struct bufferevent *client = NULL, *server = NULL;
+	SSL *ssl_client, *ssl_server;
+	int n_connected = 0, r = -1;
+
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+		return -1;
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+	ssl_client = SSL_new(get_ssl_ctx());
+	ssl_server = SSL_new(server_ctx);
+	if (!ssl_client || !ssl_server)
+		return -1;
+#ifdef SSL_OP_NO_TLSv1_3
+	/* So that the session is ready as soon as we are connected. */
+	SSL_set_options(ssl_client, SSL_OP_NO_TLSv1_3);
+#endif
+	if (no_ticket)
+		SSL_set_options(ssl_client, SSL_OP_NO_TICKET);
+	if (*session)
+		SSL_set_session(ssl_client, *session);
+	client = bufferevent_openssl_socket_new(base, pair[0], ssl_client,
+	    BUFFEREVENT_SSL_CONNECTING, BEV_OPT_CLOSE_ON_FREE);
+	server = bufferevent_openssl_socket_new(base, pair[1], ssl_server,
+	    BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+	if (!client || !server)
+		goto end;
+	bufferevent_setcb(client, NULL, NULL, resume_eventcb, &n_connected);
+	bufferevent_setcb(server, NULL, NULL, resume_eventcb, &n_connected);
+	bufferevent_enable(client, EV_READ|EV_WRITE);
+	bufferevent_enable(server, EV_READ|EV_WRITE);
+
+	event_base_dispatch(base);
+	if (n_connected != 2)
+		goto end;
+	r = SSL_session_reused(ssl_client);
+	if (*session)
+		SSL_SESSION_free(*session);
+	*session = SSL_get1_session(ssl_client);
+	/* OpenSSL won't resume a session that ended without a shutdown. */
+	SSL_set_shutdown(ssl_client, SSL_SENT_SHUTDOWN|SSL_RECEIVED_SHUTDOWN);
+	SSL_set_shutdown(ssl_server, SSL_SENT_SHUTDOWN|SSL_RECEIVED_SHUTDOWN);
+
+end:
+	if (client)
+		bufferevent_free(client);
+	if (server)
+		bufferevent_free(server);
+	return r;
+}
+
+static void
+regress_bufferevent_openssl_session_cache(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent_ssl_session_cache *cache = NULL;
+	struct bufferevent_ssl_session_cache_stats stats;
+	SSL_CTX *ctx[2] = { NULL, NULL };
+	SSL_SESSION *session = NULL;
+	int i;
+
+	init_ssl();
+
+	tt_assert(!bufferevent_ssl_session_cache_new(0, 64));
+	tt_assert(!bufferevent_ssl_session_cache_new(8, 4));
+	cache = bufferevent_ssl_session_cache_new(4, 64);
+	tt_assert(cache);
+
+	/* Two servers, as if on two threads, sharing one cache. */
+	for (i = 0; i < 2; ++i) {
+		ctx[i] = SSL_CTX_new(TLS_method());
+		tt_assert(ctx[i]);
+		SSL_CTX_use_certificate(ctx[i], ssl_getcert());
+		SSL_CTX_use_PrivateKey(ctx[i], ssl_getkey());
+		tt_int_op(bufferevent_ssl_session_cache_attach(cache, ctx[i]),
+		    ==, 0);
+	}
+
+	/* A ticket from one server works with the other. */
+	tt_int_op(resume_connect(data->base, ctx[0], &session, 0), ==, 0);
+	tt_int_op(resume_connect(data->base, ctx[1], &session, 0), ==, 1);
+	bufferevent_ssl_session_cache_get_stats(cache, &stats);
+	tt_int_op(stats.tickets_issued, >=, 1);
+	tt_int_op(stats.tickets_resumed, ==, 1);
+
+	/* After one rotation the ticket still works, and gets replaced... */
+	tt_int_op(bufferevent_ssl_session_cache_rotate_ticket_key(cache), ==, 0);
+	tt_int_op(resume_connect(data->base, ctx[0], &session, 0), ==, 1);
+	bufferevent_ssl_session_cache_get_stats(cache, &stats);
+	tt_int_op(stats.tickets_renewed, ==, 1);
+
+	/* ...but not after two more. */
+	tt_int_op(bufferevent_ssl_session_cache_rotate_ticket_key(cache), ==, 0);
+	tt_int_op(bufferevent_ssl_session_cache_rotate_ticket_key(cache), ==, 0);
+	tt_int_op(resume_connect(data->base, ctx[1], &session, 0), ==, 0);
+	bufferevent_ssl_session_cache_get_stats(cache, &stats);
+	tt_int_op(stats.tickets_unknown, ==, 1);
+
+	/* Without tickets, the servers find the session in the cache. */
+	SSL_SESSION_free(session);
+	session = NULL;
+	tt_int_op(resume_connect(data->base, ctx[0], &session, 1), ==, 0);
+	bufferevent_ssl_session_cache_get_stats(cache, &stats);
+	tt_int_op(stats.stored, >=, 1);
+	tt_int_op(stats.n_sessions, >=, 1);
+	tt_int_op(stats.hits, ==, 0);
+	tt_int_op(resume_connect(data->base, ctx[1], &session, 1), ==, 1);
+	bufferevent_ssl_session_cache_get_stats(cache, &stats);
+	tt_int_op(stats.hits, ==, 1);
+
+end:
+	if (session)
+		SSL_SESSION_free(session);
+	for (i = 0; i < 2; ++i)
+		if (ctx[i])
+			SSL_CTX_free(ctx[i]);
+	if (cache)
+		bufferevent_ssl_session_cache_free(cache);
+}
+
+#ifndef EVENT__DISABLE_THREAD_SUPPORT
+#define MAX_OFFLOAD_JOBS 32
+
+struct offload_test {
+	THREAD_T threads[MAX_OFFLOAD_JOBS];
+	int n_jobs;
+	int failed;
+	struct evbuffer *got;
+};
+
+struct offload_job {
+	void (*job)(void *);
+	void *job_arg;
+};
+
+static THREAD_FN
+offload_thread(void *arg)
+{
+	struct offload_job *oj = arg;
+	oj->job(oj->job_arg);
+	free(oj);
+	THREAD_RETURN();
+}
+
+/* A very small "pool": one thread per job. */
+static void
+offload_run(void (*job)(void *), void *job_arg, void *arg)
+{
+	struct offload_test *ot = arg;
+	struct offload_job *oj;
+
+	if (ot->n_jobs == MAX_OFFLOAD_JOBS ||
+	    !(oj = malloc(sizeof(*oj)))) {
+		/* Nobody will ever finish this handshake. */
+		ot->failed = 1;
+		return;
+	}
+	oj->job = job;
+	oj->job_arg = job_arg;
+	THREAD_START(ot->threads[ot->n_jobs], offload_thread, oj);
+	++ot->n_jobs;
+}
+
+static void
+offload_readcb(struct bufferevent *bev, void *ctx)
+{
+	struct offload_test *ot = ctx;
+	bufferevent_read_buffer(bev, ot->got);
+	if (evbuffer_get_length(ot->got) >= 6)
+		event_base_loopexit(bufferevent_get_base(bev), NULL);
+}
+
+static void
+offload_eventcb(struct bufferevent *bev, short what, void *ctx)
+{
+	if (what & BEV_EVENT_CONNECTED) {
+		if (SSL_is_server(bufferevent_openssl_get_ssl(bev)))
+			bufferevent_write(bev, "hello\n", 6);
+	} else if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		TT_FAIL(("Unexpected event %d", (int)what));
+		event_base_loopexit(bufferevent_get_base(bev), NULL);
+	}
+}
+
+static void
+regress_bufferevent_openssl_offload(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *client = NULL, *server = NULL;
+	struct bufferevent *bev_ll = NULL, *filter = NULL;
+	struct offload_test ot;
+	struct timeval tv = { 10, 0 };
+	SSL *ssl;
+	int i;
+
+	memset(&ot, 0, sizeof(ot));
+	ot.got = evbuffer_new();
+	init_ssl();
+
+	ssl = SSL_new(get_ssl_ctx());
+	tt_assert(ssl);
+	client = bufferevent_openssl_socket_new(data->base, data->pair[0],
+	    ssl, BUFFEREVENT_SSL_CONNECTING, BEV_OPT_CLOSE_ON_FREE);
+	data->pair[0] = -1;
+	ssl = SSL_new(get_ssl_ctx());
+	tt_assert(ssl);
+	SSL_use_certificate(ssl, ssl_getcert());
+	SSL_use_PrivateKey(ssl, ssl_getkey());
+	server = bufferevent_openssl_socket_new(data->base, data->pair[1],
+	    ssl, BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+	data->pair[1] = -1;
+	tt_assert(client && server);
+
+	tt_int_op(bufferevent_openssl_set_handshake_offload(client,
+		offload_run, &ot), ==, 0);
+	tt_int_op(bufferevent_openssl_set_handshake_offload(server,
+		offload_run, &ot), ==, 0);
+
+	/* Filters can't do it: their BIO uses the underlying bufferevent. */
+	bev_ll = bufferevent_socket_new(data->base, -1, 0);
+	ssl = SSL_new(get_ssl_ctx());
+	tt_assert(bev_ll && ssl);
+	filter = bufferevent_openssl_filter_new(data->base, bev_ll, ssl,
+	    BUFFEREVENT_SSL_CONNECTING, 0);
+	tt_assert(filter);
+	tt_int_op(bufferevent_openssl_set_handshake_offload(filter,
+		offload_run, &ot), ==, -1);
+
+	bufferevent_setcb(client, offload_readcb, NULL, offload_eventcb, &ot);
+	bufferevent_setcb(server, NULL, NULL, offload_eventcb, &ot);
+	bufferevent_enable(client, EV_READ);
+	bufferevent_enable(server, EV_READ|EV_WRITE);
+
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	for (i = 0; i < ot.n_jobs; ++i)
+		THREAD_JOIN(ot.threads[i]);
+	TT_BLATHER(("%d handshake jobs", ot.n_jobs));
+	tt_assert(!ot.failed);
+	/* Every handshake step went through the pool. */
+	tt_int_op(ot.n_jobs, >=, 2);
+	tt_int_op(evbuffer_get_length(ot.got), ==, 6);
+	tt_assert(!memcmp(evbuffer_pullup(ot.got, -1), "hello\n", 6));
+
+end:
+	if (client)
+		bufferevent_free(client);
+	if (server)
+		bufferevent_free(server);
+	if (filter)
+		bufferevent_free(filter);
+	if (bev_ll)
+		bufferevent_free(bev_ll);
+	if (ot.got)
+		evbuffer_free(ot.got);
+}
+
+/* Hold on to the job instead of running it, so that the test can poke at
+ * the bufferevent while the step is still "on another thread". */
+static void
+offload_hold(void (*job)(void *), void *job_arg, void *arg)
+{
+	struct offload_job *oj = arg;
+	oj->job = job;
+	oj->job_arg = job_arg;
+}
+
+static void
+regress_bufferevent_openssl_offload_busy(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *client = NULL;
+	struct offload_job held;
+	SSL *ssl;
+	int i;
+
+	memset(&held, 0, sizeof(held));
+	init_ssl();
+
+	ssl = SSL_new(get_ssl_ctx());
+	tt_assert(ssl);
+	client = bufferevent_openssl_socket_new(data->base, data->pair[0],
+	    ssl, BUFFEREVENT_SSL_CONNECTING, BEV_OPT_CLOSE_ON_FREE);
+	data->pair[0] = -1;
+	tt_assert(client);
+	tt_int_op(bufferevent_openssl_set_handshake_offload(client,
+		offload_hold, &held), ==, 0);
+	bufferevent_enable(client, EV_READ|EV_WRITE);
+
+	/* The socket is writable at once, so the first step goes out. */
+	for (i = 0; i < 10 && !held.job; ++i)
+		event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_assert(held.job);
+
+	/* None of these may touch the SSL while the job owns it. */
+	tt_int_op(bufferevent_setfd(client, data->pair[1]), ==, -1);
+	tt_int_op(bufferevent_ssl_renegotiate(client), ==, -1);
+	tt_int_op(bufferevent_openssl_set_ktls(client, 1), ==, -1);
+	tt_int_op(bufferevent_openssl_set_handshake_offload(client,
+		NULL, NULL), ==, -1);
+
+	/* Let the step finish and report back; then setfd works again. */
+	held.job(held.job_arg);
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(bufferevent_openssl_set_handshake_offload(client,
+		NULL, NULL), ==, 0);
+	tt_int_op(bufferevent_setfd(client, bufferevent_getfd(client)), ==, 0);
+
+end:
+	if (client)
+		bufferevent_free(client);
+}
+#endif
+
 struct testcase_t ssl_testcases[] = {
 #define T(a) ((void *)(a))
 	{ "bufferevent_socketpair", regress_bufferevent_openssl,
@@ -807,6 +1522,24 @@ struct testcase_t ssl_testcases[] = {
 	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "bufferevent_connect_sleep", regress_bufferevent_openssl_connect,
 	  TT_FORK|TT_NEED_BASE, &basic_setup, T(REGRESS_OPENSSL_SLEEP) },
+	{ "bufferevent_ktls", regress_bufferevent_openssl_ktls,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_records", regress_bufferevent_openssl_records,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_filter_read_ahead",
+	  regress_bufferevent_openssl_read_ahead,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_session_cache",
+	  regress_bufferevent_openssl_session_cache,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+#ifndef EVENT__DISABLE_THREAD_SUPPORT
+	{ "bufferevent_handshake_offload",
+	  regress_bufferevent_openssl_offload,
+	  TT_ISOLATED|TT_NEED_THREADS, &basic_setup, NULL },
+	{ "bufferevent_handshake_offload_busy",
+	  regress_bufferevent_openssl_offload_busy,
+	  TT_ISOLATED|TT_NEED_THREADS, &basic_setup, NULL },
+#endif
 
 #undef T
 
@@ -55,6 +55,7 @@
 #include "sys/queue.h"
 
 #include "event2/event.h"
+#include "event2/buffer.h"
 #include "event2/event_struct.h"
 #include "event2/thread.h"
 #include "event2/util.h"
@@ -564,6 +565,132 @@ end:
 	;
 }
 
+#define SPSC_N_MSGS 20000
+
+struct spsc_test {
+	struct event_base *base;
+	struct evbuffer *buf;
+	ev_uint32_t next;
+	int n_wakeups;
+	int bad;
+};
+
+static void
+spsc_data_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info,
+    void *arg)
+{
+	struct spsc_test *t = arg;
+	ev_uint32_t v;
+
+	if (!info->n_added)
+		return;
+	++t->n_wakeups;
+	while (evbuffer_remove(buf, &v, sizeof(v)) == sizeof(v)) {
+		if (v != t->next)
+			t->bad = 1;
+		++t->next;
+	}
+	if (t->next == SPSC_N_MSGS)
+		event_base_loopbreak(t->base);
+}
+
+static THREAD_FN
+spsc_producer(void *arg)
+{
+	struct spsc_test *t = arg;
+	struct evbuffer *tmp = evbuffer_new();
+	ev_uint32_t i;
+
+	for (i = 2; i < SPSC_N_MSGS; ++i) {
+		if (i & 1) {
+			evbuffer_spsc_add(t->buf, &i, sizeof(i));
+		} else {
+			evbuffer_add(tmp, &i, sizeof(i));
+			evbuffer_spsc_add_buffer(t->buf, tmp);
+		}
+	}
+	evbuffer_free(tmp);
+
+	THREAD_RETURN();
+}
+
+static void
+thread_evbuffer_spsc(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct spsc_test t;
+	struct timeval tv = { 10, 0 };
+	THREAD_T thread;
+	ev_uint32_t v;
+
+	memset(&t, 0, sizeof(t));
+	t.base = data->base;
+	t.buf = evbuffer_new();
+	evbuffer_add_cb(t.buf, spsc_data_cb, &t);
+
+	v = 0;
+	tt_int_op(evbuffer_spsc_add(t.buf, &v, sizeof(v)), ==, -1);
+	tt_int_op(evbuffer_enable_spsc(t.buf, data->base), ==, 0);
+	tt_int_op(evbuffer_enable_spsc(t.buf, data->base), ==, -1);
+
+	/* Nothing arrives until the loop runs, and then all of it at once. */
+	tt_int_op(evbuffer_spsc_add(t.buf, &v, sizeof(v)), ==, 0);
+	v = 1;
+	tt_int_op(evbuffer_spsc_add(t.buf, &v, sizeof(v)), ==, 0);
+	tt_int_op(evbuffer_get_length(t.buf), ==, 0);
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(t.n_wakeups, ==, 1);
+	tt_int_op(t.next, ==, 2);
+
+	event_base_loopexit(data->base, &tv);
+	THREAD_START(thread, spsc_producer, &t);
+	event_base_loop(data->base, EVLOOP_NO_EXIT_ON_EMPTY);
+	THREAD_JOIN(thread);
+
+	TT_BLATHER(("%d wakeups for %d messages", t.n_wakeups, SPSC_N_MSGS));
+	tt_assert(event_base_got_break(data->base));
+	tt_int_op(t.next, ==, SPSC_N_MSGS);
+	tt_assert(!t.bad);
+
+end:
+	evbuffer_free(t.buf);
+}
+
+static void
+thread_evbuffer_spsc_free_base(void *arg)
+{
+	struct event_base *base = NULL;
+	struct evbuffer *buf = NULL;
+
+	/* The base can go first, even with data waiting for it. */
+	base = event_base_new();
+	buf = evbuffer_new();
+	tt_assert(base && buf);
+	tt_int_op(evbuffer_enable_spsc(buf, base), ==, 0);
+	tt_int_op(evbuffer_spsc_add(buf, "abc", 3), ==, 0);
+	event_base_free(base);
+	base = NULL;
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+	evbuffer_free(buf);
+	buf = NULL;
+
+	/* And so can the buffer. */
+	base = event_base_new();
+	buf = evbuffer_new();
+	tt_assert(base && buf);
+	tt_int_op(evbuffer_enable_spsc(buf, base), ==, 0);
+	tt_int_op(evbuffer_spsc_add(buf, "abc", 3), ==, 0);
+	evbuffer_free(buf);
+	buf = NULL;
+	tt_int_op(event_base_loop(base, EVLOOP_NONBLOCK), ==, 1);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+	if (base)
+		event_base_free(base);
+}
+
 #define TEST(name)							\
 	{ #name, thread_##name, TT_FORK|TT_NEED_THREADS|TT_NEED_BASE,	\
 	  &basic_setup, NULL }
@@ -576,6 +703,8 @@ struct testcase_t thread_testcases[] = {
 	  &basic_setup, (char*)"forking" },
 #endif
 	TEST(conditions_simple),
+	TEST(evbuffer_spsc),
+	TEST(evbuffer_spsc_free_base),
 	{ "deferred_cb_skew", thread_deferred_cb_skew,
 	  TT_FORK|TT_NEED_THREADS|TT_OFF_BY_DEFAULT,
 	  &basic_setup, NULL },
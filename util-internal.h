@@ -398,6 +398,34 @@ int evutil_hex_char_to_int_(char c);
 void evutil_free_secure_rng_globals_(void);
 void evutil_free_globals_(void);
 
+/* Storage class for variables that need one instance per thread.  Left
+ * undefined if we are built with threads but the compiler can't do it. */
+#if defined(EVENT__DISABLE_THREAD_SUPPORT)
+#define EVUTIL_THREAD_LOCAL_
+#elif defined(_MSC_VER)
+#define EVUTIL_THREAD_LOCAL_ __declspec(thread)
+#elif defined(__GNUC__)
+#define EVUTIL_THREAD_LOCAL_ __thread
+#endif
+
+/* Atomic operations for handing data between threads without a lock.
+ * EVUTIL_ATOMIC_CAS_PTR_ stores v in *p if *p is *oldp and returns true;
+ * otherwise it sets *oldp to *p and returns false.  EVUTIL_ATOMIC_ADD_
+ * adds v to the integer *p and returns the new value.  Left undefined if
+ * the compiler has no suitable builtins. */
+#if defined(__GNUC__) && defined(__ATOMIC_ACQ_REL)
+#define EVUTIL_HAVE_ATOMICS_
+#define EVUTIL_ATOMIC_XCHG_PTR_(p, v) \
+	__atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define EVUTIL_ATOMIC_CAS_PTR_(p, oldp, v) \
+	__atomic_compare_exchange_n((p), (oldp), (v), 0, \
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define EVUTIL_ATOMIC_LOAD_PTR_(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define EVUTIL_ATOMIC_ADD_(p, v) \
+	__atomic_add_fetch((p), (v), __ATOMIC_ACQ_REL)
+#define EVUTIL_ATOMIC_LOAD_(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#endif
+
 #ifdef _WIN32
 HMODULE evutil_load_windows_system_library_(const TCHAR *library_name);
 #endif